@@ -0,0 +1,162 @@
+#include <string.h>
+
+#include "bcm.h"
+#include "gpio.h"
+
+#define BARRIER()		__sync_synchronize()
+
+// As for sparse chains, long delays are split for the DMA lite channels
+#define BCM_MAX_WORDS		16383
+
+#define PLANE_WORDS(bits, banks)	((bits) * 2 * (banks) + 1)	/* Set, clr, generation */
+
+#define ROUNDUP(val, blksz)	(((val)+((blksz)-1)) & ~(blksz-1))
+
+static int max_cbs(int bits) {
+    // Copy, then set, clr and delay per plane, with the long delays split
+    return 1 + bits * 3 + (1 << bits) / BCM_MAX_WORDS;
+}
+
+// Room for both banks, whether or not bank 1 is used
+static uint32_t words_size(int bits) {
+    return ROUNDUP(PLANE_WORDS(bits, 2) * sizeof(uint32_t), sizeof(dma_cb_t));
+}
+
+uint32_t bcm_mem_size(int bits) {
+    return words_size(bits) * 3 + max_cbs(bits) * sizeof(dma_cb_t);
+}
+
+static uint32_t bus(const bcm_t *b, const void *p) {
+    return b->bus_base + ((const uint8_t *)p - b->virt_base);
+}
+
+static dma_cb_t *add_cb(bcm_t *b, uint32_t info, uint32_t src, uint32_t dst, uint32_t len) {
+    dma_cb_t *cb = b->cbs + b->num_cbs++;
+
+    cb->info = info;
+    cb->src = src;
+    cb->dst = dst;
+    cb->length = len;
+    cb->stride = 0;
+    cb->next = bus(b, cb + 1);
+    return cb;
+}
+
+// The words staged copy 'w' should hold
+static void plane_words(const bcm_t *b, uint32_t *w) {
+    int p, k;
+
+    for (p = 0; p < b->bits; p++) {
+        for (k = 0; k < b->banks; k++) {
+            w[p * b->banks + k] = b->set[p][k];
+            w[(b->bits + p) * b->banks + k] = b->outputs[k] & ~b->set[p][k];
+        }
+    }
+    w[b->bits * 2 * b->banks] = b->gen;
+}
+
+void bcm_init(bcm_t *b, void *virt, uint32_t bus_addr, int bits, uint64_t outputs,
+              uint32_t clr_addr, uint32_t set_addr, uint32_t fifo_addr,
+              uint32_t fifo_info, volatile uint32_t *dma_reg) {
+    uint32_t info = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP, pinfo;
+    int p, i, left, len, words;
+
+    memset(b, 0, sizeof(*b));
+    b->bits = bits;
+    b->banks = outputs >> 32 ? 2 : 1;
+    b->outputs[0] = outputs;
+    b->outputs[1] = outputs >> 32;
+    b->virt_base = virt;
+    b->bus_base = bus_addr;
+    b->dma_reg = dma_reg;
+    b->active = (uint32_t *)virt;
+    b->staged[0] = (uint32_t *)(b->virt_base + words_size(bits));
+    b->staged[1] = (uint32_t *)(b->virt_base + words_size(bits) * 2);
+    b->cbs = (dma_cb_t *)(b->virt_base + words_size(bits) * 3);
+    words = PLANE_WORDS(bits, b->banks);
+    // A bank 0 only chain is just as it was
+    pinfo = b->banks > 1 ? info | DMA_SRC_INC | DMA_DEST_INC : info;
+
+    plane_words(b, b->shadow[0]);
+    plane_words(b, b->shadow[1]);
+    for (i = 0; i < words; i++)
+        b->active[i] = b->staged[0][i] = b->staged[1][i] = b->shadow[0][i];
+
+    add_cb(b, info | DMA_SRC_INC | DMA_DEST_INC, bus(b, b->staged[0]),
+           bus(b, b->active), words * sizeof(uint32_t));
+    for (p = 0; p < bits; p++) {
+        add_cb(b, pinfo, bus(b, b->active + p * b->banks), set_addr, 4 * b->banks);
+        add_cb(b, pinfo, bus(b, b->active + (bits + p) * b->banks), clr_addr,
+               4 * b->banks);
+        for (left = 1 << p; left; left -= len) {
+            len = left < BCM_MAX_WORDS ? left : BCM_MAX_WORDS;
+            // Any data will do
+            add_cb(b, fifo_info, bus(b, b->active), fifo_addr, len * 4);
+        }
+    }
+    b->cbs[b->num_cbs - 1].next = bus(b, b->cbs);
+}
+
+void bcm_set(bcm_t *b, int gpio, int value) {
+    uint32_t old, bit = GPIO_BIT(gpio);
+    int p, k = GPIO_BANK(gpio);
+
+    for (p = 0; p < b->bits; p++) {
+        old = b->set[p][k];
+        if (value & (1 << p))
+            b->set[p][k] |= bit;
+        else
+            b->set[p][k] &= ~bit;
+        if (b->set[p][k] != old)
+            b->changed = 1;
+    }
+}
+
+int bcm_taken(bcm_t *b) {
+    if (!b->pending)
+        return 1;
+    if (b->active[b->bits * 2 * b->banks] != b->gen)
+        return 0;
+    b->pending = 0;
+    return 1;
+}
+
+int bcm_flush(bcm_t *b) {
+    uint32_t want[BCM_MAX_BITS * 4 + 1];
+    int spare = !b->live, i;
+
+    if (!b->changed)
+        return 0;
+    if (!bcm_taken(b))
+        return -1;
+
+    b->gen++;
+    plane_words(b, want);
+    for (i = 0; i < PLANE_WORDS(b->bits, b->banks); i++) {
+        if (want[i] != b->shadow[spare][i]) {
+            b->staged[spare][i] = b->shadow[spare][i] = want[i];
+            b->words_written++;
+        }
+    }
+    BARRIER();
+    b->cbs[0].src = bus(b, b->staged[spare]);
+    BARRIER();
+    b->live = spare;
+    b->changed = 0;
+    b->pending = 1;
+    b->flushes++;
+    return 0;
+}
+
+void bcm_cost(const bcm_t *b, int *cbs, uint64_t *transactions, uint64_t *bytes) {
+    uint64_t words;
+    int i;
+
+    *cbs = b->num_cbs;
+    *transactions = *bytes = 0;
+    for (i = 0; i < b->num_cbs; i++) {
+        words = b->cbs[i].length / 4;
+        *transactions += 1 + words * 2;
+        *bytes += sizeof(dma_cb_t) + words * 8;
+    }
+}
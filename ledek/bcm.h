@@ -0,0 +1,80 @@
+#ifndef LEDEK_BCM
+#define LEDEK_BCM
+
+#include <stdint.h>
+
+#include "dma.h"
+
+/* Binary code modulation output for --bcm=<bits>, for dimming LEDs at a
+ * higher resolution than plain PWM can manage.  A cycle is split into one
+ * bit-plane per bit of brightness, lasting 1, 2, 4 ... 2^(bits-1) steps.
+ * At the start of each plane one CB sets the outputs that have that bit
+ * of their brightness set, and another clears the rest, so an output is on
+ * for exactly 'brightness' steps per cycle of 2^bits - 1 steps:
+ *
+ *     copy -> set(0) clr(0) delay(1) -> set(1) clr(1) delay(2) -> ...
+ *
+ * That is three or so CBs per plane whatever the resolution, where a PWM
+ * chain needs two or three per step, and a brightness update only changes
+ * the two words for each plane.  With outputs in GPIO bank 1 too, each of
+ * those is a pair of words, and the set and clr CBs write both banks.
+ *
+ * The plane words the CBs read are refreshed by the copy CB at the start
+ * of every cycle, from one of two staged copies.  An update is written to
+ * the staged copy the copy CB isn't using, which is then switched in, so
+ * the controller always runs a whole cycle from one consistent set of
+ * planes.  Each staged copy ends with a generation count, which tells us
+ * when the controller has taken the new one up.
+ */
+
+#define BCM_MIN_BITS		4
+#define BCM_MAX_BITS		16
+
+typedef struct {
+    int bits;
+    uint8_t *virt_base;		/* Start of the memory the chain is in */
+    uint32_t bus_base;		/* ... and its bus address */
+    volatile uint32_t *dma_reg;
+    int banks;			/* GPIO banks in use, 1 or 2 */
+    uint32_t *active;		/* Set words, clr words, generation */
+    uint32_t *staged[2];
+    dma_cb_t *cbs;		/* Starting with the copy CB */
+    int num_cbs;
+    uint32_t outputs[2];	/* All GPIO bits in use, per bank */
+    uint32_t set[BCM_MAX_BITS][2];	/* Planes as they are to be */
+    uint32_t shadow[2][BCM_MAX_BITS * 4 + 1];	/* What each staged copy holds */
+    uint32_t gen;
+    int live;			/* Staged copy the copy CB reads */
+    int changed;		/* Planes changed since the last bcm_flush() */
+    int pending;		/* Waiting for the controller to take one up */
+    uint64_t flushes;
+    uint64_t words_written;
+} bcm_t;
+
+// Bytes of DMA visible memory needed, to be 32 byte aligned
+uint32_t bcm_mem_size(int bits);
+
+/* Build the chain in 'virt', which the DMA controller sees at 'bus', for
+ * the GPIOs whose bits are set in 'outputs', all off.
+ */
+void bcm_init(bcm_t *b, void *virt, uint32_t bus, int bits, uint64_t outputs,
+              uint32_t clr_addr, uint32_t set_addr, uint32_t fifo_addr,
+              uint32_t fifo_info, volatile uint32_t *dma_reg);
+
+// Set one GPIO's brightness, 0 .. 2^bits - 1, in the planes to be flushed
+void bcm_set(bcm_t *b, int gpio, int value);
+
+/* Hand any changed planes to the controller.  Returns -1 if it hasn't
+ * taken up the previous lot yet; call again later.
+ */
+int bcm_flush(bcm_t *b);
+
+/* Returns 1 once the controller has taken up the last planes handed to it
+ * by bcm_flush().
+ */
+int bcm_taken(bcm_t *b);
+
+// What the controller does each cycle
+void bcm_cost(const bcm_t *b, int *cbs, uint64_t *transactions, uint64_t *bytes);
+
+#endif //LEDEK_BCM
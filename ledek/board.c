@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "board.h"
+#include "clk.h"
+#include "dma.h"
+
+// bcm_host_get_model_type() return values to name mapping
+const char *model_names[] = {
+        "A", "B", "A+", "B+", "2B", "Alpha", "CM", "CM2", "3B", "Zero", "CM3",
+        "Custom", "ZeroW", "3B+", "3A+", "FPGA", "CM3+", "4B"
+};
+const int num_models = sizeof(model_names)/sizeof(*model_names);
+
+uint32_t periph_phys_base;
+uint32_t periph_virt_base;
+uint32_t dram_phys_base;
+uint32_t mem_flag;
+
+int board_model;
+int gpio_cfg;
+uint32_t plldfreq_mhz;
+int dma_chan;
+
+#ifndef LEDEK_EMULATOR
+static void parse_cpuinfo(void) {
+    char buf[128], revstr[128], modelstr[128];
+    char *ptr, *end, *res;
+    int board_revision;
+    FILE *fp;
+
+    revstr[0] = modelstr[0] = '\0';
+
+    fp = fopen("/proc/cpuinfo", "r");
+
+    if (!fp)
+        fatal("Unable to open /proc/cpuinfo: %m\n");
+
+    while ((res = fgets(buf, 128, fp))) {
+        if (!strncasecmp("hardware", buf, 8))
+            memcpy(modelstr, buf, 128);
+        else if (!strncasecmp(buf, "revision", 8))
+            memcpy(revstr, buf, 128);
+    }
+    fclose(fp);
+
+    if (modelstr[0] == '\0')
+        fatal("servod: No 'Hardware' record in /proc/cpuinfo\n");
+    if (revstr[0] == '\0')
+        fatal("servod: No 'Revision' record in /proc/cpuinfo\n");
+
+    if (strstr(modelstr, "BCM2708"))
+        board_model = 1;
+    else if (strstr(modelstr, "BCM2709") || strstr(modelstr, "BCM2835"))
+        board_model = 2;
+    else
+        fatal("servod: Cannot parse the hardware name string\n");
+
+    /* Revisions documented at http://elinux.org/RPi_HardwareHistory */
+    ptr = revstr + strlen(revstr) - 3;
+    board_revision = strtol(ptr, &end, 16);
+    if (end != ptr + 2)
+        fatal("servod: Failed to parse Revision string\n");
+    if (board_revision < 1)
+        fatal("servod: Invalid board Revision\n");
+    else if (board_revision < 4)
+        gpio_cfg = 1;
+    else if (board_revision < 16)
+        gpio_cfg = 2;
+    else
+        gpio_cfg = 3;
+}
+#endif
+
+void get_model_and_revision(void) {
+#ifdef LEDEK_EMULATOR
+    // The emulated hardware is a 40 pin board with 2835 style peripherals
+    board_model = 2;
+    gpio_cfg = 3;
+#else
+    parse_cpuinfo();
+#endif
+
+    if (bcm_host_is_model_pi4()) {
+        plldfreq_mhz = PLLDFREQ_MHZ_PI4;
+        dma_chan = DMA_CHAN_PI4;
+    } else {
+        plldfreq_mhz = PLLDFREQ_MHZ_DEFAULT;
+        dma_chan = DMA_CHAN_DEFAULT;
+    }
+
+    periph_virt_base = bcm_host_get_peripheral_address();
+    dram_phys_base = bcm_host_get_sdram_address();
+    periph_phys_base = 0x7e000000;
+
+    /*
+     * See https://github.com/raspberrypi/firmware/wiki/Mailbox-property-interface
+     *
+     * 1:  MEM_FLAG_DISCARDABLE = 1 << 0	// can be resized to 0 at any time. Use for cached data
+     *     MEM_FLAG_NORMAL = 0 << 2		// normal allocating alias. Don't use from ARM
+     * 4:  MEM_FLAG_DIRECT = 1 << 2		// 0xC alias uncached
+     * 8:  MEM_FLAG_COHERENT = 2 << 2	// 0x8 alias. Non-allocating in L2 but coherent
+     *     MEM_FLAG_L1_NONALLOCATING =	// Allocating in L2
+     *       (MEM_FLAG_DIRECT | MEM_FLAG_COHERENT)
+     * 16: MEM_FLAG_ZERO = 1 << 4		// initialise buffer to all zeros
+     * 32: MEM_FLAG_NO_INIT = 1 << 5	// don't initialise (default is initialise to all ones
+     * 64: MEM_FLAG_HINT_PERMALOCK = 1 << 6	// Likely to be locked for long periods of time
+     *
+     */
+    if (board_model == 1) {
+        mem_flag         = 0x0c;	/* MEM_FLAG_DIRECT | MEM_FLAG_COHERENT */
+    } else {
+        mem_flag         = 0x04;	/* MEM_FLAG_DIRECT */
+    }
+}
\ No newline at end of file
@@ -0,0 +1,36 @@
+#ifndef LEDEK_BOARD
+#define LEDEK_BOARD
+
+#include <stdint.h>
+
+#ifdef LEDEK_EMULATOR
+#include "emu.h"
+#else
+#include <bcm_host.h>
+#endif
+
+/* Which board we are on, and where its peripherals and memory are, as
+ * worked out by get_model_and_revision().  This is kept apart from
+ * hardware.c so that tools such as servodebug can share it; a program
+ * using it provides fatal().
+ */
+
+#define BUS_TO_PHYS(x) ((x)&~0xC0000000)
+
+extern const char *model_names[];
+extern const int num_models;
+
+extern uint32_t periph_phys_base;
+extern uint32_t periph_virt_base;
+extern uint32_t dram_phys_base;
+extern uint32_t mem_flag;
+
+extern int board_model;
+extern int gpio_cfg;
+extern uint32_t plldfreq_mhz;
+extern int dma_chan;		/* Default for the board */
+
+void fatal(char *fmt, ...);
+void get_model_and_revision(void);
+
+#endif //LEDEK_BOARD
@@ -0,0 +1,34 @@
+#include "capture.h"
+
+int capture_oldest(const capture_slot_t *slots, int num_slots) {
+    int i, newest = 0;
+
+    // The timer wraps every 71 minutes, so compare stamps by difference
+    for (i = 1; i < num_slots; i++) {
+        if ((int32_t)(slots[i].stamp - slots[newest].stamp) > 0)
+            newest = i;
+    }
+    return (newest + 1) % num_slots;
+}
+
+int capture_edges(const capture_slot_t *slots, int num_slots, int first, int count,
+                  uint32_t mask, uint32_t since, uint32_t *levels,
+                  capture_slot_t *edges, int max_edges) {
+    const capture_slot_t *s;
+    uint32_t now;
+    int i, n = 0;
+
+    for (i = 0; i < count && n < max_edges; i++) {
+        s = slots + (first + i) % num_slots;
+        if ((int32_t)(s->stamp - since) <= 0)
+            continue;
+        now = s->levels & mask;
+        if (now != *levels) {
+            edges[n].levels = now;
+            edges[n].stamp = s->stamp;
+            n++;
+            *levels = now;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,37 @@
+#ifndef LEDEK_CAPTURE
+#define LEDEK_CAPTURE
+
+#include <stdint.h>
+
+/* Logic capture for --capture.  Two extra CBs in each step of group 0's
+ * normal chain copy GPLEV0, then the system timer, into that step's slot
+ * of a ring in the group's memory, so the DMA controller samples every
+ * output at step resolution, at the time it actually ran the step, with
+ * no CPU time spent.  The ring has a slot per step and is overwritten each
+ * cycle; a reader takes a cycle's worth at a time and turns it into edges,
+ * and can keep up indefinitely by reading at least once a cycle and using
+ * the stamps to drop slots it has seen.  GPIOs 32 and up aren't captured.
+ *
+ * The slot the controller is working on may have a new levels word and
+ * an old stamp, so readers that know where the controller is skip it.
+ */
+
+typedef struct {
+    uint32_t levels;	/* GPLEV0 */
+    uint32_t stamp;	/* System timer, in us */
+} capture_slot_t;
+
+// The slot after the most recently written one, going by the stamps
+int capture_oldest(const capture_slot_t *slots, int num_slots);
+
+/* Record in edges[] each of the 'count' slots from 'first' on, going round
+ * the ring, whose levels under 'mask' differ from the slot before, as long
+ * as its stamp is after 'since'.  *levels holds the levels before the first
+ * slot on entry, or ~0 to record the first, and those of the last on
+ * return.  Returns the number of edges recorded, at most 'max_edges'.
+ */
+int capture_edges(const capture_slot_t *slots, int num_slots, int first, int count,
+                  uint32_t mask, uint32_t since, uint32_t *levels,
+                  capture_slot_t *edges, int max_edges);
+
+#endif //LEDEK_CAPTURE
@@ -0,0 +1,115 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "client.h"
+
+client_t *client_new(int fd, int replies) {
+    client_t *c = calloc(1, sizeof(*c));
+
+    if (!c)
+        return NULL;
+    if (linebuf_init(&c->in) < 0) {
+        free(c);
+        return NULL;
+    }
+    c->fd = fd;
+    c->replies = replies;
+
+    return c;
+}
+
+void client_free(client_t *c) {
+    linebuf_free(&c->in);
+    free(c->out);
+    free(c);
+}
+
+/* Send as much of the queued output as the socket will take without
+ * blocking.  Returns 1 if output is still queued, 0 if it has all gone, or
+ * -1 if the client is dead.
+ */
+int client_flush(client_t *c) {
+    ssize_t n;
+
+    while (c->out_len && !c->dead) {
+        n = send(c->fd, c->out, c->out_len, MSG_DONTWAIT|MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            c->dead = 1;
+            break;
+        }
+        memmove(c->out, c->out + n, c->out_len - n);
+        c->out_len -= n;
+    }
+
+    return c->dead ? -1 : 0;
+}
+
+static void queue_output(client_t *c, const char *fmt, va_list ap) {
+    va_list aq;
+    size_t size;
+    char *p;
+    int n;
+
+    if (c->dead)
+        return;
+    va_copy(aq, ap);
+    n = vsnprintf(NULL, 0, fmt, aq);
+    va_end(aq);
+    if (n < 0)
+        return;
+    if (c->out_len + n + 1 > c->out_size) {
+        if (c->out_len + n + 1 > CLIENT_MAX_OUTPUT) {
+            c->dead = 1;
+            return;
+        }
+        for (size = c->out_size ? c->out_size : 256; size < c->out_len + n + 1; size *= 2)
+            ;
+        if (size > CLIENT_MAX_OUTPUT)
+            size = CLIENT_MAX_OUTPUT;
+        if (!(p = realloc(c->out, size))) {
+            c->dead = 1;
+            return;
+        }
+        c->out = p;
+        c->out_size = size;
+    }
+    vsnprintf(c->out + c->out_len, n + 1, fmt, ap);
+    c->out_len += n;
+    // Try to get it straight out; whatever doesn't fit waits for EPOLLOUT
+    if (!c->polling_out)
+        client_flush(c);
+}
+
+void client_reply(client_t *c, const char *fmt, ...) {
+    va_list ap;
+
+    if (!c || !c->replies)
+        return;
+    va_start(ap, fmt);
+    queue_output(c, fmt, ap);
+    va_end(ap);
+}
+
+// Errors go back to the client as "ERROR: ...", or to stderr for the fifo
+void client_error(client_t *c, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (c)
+        c->errors++;
+    if (!c || !c->replies) {
+        vfprintf(stderr, fmt, ap);
+    } else {
+        client_reply(c, "ERROR: ");
+        queue_output(c, fmt, ap);
+    }
+    va_end(ap);
+}
@@ -0,0 +1,39 @@
+#ifndef LEDEK_CLIENT
+#define LEDEK_CLIENT
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "linebuf.h"
+
+#define CLIENT_MAX_OUTPUT	65536	/* Unsent replies before we give up */
+
+/* One source of commands: a connection on the control socket, or the fifo.
+ * Each has its own line buffer, so partial lines from different clients
+ * are never mixed together.  Replies are queued in 'out' and written with
+ * non-blocking sends; a client that stops reading and lets more than
+ * CLIENT_MAX_OUTPUT bytes pile up is marked dead rather than being allowed
+ * to hold up everyone else.  The fifo has no way to reply, so it is set up
+ * with 'replies' clear and errors for it go to stderr as they always have.
+ */
+typedef struct {
+    int fd;
+    int replies;	/* Replies can be sent on fd */
+    int dead;		/* Close once the current event is handled */
+    int polling_out;	/* Registered for EPOLLOUT */
+    uint64_t errors;	/* client_error() calls, for servod's stats */
+    linebuf_t in;
+    char *out;
+    size_t out_len;
+    size_t out_size;
+} client_t;
+
+client_t *client_new(int fd, int replies);
+void client_free(client_t *c);
+void client_reply(client_t *c, const char *fmt, ...)
+        __attribute__((format(printf, 2, 3)));
+void client_error(client_t *c, const char *fmt, ...)
+        __attribute__((format(printf, 2, 3)));
+int client_flush(client_t *c);
+
+#endif //LEDEK_CLIENT
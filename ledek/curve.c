@@ -0,0 +1,141 @@
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "curve.h"
+
+#define CURVE_DEFAULT_GAMMA	2.2
+#define CURVE_MAX_POINTS	4096	/* Entries in a table file */
+
+// CIE 1931 lightness, 0 to 1, to relative luminance
+static double cie_luminance(double lightness) {
+    double l = lightness * 100;
+
+    if (l <= 8)
+        return l / 903.3;
+    return pow((l + 16) / 116, 3);
+}
+
+static int read_table(const char *path, double *pts) {
+    FILE *fp = fopen(path, "r");
+    char line[256], *p, *end;
+    int n = 0;
+
+    if (!fp)
+        return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if ((p = strchr(line, '#')))
+            *p = '\0';
+        for (p = line; ; p = end) {
+            pts[n] = strtod(p, &end);
+            if (end == p)
+                break;
+            if (pts[n] < 0 || pts[n] > 1 || ++n == CURVE_MAX_POINTS) {
+                fclose(fp);
+                errno = EINVAL;
+                return -1;
+            }
+        }
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+            p++;
+        if (*p) {
+            fclose(fp);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    fclose(fp);
+    if (n < 2) {
+        errno = EINVAL;
+        return -1;
+    }
+    return n;
+}
+
+int curve_build(int *lut, const char *spec, int min, int max) {
+    double *pts = NULL, gamma = 1, x, y;
+    int level, cie = 0, n = 0, i;
+    char *end;
+
+    if (!strcmp(spec, "linear")) {
+        gamma = 1;
+    } else if (!strncmp(spec, "gamma", 5)) {
+        gamma = CURVE_DEFAULT_GAMMA;
+        if (spec[5]) {
+            gamma = strtod(spec + 5, &end);
+            if (*end || gamma < 0.1 || gamma > 10) {
+                errno = EINVAL;
+                return -1;
+            }
+        }
+    } else if (!strcmp(spec, "cie")) {
+        cie = 1;
+    } else if (!strncmp(spec, "file:", 5)) {
+        if (!(pts = malloc(CURVE_MAX_POINTS * sizeof(*pts))))
+            return -1;
+        if ((n = read_table(spec + 5, pts)) < 0) {
+            free(pts);
+            return -1;
+        }
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+
+    lut[0] = 0;
+    for (level = 1; level < CURVE_LEVELS; level++) {
+        x = (double)level / PARSE_LEVEL_MAX;
+        if (pts) {
+            x *= n - 1;
+            i = x < n - 1 ? (int)x : n - 2;
+            y = pts[i] + (pts[i + 1] - pts[i]) * (x - i);
+        } else if (cie) {
+            y = cie_luminance(x);
+        } else {
+            y = pow(x, gamma);
+        }
+        lut[level] = min + (int)lround(y * (max - min));
+    }
+    free(pts);
+    return 0;
+}
+
+int curve_level(const int *lut, int width) {
+    int lo = 0, hi = PARSE_LEVEL_MAX, mid;
+
+    // A table file needn't be monotonic, but this is only a best guess anyway
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (lut[mid] <= width)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+int curve_width(const int *lut, const width_spec_t *width, int cur) {
+    uint64_t level = width->value;
+    int base;
+
+    if (width->unit == WIDTH_PERCENT)
+        level = level * PARSE_LEVEL_MAX / (100ULL * PARSE_FRAC_ONE);
+    else
+        level /= PARSE_FRAC_ONE;
+    if (level > PARSE_LEVEL_MAX) {
+        if (!width->rel)
+            return -1;
+        level = PARSE_LEVEL_MAX;
+    }
+
+    if (width->rel) {
+        base = curve_level(lut, cur);
+        if (width->rel > 0)
+            level = base + level < PARSE_LEVEL_MAX ? base + level : PARSE_LEVEL_MAX;
+        else
+            level = base > level + 1 ? base - level : 1;
+    }
+    return lut[level];
+}
@@ -0,0 +1,42 @@
+#ifndef LEDEK_CURVE
+#define LEDEK_CURVE
+
+#include "parse.h"
+
+/* Transfer curves for LEDs, set with --curve.  The eye's response to light
+ * is far from linear, so mapping a brightness straight onto the pulse width
+ * crams the visible changes into the dim end and wastes most of the range
+ * at the bright end.  A curve maps a brightness level, 0 to
+ * PARSE_LEVEL_MAX, onto the width instead.  It is worked out once, at
+ * startup, into a table of widths for every level, so that a percentage or
+ * "lv" width costs one lookup per command.
+ *
+ * A curve is one of:
+ *
+ *     linear        the same as having no curve
+ *     gamma[G]      level^G, G defaulting to 2.2
+ *     cie           CIE 1931 lightness, L*, to luminance
+ *     file:<path>   a table of at least two outputs from 0.0 to 1.0,
+ *                   separated by spaces or newlines, spread evenly over
+ *                   the levels and interpolated between; '#' starts a
+ *                   comment
+ */
+
+#define CURVE_LEVELS		(PARSE_LEVEL_MAX + 1)
+
+/* Fill lut[CURVE_LEVELS] with widths for 'spec'.  Level 0 is width 0 and
+ * every other level is from min to max, in whatever units they are in.
+ * Returns -1 with errno set if the spec or table file is no good.
+ */
+int curve_build(int *lut, const char *spec, int min, int max);
+
+// The highest level whose width is no more than 'width'
+int curve_level(const int *lut, int width);
+
+/* The width for a percentage or "lv" width spec, relative to the width
+ * 'cur' for a relative one, or -1 if it is out of range.  Relative
+ * adjustments go by level, clamped to 1 .. PARSE_LEVEL_MAX.
+ */
+int curve_width(const int *lut, const width_spec_t *width, int cur);
+
+#endif //LEDEK_CURVE
@@ -0,0 +1,99 @@
+#include <stdlib.h>
+
+#include "deadline.h"
+
+int deadline_init(deadline_heap_t *h, int max) {
+    int i;
+
+    h->n = 0;
+    h->max = max;
+    h->id = calloc(max, sizeof(*h->id));
+    h->pos = calloc(max, sizeof(*h->pos));
+    h->at = calloc(max, sizeof(*h->at));
+    if (!h->id || !h->pos || !h->at)
+        return -1;
+    for (i = 0; i < max; i++)
+        h->pos[i] = -1;
+
+    return 0;
+}
+
+static void place(deadline_heap_t *h, int i, int id) {
+    h->id[i] = id;
+    h->pos[id] = i;
+}
+
+static void sift_up(deadline_heap_t *h, int i) {
+    int id = h->id[i];
+
+    while (i > 0 && h->at[h->id[(i - 1) / 2]] > h->at[id]) {
+        place(h, i, h->id[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    place(h, i, id);
+}
+
+static void sift_down(deadline_heap_t *h, int i) {
+    int id = h->id[i];
+    int child;
+
+    while ((child = 2 * i + 1) < h->n) {
+        if (child + 1 < h->n && h->at[h->id[child + 1]] < h->at[h->id[child]])
+            child++;
+        if (h->at[h->id[child]] >= h->at[id])
+            break;
+        place(h, i, h->id[child]);
+        i = child;
+    }
+    place(h, i, id);
+}
+
+void deadline_set(deadline_heap_t *h, int id, uint64_t at) {
+    int i = h->pos[id];
+
+    if (i < 0) {
+        h->at[id] = at;
+        place(h, h->n++, id);
+        sift_up(h, h->n - 1);
+    } else if (at < h->at[id]) {
+        h->at[id] = at;
+        sift_up(h, i);
+    } else {
+        h->at[id] = at;
+        sift_down(h, i);
+    }
+}
+
+void deadline_clear(deadline_heap_t *h, int id) {
+    int i = h->pos[id];
+
+    if (i < 0)
+        return;
+    h->pos[id] = -1;
+    if (i == --h->n)
+        return;
+    place(h, i, h->id[h->n]);
+    if (i > 0 && h->at[h->id[i]] < h->at[h->id[(i - 1) / 2]])
+        sift_up(h, i);
+    else
+        sift_down(h, i);
+}
+
+// Returns 0 and the earliest deadline, or -1 if there are none
+int deadline_next(const deadline_heap_t *h, uint64_t *at) {
+    if (h->n == 0)
+        return -1;
+    *at = h->at[h->id[0]];
+    return 0;
+}
+
+// Remove and return the id of one deadline at or before 'now', or -1
+int deadline_pop_expired(deadline_heap_t *h, uint64_t now) {
+    int id;
+
+    if (h->n == 0 || h->at[h->id[0]] > now)
+        return -1;
+    id = h->id[0];
+    deadline_clear(h, id);
+    return id;
+}
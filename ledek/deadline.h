@@ -0,0 +1,25 @@
+#ifndef LEDEK_DEADLINE
+#define LEDEK_DEADLINE
+
+#include <stdint.h>
+
+/* Binary min-heap of deadlines, one optional deadline per id, where ids run
+ * from 0 to max-1.  pos[] tracks where each id sits in the heap so that a
+ * deadline can be moved or dropped in O(log n) without searching for it.
+ * Times are whatever the caller uses; servod uses CLOCK_MONOTONIC ns.
+ */
+typedef struct {
+    int n;		/* Entries in use */
+    int max;
+    int *id;		/* Heap order */
+    int *pos;		/* Heap index of each id, or -1 */
+    uint64_t *at;	/* Deadline of each id */
+} deadline_heap_t;
+
+int deadline_init(deadline_heap_t *h, int max);
+void deadline_set(deadline_heap_t *h, int id, uint64_t at);
+void deadline_clear(deadline_heap_t *h, int id);
+int deadline_next(const deadline_heap_t *h, uint64_t *at);
+int deadline_pop_expired(deadline_heap_t *h, uint64_t now);
+
+#endif //LEDEK_DEADLINE
@@ -16,16 +16,24 @@
 #define DMA_VIRT_BASE		(periph_virt_base + DMA_BASE_OFFSET)
 
 #define DMA_NO_WIDE_BURSTS	(1<<26)
-#define DMA_WAIT_RESP		(1<<3)
+#define DMA_SRC_INC		(1<<8)
 #define DMA_D_DREQ		(1<<6)
+#define DMA_DEST_INC		(1<<4)
+#define DMA_WAIT_RESP		(1<<3)
 #define DMA_PER_MAP(x)		((x)<<16)
+#define DMA_ACTIVE		(1<<0)
 #define DMA_END			(1<<1)
+#define DMA_ERROR		(1<<8)
 #define DMA_RESET		(1<<31)
 #define DMA_INT			(1<<2)
 
 #define DMA_CS			(0x00/4)
 #define DMA_CONBLK_AD		(0x04/4)
+#define DMA_TI			(0x08/4)
 #define DMA_SOURCE_AD		(0x0c/4)
+#define DMA_DEST_AD		(0x10/4)
+#define DMA_TXFR_LEN		(0x14/4)
+#define DMA_NEXTCONBK		(0x1c/4)
 #define DMA_DEBUG		(0x20/4)
 
 typedef struct {
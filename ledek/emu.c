@@ -0,0 +1,624 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/prctl.h>
+
+#include "mailbox.h"
+
+#include "clk.h"
+#include "dma.h"
+#include "emu.h"
+#include "gpio.h"
+#include "hardware.h"
+#include "pcm.h"
+#include "pwm.h"
+#include "st.h"
+#include "vcd.h"
+
+#define EMU_MAX_BLOCKS		8
+#define EMU_MAX_ALLOCS		8
+#define EMU_PAGE_SIZE		4096
+
+#define EMU_PERIPH_SPAN		0x01000000
+#define EMU_BUS_ALLOC_BASE	(EMU_SDRAM_BASE | 0x00100000)
+
+#define DMA_PERMAP_PCM		2
+#define DMA_PERMAP_PWM		5
+
+// How far emulated time may run ahead of the wall clock before we sleep
+#define EMU_MAX_LEAD_NS		20000
+
+// Bound on CBs executed back to back without a DREQ before we look around
+#define EMU_MAX_BURST		64
+
+/* Rough cost of loading a CB, and of moving each word of an unpaced
+ * transfer, to and from uncached SDRAM with no wide bursts and waiting on
+ * write responses, so that long copies hold the chain up as they would.
+ */
+#define EMU_CB_NS		250
+#define EMU_WORD_NS		60
+
+typedef struct {
+    uint32_t offset;		/* Offset from the peripheral base */
+    uint32_t len;
+    volatile uint32_t *regs;
+} emu_block_t;
+
+/* A PWM channel in M/S mode: high for DAT ticks of each period of RNG,
+ * with both latched as a period starts, as the hardware does.
+ */
+typedef struct {
+    uint64_t next;		/* Emulated time of the next edge, 0 when disabled */
+    uint64_t period_end;
+} emu_pwm_t;
+
+typedef struct {
+    unsigned handle;
+    uint32_t size;
+    uint32_t bus_addr;
+    uint8_t *virt_addr;
+} emu_alloc_t;
+
+typedef struct {
+    int running;
+    uint64_t busy_until;	/* Emulated time at which the current CB completes */
+    uint64_t period_ns;		/* Per word of the paced CB in progress, or 0 */
+    uint64_t fifo_empty;	/* Emulated time at which its FIFO runs dry */
+} emu_chan_t;
+
+static emu_block_t blocks[EMU_MAX_BLOCKS];
+static int num_blocks;
+static emu_alloc_t allocs[EMU_MAX_ALLOCS];
+static int num_allocs;
+static uint32_t next_bus_addr = EMU_BUS_ALLOC_BASE;
+
+static emu_chan_t chans[DMA_CHAN_MAX+1];
+static emu_pwm_t pwms[HWPWM_CHANS];
+static uint64_t levels;
+static uint64_t emu_now;	/* Emulated time in ns */
+static struct timespec emu_epoch;
+
+static vcd_t *vcd;
+static pthread_t emu_thread;
+static int emu_started;
+static volatile int emu_stopping;
+
+static volatile uint32_t *find_block(uint32_t offset) {
+    int i;
+
+    for (i = 0; i < num_blocks; i++) {
+        if (offset >= blocks[i].offset && offset < blocks[i].offset + blocks[i].len)
+            return blocks[i].regs + (offset - blocks[i].offset) / 4;
+    }
+    return NULL;
+}
+
+static volatile uint32_t *block_regs(uint32_t offset) {
+    int i;
+
+    for (i = 0; i < num_blocks; i++) {
+        if (blocks[i].offset == offset)
+            return blocks[i].regs;
+    }
+    return NULL;
+}
+
+static uint8_t *bus_to_virt(uint32_t bus) {
+    int i;
+
+    for (i = 0; i < num_allocs; i++) {
+        if (bus >= allocs[i].bus_addr && bus < allocs[i].bus_addr + allocs[i].size)
+            return allocs[i].virt_addr + (bus - allocs[i].bus_addr);
+    }
+    return NULL;
+}
+
+static uint64_t wall_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec - emu_epoch.tv_sec) * 1000000000ULL +
+           ts.tv_nsec - emu_epoch.tv_nsec;
+}
+
+static void update_levels(uint64_t new_levels) {
+    volatile uint32_t *gpio = block_regs(GPIO_BASE_OFFSET);
+
+    if (new_levels == levels)
+        return;
+    levels = new_levels;
+    if (gpio) {
+        gpio[GPIO_LEV0] = (uint32_t)levels;
+        gpio[GPIO_LEV0 + 1] = (uint32_t)(levels >> 32);
+    }
+    if (vcd)
+        vcd_sample(vcd, emu_now, levels);
+}
+
+static uint32_t periph_read(uint32_t offset) {
+    volatile uint32_t *reg;
+
+    if (offset == ST_BASE_OFFSET + ST_CLO * 4)
+        return (uint32_t)(emu_now / 1000);
+    if (offset == ST_BASE_OFFSET + ST_CHI * 4)
+        return (uint32_t)(emu_now / 1000 >> 32);
+    if (offset == GPIO_BASE_OFFSET + GPIO_LEV0 * 4)
+        return (uint32_t)levels;
+    if (offset == GPIO_BASE_OFFSET + (GPIO_LEV0 + 1) * 4)
+        return (uint32_t)(levels >> 32);
+    reg = find_block(offset);
+    return reg ? *reg : 0;
+}
+
+static void periph_write(uint32_t offset, uint32_t val) {
+    volatile uint32_t *reg;
+
+    if (offset == GPIO_BASE_OFFSET + GPIO_SET0 * 4) {
+        update_levels(levels | val);
+    } else if (offset == GPIO_BASE_OFFSET + (GPIO_SET0 + 1) * 4) {
+        update_levels(levels | ((uint64_t)val << 32));
+    } else if (offset == GPIO_BASE_OFFSET + GPIO_CLR0 * 4) {
+        update_levels(levels & ~(uint64_t)val);
+    } else if (offset == GPIO_BASE_OFFSET + (GPIO_CLR0 + 1) * 4) {
+        update_levels(levels & ~((uint64_t)val << 32));
+    } else if (offset == PWM_BASE_OFFSET + PWM_FIFO * 4 ||
+               offset == PCM_BASE_OFFSET + PCM_FIFO_A * 4) {
+        // FIFO data is only used for pacing
+    } else if ((reg = find_block(offset))) {
+        *reg = val;
+    }
+}
+
+static int bus_read(uint32_t bus, uint32_t *val) {
+    uint8_t *p;
+
+    if (bus >= EMU_PERIPH_PHYS_BASE && bus < EMU_PERIPH_PHYS_BASE + EMU_PERIPH_SPAN) {
+        *val = periph_read(bus - EMU_PERIPH_PHYS_BASE);
+        return 0;
+    }
+    if (!(p = bus_to_virt(bus)))
+        return -1;
+    *val = *(volatile uint32_t *)p;
+    return 0;
+}
+
+static int bus_write(uint32_t bus, uint32_t val) {
+    uint8_t *p;
+
+    if (bus >= EMU_PERIPH_PHYS_BASE && bus < EMU_PERIPH_PHYS_BASE + EMU_PERIPH_SPAN) {
+        periph_write(bus - EMU_PERIPH_PHYS_BASE, val);
+        return 0;
+    }
+    if (!(p = bus_to_virt(bus)))
+        return -1;
+    *(volatile uint32_t *)p = val;
+    return 0;
+}
+
+/* Time taken for the pacing peripheral to consume one FIFO word.  Both PWM
+ * and PCM are clocked from PLLD through an integer divider, so we work it
+ * out from the values servod has programmed into the register files.
+ */
+static uint64_t dreq_period_ns(int permap) {
+    volatile uint32_t *clk = block_regs(CLK_BASE_OFFSET);
+    volatile uint32_t *pwm = block_regs(PWM_BASE_OFFSET);
+    volatile uint32_t *pcm = block_regs(PCM_BASE_OFFSET);
+    uint32_t div, cycles;
+
+    if (!clk)
+        return 1000;
+    if (permap == DMA_PERMAP_PWM && pwm) {
+        div = (clk[PWMCLK_DIV] >> 12) & 0xfff;
+        cycles = pwm[PWM_RNG1];
+    } else if (permap == DMA_PERMAP_PCM && pcm) {
+        div = (clk[PCMCLK_DIV] >> 12) & 0xfff;
+        cycles = ((pcm[PCM_MODE_A] >> 10) & 0x3ff) + 1;
+    } else {
+        return 1000;
+    }
+    if (div == 0 || cycles == 0)
+        return 1000;
+
+    return (uint64_t)cycles * div * 1000 / plldfreq_mhz;
+}
+
+/* How many words the pacing peripheral asks for ahead of the one it is
+ * sending, from the DREQ threshold servod has programmed, so that a chain
+ * held up by less than that many periods loses no time on the output.
+ */
+static uint64_t dreq_level(int permap) {
+    volatile uint32_t *pwm = block_regs(PWM_BASE_OFFSET);
+    volatile uint32_t *pcm = block_regs(PCM_BASE_OFFSET);
+
+    if (permap == DMA_PERMAP_PWM && pwm)
+        return pwm[PWM_DMAC] & 0xff;
+    if (permap == DMA_PERMAP_PCM && pcm)
+        return (pcm[PCM_DREQ_A] >> 8) & 0x7f;
+    return 0;
+}
+
+// Drive the pins that are in the PWM channel's mode for them
+static void pwm_drive(int ch, int high) {
+    static const uint32_t pins[HWPWM_CHANS][2][2] = {
+        { { 12, GPIO_MODE_ALT0 }, { 18, GPIO_MODE_ALT5 } },
+        { { 13, GPIO_MODE_ALT0 }, { 19, GPIO_MODE_ALT5 } },
+    };
+    volatile uint32_t *gpio = block_regs(GPIO_BASE_OFFSET);
+    volatile uint32_t *pwm = block_regs(PWM_BASE_OFFSET);
+    uint64_t mask = 0;
+    uint32_t gpio_num;
+    int i;
+
+    if (!gpio || !pwm)
+        return;
+    for (i = 0; i < 2; i++) {
+        gpio_num = pins[ch][i][0];
+        if (((gpio[GPIO_FSEL0 + gpio_num / 10] >> (gpio_num % 10) * 3) & 7) == pins[ch][i][1])
+            mask |= 1ULL << gpio_num;
+    }
+    if (pwm[PWM_CTL] & PWMCTL_CHAN(PWMCTL_POLA1, ch))
+        high = !high;
+    update_levels(high ? levels | mask : levels & ~mask);
+}
+
+/* Start or stop the PWM channels to match PWM_CTL, and return the time of
+ * the next edge due on either, or 0 if neither is running.  Only M/S mode
+ * is modelled; FIFO mode is just a pacer for DMA.
+ */
+static uint64_t pwm_next_edge(void) {
+    volatile uint32_t *pwm = block_regs(PWM_BASE_OFFSET);
+    uint64_t next = 0;
+    uint32_t on;
+    int ch;
+
+    for (ch = 0; ch < HWPWM_CHANS; ch++) {
+        on = PWMCTL_CHAN(PWMCTL_PWEN1 | PWMCTL_MSEN1, ch);
+        if (!pwm || (pwm[PWM_CTL] & on) != on) {
+            if (pwms[ch].next)
+                pwm_drive(ch, 0);
+            pwms[ch].next = 0;
+            continue;
+        }
+        if (!pwms[ch].next)
+            pwms[ch].next = pwms[ch].period_end = emu_now;
+        if (!next || pwms[ch].next < next)
+            next = pwms[ch].next;
+    }
+    return next;
+}
+
+// Make the PWM edges due by now
+static void run_pwm(void) {
+    volatile uint32_t *clk = block_regs(CLK_BASE_OFFSET);
+    volatile uint32_t *pwm = block_regs(PWM_BASE_OFFSET);
+    uint64_t tick_ns, dat, rng;
+    int ch;
+
+    if (!clk || !pwm)
+        return;
+    tick_ns = ((clk[PWMCLK_DIV] >> 12) & 0xfff) * 1000 / plldfreq_mhz;
+    for (ch = 0; ch < HWPWM_CHANS; ch++) {
+        while (pwms[ch].next && pwms[ch].next <= emu_now) {
+            if (pwms[ch].next < pwms[ch].period_end) {
+                pwm_drive(ch, 0);
+                pwms[ch].next = pwms[ch].period_end;
+                continue;
+            }
+            dat = pwm[PWM_DAT(ch)];
+            rng = pwm[PWM_RNG(ch)];
+            if (!tick_ns || !rng) {
+                pwms[ch].next = 0;
+                break;
+            }
+            pwm_drive(ch, dat > 0);
+            pwms[ch].period_end += rng * tick_ns;
+            pwms[ch].next = dat > 0 && dat < rng ? pwms[ch].next + dat * tick_ns :
+                            pwms[ch].period_end;
+        }
+    }
+}
+
+static void stop_chan(volatile uint32_t *dma, emu_chan_t *chan, uint32_t cs_bits) {
+    chan->running = 0;
+    __atomic_and_fetch(&dma[DMA_CS], ~DMA_ACTIVE, __ATOMIC_RELAXED);
+    __atomic_or_fetch(&dma[DMA_CS], cs_bits, __ATOMIC_RELAXED);
+}
+
+/* Load the CB at DMA_CONBLK_AD.  Unpaced transfers are carried out straight
+ * away, and keep the channel busy for EMU_CB_NS plus EMU_WORD_NS a word.
+ * A DREQ paced transfer writes each word as soon as the FIFO has room
+ * under the DREQ level, which in the steady state is one pacing period
+ * per word, but lets the chain catch up after something held it up.
+ */
+static void exec_cb(volatile uint32_t *dma, emu_chan_t *chan) {
+    uint32_t addr = dma[DMA_CONBLK_AD];
+    dma_cb_t *cb;
+    uint32_t src, dst, i, val;
+    uint64_t t, ahead;
+
+    if (addr == 0) {
+        stop_chan(dma, chan, DMA_END);
+        return;
+    }
+    cb = (dma_cb_t *)bus_to_virt(addr);
+    if (!cb) {
+        stop_chan(dma, chan, DMA_ERROR);
+        return;
+    }
+    dma[DMA_TI] = cb->info;
+    dma[DMA_SOURCE_AD] = cb->src;
+    dma[DMA_DEST_AD] = cb->dst;
+    dma[DMA_TXFR_LEN] = cb->length;
+    dma[DMA_NEXTCONBK] = cb->next;
+
+    if (cb->info & DMA_D_DREQ) {
+        chan->period_ns = dreq_period_ns((cb->info >> 16) & 0x1f);
+        ahead = dreq_level((cb->info >> 16) & 0x1f) * chan->period_ns;
+        t = emu_now + EMU_CB_NS;
+        for (i = 0; i < cb->length / 4; i++) {
+            if (chan->fifo_empty > t + ahead)
+                t = chan->fifo_empty - ahead;
+            chan->fifo_empty = (chan->fifo_empty > t ? chan->fifo_empty : t) +
+                               chan->period_ns;
+        }
+        chan->busy_until = t;
+        return;
+    }
+    chan->period_ns = 0;
+    src = cb->src;
+    dst = cb->dst;
+    for (i = 0; i < cb->length / 4; i++) {
+        if (bus_read(src, &val) || bus_write(dst, val)) {
+            stop_chan(dma, chan, DMA_ERROR);
+            return;
+        }
+        if (cb->info & DMA_SRC_INC)
+            src += 4;
+        if (cb->info & DMA_DEST_INC)
+            dst += 4;
+    }
+    chan->busy_until = emu_now + EMU_CB_NS + (cb->length / 4) * EMU_WORD_NS;
+}
+
+// Pick up GPIO writes made directly by the CPU, e.g. from gpio_set()
+static void poll_cpu_gpio(void) {
+    volatile uint32_t *gpio = block_regs(GPIO_BASE_OFFSET);
+    uint64_t set, clr;
+
+    if (!gpio)
+        return;
+    set = __atomic_exchange_n(&gpio[GPIO_SET0], 0, __ATOMIC_RELAXED) |
+          (uint64_t)__atomic_exchange_n(&gpio[GPIO_SET0 + 1], 0, __ATOMIC_RELAXED) << 32;
+    clr = __atomic_exchange_n(&gpio[GPIO_CLR0], 0, __ATOMIC_RELAXED) |
+          (uint64_t)__atomic_exchange_n(&gpio[GPIO_CLR0 + 1], 0, __ATOMIC_RELAXED) << 32;
+    if (set | clr)
+        update_levels((levels | set) & ~clr);
+}
+
+// Track CPU writes to the channel CS registers
+static void poll_cpu_dma(volatile uint32_t *dma_base) {
+    int c;
+
+    for (c = 0; c <= DMA_CHAN_MAX; c++) {
+        volatile uint32_t *dma = dma_base + c * DMA_CHAN_SIZE / sizeof(uint32_t);
+        uint32_t cs = dma[DMA_CS];
+
+        // DEBUG's error bits are write 1 to clear, and never raised here
+        if (dma[DMA_DEBUG])
+            dma[DMA_DEBUG] = 0;
+        if (cs & DMA_RESET) {
+            dma[DMA_CS] = 0;
+            chans[c].running = 0;
+        } else if ((cs & DMA_ACTIVE) && !chans[c].running) {
+            chans[c].running = 1;
+            chans[c].busy_until = chans[c].fifo_empty = emu_now;
+            exec_cb(dma, chans + c);
+        } else if (!(cs & DMA_ACTIVE)) {
+            chans[c].running = 0;
+        }
+    }
+}
+
+// Count TXFR_LEN down through paced transfers, as the real controller does
+static void update_txfr_len(volatile uint32_t *dma_base) {
+    int c;
+
+    for (c = 0; c <= DMA_CHAN_MAX; c++) {
+        volatile uint32_t *dma = dma_base + c * DMA_CHAN_SIZE / sizeof(uint32_t);
+
+        if (chans[c].running && chans[c].period_ns && chans[c].busy_until > emu_now)
+            dma[DMA_TXFR_LEN] = (chans[c].busy_until - emu_now + chans[c].period_ns - 1) /
+                                chans[c].period_ns * 4;
+    }
+}
+
+static void *emu_main(void *arg) {
+    volatile uint32_t *dma_base = block_regs(DMA_BASE_OFFSET);
+    uint64_t wall, target, pwm_edge;
+    int c, next, burst;
+
+    (void)arg;
+    // Keep sleeps close to a step so DMA_CONBLK_AD moves as smoothly as it can
+    prctl(PR_SET_TIMERSLACK, 1000);
+    while (!emu_stopping) {
+        poll_cpu_gpio();
+        poll_cpu_dma(dma_base);
+        pwm_edge = pwm_next_edge();
+
+        next = -1;
+        for (c = 0; c <= DMA_CHAN_MAX; c++) {
+            if (chans[c].running && (next < 0 || chans[c].busy_until < chans[next].busy_until))
+                next = c;
+        }
+        if (next < 0 && !pwm_edge) {
+            // Nothing running; let emulated time follow the wall clock
+            udelay(1000);
+            wall = wall_ns();
+            if (wall > emu_now)
+                emu_now = wall;
+            continue;
+        }
+
+        // Step through a long paced transfer a word at a time
+        if (next < 0)
+            target = pwm_edge;
+        else if (chans[next].period_ns && chans[next].busy_until > emu_now + chans[next].period_ns)
+            target = emu_now + chans[next].period_ns;
+        else
+            target = chans[next].busy_until;
+        // ... stopping short at a PWM edge if one comes first
+        if (pwm_edge && pwm_edge < target)
+            target = pwm_edge;
+        if (target > emu_now)
+            emu_now = target;
+        wall = wall_ns();
+        if (emu_now > wall + EMU_MAX_LEAD_NS)
+            udelay((emu_now - wall) / 1000);
+        update_txfr_len(dma_base);
+        run_pwm();
+        if (next < 0)
+            continue;
+
+        for (burst = 0; burst < EMU_MAX_BURST && chans[next].running &&
+                        chans[next].busy_until <= emu_now; burst++) {
+            volatile uint32_t *dma = dma_base + next * DMA_CHAN_SIZE / sizeof(uint32_t);
+
+            dma[DMA_CONBLK_AD] = dma[DMA_NEXTCONBK];
+            exec_cb(dma, chans + next);
+        }
+    }
+
+    return NULL;
+}
+
+static void emu_shutdown(void) {
+    if (emu_started) {
+        emu_stopping = 1;
+        pthread_join(emu_thread, NULL);
+        emu_started = 0;
+    }
+    vcd_close(vcd);
+    vcd = NULL;
+}
+
+static void emu_start(void) {
+    clock_gettime(CLOCK_MONOTONIC, &emu_epoch);
+    if (pthread_create(&emu_thread, NULL, emu_main, NULL))
+        fatal("servod: Failed to start DMA emulator thread\n");
+    emu_started = 1;
+    atexit(emu_shutdown);
+}
+
+void *emu_map_peripheral(uint32_t base, uint32_t len) {
+    emu_block_t *blk;
+    uint32_t size = (len + EMU_PAGE_SIZE - 1) & ~(EMU_PAGE_SIZE - 1);
+
+    if (num_blocks == EMU_MAX_BLOCKS)
+        fatal("servod: Too many emulated peripherals\n");
+    blk = blocks + num_blocks;
+    blk->offset = base - periph_virt_base;
+    blk->len = len;
+    blk->regs = aligned_alloc(EMU_PAGE_SIZE, size);
+    if (!blk->regs)
+        fatal("servod: Failed to allocate emulated peripheral at 0x%08x\n", base);
+    memset((void *)blk->regs, 0, size);
+    num_blocks++;
+
+    return (void *)blk->regs;
+}
+
+int emu_set_vcd(const char *path) {
+    static char names[EMU_NUM_GPIOS][8];
+    static char *namep[EMU_NUM_GPIOS];
+    int i;
+
+    for (i = 0; i < EMU_NUM_GPIOS; i++) {
+        sprintf(names[i], "gpio%d", i);
+        namep[i] = names[i];
+    }
+    vcd = vcd_open(path, "servod", EMU_NUM_GPIOS, namep);
+    if (!vcd)
+        return -1;
+    vcd_sample(vcd, 0, levels);
+
+    return 0;
+}
+
+uint64_t emu_get_levels(void) {
+    return levels;
+}
+
+/* Replacements for the VideoCore mailbox calls in mailbox.c */
+
+int mbox_open(void) {
+    return -1;
+}
+
+void mbox_close(int file_desc) {
+    (void)file_desc;
+}
+
+unsigned mem_alloc(int file_desc, unsigned size, unsigned align, unsigned flags) {
+    emu_alloc_t *a;
+
+    (void)file_desc;
+    (void)flags;
+    if (num_allocs == EMU_MAX_ALLOCS)
+        return 0;
+    // Peripherals are all mapped by the time servod asks for VideoCore memory
+    if (!emu_started && block_regs(DMA_BASE_OFFSET))
+        emu_start();
+    if (align < EMU_PAGE_SIZE)
+        align = EMU_PAGE_SIZE;
+    a = allocs + num_allocs;
+    a->size = (size + align - 1) & ~(align - 1);
+    a->virt_addr = aligned_alloc(align, a->size);
+    if (!a->virt_addr)
+        return 0;
+    memset(a->virt_addr, 0, a->size);
+    a->bus_addr = (next_bus_addr + align - 1) & ~(align - 1);
+    next_bus_addr = a->bus_addr + a->size;
+    a->handle = ++num_allocs;
+
+    return a->handle;
+}
+
+unsigned mem_free(int file_desc, unsigned handle) {
+    (void)file_desc;
+    (void)handle;
+    // Memory stays put; the DMA thread may still be looking at it
+    return 0;
+}
+
+unsigned mem_lock(int file_desc, unsigned handle) {
+    (void)file_desc;
+    if (handle == 0 || handle > num_allocs)
+        return ~0;
+    return allocs[handle - 1].bus_addr;
+}
+
+unsigned mem_unlock(int file_desc, unsigned handle) {
+    (void)file_desc;
+    (void)handle;
+    return 0;
+}
+
+void *mapmem(unsigned base, unsigned size) {
+    int i;
+
+    (void)size;
+    for (i = 0; i < num_allocs; i++) {
+        if (BUS_TO_PHYS(allocs[i].bus_addr) == base)
+            return allocs[i].virt_addr;
+    }
+    fatal("servod: No emulated VideoCore memory at 0x%08x\n", base);
+    return NULL;
+}
+
+void *unmapmem(void *addr, unsigned size) {
+    (void)addr;
+    (void)size;
+    return NULL;
+}
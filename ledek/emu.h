@@ -0,0 +1,34 @@
+#ifndef LEDEK_EMU
+#define LEDEK_EMU
+
+#include <stdint.h>
+
+/*
+ * Software stand-in for the BCM283x peripherals used by servod, selected at
+ * build time with LEDEK_EMULATOR.  Peripheral register blocks and VideoCore
+ * memory are plain heap allocations; emu.c also provides mem_alloc() and
+ * friends from mailbox.h, so mailbox.c is left out of emulator builds.  A
+ * background thread executes any DMA channel that servod starts, walking the
+ * dma_cb_t chain in real time: GPSETn/GPCLRn writes update a virtual pin
+ * state, unpaced copies take a rough per-CB and per-word time, and DREQ
+ * paced transfers to the PWM or PCM FIFO take as long as the pacing
+ * peripheral has been programmed to take, less whatever its FIFO absorbs.
+ */
+
+#define EMU_PERIPH_VIRT_BASE	0x3f000000
+#define EMU_PERIPH_PHYS_BASE	0x7e000000
+#define EMU_SDRAM_BASE		0xc0000000
+
+#define EMU_NUM_GPIOS		54
+
+// Stand-ins for the bcm_host calls servod makes, reporting a Pi 3B
+static inline unsigned bcm_host_get_peripheral_address(void) { return EMU_PERIPH_VIRT_BASE; }
+static inline unsigned bcm_host_get_sdram_address(void) { return EMU_SDRAM_BASE; }
+static inline int bcm_host_get_model_type(void) { return 8; }
+static inline int bcm_host_is_model_pi4(void) { return 0; }
+
+void *emu_map_peripheral(uint32_t base, uint32_t len);
+int emu_set_vcd(const char *path);
+uint64_t emu_get_levels(void);
+
+#endif //LEDEK_EMU
@@ -1,8 +1,12 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "gpio.h"
 #include "hardware.h"
+#include "servod.h"
 
-const uint8_t rev1_p1pin2gpio_map[] = {
+static uint8_t rev1_p1pin2gpio_map[] = {
         DMY,	// P1-1   3v3
         DMY,	// P1-2   5v
         0,	    // P1-3   GPIO 0 (SDA)
@@ -148,17 +152,47 @@ void gpio_set_mode(uint32_t gpio, uint32_t mode) {
 
 void gpio_set(int gpio, int level) {
     if (level)
-        gpio_reg[GPIO_SET0] = 1 << gpio;
+        gpio_reg[GPIO_SET0 + GPIO_BANK(gpio)] = GPIO_BIT(gpio);
     else
-        gpio_reg[GPIO_CLR0] = 1 << gpio;
+        gpio_reg[GPIO_CLR0 + GPIO_BANK(gpio)] = GPIO_BIT(gpio);
+}
+
+// The P1 header map for this board
+static uint8_t *p1_map(int *len) {
+    if (board_model == 1 && gpio_cfg == 1) {
+        *len = sizeof(rev1_p1pin2gpio_map);
+        return rev1_p1pin2gpio_map;
+    } else if (board_model == 1 && gpio_cfg == 2) {
+        *len = sizeof(rev2_p1pin2gpio_map);
+        return rev2_p1pin2gpio_map;
+    }
+    *len = sizeof(bplus_p1pin2gpio_map);
+    return bplus_p1pin2gpio_map;
+}
+
+/* Write a cfg file so can tell which pins are used for servos */
+static void write_cfg_file(const char *pins) {
+    FILE *fp = fopen(CFGFILE, "w");
+    int i;
+
+    if (!fp)
+        return;
+    fprintf(fp, "%s\n", pins);
+    fprintf(fp, "\nServo mapping:\n");
+    for (i = 0; i < MAX_SERVOS; i++) {
+        if (servo2gpio[i] == DMY)
+            continue;
+        fprintf(fp, "    %2d on %-5s          GPIO-%d\n", i, gpio2pinname(servo2gpio[i]), servo2gpio[i]);
+    }
+    fclose(fp);
 }
 
 void parse_pin_lists(int p1first, char *p1pins, char*p5pins) {
     char *name, *pins;
-    int i, mapcnt;
+    int mapcnt;
     uint8_t *map, *pNpin2servo;
     int lst, servo = 0;
-    FILE *fp;
+    char buf[256];
 
     memset(servo2gpio, DMY, sizeof(servo2gpio));
     memset(p1pin2servo, DMY, sizeof(p1pin2servo));
@@ -167,16 +201,7 @@ void parse_pin_lists(int p1first, char *p1pins, char*p5pins) {
         if (lst == 0 && p1first) {
             name = "P1";
             pins = p1pins;
-            if (board_model == 1 && gpio_cfg == 1) {
-                map = rev1_p1pin2gpio_map;
-                mapcnt = sizeof(rev1_p1pin2gpio_map);
-            } else if (board_model == 1 && gpio_cfg == 2) {
-                map = rev2_p1pin2gpio_map;
-                mapcnt = sizeof(rev2_p1pin2gpio_map);
-            } else {
-                map = bplus_p1pin2gpio_map;
-                mapcnt = sizeof(bplus_p1pin2gpio_map);
-            }
+            map = p1_map(&mapcnt);
             pNpin2servo = p1pin2servo;
         } else {
             name = "P5";
@@ -217,21 +242,49 @@ void parse_pin_lists(int p1first, char *p1pins, char*p5pins) {
                 pins++;
         }
     }
-    /* Write a cfg file so can tell which pins are used for servos */
-    fp = fopen(CFGFILE, "w");
-    if (fp) {
-        if (p1first)
-            fprintf(fp, "p1pins=%s\np5pins=%s\n", p1pins, p5pins);
-        else
-            fprintf(fp, "p5pins=%s\np1pins=%s\n", p5pins, p1pins);
-        fprintf(fp, "\nServo mapping:\n");
-        for (i = 0; i < MAX_SERVOS; i++) {
-            if (servo2gpio[i] == DMY)
-                continue;
-            fprintf(fp, "    %2d on %-5s          GPIO-%d\n", i, gpio2pinname(servo2gpio[i]), servo2gpio[i]);
-        }
-        fclose(fp);
+    if (p1first)
+        snprintf(buf, sizeof(buf), "p1pins=%s\np5pins=%s", p1pins, p5pins);
+    else
+        snprintf(buf, sizeof(buf), "p5pins=%s\np1pins=%s", p5pins, p1pins);
+    write_cfg_file(buf);
+}
+
+/* --gpios=<list> maps servos straight onto GPIO numbers, 0 to NUM_GPIOS-1,
+ * which is the only way to reach GPIOs that aren't on a header, such as
+ * 32-53 on a Compute Module.  Those on P1 can still be given as P1-N.
+ */
+void parse_gpio_list(char *gpios) {
+    uint8_t *map;
+    int servo = 0, len, pin, i;
+    char buf[256], *p = gpios;
+
+    memset(servo2gpio, DMY, sizeof(servo2gpio));
+    memset(p1pin2servo, DMY, sizeof(p1pin2servo));
+    memset(p5pin2servo, DMY, sizeof(p5pin2servo));
+    map = p1_map(&len);
+    while (*p) {
+        char *end;
+        long gpio = strtol(p, &end, 10);
+
+        if (end == p || (*end && *end != ','))
+            fatal("Invalid character '%c' in GPIO list\n", *end);
+        if (gpio < 0 || gpio >= NUM_GPIOS)
+            fatal("Invalid GPIO number %ld in GPIO list\n", gpio);
+        if (servo == MAX_SERVOS)
+            fatal("Too many servos specified\n");
+        for (i = 0; i < servo; i++)
+            if (servo2gpio[i] == gpio)
+                fatal("GPIO %ld is in the GPIO list twice\n", gpio);
+        if ((pin = gpiosearch(gpio, map, len)))
+            p1pin2servo[pin] = servo;
+        servo2gpio[servo++] = gpio;
+        num_servos++;
+        p = end;
+        if (*p == ',')
+            p++;
     }
+    snprintf(buf, sizeof(buf), "gpios=%s", gpios);
+    write_cfg_file(buf);
 }
 
 uint8_t gpiosearch(uint8_t gpio, uint8_t *map, int len) {
@@ -252,19 +305,19 @@ char * gpio2pinname(uint8_t gpio) {
         else if ((pin = gpiosearch(gpio, rev1_p5pin2gpio_map, sizeof(rev1_p5pin2gpio_map))))
             sprintf(res, "P5-%d", pin);
         else
-            fatal("Cannot map GPIO %d to a header pin\n", gpio);
+            strcpy(res, "-");	// Only possible with --gpios
     } else if (board_model == 1 && gpio_cfg == 2) {
         if ((pin = gpiosearch(gpio, rev2_p1pin2gpio_map, sizeof(rev2_p1pin2gpio_map))))
             sprintf(res, "P1-%d", pin);
         else if ((pin = gpiosearch(gpio, rev2_p5pin2gpio_map, sizeof(rev2_p5pin2gpio_map))))
             sprintf(res, "P5-%d", pin);
         else
-            fatal("Cannot map GPIO %d to a header pin\n", gpio);
+            strcpy(res, "-");	// Only possible with --gpios
     } else {
         if ((pin = gpiosearch(gpio, bplus_p1pin2gpio_map, sizeof(bplus_p1pin2gpio_map))))
             sprintf(res, "P1-%d", pin);
         else
-            fatal("Cannot map GPIO %d to a header pin\n", gpio);
+            strcpy(res, "-");	// Only possible with --gpios
     }
 
     return res;
@@ -7,6 +7,7 @@
 
 #define NUM_P1PINS	40
 #define NUM_P5PINS	8
+#define NUM_GPIOS	54	/* GPIO 0-31 in bank 0, 32-53 in bank 1 */
 
 #define GPIO_BASE_OFFSET	0x00200000
 #define GPIO_LEN		0x100
@@ -21,13 +22,22 @@
 #define GPIO_PULLEN		(0x94/4)
 #define GPIO_PULLCLK		(0x98/4)
 
+// Bank 1 registers follow on from the bank 0 ones
+#define GPIO_BANK(gpio)		((gpio) >> 5)
+#define GPIO_BIT(gpio)		(1U << ((gpio) & 31))
+
 #define GPIO_MODE_IN		0
 #define GPIO_MODE_OUT		1
+#define GPIO_MODE_ALT0		4
+#define GPIO_MODE_ALT5		2
+
+extern char *gpio_desc[];
 
 uint32_t gpio_get_mode(uint32_t gpio);
 void gpio_set_mode(uint32_t gpio, uint32_t mode);
 void gpio_set(int gpio, int level);
 void parse_pin_lists(int p1first, char *p1pins, char*p5pins);
+void parse_gpio_list(char *gpios);
 uint8_t gpiosearch(uint8_t gpio, uint8_t *map, int len);
 char * gpio2pinname(uint8_t gpio);
 
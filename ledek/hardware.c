@@ -1,59 +1,37 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
 
 #include "clk.h"
 #include "dma.h"
 #include "gpio.h"
 #include "hardware.h"
+#include "pcm.h"
 #include "pwm.h"
-
-// bcm_host_get_model_type() return values to name mapping
-const char *model_names[] = {
-        "A", "B", "A+", "B+", "2B", "Alpha", "CM", "CM2", "3B", "Zero", "CM3",
-        "Custom", "ZeroW", "3B+", "3A+", "FPGA", "CM3+", "4B"
-};
-#define NUM_MODELS	(sizeof(model_names)/sizeof(*model_names))
+#include "servod.h"
+#include "strip.h"
 
 volatile uint32_t *pwm_reg;
 volatile uint32_t *pcm_reg;
 volatile uint32_t *clk_reg;
-volatile uint32_t *dma_reg;
 volatile uint32_t *gpio_reg;
 
-int delay_hw = DELAY_VIA_PWM;
-
-uint32_t periph_phys_base;
-uint32_t periph_virt_base;
-uint32_t dram_phys_base;
-uint32_t mem_flag;
-
 void terminate(int dummy) {
     int i;
 
-    if (dma_reg && mbox.virt_addr) {
-        for (i = 0; i < MAX_SERVOS; i++) {
-            if (servo2gpio[i] != DMY)
-                set_servo(i, 0);
-        }
-        udelay(cycle_time_us);
-        dma_reg[DMA_CS] = DMA_RESET;
-        udelay(10);
-    }
+    stop_groups();
     if (restore_gpio_modes) {
         for (i = 0; i < MAX_SERVOS; i++) {
             if (servo2gpio[i] != DMY)
                 gpio_set_mode(servo2gpio[i], gpiomode[i]);
         }
     }
-    if (mbox.virt_addr != NULL) {
-        unmapmem(mbox.virt_addr, mbox.size);
-        mem_unlock(mbox.handle, mbox.mem_ref);
-        mem_free(mbox.handle, mbox.mem_ref);
-        if (mbox.handle >= 0)
-            mbox_close(mbox.handle);
-    }
 
     unlink(DEVFILE);
+    unlink(CTLFILE);
     unlink(CFGFILE);
     exit(1);
 }
@@ -81,136 +59,188 @@ void setup_sighandlers(void) {
     }
 }
 
-void init_hardware(void) {
+static void add_step(hw_setup_t *s, volatile uint32_t *reg, uint32_t value,
+                     int or_in, int delay_us) {
+    s->step[s->num_steps].reg = reg;
+    s->step[s->num_steps].value = value;
+    s->step[s->num_steps].or_in = or_in;
+    s->step[s->num_steps].delay_us = delay_us;
+    s->num_steps++;
+}
+
+static void add_start_dma(hw_setup_t *s, volatile uint32_t *dma_reg, uint32_t cb_addr,
+                          int delay_us) {
+    add_step(s, dma_reg + DMA_CS, DMA_RESET, 0, 10);
+    add_step(s, dma_reg + DMA_CS, DMA_INT | DMA_END, 0, 0);
+    add_step(s, dma_reg + DMA_CONBLK_AD, cb_addr, 0, 0);
+    add_step(s, dma_reg + DMA_DEBUG, 7, 0, 0);	// clear debug error flags
+    add_step(s, dma_reg + DMA_CS, 0x10880001, 0, delay_us);	// go, mid priority, wait for outstanding writes
+}
+
+void hw_setup_delay(hw_setup_t *s, int delay_hw, int step_time_us,
+                    volatile uint32_t *dma_reg, uint32_t cb_addr) {
+    s->num_steps = s->next = 0;
     if (delay_hw == DELAY_VIA_PWM) {
         // Initialise PWM
-        pwm_reg[PWM_CTL] = 0;
-        udelay(10);
-        clk_reg[PWMCLK_CNTL] = 0x5A000006;		// Source=PLLD (500MHz or 750MHz on Pi4)
-        udelay(100);
-        clk_reg[PWMCLK_DIV] = 0x5A000000 | (plldfreq_mhz<<12);	// set pwm div to give 1MHz
-        udelay(100);
-        clk_reg[PWMCLK_CNTL] = 0x5A000016;		// Source=PLLD and enable
-        udelay(100);
-        pwm_reg[PWM_RNG1] = step_time_us;
-        udelay(10);
-        pwm_reg[PWM_DMAC] = PWMDMAC_ENAB | PWMDMAC_THRSHLD;
-        udelay(10);
-        pwm_reg[PWM_CTL] = PWMCTL_CLRF;
-        udelay(10);
-        pwm_reg[PWM_CTL] = PWMCTL_USEF1 | PWMCTL_PWEN1;
-        udelay(10);
+        add_step(s, pwm_reg + PWM_CTL, 0, 0, 10);
+        add_step(s, clk_reg + PWMCLK_CNTL, 0x5A000006, 0, 100);	// Source=PLLD (500MHz or 750MHz on Pi4)
+        add_step(s, clk_reg + PWMCLK_DIV, 0x5A000000 | (plldfreq_mhz<<12), 0, 100);	// set pwm div to give 1MHz
+        add_step(s, clk_reg + PWMCLK_CNTL, 0x5A000016, 0, 100);	// Source=PLLD and enable
+        add_step(s, pwm_reg + PWM_RNG1, step_time_us, 0, 10);
+        add_step(s, pwm_reg + PWM_DMAC, PWMDMAC_ENAB | PWMDMAC_THRSHLD, 0, 10);
+        add_step(s, pwm_reg + PWM_CTL, PWMCTL_CLRF, 0, 10);
+        add_step(s, pwm_reg + PWM_CTL, PWMCTL_USEF1 | PWMCTL_PWEN1, 0, 10);
     } else {
         // Initialise PCM
-        pcm_reg[PCM_CS_A] = 1;				// Disable Rx+Tx, Enable PCM block
-        udelay(100);
-        clk_reg[PCMCLK_CNTL] = 0x5A000006;		// Source=PLLD (500MHz or 750MHz on Pi4)
-        udelay(100);
-        clk_reg[PCMCLK_DIV] = 0x5A000000 | (plldfreq_mhz<<12);	// Set pcm div to give 1MHz
-        udelay(100);
-        clk_reg[PCMCLK_CNTL] = 0x5A000016;		// Source=PLLD and enable
-        udelay(100);
-        pcm_reg[PCM_TXC_A] = 0<<31 | 1<<30 | 0<<20 | 0<<16; // 1 channel, 8 bits
-        udelay(100);
-        pcm_reg[PCM_MODE_A] = (step_time_us - 1) << 10;
-        udelay(100);
-        pcm_reg[PCM_CS_A] |= 1<<4 | 1<<3;		// Clear FIFOs
-        udelay(100);
-        pcm_reg[PCM_DREQ_A] = 64<<24 | 64<<8;		// DMA Req when one slot is free?
-        udelay(100);
-        pcm_reg[PCM_CS_A] |= 1<<9;			// Enable DMA
-        udelay(100);
+        add_step(s, pcm_reg + PCM_CS_A, 1, 0, 100);		// Disable Rx+Tx, Enable PCM block
+        add_step(s, clk_reg + PCMCLK_CNTL, 0x5A000006, 0, 100);	// Source=PLLD (500MHz or 750MHz on Pi4)
+        add_step(s, clk_reg + PCMCLK_DIV, 0x5A000000 | (plldfreq_mhz<<12), 0, 100);	// Set pcm div to give 1MHz
+        add_step(s, clk_reg + PCMCLK_CNTL, 0x5A000016, 0, 100);	// Source=PLLD and enable
+        add_step(s, pcm_reg + PCM_TXC_A, 0<<31 | 1<<30 | 0<<20 | 0<<16, 0, 100); // 1 channel, 8 bits
+        add_step(s, pcm_reg + PCM_MODE_A, (step_time_us - 1) << 10, 0, 100);
+        add_step(s, pcm_reg + PCM_CS_A, 1<<4 | 1<<3, 1, 100);	// Clear FIFOs
+        add_step(s, pcm_reg + PCM_DREQ_A, 64<<24 | 64<<8, 0, 100);	// DMA Req when one slot is free?
+        add_step(s, pcm_reg + PCM_CS_A, 1<<9, 1, 100);		// Enable DMA
     }
 
-    // Initialise the DMA
-    dma_reg[DMA_CS] = DMA_RESET;
-    udelay(10);
-    dma_reg[DMA_CS] = DMA_INT | DMA_END;
-    dma_reg[DMA_CONBLK_AD] = mem_virt_to_phys(cb_base);
-    dma_reg[DMA_DEBUG] = 7; // clear debug error flags
-    dma_reg[DMA_CS] = 0x10880001;	// go, mid priority, wait for outstanding writes
+    add_start_dma(s, dma_reg, cb_addr, 0);
 
     if (delay_hw == DELAY_VIA_PCM) {
-        pcm_reg[PCM_CS_A] |= 1<<2;			// Enable Tx
+        add_step(s, pcm_reg + PCM_CS_A, 1<<2, 1, 0);		// Enable Tx
     }
 }
 
-void get_model_and_revision(void) {
-    char buf[128], revstr[128], modelstr[128];
-    char *ptr, *end, *res;
-    int board_revision;
-    FILE *fp;
+/* Run PCM as a serial output for the strip: 32 bit frames back to back at
+ * STRIP_BIT_HZ, which PLLD only divides down to with a fraction, so MASH
+ * is on to spread the error.  The controller must have the FIFO filled
+ * before transmit is enabled, or the first bits sent would be an underrun.
+ */
+void hw_setup_strip(hw_setup_t *s, volatile uint32_t *dma_reg, uint32_t cb_addr) {
+    uint32_t div = (uint64_t)plldfreq_mhz * 1000000 * 4096 / STRIP_BIT_HZ;
+
+    s->num_steps = s->next = 0;
+    add_step(s, pcm_reg + PCM_CS_A, 1, 0, 100);		// Disable Rx+Tx, Enable PCM block
+    add_step(s, clk_reg + PCMCLK_CNTL, 0x5A000006, 0, 100);	// Source=PLLD (500MHz or 750MHz on Pi4)
+    add_step(s, clk_reg + PCMCLK_DIV, 0x5A000000 | div, 0, 100);	// 12 bit integer, 12 bit fraction
+    add_step(s, clk_reg + PCMCLK_CNTL, 0x5A000216, 0, 100);	// Source=PLLD, MASH 1 and enable
+    add_step(s, pcm_reg + PCM_TXC_A, 1<<31 | 1<<30 | 0<<20 | 8<<16, 0, 100); // 1 channel, 32 bits
+    add_step(s, pcm_reg + PCM_MODE_A, 31 << 10, 0, 100);	// 32 clocks a frame
+    add_step(s, pcm_reg + PCM_CS_A, 1<<4 | 1<<3, 1, 100);	// Clear FIFOs
+    add_step(s, pcm_reg + PCM_DREQ_A, 64<<24 | 64<<8, 0, 100);
+    add_step(s, pcm_reg + PCM_CS_A, 1<<9, 1, 100);		// Enable DMA
+    add_start_dma(s, dma_reg, cb_addr, 100);
+    add_step(s, pcm_reg + PCM_CS_A, 1<<2, 1, 0);		// Enable Tx
+}
 
-    revstr[0] = modelstr[0] = '\0';
+int hw_setup_step(hw_setup_t *s) {
+    int delay_us = 0;
 
-    fp = fopen("/proc/cpuinfo", "r");
+    while (s->next < s->num_steps && !delay_us) {
+        if (s->step[s->next].or_in)
+            *s->step[s->next].reg |= s->step[s->next].value;
+        else
+            *s->step[s->next].reg = s->step[s->next].value;
+        delay_us = s->step[s->next++].delay_us;
+    }
+    return s->next < s->num_steps ? delay_us : -1;
+}
 
-    if (!fp)
-        fatal("Unable to open /proc/cpuinfo: %m\n");
+static void run_setup(hw_setup_t *s) {
+    int us;
 
-    while ((res = fgets(buf, 128, fp))) {
-        if (!strncasecmp("hardware", buf, 8))
-            memcpy(modelstr, buf, 128);
-        else if (!strncasecmp(buf, "revision", 8))
-            memcpy(revstr, buf, 128);
-    }
-    fclose(fp);
-
-    if (modelstr[0] == '\0')
-        fatal("servod: No 'Hardware' record in /proc/cpuinfo\n");
-    if (revstr[0] == '\0')
-        fatal("servod: No 'Revision' record in /proc/cpuinfo\n");
-
-    if (strstr(modelstr, "BCM2708"))
-        board_model = 1;
-    else if (strstr(modelstr, "BCM2709") || strstr(modelstr, "BCM2835"))
-        board_model = 2;
-    else
-        fatal("servod: Cannot parse the hardware name string\n");
-
-    /* Revisions documented at http://elinux.org/RPi_HardwareHistory */
-    ptr = revstr + strlen(revstr) - 3;
-    board_revision = strtol(ptr, &end, 16);
-    if (end != ptr + 2)
-        fatal("servod: Failed to parse Revision string\n");
-    if (board_revision < 1)
-        fatal("servod: Invalid board Revision\n");
-    else if (board_revision < 4)
-        gpio_cfg = 1;
-    else if (board_revision < 16)
-        gpio_cfg = 2;
-    else
-        gpio_cfg = 3;
-
-    if (bcm_host_is_model_pi4()) {
-        plldfreq_mhz = PLLDFREQ_MHZ_PI4;
-        dma_chan = DMA_CHAN_PI4;
-    } else {
-        plldfreq_mhz = PLLDFREQ_MHZ_DEFAULT;
-        dma_chan = DMA_CHAN_DEFAULT;
+    while ((us = hw_setup_step(s)) >= 0)
+        udelay(us);
+}
+
+void init_hardware(int delay_hw, int step_time_us, volatile uint32_t *dma_reg,
+                   uint32_t cb_addr) {
+    hw_setup_t s;
+
+    hw_setup_delay(&s, delay_hw, step_time_us, dma_reg, cb_addr);
+    run_setup(&s);
+}
+
+void init_strip_pcm(volatile uint32_t *dma_reg, uint32_t cb_addr) {
+    hw_setup_t s;
+
+    hw_setup_strip(&s, dma_reg, cb_addr);
+    run_setup(&s);
+}
+
+void stop_strip_pcm(volatile uint32_t *dma_reg) {
+    pcm_reg[PCM_CS_A] &= ~(1<<2);
+    udelay(10);
+    dma_reg[DMA_CS] = DMA_RESET;
+    udelay(10);
+}
+
+/* The PWM channel whose M/S output can be routed to 'gpio', and into *mode
+ * the pin mode that does it, or -1 if there isn't one.  GPIOs 40, 41 and
+ * 45 have PWM outputs too, but on most boards they only go to the audio
+ * jack.
+ */
+int hw_pwm_channel(int gpio, uint32_t *mode) {
+    switch (gpio) {
+    case 12:
+    case 13:
+        *mode = GPIO_MODE_ALT0;
+        return gpio - 12;
+    case 18:
+    case 19:
+        *mode = GPIO_MODE_ALT5;
+        return gpio - 18;
     }
+    return -1;
+}
 
-    periph_virt_base = bcm_host_get_peripheral_address();
-    dram_phys_base = bcm_host_get_sdram_address();
-    periph_phys_base = 0x7e000000;
-
-    /*
-     * See https://github.com/raspberrypi/firmware/wiki/Mailbox-property-interface
-     *
-     * 1:  MEM_FLAG_DISCARDABLE = 1 << 0	// can be resized to 0 at any time. Use for cached data
-     *     MEM_FLAG_NORMAL = 0 << 2		// normal allocating alias. Don't use from ARM
-     * 4:  MEM_FLAG_DIRECT = 1 << 2		// 0xC alias uncached
-     * 8:  MEM_FLAG_COHERENT = 2 << 2	// 0x8 alias. Non-allocating in L2 but coherent
-     *     MEM_FLAG_L1_NONALLOCATING =	// Allocating in L2
-     *       (MEM_FLAG_DIRECT | MEM_FLAG_COHERENT)
-     * 16: MEM_FLAG_ZERO = 1 << 4		// initialise buffer to all zeros
-     * 32: MEM_FLAG_NO_INIT = 1 << 5	// don't initialise (default is initialise to all ones
-     * 64: MEM_FLAG_HINT_PERMALOCK = 1 << 6	// Likely to be locked for long periods of time
-     *
-     */
-    if (board_model == 1) {
-        mem_flag         = 0x0c;	/* MEM_FLAG_DIRECT | MEM_FLAG_COHERENT */
-    } else {
-        mem_flag         = 0x04;	/* MEM_FLAG_DIRECT */
+// Whether the kernel's PWM driver has the channel exported for its own use
+int hw_pwm_claimed(int chan) {
+#ifdef LEDEK_EMULATOR
+    return 0;
+#else
+    char path[64];
+
+    sprintf(path, "/sys/class/pwm/pwmchip0/pwm%d", chan);
+    return access(path, F_OK) == 0;
+#endif
+}
+
+/* Run the PWM channels in 'chans', a bit per channel, in M/S mode with a
+ * period of 'range' ticks of HWPWM_CLOCK_MHZ, and every output off.  The
+ * PWM block then can't pace a DMA channel, so the caller must see to it
+ * that none uses DELAY_VIA_PWM.
+ */
+void init_hw_pwm(int chans, uint32_t range, int invert) {
+    uint32_t ctl = 0;
+    int chan;
+
+    pwm_reg[PWM_CTL] = 0;
+    udelay(10);
+    clk_reg[PWMCLK_CNTL] = 0x5A000006;		// Source=PLLD (500MHz or 750MHz on Pi4)
+    udelay(100);
+    clk_reg[PWMCLK_DIV] = 0x5A000000 | ((plldfreq_mhz / HWPWM_CLOCK_MHZ) << 12);
+    udelay(100);
+    clk_reg[PWMCLK_CNTL] = 0x5A000016;		// Source=PLLD and enable
+    udelay(100);
+    for (chan = 0; chan < HWPWM_CHANS; chan++) {
+        if (!(chans & (1 << chan)))
+            continue;
+        pwm_reg[PWM_RNG(chan)] = range;
+        pwm_reg[PWM_DAT(chan)] = 0;
+        ctl |= PWMCTL_CHAN(PWMCTL_PWEN1 | PWMCTL_MSEN1 |
+                           (invert ? PWMCTL_POLA1 : 0), chan);
     }
-}
\ No newline at end of file
+    udelay(10);
+    pwm_reg[PWM_CTL] = ctl;
+    udelay(10);
+}
+
+// Takes effect from the start of the channel's next period
+void set_hw_pwm(int chan, uint32_t ticks) {
+    pwm_reg[PWM_DAT(chan)] = ticks;
+}
+
+void stop_hw_pwm(void) {
+    pwm_reg[PWM_CTL] = 0;
+    udelay(10);
+}
@@ -3,13 +3,51 @@
 
 #include <stdint.h>
 
-#define BUS_TO_PHYS(x) ((x)&~0xC0000000)
+#include "board.h"
+
+extern volatile uint32_t *pwm_reg;
+extern volatile uint32_t *pcm_reg;
+extern volatile uint32_t *clk_reg;
+extern volatile uint32_t *gpio_reg;
+
+/* A block's setup as a list of register writes, each with the time the
+ * block is given to settle before the next.  Startup runs the list straight
+ * through; the watchdog runs it a step at a time off a timer, so as not to
+ * hold up the event loop for the millisecond or so it takes.
+ */
+#define HW_SETUP_STEPS		16
+
+typedef struct {
+    struct {
+        volatile uint32_t *reg;
+        uint32_t value;
+        int or_in;		/* OR the value in, rather than write it */
+        int delay_us;		/* Before the next write */
+    } step[HW_SETUP_STEPS];
+    int num_steps;
+    int next;
+} hw_setup_t;
 
-const char *model_names[];
 void terminate(int dummy);
-void fatal(char *fmt, ...);
 void setup_sighandlers(void);
-void init_hardware(void);
-void get_model_and_revision(void);
+// Set up PWM or PCM to pace 'dma_reg', which is then started at 'cb_addr'
+void hw_setup_delay(hw_setup_t *s, int delay_hw, int step_time_us,
+                    volatile uint32_t *dma_reg, uint32_t cb_addr);
+// ... or PCM to send the strip, as init_strip_pcm() does
+void hw_setup_strip(hw_setup_t *s, volatile uint32_t *dma_reg, uint32_t cb_addr);
+/* Make the writes that are due, returning the microseconds to wait before
+ * the next call, or -1 once the setup is done.
+ */
+int hw_setup_step(hw_setup_t *s);
+// The same, waiting in udelay() between writes
+void init_hardware(int delay_hw, int step_time_us, volatile uint32_t *dma_reg,
+                   uint32_t cb_addr);
+void init_strip_pcm(volatile uint32_t *dma_reg, uint32_t cb_addr);
+void stop_strip_pcm(volatile uint32_t *dma_reg);
+int hw_pwm_channel(int gpio, uint32_t *mode);
+int hw_pwm_claimed(int chan);
+void init_hw_pwm(int chans, uint32_t range, int invert);
+void set_hw_pwm(int chan, uint32_t ticks);
+void stop_hw_pwm(void);
 
 #endif //LEDEK_HARDWARE
@@ -0,0 +1,83 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "linebuf.h"
+
+int linebuf_init(linebuf_t *lb) {
+    memset(lb, 0, sizeof(*lb));
+    lb->buf = malloc(LINEBUF_INITIAL_SIZE);
+    if (!lb->buf)
+        return -1;
+    lb->size = LINEBUF_INITIAL_SIZE;
+
+    return 0;
+}
+
+void linebuf_free(linebuf_t *lb) {
+    free(lb->buf);
+    lb->buf = NULL;
+    lb->size = lb->start = lb->scan = lb->len = 0;
+}
+
+// Make room at the end of the buffer, first by compacting, then by growing
+static int make_room(linebuf_t *lb) {
+    char *p;
+
+    if (lb->start) {
+        memmove(lb->buf, lb->buf + lb->start, lb->len - lb->start);
+        lb->len -= lb->start;
+        lb->scan -= lb->start;
+        lb->start = 0;
+    }
+    if (lb->len < lb->size)
+        return 0;
+    if (lb->size >= LINEBUF_MAX_SIZE) {
+        // Line too long; throw away what we have and skip to the next newline
+        lb->len = lb->scan = 0;
+        lb->discarding = 1;
+        lb->overflow = 1;
+        return 0;
+    }
+    p = realloc(lb->buf, lb->size * 2);
+    if (!p)
+        return -1;
+    lb->buf = p;
+    lb->size *= 2;
+
+    return 0;
+}
+
+ssize_t linebuf_read(linebuf_t *lb, int fd) {
+    ssize_t n;
+
+    if (make_room(lb) < 0)
+        return -1;
+    n = read(fd, lb->buf + lb->len, lb->size - lb->len);
+    if (n > 0)
+        lb->len += n;
+
+    return n;
+}
+
+char *linebuf_getline(linebuf_t *lb) {
+    char *line, *nl;
+
+    for (;;) {
+        nl = memchr(lb->buf + lb->scan, '\n', lb->len - lb->scan);
+        if (!nl) {
+            lb->scan = lb->len;
+            if (lb->discarding)
+                lb->start = lb->scan = lb->len = 0;
+            return NULL;
+        }
+        *nl = '\0';
+        line = lb->buf + lb->start;
+        lb->start = lb->scan = nl + 1 - lb->buf;
+        if (lb->start == lb->len)
+            lb->start = lb->scan = lb->len = 0;
+        if (!lb->discarding)
+            return line;
+        lb->discarding = 0;
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef LEDEK_LINEBUF
+#define LEDEK_LINEBUF
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define LINEBUF_INITIAL_SIZE	4096
+#define LINEBUF_MAX_SIZE	65536
+
+/* Input buffer for the command stream.  linebuf_read() pulls in as much as
+ * a single read() will give us, and linebuf_getline() then hands out every
+ * complete line in place, with the trailing newline replaced by a NUL.  Any
+ * partial line is kept for the next read.  The buffer grows as needed up to
+ * LINEBUF_MAX_SIZE; a line longer than that is reported once via the
+ * overflow flag and then discarded up to its newline.
+ */
+typedef struct {
+    char *buf;
+    size_t size;	/* Allocated size */
+    size_t start;	/* First unconsumed byte */
+    size_t scan;	/* Bytes before this contain no newline */
+    size_t len;		/* End of valid data */
+    int discarding;	/* Dropping the tail of an over-long line */
+    int overflow;	/* Set when a line was dropped, cleared by caller */
+} linebuf_t;
+
+int linebuf_init(linebuf_t *lb);
+void linebuf_free(linebuf_t *lb);
+ssize_t linebuf_read(linebuf_t *lb, int fd);
+char *linebuf_getline(linebuf_t *lb);
+
+#endif //LEDEK_LINEBUF
@@ -0,0 +1,300 @@
+#include <stddef.h>
+
+#include "mask.h"
+
+/* Bulk OR and AND-NOT over a contiguous run of table words, and bulk copy
+ * from a cached shadow table into the DMA visible one.  The vector paths
+ * only ever do aligned 16 byte accesses to the destination, with the odd
+ * words at either end done one at a time; the uncached memory on a Pi
+ * faults on unaligned NEON accesses.  The compiler barrier in each step
+ * stops the stores being reordered, since the order they land in is what
+ * keeps width changes glitch free.
+ *
+ * Copies are plain vector stores.  As the DMA table on a Pi is uncached
+ * they already go straight out, in order.  On x86, where there is only
+ * the emulator, ordinary stores are kept in order too; non-temporal ones
+ * would need an sfence every cache line, which costs far more than it
+ * saves on memory that is cached anyway.
+ *
+ * Most width changes only move an edge by a word or two, and for those the
+ * vector set up and the alignment loops cost more than they save, so spans
+ * shorter than SHORT_SPAN words take a plain loop instead.
+ */
+
+#define SHORT_SPAN	16
+
+#define BARRIER()	__asm__ __volatile__("" ::: "memory")
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+const char *mask_kernel_name = "neon";
+
+#define VEC_WORDS	4
+#define VEC_OR(p, v)	vst1q_u32((uint32_t *)(p), vorrq_u32(vld1q_u32((uint32_t *)(p)), v))
+#define VEC_BIC(p, v)	vst1q_u32((uint32_t *)(p), vbicq_u32(vld1q_u32((uint32_t *)(p)), v))
+#define VEC_DUP(bit)	vdupq_n_u32(bit)
+#define VEC_COPY(d, s)	vst1q_u32((uint32_t *)(d), vld1q_u32(s))
+typedef uint32x4_t vec_t;
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+const char *mask_kernel_name = "sse2";
+
+#define VEC_WORDS	4
+#define VEC_OR(p, v)	_mm_store_si128((__m128i *)(p), _mm_or_si128(_mm_load_si128((__m128i *)(p)), v))
+#define VEC_BIC(p, v)	_mm_store_si128((__m128i *)(p), _mm_andnot_si128(v, _mm_load_si128((__m128i *)(p))))
+#define VEC_DUP(bit)	_mm_set1_epi32(bit)
+#define VEC_COPY(d, s)	_mm_store_si128((__m128i *)(d), _mm_loadu_si128((const __m128i *)(s)))
+typedef __m128i vec_t;
+
+#else
+
+const char *mask_kernel_name = "scalar";
+
+#endif
+
+#define ALIGNED(p)	(((uintptr_t)(p) & (VEC_WORDS * 4 - 1)) == 0)
+
+// Set 'bit' in p[0..n-1], lowest address first
+static void span_or(volatile uint32_t *p, int n, uint32_t bit) {
+    volatile uint32_t *end = p + n;
+#ifdef VEC_WORDS
+    vec_t v;
+
+    if (n < SHORT_SPAN) {
+        while (p < end)
+            *p++ |= bit;
+        return;
+    }
+    v = VEC_DUP(bit);
+    while (p < end && !ALIGNED(p))
+        *p++ |= bit;
+    for (; end - p >= VEC_WORDS; p += VEC_WORDS) {
+        VEC_OR(p, v);
+        BARRIER();
+    }
+#else
+    for (; end - p >= 4; p += 4) {
+        p[0] |= bit;
+        p[1] |= bit;
+        p[2] |= bit;
+        p[3] |= bit;
+    }
+#endif
+    while (p < end)
+        *p++ |= bit;
+}
+
+// Clear 'bit' in p[0..n-1], highest address first
+static void span_bic_rev(volatile uint32_t *p, int n, uint32_t bit) {
+    volatile uint32_t *end = p + n;
+#ifdef VEC_WORDS
+    vec_t v;
+
+    if (n < SHORT_SPAN) {
+        while (end > p)
+            *--end &= ~bit;
+        return;
+    }
+    v = VEC_DUP(bit);
+    while (end > p && !ALIGNED(end))
+        *--end &= ~bit;
+    for (; end - p >= VEC_WORDS; end -= VEC_WORDS) {
+        VEC_BIC(end - VEC_WORDS, v);
+        BARRIER();
+    }
+#else
+    for (; end - p >= 4; end -= 4) {
+        end[-1] &= ~bit;
+        end[-2] &= ~bit;
+        end[-3] &= ~bit;
+        end[-4] &= ~bit;
+    }
+#endif
+    while (end > p)
+        *--end &= ~bit;
+}
+
+// Copy s[0..n-1] to d[0..n-1], lowest address first
+static void span_copy(volatile uint32_t *d, const uint32_t *s, int n) {
+    volatile uint32_t *end = d + n;
+
+#ifdef VEC_WORDS
+    if (n < SHORT_SPAN) {
+        while (d < end)
+            *d++ = *s++;
+        return;
+    }
+    while (d < end && !ALIGNED(d))
+        *d++ = *s++;
+    for (; end - d >= VEC_WORDS; d += VEC_WORDS, s += VEC_WORDS) {
+        VEC_COPY(d, s);
+        BARRIER();
+    }
+#endif
+    while (d < end)
+        *d++ = *s++;
+}
+
+// Copy s[0..n-1] to d[0..n-1], highest address first
+static void span_copy_rev(volatile uint32_t *d, const uint32_t *s, int n) {
+    volatile uint32_t *end = d + n;
+
+    s += n;
+#ifdef VEC_WORDS
+    if (n < SHORT_SPAN) {
+        while (end > d)
+            *--end = *--s;
+        return;
+    }
+    while (end > d && !ALIGNED(end))
+        *--end = *--s;
+    for (; end - d >= VEC_WORDS; end -= VEC_WORDS, s -= VEC_WORDS) {
+        VEC_COPY(end - VEC_WORDS, s - VEC_WORDS);
+        BARRIER();
+    }
+#endif
+    while (end > d)
+        *--end = *--s;
+}
+
+/* The words to change run from start+min(old,width) to start+max(old,width),
+ * which splits into at most two spans where it wraps round the end of the
+ * table: span[0] is [lo, lo+n0) and span[1], if n1 is non-zero, is
+ * [0, n1).  Returns 0 if there is nothing to change.
+ */
+static int get_spans(int num_samples, int start, int old, int width,
+                     int *lo, int *n0, int *n1) {
+    int hi;
+
+    if (width == old)
+        return 0;
+    *lo = start + (width > old ? old : width);
+    hi = start + (width > old ? width : old);
+    if (*lo >= num_samples) {
+        *lo -= num_samples;
+        hi -= num_samples;
+    }
+    if (hi > num_samples) {
+        *n0 = num_samples - *lo;
+        *n1 = hi - num_samples;
+    } else {
+        *n0 = hi - *lo;
+        *n1 = 0;
+    }
+    return 1;
+}
+
+/* A change of fewer than SHORT_SPAN words, a word at a time in the same
+ * order the spans would go, without splitting it up first.
+ */
+#define SHORT_CHANGE(old, width) \
+    ((unsigned)((width) - (old) + SHORT_SPAN - 1) < 2 * SHORT_SPAN - 1)
+
+static void short_change(volatile uint32_t *tbl, int num_samples, int start,
+                         int old, int width, uint32_t bit) {
+    volatile uint32_t *p = tbl + start + width, *end = tbl + num_samples;
+    int n;
+
+    if (p >= end)
+        p -= num_samples;
+    if (width > old) {
+        for (n = width - old; n > 0; n--) {
+            if (--p < tbl)
+                p = end - 1;
+            *p &= ~bit;
+        }
+    } else {
+        for (n = old - width; n > 0; n--) {
+            *p++ |= bit;
+            if (p >= end)
+                p = tbl;
+        }
+    }
+}
+
+static void short_flush(volatile uint32_t *dst, const uint32_t *src, int num_samples,
+                        int start, int old, int width) {
+    int i = start + width, n;
+
+    if (i >= num_samples)
+        i -= num_samples;
+    if (width > old) {
+        for (n = width - old; n > 0; n--) {
+            if (--i < 0)
+                i = num_samples - 1;
+            dst[i] = src[i];
+        }
+    } else {
+        for (n = old - width; n > 0; n--) {
+            dst[i] = src[i];
+            if (++i >= num_samples)
+                i = 0;
+        }
+    }
+}
+
+/* A longer pulse is cleared from its far end back, so the wrapped span goes
+ * first; a shorter one is set from its near end forwards.
+ */
+void mask_change_width(volatile uint32_t *tbl, int num_samples, int start,
+                       int old, int width, uint32_t bit) {
+    int lo, n0, n1;
+
+    if (SHORT_CHANGE(old, width)) {
+        short_change(tbl, num_samples, start, old, width, bit);
+        return;
+    }
+    if (!get_spans(num_samples, start, old, width, &lo, &n0, &n1))
+        return;
+    if (width > old) {
+        span_bic_rev(tbl, n1, bit);
+        span_bic_rev(tbl + lo, n0, bit);
+    } else {
+        span_or(tbl + lo, n0, bit);
+        span_or(tbl, n1, bit);
+    }
+}
+
+void mask_change_width_banked(uint32_t *tbl, int num_samples, int start,
+                              int old, int width, int bank, uint32_t bit) {
+    int lo, n0, n1, i;
+
+    if (!get_spans(num_samples, start, old, width, &lo, &n0, &n1))
+        return;
+    tbl += bank;
+    if (width > old) {
+        for (i = n1 - 1; i >= 0; i--)
+            tbl[i * 2] &= ~bit;
+        for (i = lo + n0 - 1; i >= lo; i--)
+            tbl[i * 2] &= ~bit;
+    } else {
+        for (i = lo; i < lo + n0; i++)
+            tbl[i * 2] |= bit;
+        for (i = 0; i < n1; i++)
+            tbl[i * 2] |= bit;
+    }
+}
+
+// Copy the words mask_change_width() changed, in the same order
+int mask_flush_width(volatile uint32_t *dst, const uint32_t *src, int num_samples,
+                     int start, int old, int width) {
+    int lo, n0, n1;
+
+    if (SHORT_CHANGE(old, width)) {
+        short_flush(dst, src, num_samples, start, old, width);
+        return width > old ? width - old : old - width;
+    }
+    if (!get_spans(num_samples, start, old, width, &lo, &n0, &n1))
+        return 0;
+    if (width > old) {
+        span_copy_rev(dst, src, n1);
+        span_copy_rev(dst + lo, src + lo, n0);
+    } else {
+        span_copy(dst + lo, src + lo, n0);
+        span_copy(dst, src, n1);
+    }
+    return n0 + n1;
+}
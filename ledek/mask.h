@@ -0,0 +1,42 @@
+#ifndef LEDEK_MASK
+#define LEDEK_MASK
+
+#include <stdint.h>
+
+/* The turnoff_mask table has one word per sample; a set bit turns that
+ * output off at that sample.  An output with pulse start 'start' and width
+ * 'width' has its bit clear for samples start..start+width-1, wrapping
+ * round the end of the table, and set everywhere else.
+ *
+ * mask_change_width() moves the end of one output's pulse from 'old' to
+ * 'width' samples after 'start', in an order that means the DMA controller
+ * only ever sees a pulse of the old width or the new one: a longer pulse
+ * has its bits cleared from the far end back, a shorter one has them set
+ * from the near end forwards.  The words are changed with NEON or SSE2
+ * where available; mask_kernel_name says which.
+ */
+extern const char *mask_kernel_name;
+
+void mask_change_width(volatile uint32_t *tbl, int num_samples, int start,
+                       int old, int width, uint32_t bit);
+
+/* servod makes its changes to a cached shadow of turnoff_mask, then uses
+ * mask_flush_width() to copy just the words that changed across to the
+ * real table, in the same order mask_change_width() changed them.  That
+ * costs one uncached write per word, where changing the real table in
+ * place costs an uncached read and a write.  Returns the words written.
+ */
+int mask_flush_width(volatile uint32_t *dst, const uint32_t *src, int num_samples,
+                     int start, int old, int width);
+
+/* With outputs in GPIO bank 1 as well, the table has two words per sample,
+ * bank 0 then bank 1, so that one CB can clear both banks.  This changes
+ * 'bit' in the 'bank' words of such a table as mask_change_width() does.
+ * It is scalar, as it is only ever used on the cached shadow; the copy to
+ * the real table is mask_flush_width() with everything doubled, which
+ * copies whole samples.
+ */
+void mask_change_width_banked(uint32_t *tbl, int num_samples, int start,
+                              int old, int width, int bank, uint32_t bit);
+
+#endif //LEDEK_MASK
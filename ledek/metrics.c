@@ -0,0 +1,44 @@
+#include "metrics.h"
+
+void metrics_observe(metrics_hist_t *h, uint64_t ns, uint64_t n) {
+    uint64_t us = (ns + 999) / 1000;
+    int b = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+
+    h->bucket[b < METRICS_BUCKETS ? b : METRICS_BUCKETS] += n;
+    h->count += n;
+    h->sum_ns += ns * n;
+}
+
+void metrics_family(FILE *fp, const char *name, const char *type, const char *help) {
+    fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_value(FILE *fp, const char *name, const char *labels, uint64_t value) {
+    if (labels)
+        fprintf(fp, "%s{%s} %llu\n", name, labels, (unsigned long long)value);
+    else
+        fprintf(fp, "%s %llu\n", name, (unsigned long long)value);
+}
+
+void metrics_hist(FILE *fp, const char *name, const char *labels, const metrics_hist_t *h) {
+    const char *sep = labels ? "," : "";
+    uint64_t total = 0;
+    int b;
+
+    if (!labels)
+        labels = "";
+    for (b = 0; b < METRICS_BUCKETS; b++) {
+        total += h->bucket[b];
+        fprintf(fp, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep,
+                (double)(1ULL << b) / 1e6, (unsigned long long)total);
+    }
+    fprintf(fp, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+            (unsigned long long)h->count);
+    if (*labels) {
+        fprintf(fp, "%s_sum{%s} %.9f\n", name, labels, h->sum_ns / 1e9);
+        fprintf(fp, "%s_count{%s} %llu\n", name, labels, (unsigned long long)h->count);
+    } else {
+        fprintf(fp, "%s_sum %.9f\n", name, h->sum_ns / 1e9);
+        fprintf(fp, "%s_count %llu\n", name, (unsigned long long)h->count);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef LEDEK_METRICS
+#define LEDEK_METRICS
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Counters and latency histograms written out in the Prometheus text
+ * format, for --stats-file and the stats command.  servod counts, and
+ * writes the counts out, from its one event loop, so they are plain
+ * integers with no locking; nothing on the DMA or ring thread side
+ * touches them.
+ *
+ * A histogram has a bucket per power of two microseconds, from 1us to
+ * 2^(METRICS_BUCKETS-1)us, about 8s, and one for anything longer.  An
+ * observation costs a count-leading-zeros and three adds.
+ */
+
+#define METRICS_BUCKETS		24
+
+typedef struct {
+    uint64_t bucket[METRICS_BUCKETS + 1];	/* Last is over the top bound */
+    uint64_t count;
+    uint64_t sum_ns;
+} metrics_hist_t;
+
+// Count 'n' observations of 'ns'
+void metrics_observe(metrics_hist_t *h, uint64_t ns, uint64_t n);
+
+// The # HELP and # TYPE lines that start a metric family
+void metrics_family(FILE *fp, const char *name, const char *type, const char *help);
+
+// One sample, with 'labels' such as group="0" inside the braces, or NULL
+void metrics_value(FILE *fp, const char *name, const char *labels, uint64_t value);
+
+// A histogram's samples, cumulative as Prometheus wants, in seconds
+void metrics_hist(FILE *fp, const char *name, const char *labels, const metrics_hist_t *h);
+
+#endif //LEDEK_METRICS
@@ -0,0 +1,253 @@
+#include <stddef.h>
+
+#include "parse.h"
+
+/* Single pass command tokenizer.  Nothing here allocates, formats or
+ * touches floating point; widths are carried as fixed point and turned
+ * into ticks with integer arithmetic, rounding down the way the old
+ * strtod()/floor() code did.
+ */
+
+#define IS_DIGIT(c)	((c) >= '0' && (c) <= '9')
+#define IS_SPACE(c)	((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+
+const char *skip_spaces(const char *p) {
+    while (IS_SPACE(*p))
+        p++;
+    return p;
+}
+
+static const char *parse_int(const char *p, int *value) {
+    int v = 0;
+
+    if (!IS_DIGIT(*p))
+        return NULL;
+    while (IS_DIGIT(*p)) {
+        if (v < PARSE_INT_MAX)
+            v = v * 10 + (*p - '0');
+        p++;
+    }
+    *value = v;
+    return p;
+}
+
+// Parse "123" or "123.456" into 1/PARSE_FRAC_ONE units
+const char *parse_decimal(const char *p, uint64_t *value) {
+    uint64_t ipart = 0, fpart = 0;
+    int fdigits = 0;
+
+    if (!IS_DIGIT(*p))
+        return NULL;
+    while (IS_DIGIT(*p)) {
+        if (ipart < PARSE_INT_MAX)
+            ipart = ipart * 10 + (*p - '0');
+        p++;
+    }
+    if (*p == '.') {
+        p++;
+        while (IS_DIGIT(*p)) {
+            if (fdigits < PARSE_FRAC_DIGITS) {
+                fpart = fpart * 10 + (*p - '0');
+                fdigits++;
+            }
+            p++;
+        }
+    }
+    while (fdigits++ < PARSE_FRAC_DIGITS)
+        fpart *= 10;
+    *value = ipart * PARSE_FRAC_ONE + fpart;
+
+    return p;
+}
+
+// Parse "[+|-]N[us|%|lv]", stopping at anything that can't be part of it
+const char *parse_width_spec(const char *p, width_spec_t *width) {
+    width->rel = 0;
+    if (*p == '+') {
+        width->rel = 1;
+        p++;
+    } else if (*p == '-') {
+        width->rel = -1;
+        p++;
+    }
+    if (!(p = parse_decimal(p, &width->value)))
+        return NULL;
+    if (p[0] == 'u' && p[1] == 's') {
+        width->unit = WIDTH_US;
+        p += 2;
+    } else if (*p == '%') {
+        width->unit = WIDTH_PERCENT;
+        p++;
+    } else if (p[0] == 'l' && p[1] == 'v') {
+        width->unit = WIDTH_LEVEL;
+        p += 2;
+    } else {
+        width->unit = WIDTH_STEPS;
+    }
+
+    return p;
+}
+
+static int match_word(const char **pp, const char *word) {
+    const char *p = *pp;
+
+    while (*word && *p == *word) {
+        p++;
+        word++;
+    }
+    if (*word || (*p >= 'a' && *p <= 'z'))
+        return 0;
+    *pp = p;
+    return 1;
+}
+
+/* Parse a pixel number "N", or a range "N..M", into *first and *last; *last
+ * is -1 if no range was given.
+ */
+const char *parse_range(const char *p, int *first, int *last) {
+    if (!(p = parse_int(p, first)))
+        return NULL;
+    *last = -1;
+    if (p[0] == '.' && p[1] == '.' && !(p = parse_int(p + 2, last)))
+        return NULL;
+    return p;
+}
+
+// Parse a colour as six hex digits, "rrggbb", into 0xRRGGBB
+const char *parse_rgb(const char *p, uint32_t *rgb) {
+    uint32_t v = 0;
+    int i, d;
+
+    for (i = 0; i < 6; i++, p++) {
+        if (IS_DIGIT(*p))
+            d = *p - '0';
+        else if (*p >= 'a' && *p <= 'f')
+            d = *p - 'a' + 10;
+        else if (*p >= 'A' && *p <= 'F')
+            d = *p - 'A' + 10;
+        else
+            return NULL;
+        v = v << 4 | d;
+    }
+    *rgb = v;
+    return p;
+}
+
+// Parse a time in "ms" or "s" into milliseconds, saturating at UINT32_MAX
+const char *parse_duration(const char *p, uint32_t *ms) {
+    uint64_t value;
+
+    if (!(p = parse_decimal(p, &value)))
+        return NULL;
+    if (p[0] == 'm' && p[1] == 's') {
+        value /= PARSE_FRAC_ONE;
+        p += 2;
+    } else if (*p == 's') {
+        value = value / (PARSE_FRAC_ONE / 1000);
+        p++;
+    } else {
+        return NULL;
+    }
+    *ms = value > UINT32_MAX ? UINT32_MAX : value;
+
+    return p;
+}
+
+/* Parse the "@<time>[:<easing>]" that may follow a width, where the time is
+ * in "ms" or "s" and the easing is one of linear (the default), in, out,
+ * inout or exp.
+ */
+const char *parse_ramp_spec(const char *p, ramp_spec_t *ramp) {
+    static const char *names[] = { "linear", "inout", "in", "out", "exp" };
+    static const int eases[] = { EASE_LINEAR, EASE_INOUT, EASE_IN, EASE_OUT, EASE_EXP };
+    int i;
+
+    if (*p++ != '@' || !(p = parse_duration(p, &ramp->ms)) || ramp->ms > RAMP_MAX_MS)
+        return NULL;
+    ramp->ease = EASE_LINEAR;
+    if (*p == ':') {
+        p++;
+        for (i = 0; i < sizeof(names)/sizeof(*names); i++)
+            if (match_word(&p, names[i]))
+                break;
+        if (i == sizeof(names)/sizeof(*names))
+            return NULL;
+        ramp->ease = eases[i];
+    }
+
+    return p;
+}
+
+// Parse the "N=" or "P1-N="/"P5-N=" in front of a width
+const char *parse_servo_target(const char *p, servo_cmd_t *cmd) {
+    p = skip_spaces(p);
+    if (*p == 'p' || *p == 'P') {
+        if (!(p = parse_int(p + 1, &cmd->hdr)) || *p++ != '-')
+            return NULL;
+    } else {
+        cmd->hdr = 0;
+    }
+    if (!(p = parse_int(p, &cmd->num)) || *p++ != '=')
+        return NULL;
+
+    return p;
+}
+
+/* Convert a parsed width to a width in 1/2^frac_bits ticks, relative to
+ * the current width 'cur' in the same units.  Returns -1 if the result is
+ * out of range.  As before, a relative adjustment is clamped to the
+ * min/max range and zero is always allowed.
+ */
+int width_to_fine(const width_spec_t *width, int cur, int step_time_us,
+                  int min_ticks, int max_ticks, int frac_bits) {
+    int64_t fine, min_fine = (int64_t)min_ticks << frac_bits;
+    int64_t max_fine = (int64_t)max_ticks << frac_bits;
+    uint64_t value = width->value;
+
+    switch (width->unit) {
+    case WIDTH_US:
+        fine = (value << frac_bits) / ((uint64_t)PARSE_FRAC_ONE * step_time_us);
+        break;
+    case WIDTH_PERCENT:
+        // Anything over 100% is out of range anyway; this keeps it from
+        // overflowing
+        if (value > 101ULL * PARSE_FRAC_ONE)
+            value = 101ULL * PARSE_FRAC_ONE;
+        fine = (value * (max_ticks - min_ticks) << frac_bits) / (100ULL * PARSE_FRAC_ONE) +
+               min_fine;
+        break;
+    case WIDTH_LEVEL:
+        // Linear, as for percentages, for outputs without a curve
+        if (value > (PARSE_LEVEL_MAX + 1ULL) * PARSE_FRAC_ONE)
+            value = (PARSE_LEVEL_MAX + 1ULL) * PARSE_FRAC_ONE;
+        fine = (value * (max_ticks - min_ticks) << frac_bits) /
+               ((uint64_t)PARSE_LEVEL_MAX * PARSE_FRAC_ONE) + min_fine;
+        break;
+    default:
+        fine = (value << frac_bits) / PARSE_FRAC_ONE;
+        break;
+    }
+
+    if (width->rel > 0) {
+        fine = cur + fine;
+        if (fine > max_fine)
+            fine = max_fine;
+    } else if (width->rel < 0) {
+        fine = cur - fine;
+        if (fine < min_fine)
+            fine = min_fine;
+    }
+
+    if (fine == 0)
+        return 0;
+    else if (fine < min_fine || fine > max_fine)
+        return -1;
+    else
+        return (int)fine;
+}
+
+// As width_to_fine(), in whole ticks
+int width_to_ticks(const width_spec_t *width, int cur, int step_time_us,
+                   int min_ticks, int max_ticks) {
+    return width_to_fine(width, cur, step_time_us, min_ticks, max_ticks, 0);
+}
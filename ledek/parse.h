@@ -0,0 +1,58 @@
+#ifndef LEDEK_PARSE
+#define LEDEK_PARSE
+
+#include <stdint.h>
+
+/* Widths are parsed as unsigned fixed point decimals with PARSE_FRAC_DIGITS
+ * digits after the point; any further digits are ignored.
+ */
+#define PARSE_FRAC_DIGITS	4
+#define PARSE_FRAC_ONE		10000
+#define PARSE_INT_MAX		100000000	/* Larger values saturate */
+
+#define WIDTH_STEPS		0
+#define WIDTH_US		1
+#define WIDTH_PERCENT		2
+#define WIDTH_LEVEL		3	/* Raw brightness, 0 to PARSE_LEVEL_MAX */
+
+#define PARSE_LEVEL_MAX		65535
+
+typedef struct {
+    int rel;		/* +1 or -1 for a relative adjustment, otherwise 0 */
+    int unit;		/* WIDTH_STEPS, WIDTH_US, WIDTH_PERCENT or WIDTH_LEVEL */
+    uint64_t value;	/* Magnitude in 1/PARSE_FRAC_ONE units */
+} width_spec_t;
+
+#define EASE_LINEAR		0
+#define EASE_IN			1
+#define EASE_OUT		2
+#define EASE_INOUT		3
+#define EASE_EXP		4
+
+#define RAMP_MAX_MS		3600000
+
+typedef struct {
+    uint32_t ms;	/* Ramp duration, 0 to change straight away */
+    int ease;		/* EASE_xxx */
+} ramp_spec_t;
+
+typedef struct {
+    int hdr;		/* 1 or 5 for a P1-N/P5-N pin, 0 for a servo number */
+    int num;		/* Servo or pin number */
+    width_spec_t width;
+} servo_cmd_t;
+
+const char *parse_decimal(const char *p, uint64_t *value);
+const char *parse_width_spec(const char *p, width_spec_t *width);
+const char *parse_servo_target(const char *p, servo_cmd_t *cmd);
+const char *parse_duration(const char *p, uint32_t *ms);
+const char *parse_ramp_spec(const char *p, ramp_spec_t *ramp);
+const char *parse_range(const char *p, int *first, int *last);
+const char *parse_rgb(const char *p, uint32_t *rgb);
+const char *skip_spaces(const char *p);
+int width_to_fine(const width_spec_t *width, int cur, int step_time_us,
+                  int min_ticks, int max_ticks, int frac_bits);
+int width_to_ticks(const width_spec_t *width, int cur, int step_time_us,
+                   int min_ticks, int max_ticks);
+
+#endif //LEDEK_PARSE
@@ -0,0 +1,25 @@
+#ifndef LEDEK_PCM
+#define LEDEK_PCM
+
+#define PCM_BASE_OFFSET		0x00203000
+#define PCM_LEN			0x24
+
+#define PCM_VIRT_BASE		(periph_virt_base + PCM_BASE_OFFSET)
+#define PCM_PHYS_BASE		(periph_phys_base + PCM_BASE_OFFSET)
+
+#define PCM_CS_A		(0x00/4)
+#define PCM_FIFO_A		(0x04/4)
+#define PCM_MODE_A		(0x08/4)
+#define PCM_RXC_A		(0x0c/4)
+#define PCM_TXC_A		(0x10/4)
+#define PCM_DREQ_A		(0x14/4)
+#define PCM_INTEN_A		(0x18/4)
+#define PCM_INT_STC_A		(0x1c/4)
+#define PCM_GRAY		(0x20/4)
+
+#define PCMCLK_CNTL		38
+#define PCMCLK_DIV		39
+
+#define DELAY_VIA_PCM		1
+
+#endif //LEDEK_PCM
@@ -0,0 +1,161 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "phase.h"
+
+typedef struct {
+    int num_samples;
+    int *cover;			/* Outputs on in each step */
+    int *edge;			/* Edges in each step */
+    int *near;			/* Edges within the guard of each step */
+    int *wmax, *dq;		/* Working space for best_start() */
+    int peak_on, peak_edges;	/* Most of each in any one step so far */
+} phase_work_t;
+
+// Count an edge at step 'pos', and in near[] for each step within the guard
+static void add_edge(phase_work_t *w, int pos) {
+    int i;
+
+    if (++w->edge[pos] > w->peak_edges)
+        w->peak_edges = w->edge[pos];
+    for (i = pos - PHASE_EDGE_GUARD; i <= pos + PHASE_EDGE_GUARD; i++)
+        w->near[(i + w->num_samples) % w->num_samples]++;
+}
+
+static void place(phase_work_t *w, int start, int width) {
+    int i, j;
+
+    if (width <= 0)
+        return;
+    if (width > w->num_samples)
+        width = w->num_samples;
+    for (i = start; i < start + width; i++) {
+        j = i % w->num_samples;
+        if (++w->cover[j] > w->peak_on)
+            w->peak_on = w->cover[j];
+    }
+    if (width == w->num_samples)
+        return;
+    add_edge(w, start);
+    add_edge(w, (start + width) % w->num_samples);
+}
+
+/* The start for a pulse of 'width' that doesn't cross the end of the
+ * cycle.  Candidates are ranked by, in turn: the most outputs on at once
+ * and the most edges in one step once it is placed, over the whole cycle;
+ * the most pulses already on that it overlaps; and the edges near its own,
+ * as counted in near[]; 'cur' wins a tie.  Counting edges as well as
+ * overlap stops pulses being packed end to start, which keeps the peak on
+ * down but lines up an end and a start in the same step.  wmax[s] is
+ * filled in with the most pulses already on over s..s+width-1 using a
+ * sliding window maximum, so that each output costs O(num_samples).
+ */
+static int best_start(phase_work_t *w, int width, int cur) {
+    int n = w->num_samples, *wmax = w->wmax, *dq = w->dq, *edge = w->edge;
+    int s, i, head = 0, tail = 0, best = -1, key[5], best_key[5];
+
+    for (i = 0; i < n; i++) {
+        while (tail > head && w->cover[dq[tail - 1]] <= w->cover[i])
+            tail--;
+        dq[tail++] = i;
+        if (dq[head] <= i - width)
+            head++;
+        if (i >= width - 1)
+            wmax[i - width + 1] = w->cover[dq[head]];
+    }
+    for (s = 0; s + width <= n; s++) {
+        key[0] = wmax[s] + 1 > w->peak_on ? wmax[s] + 1 : w->peak_on;
+        key[1] = w->peak_edges;
+        if (edge[s] + 1 > key[1])
+            key[1] = edge[s] + 1;
+        if (edge[(s + width) % n] + 1 > key[1])
+            key[1] = edge[(s + width) % n] + 1;
+        key[2] = wmax[s];
+        key[3] = w->near[s] + w->near[(s + width) % n];
+        key[4] = s != cur;
+        if (best >= 0) {
+            for (i = 0; i < 5 && key[i] == best_key[i]; i++)
+                ;
+            if (i == 5 || key[i] > best_key[i])
+                continue;
+        }
+        best = s;
+        memcpy(best_key, key, sizeof(key));
+    }
+    return best;
+}
+
+int phase_alloc(int num_samples, int num, const int *width, const char *fixed,
+                int *start) {
+    phase_work_t w = { num_samples };
+    int *order;
+    int i, j, k, n = 0;
+
+    w.cover = calloc(num_samples * 5 + num, sizeof(int));
+    if (!w.cover)
+        return -1;
+    w.edge = w.cover + num_samples;
+    w.near = w.edge + num_samples;
+    w.wmax = w.near + num_samples;
+    w.dq = w.wmax + num_samples;
+    order = w.dq + num_samples;
+    for (i = 0; i < num; i++) {
+        if (fixed[i] || width[i] <= 0 || width[i] >= num_samples) {
+            place(&w, start[i], width[i]);
+            continue;
+        }
+        // Widest first, which is insertion sorted as there are few outputs
+        for (j = n++; j > 0 && width[order[j - 1]] < width[i]; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+    for (j = 0; j < n; j++) {
+        k = order[j];
+        start[k] = best_start(&w, width[k], start[k]);
+        place(&w, start[k], width[k]);
+    }
+    free(w.cover);
+    return phase_peak(num_samples, num, width, start, NULL);
+}
+
+int phase_peak(int num_samples, int num, const int *width, const int *start,
+               int *edges) {
+    int *diff = calloc(num_samples * 2 + 1, sizeof(int)), *count = diff + num_samples + 1;
+    int i, end, on = 0, peak = 0;
+
+    if (!diff)
+        return -1;
+    for (i = 0; i < num; i++) {
+        if (width[i] <= 0)
+            continue;
+        if (width[i] >= num_samples) {
+            diff[0]++;
+            continue;
+        }
+        end = start[i] + width[i];
+        diff[start[i]]++;
+        if (end <= num_samples) {
+            diff[end]--;
+        } else {
+            diff[num_samples]--;
+            diff[0]++;
+            diff[end - num_samples]--;
+        }
+        count[start[i]]++;
+        count[end % num_samples]++;
+    }
+    for (i = 0; i < num_samples; i++) {
+        on += diff[i];
+        if (on > peak)
+            peak = on;
+    }
+    if (edges) {
+        *edges = 0;
+        for (i = 0; i < num_samples; i++) {
+            if (count[i] > *edges)
+                *edges = count[i];
+        }
+    }
+    free(diff);
+    return peak;
+}
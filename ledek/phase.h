@@ -0,0 +1,39 @@
+#ifndef LEDEK_PHASE
+#define LEDEK_PHASE
+
+/* Start phases for the outputs of a chain.  Spacing the starts evenly, as
+ * servod does at first, is fine while the widths are unknown, but once
+ * they are set many LED outputs can end up on at once, drawing current
+ * together and switching on in the same step.  phase_alloc() works out
+ * starts for the widths the outputs actually have: the widest is placed
+ * first, then each of the others goes wherever it leaves the fewest
+ * outputs on at once and the fewest edges in any one step, and among
+ * those, where it overlaps the fewest outputs already placed and the
+ * fewest edges are close to its own.  An output keeps its start if
+ * nowhere is better.
+ *
+ * New starts never put a pulse across the end of the cycle.  A chain
+ * switched in at the cycle boundary then can't cut short or stretch a
+ * pulse which had been moved there; outputs whose pulses do cross it now
+ * are passed in as fixed, and stay where they are.
+ */
+
+// Edges this many steps either side of a start or end count as close to it
+#define PHASE_EDGE_GUARD	1
+
+/* Fill in start[] for 'num' outputs with the given widths, in a cycle of
+ * 'num_samples' steps.  start[] holds the current starts on entry; those
+ * with fixed[i] set are left alone.  Returns the most outputs on at once
+ * with the new starts, or -1 if the working space can't be allocated.
+ */
+int phase_alloc(int num_samples, int num, const int *width, const char *fixed,
+                int *start);
+
+/* The most outputs on at once, and into *edges the most edges due in any
+ * one step, for these starts and widths.  Returns -1 if the working space
+ * can't be allocated.
+ */
+int phase_peak(int num_samples, int num, const int *width, const int *start,
+               int *edges);
+
+#endif //LEDEK_PHASE
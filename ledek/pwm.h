@@ -10,19 +10,37 @@
 #define PWM_CTL			(0x00/4)
 #define PWM_DMAC		(0x08/4)
 #define PWM_RNG1		(0x10/4)
+#define PWM_DAT1		(0x14/4)
 #define PWM_FIFO		(0x18/4)
+#define PWM_RNG2		(0x20/4)
+#define PWM_DAT2		(0x24/4)
+
+// Channel 2's RNG and DAT registers are 4 words on from channel 1's
+#define PWM_RNG(chan)		(PWM_RNG1 + (chan) * 4)
+#define PWM_DAT(chan)		(PWM_DAT1 + (chan) * 4)
 
 #define PWMCLK_CNTL		40
 #define PWMCLK_DIV		41
 
 #define PWMCTL_MODE1		(1<<1)
 #define PWMCTL_PWEN1		(1<<0)
+#define PWMCTL_POLA1		(1<<4)
 #define PWMCTL_CLRF		(1<<6)
 #define PWMCTL_USEF1		(1<<5)
+#define PWMCTL_MSEN1		(1<<7)
+
+// Channel 2's control bits are channel 1's moved up by 8
+#define PWMCTL_CHAN(bits, chan)	((bits) << ((chan) * 8))
 
 #define PWMDMAC_ENAB		(1<<31)
 #define PWMDMAC_THRSHLD		((15<<8)|(15<<0))
 
 #define DELAY_VIA_PWM		0
 
+/* Clock for --hw-pwm outputs, which PLLD divides down to for both 500MHz
+ * and 750MHz.  A tick is 20ns, so a 20ms cycle is a range of 1000000.
+ */
+#define HWPWM_CLOCK_MHZ		50
+#define HWPWM_CHANS		2
+
 #endif //LEDEK_PWM
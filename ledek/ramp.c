@@ -0,0 +1,51 @@
+#include <math.h>
+
+#include "parse.h"
+#include "ramp.h"
+
+void ramp_start(ramp_t *r, int from, int to, int floor, int ease,
+                uint64_t now_ns, uint32_t ms) {
+    r->active = 1;
+    r->ease = ease;
+    r->from = from;
+    r->to = to;
+    r->floor = floor > 0 ? floor : 1;
+    r->start_ns = now_ns;
+    r->dur_ns = (uint64_t)ms * 1000000;
+}
+
+/* Width for time 'now_ns'.  The ramp is marked inactive once it returns
+ * the final width.  'exp' interpolates geometrically, so each cycle changes
+ * the width by the same ratio; for an LED that looks like a steady fade,
+ * where a linear ramp seems to rush through the dim end.
+ */
+int ramp_width(ramp_t *r, uint64_t now_ns) {
+    int from = r->from ? r->from : r->floor;
+    int to = r->to ? r->to : r->floor;
+    double t, e;
+
+    if (now_ns - r->start_ns >= r->dur_ns) {
+        r->active = 0;
+        return r->to;
+    }
+    t = (double)(now_ns - r->start_ns) / r->dur_ns;
+
+    switch (r->ease) {
+    case EASE_IN:
+        e = t * t;
+        break;
+    case EASE_OUT:
+        e = 1 - (1 - t) * (1 - t);
+        break;
+    case EASE_INOUT:
+        e = t < 0.5 ? 2 * t * t : 1 - 2 * (1 - t) * (1 - t);
+        break;
+    case EASE_EXP:
+        return (int)lround(from * pow((double)to / from, t));
+    default:
+        e = t;
+        break;
+    }
+
+    return (int)lround(from + (to - from) * e);
+}
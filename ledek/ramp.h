@@ -0,0 +1,26 @@
+#ifndef LEDEK_RAMP
+#define LEDEK_RAMP
+
+#include <stdint.h>
+
+/* A timed move of one output from one width to another, as requested with
+ * "N=<width>@<time>[:<easing>]".  servod keeps one of these per servo and
+ * evaluates every active ramp once per cycle.  Ramps to or from zero run
+ * to or from 'floor' instead, the narrowest pulse the output is allowed,
+ * and the output is switched off once a ramp to zero has finished.
+ */
+typedef struct {
+    int active;
+    int ease;		/* EASE_xxx from parse.h */
+    int from;		/* Ticks */
+    int to;
+    int floor;
+    uint64_t start_ns;
+    uint64_t dur_ns;
+} ramp_t;
+
+void ramp_start(ramp_t *r, int from, int to, int floor, int ease,
+                uint64_t now_ns, uint32_t ms);
+int ramp_width(ramp_t *r, uint64_t now_ns);
+
+#endif //LEDEK_RAMP
@@ -0,0 +1,234 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "clk.h"
+#include "relink.h"
+
+/* The DMA controller fetches a whole CB, 'next' included, when it starts on
+ * it, so a CB it has already fetched carries on to wherever it pointed at
+ * the time.  That is why a moved CB always goes in before the old one is
+ * taken out, and why an unlinked CB is not reused while the controller is
+ * still on it or on the CB it was unlinked from.
+ */
+
+#define BARRIER()		__sync_synchronize()
+
+// Samples of slack allowed for the controller moving on while we work
+#define RELINK_MARGIN		2
+#define RELINK_MAX_WAITS	100
+
+#define ROUNDUP(val, blksz)	(((val)+((blksz)-1)) & ~(blksz-1))
+
+static uint32_t bus(const relink_t *r, const dma_cb_t *cb) {
+    return r->bus_base + ((const uint8_t *)cb - r->virt_base);
+}
+
+static dma_cb_t *virt(const relink_t *r, uint32_t addr) {
+    return (dma_cb_t *)(r->virt_base + (addr - r->bus_base));
+}
+
+uint32_t relink_mem_size(int num_samples) {
+    return ROUNDUP(MAX_SERVOS * 2 * sizeof(uint32_t), sizeof(dma_cb_t)) +
+           (num_samples + MAX_SERVOS * 3) * sizeof(dma_cb_t);
+}
+
+int relink_pos(const relink_t *r) {
+    dma_cb_t *cb = virt(r, r->dma_reg[DMA_CONBLK_AD]);
+
+    if (cb >= r->delay && cb < r->delay + r->num_samples)
+        return cb - r->delay;
+    if (cb >= r->turnon_cb && cb < r->turnon_cb + MAX_SERVOS)
+        return r->start[cb - r->turnon_cb];
+    if (cb >= r->turnoff && cb < r->turnoff + MAX_SERVOS * 2)
+        return r->slot[cb - r->turnoff];
+    return -1;
+}
+
+static void fill_cb(relink_t *r, dma_cb_t *cb, uint32_t info, void *src, uint32_t dst) {
+    cb->info = info;
+    cb->src = r->bus_base + ((uint8_t *)src - r->virt_base);
+    cb->dst = dst;
+    cb->length = 4;
+    cb->stride = 0;
+    cb->next = 0;
+}
+
+// Put 'cb' in front of sample 'slot', ahead of anything already there
+static void link_cb(relink_t *r, dma_cb_t *cb, int slot) {
+    int n = r->num_samples;
+    dma_cb_t *prev = r->delay + (slot + n - 1) % n;
+
+    cb->next = prev->next;
+    BARRIER();
+    prev->next = bus(r, cb);
+    BARRIER();
+    r->slot[cb - r->turnoff] = slot;
+}
+
+static void unlink_cb(relink_t *r, dma_cb_t *cb) {
+    int n = r->num_samples, i;
+    dma_cb_t *p = r->delay + (r->slot[cb - r->turnoff] + n - 1) % n;
+    uint32_t addr = bus(r, cb);
+
+    // Only turnoff and turnon CBs can be between two delay CBs
+    for (i = 0; i <= MAX_SERVOS * 3 && p->next != addr; i++)
+        p = virt(r, p->next);
+    if (p->next != addr)
+        return;
+    p->next = cb->next;
+    BARRIER();
+    r->pred[cb - r->turnoff] = p;
+}
+
+// Wait until the controller can't be holding a pointer to 'cb'
+static int wait_clear(relink_t *r, dma_cb_t *cb) {
+    dma_cb_t *pred = r->pred[cb - r->turnoff];
+    uint32_t addr;
+    int i;
+
+    for (i = 0; i < RELINK_MAX_WAITS; i++) {
+        addr = r->dma_reg[DMA_CONBLK_AD];
+        if (addr != bus(r, cb) && (!pred || addr != bus(r, pred)))
+            return 0;
+        r->waits++;
+        udelay(1);
+    }
+    return -1;
+}
+
+/* Dropping the CB for the old end of a pulse is safe unless the pulse is
+ * getting shorter and the controller is already too close to, or past,
+ * its new end but hasn't reached its old one.
+ */
+static int can_drop(const relink_t *r, int servo, int old_width, int width) {
+    int n = r->num_samples, pos, rel;
+
+    if (width >= old_width || (pos = relink_pos(r)) < 0)
+        return 1;
+    rel = (pos - r->start[servo] + n) % n;
+    return rel + RELINK_MARGIN < width || rel >= old_width;
+}
+
+static int retire(relink_t *r, int servo) {
+    if (!can_drop(r, servo, r->retire_width[servo], r->width[servo]))
+        return 0;
+    unlink_cb(r, r->retiring[servo]);
+    r->retiring[servo] = NULL;
+    r->num_retiring--;
+    return 1;
+}
+
+void relink_init(relink_t *r, void *virt_addr, uint32_t bus_addr, int num_samples,
+                 const int *start, const uint32_t *bits, const uint8_t *bank,
+                 uint32_t clr_addr, uint32_t set_addr, uint32_t fifo_addr,
+                 uint32_t fifo_info, volatile uint32_t *dma_reg) {
+    uint32_t info = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP;
+    dma_cb_t *prev = NULL, *cb;
+    int i, servo;
+
+    memset(r, 0, sizeof(*r));
+    r->num_samples = num_samples;
+    r->virt_base = virt_addr;
+    r->bus_base = bus_addr;
+    r->dma_reg = dma_reg;
+    r->bits = (uint32_t *)virt_addr;
+    r->turnon = r->bits + MAX_SERVOS;
+    r->delay = (dma_cb_t *)(r->virt_base +
+            ROUNDUP(MAX_SERVOS * 2 * sizeof(uint32_t), sizeof(dma_cb_t)));
+    r->turnon_cb = r->delay + num_samples;
+    r->turnoff = r->turnon_cb + MAX_SERVOS;
+
+    for (servo = 0; servo < MAX_SERVOS; servo++) {
+        r->bits[servo] = bits[servo];
+        r->turnon[servo] = 0;
+        r->start[servo] = start[servo];
+    }
+
+    for (i = 0; i < num_samples; i++) {
+        for (servo = 0; servo < MAX_SERVOS; servo++) {
+            if (!bits[servo] || start[servo] != i)
+                continue;
+            cb = r->turnon_cb + servo;
+            fill_cb(r, cb, info, r->turnon + servo, set_addr + bank[servo] * 4);
+            if (prev)
+                prev->next = bus(r, cb);
+            else
+                r->entry = cb;
+            prev = cb;
+        }
+        cb = r->delay + i;
+        fill_cb(r, cb, fifo_info, r->bits, fifo_addr);	// Any data will do
+        if (prev)
+            prev->next = bus(r, cb);
+        else
+            r->entry = cb;
+        prev = cb;
+    }
+    prev->next = bus(r, r->entry);
+
+    for (servo = 0; servo < MAX_SERVOS; servo++) {
+        if (!bits[servo])
+            continue;
+        cb = r->turnoff + servo * 2;
+        fill_cb(r, cb, info, r->bits + servo, clr_addr + bank[servo] * 4);
+        fill_cb(r, cb + 1, info, r->bits + servo, clr_addr + bank[servo] * 4);
+        link_cb(r, cb, start[servo]);
+        r->live[servo] = cb;
+    }
+}
+
+int relink_move(relink_t *r, int servo, int width) {
+    dma_cb_t *old = r->live[servo], *cb = NULL;
+    int old_width = r->width[servo];
+
+    if (r->retiring[servo] && !retire(r, servo))
+        return -1;
+    if (old ? width == 0 || width == old_width : width == r->num_samples)
+        return 0;
+
+    if (width < r->num_samples) {
+        cb = r->turnoff + servo * 2;
+        if (cb == old)
+            cb++;
+        if (wait_clear(r, cb) < 0)
+            return -1;
+        link_cb(r, cb, (r->start[servo] + width) % r->num_samples);
+    }
+    r->live[servo] = cb;
+    r->width[servo] = width;
+    r->moves++;
+
+    if (!old)
+        return 0;
+    if (can_drop(r, servo, old_width, width)) {
+        unlink_cb(r, old);
+    } else {
+        r->retiring[servo] = old;
+        r->retire_width[servo] = old_width;
+        r->num_retiring++;
+        r->deferred++;
+    }
+    return 0;
+}
+
+int relink_reap(relink_t *r) {
+    int servo;
+
+    for (servo = 0; r->num_retiring && servo < MAX_SERVOS; servo++) {
+        if (r->retiring[servo])
+            retire(r, servo);
+    }
+    return r->num_retiring;
+}
+
+void relink_retire_all(relink_t *r) {
+    int servo;
+
+    for (servo = 0; r->num_retiring && servo < MAX_SERVOS; servo++) {
+        if (r->retiring[servo]) {
+            unlink_cb(r, r->retiring[servo]);
+            r->retiring[servo] = NULL;
+            r->num_retiring--;
+        }
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef LEDEK_RELINK
+#define LEDEK_RELINK
+
+#include <stdint.h>
+
+#include "dma.h"
+#include "servod.h"
+
+/* Alternative chain layout for --relink.  In place of one turn-off CB per
+ * sample reading that sample's turnoff_mask word, each servo has its own
+ * turn-off CB, which clears just that servo's bit and is linked into the
+ * chain in front of the sample at which its pulse ends:
+ *
+ *     ... -> delay[k-1] -> turnoff(servo) -> [turnon(k)] -> delay[k] -> ...
+ *
+ * Changing a width then means moving that one CB, which is a few writes to
+ * 'next' pointers whatever the step size, rather than editing every
+ * turnoff_mask word between the old end of the pulse and the new one.
+ *
+ * Each servo has two turn-off CBs.  A move links the spare one in at the
+ * new position before unlinking the old one, so the DMA controller never
+ * finds a CB it may be about to execute being changed under it.  When a
+ * pulse is shortened while the controller is between its new end and its
+ * old one, unlinking the old CB straight away would leave the output on
+ * until the new end comes round again, so the old CB is left to end this
+ * pulse and is retired by a later relink_reap().
+ *
+ * A servo at width 0 keeps its turn-off CB where it was, so a pulse that
+ * is in progress still ends properly once servod clears the turn-on word;
+ * one at the full cycle has none linked at all.
+ */
+
+typedef struct {
+    int num_samples;
+    uint8_t *virt_base;		/* Start of the memory the chain is in */
+    uint32_t bus_base;		/* ... and its bus address */
+    volatile uint32_t *dma_reg;	/* Channel running the chain */
+    uint32_t *bits;		/* GPIO bit for each servo, what turnoff CBs clear */
+    uint32_t *turnon;		/* Turn-on word for each servo, as turnon_mask */
+    dma_cb_t *delay;		/* One DREQ paced CB per sample */
+    dma_cb_t *turnon_cb;	/* One per servo, in front of delay[start] */
+    dma_cb_t *turnoff;		/* Two per servo */
+    dma_cb_t *entry;		/* First CB of the chain */
+    dma_cb_t *pred[MAX_SERVOS*2];	/* Where each turnoff CB was unlinked from */
+    int slot[MAX_SERVOS*2];	/* Sample each turnoff CB was linked in front of */
+    dma_cb_t *live[MAX_SERVOS];	/* Linked turnoff CB, or NULL at full width */
+    dma_cb_t *retiring[MAX_SERVOS];	/* Old turnoff CB still to be unlinked */
+    int start[MAX_SERVOS];
+    int width[MAX_SERVOS];	/* Width the live CB is placed for */
+    int retire_width[MAX_SERVOS];	/* Width the retiring CB is placed for */
+    int num_retiring;
+    uint64_t moves;		/* CB moves made */
+    uint64_t deferred;		/* Old CBs that had to be retired later */
+    uint64_t waits;		/* Times we waited for the controller to pass */
+} relink_t;
+
+// Bytes of DMA visible memory the chain needs, to be 32 byte aligned
+uint32_t relink_mem_size(int num_samples);
+
+/* Build the chain in 'virt', which the DMA controller sees at 'bus'.  Servos
+ * with bits[servo] == 0 are not used.  bank[servo] is the GPIO bank the bit
+ * is in; CBs for bank 1 outputs write the register after clr_addr or
+ * set_addr.  Every servo starts at width 0.
+ */
+void relink_init(relink_t *r, void *virt, uint32_t bus, int num_samples,
+                 const int *start, const uint32_t *bits, const uint8_t *bank,
+                 uint32_t clr_addr, uint32_t set_addr, uint32_t fifo_addr,
+                 uint32_t fifo_info, volatile uint32_t *dma_reg);
+
+/* Move a servo's turn-off CB for a pulse of 'width' samples.  Returns 0, or
+ * -1 if it can't be done yet because an earlier move is still waiting to be
+ * retired; try again once relink_reap() has caught up.  Width 0 leaves the
+ * CB where it is, so the caller must clear the turn-on word after this
+ * call when going to 0, and set it after this call when leaving 0.
+ */
+int relink_move(relink_t *r, int servo, int width);
+
+// Unlink any retiring CBs that are now safe to drop.  Returns those left.
+int relink_reap(relink_t *r);
+
+/* Unlink every retiring CB now, for when the controller is stopped and is
+ * to be started again at the top of the chain, so can't be part way
+ * through a pulse one of them ends.
+ */
+void relink_retire_all(relink_t *r);
+
+// Sample the DMA controller is at, or -1 if it isn't in the chain
+int relink_pos(const relink_t *r);
+
+#endif //LEDEK_RELINK
@@ -0,0 +1,136 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "ring.h"
+
+static servoring_t *ring;
+static int wake_fd = -1;	/* Helper thread -> main loop */
+static int ack_fd = -1;		/* Main loop -> helper thread */
+static pthread_t waker;
+
+static void ring_unlink(void) {
+    shm_unlink(SERVORING_NAME);
+}
+
+int ring_create(void) {
+    int fd, i;
+
+    shm_unlink(SERVORING_NAME);
+    fd = shm_open(SERVORING_NAME, O_RDWR|O_CREAT|O_EXCL, 0666);
+    if (fd < 0)
+        return -1;
+    // Don't let the umask stop unprivileged clients from opening it
+    if (fchmod(fd, 0666) < 0 || ftruncate(fd, sizeof(*ring)) < 0) {
+        close(fd);
+        shm_unlink(SERVORING_NAME);
+        return -1;
+    }
+    ring = mmap(NULL, sizeof(*ring), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        shm_unlink(SERVORING_NAME);
+        return -1;
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    for (i = 0; i < SERVORING_SLOTS; i++)
+        ring->slots[i].seq = i;
+    ring->num_slots = SERVORING_SLOTS;
+    __atomic_store_n(&ring->magic, SERVORING_MAGIC, __ATOMIC_RELEASE);
+    atexit(ring_unlink);
+
+    return 0;
+}
+
+/* Clients bump the doorbell after every push, but only make the futex call
+ * if 'waiting' is set.  Setting 'waiting' before re-reading the doorbell,
+ * while clients bump the doorbell before reading 'waiting', means that
+ * either we see the new doorbell value or the client sees us waiting; and
+ * FUTEX_WAIT itself fails if the doorbell moves before we are asleep.
+ */
+static void *waker_thread(void *arg) {
+    uint32_t seen = __atomic_load_n(&ring->doorbell, __ATOMIC_SEQ_CST);
+    uint32_t cur;
+    uint64_t v;
+
+    for (;;) {
+        __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+        cur = __atomic_load_n(&ring->doorbell, __ATOMIC_SEQ_CST);
+        if (cur == seen) {
+            syscall(SYS_futex, &ring->doorbell, FUTEX_WAIT, seen, NULL, NULL, 0);
+            continue;
+        }
+        __atomic_store_n(&ring->waiting, 0, __ATOMIC_SEQ_CST);
+        seen = cur;
+        v = 1;
+        if (write(wake_fd, &v, sizeof(v)) != sizeof(v))
+            break;
+        // Sleep until the main loop has emptied the ring
+        while (read(ack_fd, &v, sizeof(v)) != sizeof(v))
+            if (errno != EINTR)
+                return NULL;
+    }
+    return NULL;
+}
+
+// Must be called after daemon(), as threads do not survive the fork
+int ring_start(void) {
+    sigset_t all, old;
+    int err;
+
+    wake_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    ack_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd < 0 || ack_fd < 0)
+        return -1;
+
+    // Leave signal handling to the main thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&waker, NULL, waker_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    return wake_fd;
+}
+
+// Pop up to 'max' records; single consumer, so 'tail' is ours alone
+int ring_drain(ring_rec_t *recs, int max) {
+    uint32_t pos = ring->tail;
+    servoring_slot_t *slot;
+    int n;
+
+    for (n = 0; n < max; n++, pos++) {
+        slot = ring->slots + (pos & (SERVORING_SLOTS - 1));
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+            break;
+        recs[n].channel = slot->channel;
+        recs[n].flags = slot->flags;
+        recs[n].ticks = slot->ticks;
+        __atomic_store_n(&slot->seq, pos + SERVORING_SLOTS, __ATOMIC_RELEASE);
+    }
+    ring->tail = pos;
+
+    return n;
+}
+
+void ring_ack(void) {
+    uint64_t v;
+
+    if (read(wake_fd, &v, sizeof(v)) != sizeof(v))
+        return;
+    v = 1;
+    write(ack_fd, &v, sizeof(v));
+}
@@ -0,0 +1,29 @@
+#ifndef LEDEK_RING
+#define LEDEK_RING
+
+#include <stdint.h>
+
+#include "servoring.h"
+
+/* servod's end of the shared memory update ring described in servoring.h.
+ * ring_create() sets up the shared memory object, and ring_start() starts
+ * a helper thread that sleeps on the ring's futex doorbell whenever the
+ * ring is empty.  When a client rings it the thread makes the returned
+ * eventfd readable, so the ring can sit in servod's epoll set next to the
+ * fifo and the control socket.  The main loop then calls ring_drain()
+ * until it returns 0, followed by ring_ack(); until the ack arrives the
+ * helper thread stays out of the way and clients can keep pushing without
+ * any system calls.
+ */
+typedef struct {
+    uint16_t channel;
+    uint16_t flags;
+    int32_t ticks;
+} ring_rec_t;
+
+int ring_create(void);
+int ring_start(void);
+int ring_drain(ring_rec_t *recs, int max);
+void ring_ack(void);
+
+#endif //LEDEK_RING
@@ -0,0 +1,974 @@
+/*
+ * servobench.c - benchmarks for the servod command and update paths
+ *
+ * This is built alongside servod, or by hand with:
+ *
+ *   gcc -Wall -O2 -o servobench servobench.c capture.c clk.c curve.c linebuf.c \
+ *       mask.c parse.c phase.c relink.c strip.c -lm
+ *
+ * Run it with the name of the benchmark to run, or no arguments to run
+ * them all:
+ *
+ *   ./servobench [fifo|parse|curve|mask|relink|phase|strip|capture]
+ *
+ *   fifo   Commands/sec through the command fifo read path, comparing the
+ *          old one byte per read() loop with the buffered line reader.
+ *   parse  Checks the fixed point command parser against the old sscanf()
+ *          and strtod() based parse_width() over a generated set of
+ *          commands, then times both.
+ *   curve  A gamma corrected percentage looked up in a --curve table,
+ *          against working it out with pow() for every command.  The two
+ *          are checked against each other first.
+ *   mask   The turnoff_mask width change kernel against the old one word
+ *          at a time loop, run on ordinary heap memory over a range of
+ *          table sizes, channel counts and width changes, with and without
+ *          the change wrapping round the end of the table, then the same
+ *          again with each change copied from the shadow table to a second
+ *          one, as servod copies its shadow to the DMA table.  Results are
+ *          checked against a table rebuilt from scratch.
+ *   relink The same width changes made by moving per channel turn-off CBs
+ *          in a --relink chain, against the mask spans, for step sizes
+ *          down to 1us.  The chain is checked by walking it afterwards.
+ *   phase  Outputs on at once, and edges in one step, for random LED widths
+ *          with the evenly spaced starts servod begins with, against the
+ *          starts phase_alloc() picks, and the time an allocation takes.
+ *   strip  Encoding a frame of WS2812 pixels into PCM data through the
+ *          byte table, against a bit at a time, for strip lengths up to
+ *          STRIP_MAX_PIXELS, as a share of the time the frame takes to
+ *          send.  The table output is decoded and checked first.
+ *   capture
+ *          Turning a cycle of --capture slots into edges, for 8 outputs
+ *          with random pulses, as a share of the cycle.  The edges found
+ *          are checked against the pulses.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <sys/select.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "capture.h"
+#include "curve.h"
+#include "linebuf.h"
+#include "mask.h"
+#include "parse.h"
+#include "phase.h"
+#include "relink.h"
+#include "strip.h"
+
+#define FIFO_COMMANDS		2000000
+#define FIFO_CHANNELS		32
+
+#define PARSE_COMMANDS		100000
+#define PARSE_ROUNDS		20
+#define PARSE_STEP_US		10
+#define PARSE_MIN_TICKS		50
+#define PARSE_MAX_TICKS		250
+
+#define CURVE_GAMMA		2.2
+
+#define MASK_WORDS		50000000	/* Words to touch per configuration */
+#define MASK_MIN_UPDATES	20000
+#define MASK_RUNS		3	/* Best of, as short changes take a few ns */
+
+#define RELINK_UPDATES		2000000
+#define RELINK_CHANS		8
+
+#define PHASE_TRIALS		200
+
+#define STRIP_BYTES		50000000	/* Pixel bytes to encode per length */
+
+#define CAPTURE_SLOTS		50000000	/* Slots to decode per cycle length */
+#define CAPTURE_CHANS		8
+#define CAPTURE_STEP_US		10
+
+static void
+fatal(char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	exit(1);
+}
+
+static uint64_t
+clock_ns(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Fork a producer that writes 'count' servo commands into the pipe, 'batch'
+ * lines per write() call, the way a number of separate clients would.
+ */
+static pid_t
+start_writer(int fd, int count, int batch)
+{
+	pid_t pid = fork();
+	char buf[64 * 32];
+	int i, j, len;
+
+	if (pid < 0)
+		fatal("fork() failed: %m\n");
+	if (pid > 0)
+		return pid;
+
+	for (i = 0; i < count; i += batch) {
+		len = 0;
+		for (j = 0; j < batch && i + j < count; j++)
+			len += sprintf(buf + len, "%d=%d%%\n", (i + j) % FIFO_CHANNELS, (i + j) % 101);
+		if (write(fd, buf, len) != len)
+			_exit(1);
+	}
+	_exit(0);
+}
+
+// The read loop servod used to have: one read() per byte
+static int
+read_bytewise(int fd, int count)
+{
+	static char line[128];
+	int nchars = 0, lines = 0;
+	fd_set ifds;
+
+	while (lines < count) {
+		FD_ZERO(&ifds);
+		FD_SET(fd, &ifds);
+		if (select(fd+1, &ifds, NULL, NULL, NULL) != 1)
+			continue;
+		while (read(fd, line+nchars, 1) == 1) {
+			if (line[nchars] == '\n') {
+				line[++nchars] = '\0';
+				nchars = 0;
+				lines++;
+			} else if (++nchars >= 126) {
+				nchars = 0;
+			}
+		}
+	}
+	return lines;
+}
+
+static int
+read_linebuf(int fd, int count)
+{
+	linebuf_t lb;
+	int lines = 0;
+	fd_set ifds;
+
+	if (linebuf_init(&lb) < 0)
+		fatal("Failed to allocate line buffer\n");
+	while (lines < count) {
+		FD_ZERO(&ifds);
+		FD_SET(fd, &ifds);
+		if (select(fd+1, &ifds, NULL, NULL, NULL) != 1)
+			continue;
+		while (linebuf_read(&lb, fd) > 0) {
+			while (linebuf_getline(&lb))
+				lines++;
+		}
+	}
+	linebuf_free(&lb);
+	return lines;
+}
+
+static void
+bench_fifo(void)
+{
+	static const int batches[] = { 1, 8, 32 };
+	static const struct {
+		const char *name;
+		int (*reader)(int fd, int count);
+	} readers[] = {
+		{ "bytewise", read_bytewise },
+		{ "linebuf",  read_linebuf },
+	};
+	int b, r, fds[2];
+
+	printf("\nfifo read path, %d commands\n\n", FIFO_COMMANDS);
+	printf("  reader    lines/write    cmds/sec   cpu ns/cmd\n");
+	for (b = 0; b < sizeof(batches)/sizeof(*batches); b++) {
+		for (r = 0; r < sizeof(readers)/sizeof(*readers); r++) {
+			uint64_t t0, c0, t1, c1;
+			pid_t pid;
+			int n;
+
+			if (pipe(fds) < 0)
+				fatal("pipe() failed: %m\n");
+			fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+			t0 = clock_ns(CLOCK_MONOTONIC);
+			c0 = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+			pid = start_writer(fds[1], FIFO_COMMANDS, batches[b]);
+			n = readers[r].reader(fds[0], FIFO_COMMANDS);
+			t1 = clock_ns(CLOCK_MONOTONIC);
+			c1 = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+			waitpid(pid, NULL, 0);
+			close(fds[0]);
+			close(fds[1]);
+
+			printf("  %-9s %11d %11.0f %12.1f\n", readers[r].name, batches[b],
+				n * 1e9 / (t1 - t0), (double)(c1 - c0) / n);
+		}
+	}
+}
+
+/* parse_width() and the sscanf() call in front of it, as servod had them
+ * before the fixed point parser.  This is the reference the new parser is
+ * checked against.
+ */
+static int
+ref_parse_width(int cur, char *width_arg)
+{
+	char *p;
+	char *digits = width_arg;
+	double width;
+
+	if (*width_arg == '-' || *width_arg == '+') {
+		digits++;
+	}
+
+	if (*digits < '0' || *digits > '9') {
+		return -1;
+	}
+	width = strtod(digits, &p);
+
+	if (*p == '\0') {
+		/* Specified in steps */
+	} else if (!strcmp(p, "us")) {
+		width /= PARSE_STEP_US;
+	} else if (!strcmp(p, "%")) {
+		width = width * (PARSE_MAX_TICKS - PARSE_MIN_TICKS) / 100.0 + PARSE_MIN_TICKS;
+	} else {
+		return -1;
+	}
+	width = floor(width);
+	if (*width_arg == '+') {
+		width = cur + width;
+		if (width > PARSE_MAX_TICKS)
+			width = PARSE_MAX_TICKS;
+	} else if (*width_arg == '-') {
+		width = cur - width;
+		if (width < PARSE_MIN_TICKS)
+			width = PARSE_MIN_TICKS;
+	}
+
+	if (width == 0) {
+		return (int)width;
+	} else if (width < PARSE_MIN_TICKS || width > PARSE_MAX_TICKS) {
+		return -1;
+	} else {
+		return (int)width;
+	}
+}
+
+static int
+ref_parse(char *line, int cur)
+{
+	char width_arg[64];
+	int servo;
+
+	if (sscanf(line, "%d=%63s", &servo, width_arg) != 2)
+		return -2;
+	return ref_parse_width(cur, width_arg);
+}
+
+static int
+new_parse(char *line, int cur)
+{
+	servo_cmd_t cmd;
+	const char *end = parse_servo_target(line, &cmd);
+
+	if (!end || !*(end = skip_spaces(end)))
+		return -2;
+	end = parse_width_spec(end, &cmd.width);
+	if (!end || *skip_spaces(end))
+		return -1;
+	return width_to_ticks(&cmd.width, cur, PARSE_STEP_US, PARSE_MIN_TICKS, PARSE_MAX_TICKS);
+}
+
+static void
+gen_command(char *buf, unsigned r)
+{
+	static const char *prefix[] = { "", "", "+", "-" };
+	static const char *unit[] = { "", "us", "%" };
+	static const int range[] = { 300, 3000, 101 };
+	int u = (r >> 2) % 3;
+	int v = (r >> 4) % range[u];
+	int len;
+
+	len = sprintf(buf, "%u=%s%d", (r >> 16) % FIFO_CHANNELS, prefix[r & 3], v);
+	// Some fractional values, and the odd malformed command
+	if ((r >> 12) % 4 == 0)
+		len += sprintf(buf + len, ".%u", (r >> 20) % 1000);
+	if ((r >> 14) % 64 == 0)
+		len += sprintf(buf + len, "x");
+	sprintf(buf + len, "%s", unit[u]);
+}
+
+static void
+bench_parse(void)
+{
+	char (*cmds)[32] = malloc(PARSE_COMMANDS * sizeof(*cmds));
+	int *curs = malloc(PARSE_COMMANDS * sizeof(*curs));
+	int i, round, mismatches = 0, shown = 0;
+	unsigned r = 12345;
+	uint64_t t0, t1, t2;
+	volatile int sink = 0;
+
+	if (!cmds || !curs)
+		fatal("malloc() failed\n");
+	for (i = 0; i < PARSE_COMMANDS; i++) {
+		r = r * 1103515245 + 12345;
+		gen_command(cmds[i], r);
+		curs[i] = (i % 5 == 0) ? 0 : PARSE_MIN_TICKS + (r >> 8) % (PARSE_MAX_TICKS - PARSE_MIN_TICKS + 1);
+	}
+
+	printf("\ncommand parser, %d commands\n\n", PARSE_COMMANDS);
+	for (i = 0; i < PARSE_COMMANDS; i++) {
+		int a = ref_parse(cmds[i], curs[i]);
+		int b = new_parse(cmds[i], curs[i]);
+
+		if (a != b) {
+			mismatches++;
+			if (shown++ < 10)
+				printf("  mismatch: \"%s\" at %d: old %d, new %d\n", cmds[i], curs[i], a, b);
+		}
+	}
+	printf("  %d of %d commands differ from the old parser\n\n", mismatches, PARSE_COMMANDS);
+
+	t0 = clock_ns(CLOCK_MONOTONIC);
+	for (round = 0; round < PARSE_ROUNDS; round++)
+		for (i = 0; i < PARSE_COMMANDS; i++)
+			sink += ref_parse(cmds[i], curs[i]);
+	t1 = clock_ns(CLOCK_MONOTONIC);
+	for (round = 0; round < PARSE_ROUNDS; round++)
+		for (i = 0; i < PARSE_COMMANDS; i++)
+			sink += new_parse(cmds[i], curs[i]);
+	t2 = clock_ns(CLOCK_MONOTONIC);
+
+	printf("  parser          ns/cmd\n");
+	printf("  sscanf+strtod %8.1f\n", (double)(t1 - t0) / PARSE_ROUNDS / PARSE_COMMANDS);
+	printf("  fixed point   %8.1f\n", (double)(t2 - t1) / PARSE_ROUNDS / PARSE_COMMANDS);
+	free(cmds);
+	free(curs);
+}
+
+// A percentage through a gamma curve the way it would be done per command
+static int
+ref_curve_width(const width_spec_t *width)
+{
+	double x = (double)width->value / (100.0 * PARSE_FRAC_ONE);
+
+	if (x > 1.0)
+		return -1;
+	x = floor(x * PARSE_LEVEL_MAX) / PARSE_LEVEL_MAX;
+	if (x == 0)
+		return 0;
+	return PARSE_MIN_TICKS + (int)lround(pow(x, CURVE_GAMMA) *
+			(PARSE_MAX_TICKS - PARSE_MIN_TICKS));
+}
+
+static void
+bench_curve(void)
+{
+	width_spec_t *specs = malloc(PARSE_COMMANDS * sizeof(*specs));
+	int *lut = malloc(CURVE_LEVELS * sizeof(*lut));
+	int i, round, mismatches = 0;
+	unsigned r = 12345;
+	uint64_t t0, t1, t2;
+	volatile int sink = 0;
+
+	if (!specs || !lut)
+		fatal("malloc() failed\n");
+	if (curve_build(lut, "gamma2.2", PARSE_MIN_TICKS, PARSE_MAX_TICKS) < 0)
+		fatal("curve_build() failed: %m\n");
+	for (i = 0; i < PARSE_COMMANDS; i++) {
+		r = r * 1103515245 + 12345;
+		specs[i].rel = 0;
+		specs[i].unit = WIDTH_PERCENT;
+		specs[i].value = (r >> 8) % (100 * PARSE_FRAC_ONE + 1);
+	}
+
+	printf("\ngamma %.1f curve, %d percentages\n\n", CURVE_GAMMA, PARSE_COMMANDS);
+	for (i = 0; i < PARSE_COMMANDS; i++) {
+		if (abs(curve_width(lut, specs + i, 0) - ref_curve_width(specs + i)) > 1)
+			mismatches++;
+	}
+	printf("  %d of %d widths differ from pow() by more than a tick\n\n",
+		mismatches, PARSE_COMMANDS);
+
+	t0 = clock_ns(CLOCK_MONOTONIC);
+	for (round = 0; round < PARSE_ROUNDS; round++)
+		for (i = 0; i < PARSE_COMMANDS; i++)
+			sink += ref_curve_width(specs + i);
+	t1 = clock_ns(CLOCK_MONOTONIC);
+	for (round = 0; round < PARSE_ROUNDS; round++)
+		for (i = 0; i < PARSE_COMMANDS; i++)
+			sink += curve_width(lut, specs + i, 0);
+	t2 = clock_ns(CLOCK_MONOTONIC);
+
+	printf("  conversion      ns/cmd\n");
+	printf("  pow()         %8.1f\n", (double)(t1 - t0) / PARSE_ROUNDS / PARSE_COMMANDS);
+	printf("  lookup        %8.1f\n", (double)(t2 - t1) / PARSE_ROUNDS / PARSE_COMMANDS);
+	free(specs);
+	free(lut);
+}
+
+// Rebuild the table from scratch and compare
+static int
+mask_check(uint32_t *tbl, int num_samples, int chans, const int *start, const int *width)
+{
+	int i, c, j, bad = 0;
+	uint32_t want;
+
+	for (i = 0; i < num_samples; i++) {
+		want = (chans == 32) ? ~0U : (1U << chans) - 1;
+		for (c = 0; c < chans; c++) {
+			j = i - start[c];
+			if (j < 0)
+				j += num_samples;
+			if (j < width[c])
+				want &= ~(1U << c);
+		}
+		if (tbl[i] != want)
+			bad++;
+	}
+	return bad;
+}
+
+typedef void (*mask_kernel_t)(volatile uint32_t *tbl, int num_samples, int start,
+		int old, int width, uint32_t bit);
+typedef int (*flush_kernel_t)(volatile uint32_t *dst, const uint32_t *src,
+		int num_samples, int start, int old, int width);
+
+/* The width change loop set_servo() had before mask.c split the change into
+ * spans: one word per iteration with a wraparound check on each.
+ */
+static void
+ref_change_width(volatile uint32_t *tbl, int num_samples, int start,
+		int old, int width, uint32_t bit)
+{
+	volatile uint32_t *dp;
+	int i;
+
+	if (width > old) {
+		dp = tbl + start + width;
+		if (dp >= tbl + num_samples)
+			dp -= num_samples;
+		for (i = width; i > old; i--) {
+			dp--;
+			if (dp < tbl)
+				dp = tbl + num_samples - 1;
+			*dp &= ~bit;
+		}
+	} else if (width < old) {
+		dp = tbl + start + width;
+		if (dp >= tbl + num_samples)
+			dp -= num_samples;
+		for (i = width; i < old; i++) {
+			*dp++ |= bit;
+			if (dp >= tbl + num_samples)
+				dp = tbl;
+		}
+	}
+}
+
+// The same walk, copying each word from the shadow instead
+static int
+ref_flush_width(volatile uint32_t *dst, const uint32_t *src, int num_samples,
+		int start, int old, int width)
+{
+	int i, j;
+
+	if (width > old) {
+		j = start + width;
+		if (j >= num_samples)
+			j -= num_samples;
+		for (i = width; i > old; i--) {
+			if (--j < 0)
+				j = num_samples - 1;
+			dst[j] = src[j];
+		}
+	} else if (width < old) {
+		j = start + width;
+		if (j >= num_samples)
+			j -= num_samples;
+		for (i = width; i < old; i++) {
+			dst[j] = src[j];
+			if (++j >= num_samples)
+				j = 0;
+		}
+	}
+	return abs(width - old);
+}
+
+/* Each update moves one channel between widths 0 and 'delta', taking the
+ * channels in turn, the way a client animating a set of LEDs would.  With
+ * 'wrap' set the starts are placed so that every pulse straddles the end
+ * of the table.  With 'flush' each change is then copied to a second
+ * table.  Returns ns per update, the best of MASK_RUNS.
+ */
+static double
+mask_run(mask_kernel_t kernel, flush_kernel_t flush, int num_samples, int chans,
+		int delta, int wrap)
+{
+	uint32_t *tbl, *dst;
+	int start[32], width[32];
+	int i, c, updates, next, run;
+	uint64_t t0, t1, best = UINT64_MAX;
+
+	if (posix_memalign((void **)&tbl, 64, num_samples * sizeof(*tbl)) ||
+			posix_memalign((void **)&dst, 64, num_samples * sizeof(*dst)))
+		fatal("posix_memalign() failed\n");
+	for (i = 0; i < num_samples; i++)
+		tbl[i] = dst[i] = (chans == 32) ? ~0U : (1U << chans) - 1;
+	for (c = 0; c < chans; c++) {
+		if (wrap)
+			start[c] = (2 * num_samples - delta / 2 - c) % num_samples;
+		else
+			start[c] = c * (num_samples / chans);
+		width[c] = 0;
+	}
+
+	updates = MASK_WORDS / delta;
+	if (updates < MASK_MIN_UPDATES)
+		updates = MASK_MIN_UPDATES;
+	updates -= updates % (2 * chans);
+	for (run = 0; run < MASK_RUNS; run++) {
+		t0 = clock_ns(CLOCK_MONOTONIC);
+		for (i = 0; i < updates; i++) {
+			c = i % chans;
+			next = width[c] ? 0 : delta;
+			kernel(tbl, num_samples, start[c], width[c], next, 1U << c);
+			if (flush)
+				flush(dst, tbl, num_samples, start[c], width[c], next);
+			width[c] = next;
+		}
+		t1 = clock_ns(CLOCK_MONOTONIC);
+		if (t1 - t0 < best)
+			best = t1 - t0;
+	}
+
+	// Leave every channel somewhere other than where it started, and check
+	for (c = 0; c < chans; c++) {
+		next = (c + 1) * delta / (chans + 1);
+		kernel(tbl, num_samples, start[c], width[c], next, 1U << c);
+		if (flush)
+			flush(dst, tbl, num_samples, start[c], width[c], next);
+		width[c] = next;
+	}
+	if (mask_check(flush ? dst : tbl, num_samples, chans, start, width))
+		fatal("mask table wrong for %d samples, %d channels, delta %d%s\n",
+			num_samples, chans, delta, wrap ? ", wrapped" : "");
+	free(tbl);
+	free(dst);
+
+	return (double)best / updates;
+}
+
+static void
+bench_mask(void)
+{
+	// 20ms cycles at 10us and 2us steps
+	static const int samples[] = { 2000, 10000 };
+	static const int chans[] = { 1, 8, 32 };
+	static const int deltas[] = { 1, 4, 8, 16, 64, 256, 1000 };
+	int s, c, d, w, delta;
+	double old_ns, new_ns;
+
+	printf("\nturnoff_mask width change, old per word loop against %s spans\n\n",
+		mask_kernel_name);
+	printf("  samples chans   delta  wrap  words/update   old ns/upd   new ns/upd  speedup\n");
+	for (s = 0; s < sizeof(samples)/sizeof(*samples); s++) {
+		for (c = 0; c < sizeof(chans)/sizeof(*chans); c++) {
+			for (d = 0; d < sizeof(deltas)/sizeof(*deltas) + 1; d++) {
+				// The last delta is the full table, as for an LED going 0-100%
+				delta = d < sizeof(deltas)/sizeof(*deltas) ? deltas[d] : samples[s];
+				for (w = 0; w < 2; w++) {
+					old_ns = mask_run(ref_change_width, NULL, samples[s],
+							chans[c], delta, w);
+					new_ns = mask_run(mask_change_width, NULL, samples[s],
+							chans[c], delta, w);
+					printf("  %7d %5d %7d %5s %13d %12.1f %12.1f %8.1fx\n",
+						samples[s], chans[c], delta, w ? "yes" : "no",
+						delta, old_ns, new_ns, old_ns / new_ns);
+				}
+			}
+		}
+	}
+
+	printf("\nShadow to DMA table copy after each change, old per word loop against "
+		"%s spans\n\n", mask_kernel_name);
+	printf("  samples chans   delta  wrap  words/update   old ns/upd   new ns/upd  speedup\n");
+	for (s = 0; s < sizeof(samples)/sizeof(*samples); s++) {
+		for (d = 0; d < sizeof(deltas)/sizeof(*deltas) + 1; d++) {
+			delta = d < sizeof(deltas)/sizeof(*deltas) ? deltas[d] : samples[s];
+			for (w = 0; w < 2; w++) {
+				old_ns = mask_run(mask_change_width, ref_flush_width, samples[s],
+						8, delta, w);
+				new_ns = mask_run(mask_change_width, mask_flush_width, samples[s],
+						8, delta, w);
+				printf("  %7d %5d %7d %5s %13d %12.1f %12.1f %8.1fx\n",
+					samples[s], 8, delta, w ? "yes" : "no",
+					delta, old_ns, new_ns, old_ns / new_ns);
+			}
+		}
+	}
+}
+
+/* Walk the chain from delay CB 0 for a whole cycle, checking each channel's
+ * turn-off CB turns up just once and in front of the right sample.
+ */
+static int
+relink_check(relink_t *r, const int *start, const int *width)
+{
+	int seen[MAX_SERVOS] = { 0 };
+	int n = r->num_samples, i = 0, c;
+	dma_cb_t *cb = r->delay;
+
+	while (i < n) {
+		cb = (dma_cb_t *)(r->virt_base + (cb->next - r->bus_base));
+		if (cb >= r->delay && cb < r->delay + n) {
+			if (cb != r->delay + (i + 1) % n)
+				return -1;
+			i++;
+		} else if (cb >= r->turnoff && cb < r->turnoff + MAX_SERVOS * 2) {
+			c = (cb - r->turnoff) / 2;
+			if (seen[c]++ || (i + 1) % n != (start[c] + width[c]) % n)
+				return -1;
+		}
+	}
+	for (c = 0; c < RELINK_CHANS; c++) {
+		if (seen[c] != (width[c] < n))
+			return -1;
+	}
+	return 0;
+}
+
+// ns per update to move RELINK_CHANS channels between 0 and 'delta' samples
+static double
+relink_run(int num_samples, int delta)
+{
+	static uint32_t fake_dma[DMA_CHAN_SIZE / 4];	// DMA_CONBLK_AD stays 0
+	int start[MAX_SERVOS] = { 0 }, width[MAX_SERVOS] = { 0 };
+	uint32_t bits[MAX_SERVOS] = { 0 };
+	uint8_t bank[MAX_SERVOS] = { 0 };
+	relink_t r;
+	void *mem;
+	int i, c;
+	uint64_t t0, t1;
+
+	if (posix_memalign(&mem, 64, relink_mem_size(num_samples)))
+		fatal("posix_memalign() failed\n");
+	for (c = 0; c < RELINK_CHANS; c++) {
+		start[c] = c * (num_samples / RELINK_CHANS);
+		bits[c] = 1U << c;
+	}
+	relink_init(&r, mem, 0xc0000000, num_samples, start, bits, bank,
+		0x7e200028, 0x7e20001c, 0x7e20c018, 0, fake_dma);
+
+	t0 = clock_ns(CLOCK_MONOTONIC);
+	for (i = 0; i < RELINK_UPDATES; i++) {
+		c = i % RELINK_CHANS;
+		// Width 0 leaves the CB alone, so move between 1 and 1 + delta
+		width[c] = width[c] == 1 ? 1 + delta : 1;
+		if (relink_move(&r, c, width[c]) < 0)
+			fatal("relink_move() failed\n");
+	}
+	t1 = clock_ns(CLOCK_MONOTONIC);
+
+	if (relink_check(&r, start, width))
+		fatal("relink chain wrong for %d samples, delta %d\n", num_samples, delta);
+	free(mem);
+
+	return (double)(t1 - t0) / RELINK_UPDATES;
+}
+
+static void
+bench_relink(void)
+{
+	// 20ms cycles at 10us, 2us and 1us steps
+	static const int samples[] = { 2000, 10000, 20000 };
+	static const int deltas[] = { 1, 16, 256, 1000 };
+	int s, d, delta;
+	double mask_ns, relink_ns;
+
+	printf("\nWidth change, %s mask spans against relinked turn-off CBs, %d channels\n\n",
+		mask_kernel_name, RELINK_CHANS);
+	printf("  samples   delta  mask ns/upd  relink ns/upd  speedup\n");
+	for (s = 0; s < sizeof(samples)/sizeof(*samples); s++) {
+		for (d = 0; d < sizeof(deltas)/sizeof(*deltas) + 1; d++) {
+			delta = d < sizeof(deltas)/sizeof(*deltas) ? deltas[d] : samples[s] - 1;
+			mask_ns = mask_run(mask_change_width, NULL, samples[s], RELINK_CHANS, delta, 0);
+			relink_ns = relink_run(samples[s], delta);
+			printf("  %7d %7d %12.1f %14.1f %7.1fx\n", samples[s], delta,
+				mask_ns, relink_ns, mask_ns / relink_ns);
+		}
+	}
+}
+
+/* Average peaks over PHASE_TRIALS sets of random widths, checking that no
+ * pulse is moved across the end of the cycle.
+ */
+static void
+phase_run(int num_samples, int chans, double *even, double *alloc,
+	  double *even_edges, double *alloc_edges, double *ns)
+{
+	int width[32], start[32], t, c, edges;
+	char fixed[32] = { 0 };
+	uint64_t t0, total = 0;
+
+	*even = *alloc = *even_edges = *alloc_edges = 0.0;
+	for (t = 0; t < PHASE_TRIALS; t++) {
+		for (c = 0; c < chans; c++) {
+			width[c] = rand() % num_samples;
+			start[c] = c * (num_samples / chans);
+		}
+		*even += phase_peak(num_samples, chans, width, start, &edges);
+		*even_edges += edges;
+		t0 = clock_ns(CLOCK_MONOTONIC);
+		*alloc += phase_alloc(num_samples, chans, width, fixed, start);
+		total += clock_ns(CLOCK_MONOTONIC) - t0;
+		phase_peak(num_samples, chans, width, start, &edges);
+		*alloc_edges += edges;
+		for (c = 0; c < chans; c++) {
+			if (start[c] < 0 || start[c] + width[c] > num_samples)
+				fatal("phase_alloc() put channel %d across the cycle end\n", c);
+		}
+	}
+	*even /= PHASE_TRIALS;
+	*alloc /= PHASE_TRIALS;
+	*even_edges /= PHASE_TRIALS;
+	*alloc_edges /= PHASE_TRIALS;
+	*ns = (double)total / PHASE_TRIALS;
+}
+
+static void
+bench_phase(void)
+{
+	static const int samples[] = { 2000, 10000, 20000 };
+	static const int chans[] = { 8, 16, 32 };
+	double even, alloc, even_edges, alloc_edges, ns;
+	int s, c;
+
+	srand(1);
+	printf("\nStart phases for random widths, evenly spaced against phase_alloc(),\n"
+		"averaged over %d sets of widths\n\n", PHASE_TRIALS);
+	printf("  samples  chans  peak on: even  alloc  edges: even  alloc  us/alloc\n");
+	for (s = 0; s < sizeof(samples)/sizeof(*samples); s++) {
+		for (c = 0; c < sizeof(chans)/sizeof(*chans); c++) {
+			phase_run(samples[s], chans[c], &even, &alloc, &even_edges,
+				  &alloc_edges, &ns);
+			printf("  %7d %6d %14.2f %6.2f %12.2f %6.2f %9.1f\n", samples[s],
+				chans[c], even, alloc, even_edges, alloc_edges, ns / 1000);
+		}
+	}
+}
+
+// The encoding as the WS2812 data sheet puts it, one symbol bit at a time
+static int
+strip_encode_bits(const uint8_t *grb, int num_bytes, uint32_t *out)
+{
+	int i, bit, k, n = 0;
+	uint32_t sym;
+
+	for (i = 0; i < num_bytes; i++) {
+		for (bit = 7; bit >= 0; bit--) {
+			sym = grb[i] & (1 << bit) ? 6 : 4;
+			for (k = 2; k >= 0; k--, n++) {
+				if (n % 32 == 0)
+					out[n / 32] = 0;
+				out[n / 32] |= (sym >> k & 1) << (31 - n % 32);
+			}
+		}
+	}
+	return (n + 31) / 32;
+}
+
+// Decode PCM data back to bytes, returning -1 if a symbol isn't 100 or 110
+static int
+strip_decode(const uint32_t *data, int num_bytes, uint8_t *grb)
+{
+	int i, bit, n = 0;
+	uint32_t sym;
+
+	for (i = 0; i < num_bytes; i++) {
+		grb[i] = 0;
+		for (bit = 0; bit < 8; bit++, n += 3) {
+			sym = (data[n / 32] >> (31 - n % 32) & 1) << 2 |
+			      (data[(n + 1) / 32] >> (31 - (n + 1) % 32) & 1) << 1 |
+			      (data[(n + 2) / 32] >> (31 - (n + 2) % 32) & 1);
+			if (sym != 4 && sym != 6)
+				return -1;
+			grb[i] = grb[i] << 1 | (sym == 6);
+		}
+	}
+	return 0;
+}
+
+// ns per frame of 'pixels' for the encoder
+static double
+strip_run(int (*encode)(const uint8_t *, int, uint32_t *), const uint8_t *grb,
+	  int pixels, uint32_t *out)
+{
+	int i, rounds = STRIP_BYTES / (pixels * 3);
+	uint64_t t0, t1;
+
+	t0 = clock_ns(CLOCK_MONOTONIC);
+	for (i = 0; i < rounds; i++)
+		encode(grb, pixels * 3, out);
+	t1 = clock_ns(CLOCK_MONOTONIC);
+
+	return (double)(t1 - t0) / rounds;
+}
+
+static void
+bench_strip(void)
+{
+	static const int pixels[] = { 60, 300, 1000, STRIP_MAX_PIXELS };
+	static uint8_t grb[STRIP_MAX_PIXELS * 3], back[STRIP_MAX_PIXELS * 3];
+	static uint32_t out[STRIP_MAX_PIXELS * 9 / 4 + 1], ref[STRIP_MAX_PIXELS * 9 / 4 + 1];
+	double bits_ns, table_ns, frame_ns;
+	int i, p, n;
+
+	srand(1);
+	for (i = 0; i < sizeof(grb); i++)
+		grb[i] = rand();
+	n = strip_encode(grb, sizeof(grb), out);
+	if (n != strip_encode_bits(grb, sizeof(grb), ref) || memcmp(out, ref, n * 4))
+		fatal("strip_encode() doesn't match the bit at a time encoding\n");
+	if (strip_decode(out, sizeof(grb), back) || memcmp(grb, back, sizeof(grb)))
+		fatal("strip_encode() output doesn't decode back to the pixels\n");
+
+	printf("\nWS2812 frame encoding, a bit at a time against the byte table\n\n");
+	printf("  pixels  bits us/frame  table us/frame  speedup  table %% of send\n");
+	for (p = 0; p < sizeof(pixels)/sizeof(*pixels); p++) {
+		bits_ns = strip_run(strip_encode_bits, grb, pixels[p], out);
+		table_ns = strip_run(strip_encode, grb, pixels[p], out);
+		frame_ns = pixels[p] * 24 * 3 * 1e9 / STRIP_BIT_HZ;
+		printf("  %6d %15.2f %15.2f %7.1fx %15.3f\n", pixels[p], bits_ns / 1000,
+			table_ns / 1000, bits_ns / table_ns, 100.0 * table_ns / frame_ns);
+	}
+}
+
+/* Fill a ring as --capture would for one cycle of CAPTURE_CHANS random
+ * pulses, each starting at the start of its own stretch of the cycle, with
+ * the controller last on slot 'pos'.  Returns the number of edges.
+ */
+static int
+capture_fill(capture_slot_t *slots, int num_samples, int pos)
+{
+	int width[CAPTURE_CHANS], c, i, k;
+	uint32_t levels;
+
+	for (c = 0; c < CAPTURE_CHANS; c++)
+		width[c] = 1 + rand() % (num_samples / CAPTURE_CHANS - 1);
+	for (i = 0; i < num_samples; i++) {
+		levels = 0;
+		for (c = 0; c < CAPTURE_CHANS; c++) {
+			k = i - c * (num_samples / CAPTURE_CHANS);
+			if (k >= 0 && k < width[c])
+				levels |= 1U << c;
+		}
+		// Slots after the controller are a cycle older
+		slots[i].levels = levels;
+		slots[i].stamp = 1000000 + (i - (i > pos ? num_samples : 0)) * CAPTURE_STEP_US;
+	}
+	// Each pulse has its two edges, as no two are on at once
+	return CAPTURE_CHANS * 2;
+}
+
+static void
+bench_capture(void)
+{
+	static const int samples[] = { 2000, 10000, 20000 };
+	capture_slot_t *slots, *edges;
+	int s, r, n, rounds, want, first;
+	uint32_t levels;
+	uint64_t t0, t1;
+	double ns;
+
+	srand(1);
+	printf("\nDecoding a cycle of capture slots into edges, %d outputs\n\n",
+		CAPTURE_CHANS);
+	printf("  samples  edges  us/cycle  %% of cycle\n");
+	for (s = 0; s < sizeof(samples)/sizeof(*samples); s++) {
+		slots = malloc(samples[s] * 2 * sizeof(*slots));
+		if (!slots)
+			fatal("malloc() failed\n");
+		edges = slots + samples[s];
+		want = capture_fill(slots, samples[s], samples[s] / 3);
+		first = capture_oldest(slots, samples[s]);
+		if (first != samples[s] / 3 + 1)
+			fatal("capture_oldest() found slot %d, not %d\n", first, samples[s] / 3 + 1);
+		// Start from all off, as the pulses are when the ring is read in order
+		levels = 0;
+		n = capture_edges(slots, samples[s], first, samples[s], ~0U, 0, &levels,
+				edges, samples[s]);
+		if (n != want)
+			fatal("capture_edges() found %d edges, not %d\n", n, want);
+		for (r = 1; r < n; r++) {
+			if ((int32_t)(edges[r].stamp - edges[r - 1].stamp) <= 0)
+				fatal("capture_edges() put edges out of order\n");
+		}
+		rounds = CAPTURE_SLOTS / samples[s];
+		t0 = clock_ns(CLOCK_MONOTONIC);
+		for (r = 0; r < rounds; r++) {
+			levels = 0;
+			capture_edges(slots, samples[s], first, samples[s], ~0U, 0, &levels,
+				edges, samples[s]);
+		}
+		t1 = clock_ns(CLOCK_MONOTONIC);
+		ns = (double)(t1 - t0) / rounds;
+		printf("  %7d %6d %9.2f %11.3f\n", samples[s], n, ns / 1000,
+			100.0 * ns / (samples[s] * CAPTURE_STEP_US * 1000.0));
+		free(slots);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	int all = argc < 2;
+
+	signal(SIGPIPE, SIG_IGN);
+	if (!all && strcmp(argv[1], "fifo") && strcmp(argv[1], "parse") &&
+			strcmp(argv[1], "curve") && strcmp(argv[1], "mask") &&
+			strcmp(argv[1], "relink") && strcmp(argv[1], "phase") &&
+			strcmp(argv[1], "strip") && strcmp(argv[1], "capture"))
+		fatal("Unknown benchmark '%s'\n", argv[1]);
+	if (all || !strcmp(argv[1], "fifo"))
+		bench_fifo();
+	if (all || !strcmp(argv[1], "parse"))
+		bench_parse();
+	if (all || !strcmp(argv[1], "curve"))
+		bench_curve();
+	if (all || !strcmp(argv[1], "mask"))
+		bench_mask();
+	if (all || !strcmp(argv[1], "relink"))
+		bench_relink();
+	if (all || !strcmp(argv[1], "phase"))
+		bench_phase();
+	if (all || !strcmp(argv[1], "strip"))
+		bench_strip();
+	if (all || !strcmp(argv[1], "capture"))
+		bench_capture();
+	printf("\n");
+
+	return 0;
+}
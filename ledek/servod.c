@@ -21,7 +21,6 @@
  */
 
 /* TODO: Separate idle timeout handling from genuine set-to-zero requests */
-/* TODO: Add ability to specify time frame over which an adjustment should be made */
 /* TODO: Add servoctl utility to set and query servo positions, etc */
 /* TODO: Add slow-start option */
 
@@ -32,67 +31,82 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <limits.h>
 #include <signal.h>
 #include <time.h>
-#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <getopt.h>
 #include <math.h>
-#include <bcm_host.h>
 
 #include "mailbox.h"
 
+#include "bcm.h"
+#include "capture.h"
+#include "client.h"
 #include "clk.h"
+#include "curve.h"
+#include "deadline.h"
 #include "dma.h"
 #include "gpio.h"
 #include "hardware.h"
+#include "linebuf.h"
+#include "mask.h"
+#include "metrics.h"
+#include "parse.h"
+#include "pcm.h"
+#include "phase.h"
 #include "pwm.h"
+#include "ramp.h"
+#include "relink.h"
+#include "ring.h"
+#include "servod.h"
+#include "sparse.h"
+#include "st.h"
+#include "strip.h"
 
 
-#define MAX_SERVOS	32	/* Only 21 really, but this lets you map servo IDs
-				 * to P1 pins, if you want to
-				 */
 #define MAX_MEMORY_USAGE	(16*1024*1024)	/* Somewhat arbitrary limit of 16MB */
 
 #define DEFAULT_CYCLE_TIME_US	20000
 #define DEFAULT_STEP_TIME_US	10
 #define DEFAULT_SERVO_MIN_US	500
 #define DEFAULT_SERVO_MAX_US	2500
+#define BCM_MAX_CYCLE_US	20000	/* Any slower and --bcm LEDs flicker */
 
-#define DEVFILE			"/dev/servoblaster"
-#define CFGFILE			"/dev/servoblaster-cfg"
-
-#define PAGE_SIZE		4096
-#define PAGE_SHIFT		12
-
+// Ways of laying out the DMA chain
+#define CHAIN_MASK		0	/* Turn-off CB per sample, reading turnoff_mask */
+#define CHAIN_RELINK		1	/* Per servo turn-off CBs, see relink.h */
+#define CHAIN_SPARSE		2	/* Edge only chain, see sparse.h */
+#define CHAIN_BCM		3	/* Bit-planes, see bcm.h */
 
+static const char *chain_names[] = { "    Mask", "  Relink", "  Sparse", "     BCM" };
 
-#define PCM_BASE_OFFSET		0x00203000
-#define PCM_LEN			0x24
+#define DITHER_BITS		8	/* Fraction bits kept for --dither */
 
-#define PCM_VIRT_BASE		(periph_virt_base + PCM_BASE_OFFSET)
-#define PCM_PHYS_BASE		(periph_phys_base + PCM_BASE_OFFSET)
+#define RING_BATCH		64	/* Records pulled off the ring at a time */
+#define MAX_EVENTS		32	/* epoll events handled per wakeup */
 
-#define PCM_CS_A		(0x00/4)
-#define PCM_FIFO_A		(0x04/4)
-#define PCM_MODE_A		(0x08/4)
-#define PCM_RXC_A		(0x0c/4)
-#define PCM_TXC_A		(0x10/4)
-#define PCM_DREQ_A		(0x14/4)
-#define PCM_INTEN_A		(0x18/4)
-#define PCM_INT_STC_A		(0x1c/4)
-#define PCM_GRAY		(0x20/4)
+#define STATS_INTERVAL_S	1	/* How often --stats-file is rewritten */
 
-#define PCMCLK_CNTL		38
-#define PCMCLK_DIV		39
-
-#define DELAY_VIA_PCM		1
+#define WATCHDOG_DEFAULT_MS	500	/* Between checks on the DMA controllers */
+#define WATCHDOG_EVENTS		16	/* Recoveries kept for debug */
 
+#define PAGE_SIZE		4096
+#define PAGE_SHIFT		12
 
 #define ROUNDUP(val, blksz)	(((val)+((blksz)-1)) & ~(blksz-1))
+#define BARRIER()		__sync_synchronize()
+
+#define FRAME_SPANS		16	/* Copies of runs of turn-off words */
+#define FRAME_GAP		8	/* Gap in a run worth a CB to skip */
+#define FRAME_CBS		(FRAME_SPANS + 2) /* With turn-ons, unhook */
 
 
 /* Define which P1 header pins to use by default.  These are the eight standard
@@ -115,118 +129,277 @@ static char *default_p5_pins = "";
 // will use too much memory bandwidth.  10us is a good value, though you
 // might be ok setting it as low as 2us.
 
-static int cycle_time_us;
-static int step_time_us;
-
-static uint8_t servo2gpio[MAX_SERVOS];
-static uint8_t p1pin2servo[NUM_P1PINS+1];
-static uint8_t p5pin2servo[NUM_P5PINS+1];
+/* Updates to a group that its chain hasn't taken yet, for the apply
+ * latency histogram, batched by the loop_now they came in on.  'flush'
+ * numbers the flush that put them into the chain, so that they are
+ * counted once the controller has picked that flush up.
+ */
+#define APPLY_BATCHES		32
+
+typedef struct {
+	uint64_t sum_since;		/* Sum of the loop_now each came in on */
+	uint64_t last;			/* ... and the latest of them */
+	uint64_t flush;			/* Flush they went out with, or 0 */
+	uint32_t n;			/* Updates */
+} apply_batch_t;
+
+/* Outputs are split into groups, each driven by its own DMA channel and
+ * chain, with its own cycle and step time.  A chain is paced by writes to
+ * the PWM or PCM FIFO, and each of those can only run at one rate, so
+ * there can be two groups: group 0 has every output not moved elsewhere
+ * with --group, and uses whichever of PWM and PCM --pcm says; group 1 uses
+ * the other.  Servo numbers are the same whichever group a servo is in.
+ */
+typedef struct {
+	int delay_hw;			/* DELAY_VIA_PWM or DELAY_VIA_PCM */
+	int dma_chan;
+	volatile uint32_t *dma_reg;
+	mbox_t mbox;
+	int cycle_time_us;
+	int step_time_us;
+	int servo_min_ticks;
+	int servo_max_ticks;
+	int num_servos;
+	int num_samples;
+	int num_cbs;
+	int num_pages;
+	int num_banks;			/* GPIO banks in use, 1 or 2 */
+	int chain_mode;
+	int bcm_bits;
+	uint32_t *turnoff_mask;		/* num_banks words per sample */
+	uint32_t *turnon_mask;
+	uint32_t *shadow_off;		/* Cached copy of turnoff_mask */
+	int *cb_sample;			/* Sample each CB belongs to */
+	uint32_t *frame_set;		/* Pending turnoff_mask changes for a frame */
+	uint32_t *frame_clr;
+	uint32_t *frame_hold;		/* Turn-offs kept back to the next frame */
+	int hold_lo, hold_hi;		/* ... and the words they are in */
+	uint32_t *frame_stage;		/* Words the frame CBs copy, see stage_frame() */
+	dma_cb_t *frame_cbs;
+	int frame_wanted;		/* Dirty servos are to go in as one frame */
+	int frame_pending;		/* Waiting for the controller to copy one in */
+	dma_cb_t *cb_base;
+	dma_cb_t *cb_last;		/* The CB that loops back to cb_base */
+	relink_t relink;
+	sparse_t sparse;
+	bcm_t bcm;
+	int dirty_list[MAX_SERVOS];	/* Servos with changes not yet flushed */
+	int num_dirty;
+	uint64_t mask_updates;		/* Width changes asked for */
+	uint64_t mask_words_changed;	/* Words those would change in place */
+	uint64_t mask_words_written;	/* Words actually written to turnoff_mask */
+	apply_batch_t apply[APPLY_BATCHES];	/* Oldest first */
+	int num_apply;
+	uint64_t flush_seq;		/* Flushes that put updates into the chain */
+	uint64_t retire_flush[MAX_SERVOS];	/* Flush each retiring relink CB came from */
+	int cycle_fd;			/* Cycle tick while any ramp or dither is active */
+	int cycle_timer_on;
+	int rephase_wanted;		/* Set by the rephase command */
+	uint64_t rephases;		/* Times the starts have been moved */
+	uint64_t rephases_kept;		/* ... and kept, as nowhere was better */
+	int last_peak;			/* Outputs on at once after the last flush */
+	int last_edges;			/* ... and most edges in one step */
+	int capture;			/* --capture, normal chain only */
+	capture_slot_t *capture_slots;	/* Slot per sample, see capture.h */
+	uint32_t capture_seen;		/* Stamp of the last slot read out */
+	uint32_t capture_levels;	/* ... and its levels */
+} group_t;
+
+#define MAX_GROUPS		2
+
+static group_t groups[MAX_GROUPS];
+static int num_groups = 1;
+static volatile uint32_t *dma_base;	/* All the channels, which groups share */
+static uint8_t servo_group[MAX_SERVOS];	/* Group each servo is in */
+
+#define GROUP_OF(servo)		(groups + servo_group[servo])
+
+/* --strip drives a WS2812 LED strip from the PCM block, on its own DMA
+ * channel, so PCM can't then pace a group; group 0 uses PWM and there is
+ * no group 1.
+ */
+#define STRIP_GPIO		21	/* PCM_DOUT in ALT0 */
+
+static strip_t strip;
+static int strip_pixels;		/* 0 without --strip */
+static int strip_dma_chan;
+static volatile uint32_t *strip_dma_reg;
+static mbox_t strip_mbox;
+static uint32_t strip_gpio_mode;	/* To put the pin back to on exit */
+static int strip_held;			/* Ring pixels for a frame still to come */
+
+uint8_t servo2gpio[MAX_SERVOS];
+uint8_t p1pin2servo[NUM_P1PINS+1];
+uint8_t p5pin2servo[NUM_P5PINS+1];
 static int servostart[MAX_SERVOS];
 static int servowidth[MAX_SERVOS];
-static int num_servos;
-static uint32_t gpiomode[MAX_SERVOS];
-static int restore_gpio_modes;
+int num_servos;
+uint32_t gpiomode[MAX_SERVOS];
+int restore_gpio_modes;
 
 
-static struct timeval *servo_kill_time;
+static deadline_heap_t idle_heap;	/* When each idle output is turned off */
+static int idle_ms[MAX_SERVOS];		/* Per servo idle timeout, 0 for none */
+static int idle_fd = -1;
+static uint64_t idle_armed;		/* Deadline idle_fd is set for, or 0 */
+static uint64_t loop_now;		/* CLOCK_MONOTONIC ns, read once per loop */
 
-static uint32_t plldfreq_mhz;
-static int dma_chan;
 static int idle_timeout;
 static int invert = 0;
-static int servo_min_ticks;
-static int servo_max_ticks;
-static int num_samples;
-static int num_cbs;
-static int num_pages;
-static uint32_t *turnoff_mask;
-static uint32_t *turnon_mask;
-static dma_cb_t *cb_base;
-
-static int board_model;
-static int gpio_cfg;
-
+static uint32_t shadow_on[MAX_SERVOS];	/* Cached copy of each turnon_mask word */
+static int flushedwidth[MAX_SERVOS];	/* Width turnoff_mask has for each servo */
+static char dirty[MAX_SERVOS];
+static char sparse_turnon[MAX_SERVOS];	/* Turn on once the queued chain runs */
+static ramp_t ramps[MAX_SERVOS];
+static int dither_bits;			/* Fraction bits of finewidth[], 0 for none */
+static int finewidth[MAX_SERVOS];	/* Width asked for, in 1/2^dither_bits steps */
+static uint32_t dither_acc[MAX_SERVOS];	/* Fraction carried over between cycles */
+static char dithering[MAX_SERVOS];	/* Width has a fraction to dither */
+static int num_dithering;
+static int auto_rephase;		/* Move starts as widths change */
+static uint8_t hw_pwm[MAX_SERVOS];	/* PWM channel + 1 driving the servo, or 0 */
+static int num_hw_pwm;
+static int hw_pwm_started;
+static int *servo_curve[MAX_SERVOS];	/* Width per level from --curve, or NULL */
+static const char *curve_name[MAX_SERVOS];
+
+/* Counts for --stats-file and the stats command, see metrics.h.  Those
+ * kept per source are indexed by client_t.replies, so 0 is the fifo and 1
+ * the control socket.
+ */
 static struct {
-	int handle;		/* From mbox_open() */
-	uint32_t size;		/* Required size */
-	unsigned mem_ref;	/* From mem_alloc() */
-	unsigned bus_addr;	/* From mem_lock() */
-	uint8_t *virt_addr;	/* From mapmem() */
-} mbox;
-	
-static void set_servo(int servo, int width);
+	uint64_t lines[2];		/* Commands handled */
+	uint64_t errors[2];		/* ... and rejected */
+	uint64_t bytes[2];		/* Bytes read */
+	uint64_t ring_records;
+	uint64_t ring_invalid;
+	uint64_t set_servo;		/* set_servo() calls */
+	uint64_t frames;		/* set_servo_frame() calls */
+	uint64_t idle_expiries;
+	metrics_hist_t apply_ns;	/* Command read until the chain has it */
+} stats;
+static char *stats_path;		/* --stats-file, or NULL */
+static int stats_fd = -1;
+static int stats_failing;		/* Last rewrite failed, and was reported */
+
+/* The watchdog checks each DMA controller every watchdog_ms, and restarts
+ * any that has stopped, reported an error, or stalled; see check_dma().
+ * watched[] has the groups, then the strip if there is one.
+ */
+#define WD_STALLED		0	/* Still on the same word of the same CB */
+#define WD_ERROR		1	/* DMA_CS ERROR or DMA_DEBUG error bits set */
+#define WD_STOPPED		2	/* No longer ACTIVE */
+
+static const char *wd_reasons[] = { "stalled", "error", "stopped" };
+
+typedef struct {
+	volatile uint32_t *dma_reg;
+	int dma_chan;
+	int word_us;			/* Time the controller takes over a paced word */
+	uint32_t last_cb;		/* DMA_CONBLK_AD at the last check */
+	uint32_t last_len;		/* ... and DMA_TXFR_LEN */
+	int suspect;			/* They hadn't moved then either */
+	int in_a_row;			/* Recoveries with no good check between */
+	uint64_t recoveries[3];		/* By reason */
+	struct timespec last_recovery;	/* CLOCK_REALTIME */
+	int restarting;			/* Being set up again, see restart_dma() */
+	hw_setup_t setup;		/* ... by these steps */
+	int restart_fd;			/* ... paced by this timerfd */
+} watch_t;
+
+typedef struct {
+	struct timespec when;		/* CLOCK_REALTIME */
+	int watch;			/* Index into watched[] */
+	int reason;
+	uint32_t cs, debug, cb;		/* Registers as found */
+	int in_a_row;
+} wd_event_t;
+
+static int watchdog_ms = WATCHDOG_DEFAULT_MS;	/* 0 for no watchdog */
+static int watchdog_fd = -1;
+static watch_t watched[MAX_GROUPS + 1];
+static int num_watched;
+static wd_event_t wd_events[WATCHDOG_EVENTS];	/* Most recent recoveries */
+static uint64_t wd_num_events;
+
 static void set_servo_idle(int servo);
-static void gpio_set_mode(uint32_t gpio, uint32_t mode);
-static char *gpio2pinname(uint8_t gpio);
 
 
 
 
+static uint64_t
+monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Idle timeouts are kept as CLOCK_MONOTONIC deadlines in a min-heap, so
+ * wall clock changes don't affect them, an update costs O(log n), and
+ * idle_fd, a timerfd, is always set for exactly the earliest one.
+ */
 static void
 init_idle_timers(void)
 {
-	servo_kill_time = calloc(MAX_SERVOS, sizeof(struct timeval));
-	if (!servo_kill_time)
+	int i;
+
+	if (deadline_init(&idle_heap, MAX_SERVOS) < 0)
 		fatal("servod: calloc() failed\n");
+	for (i = 0; i < MAX_SERVOS; i++)
+		idle_ms[i] = idle_timeout;
 }
 
 static void
 update_idle_time(int servo)
 {
-	if (idle_timeout == 0)
+	if (idle_ms[servo] == 0)
 		return;
 
-	gettimeofday(servo_kill_time + servo, NULL);
-	servo_kill_time[servo].tv_sec += idle_timeout / 1000;
-	servo_kill_time[servo].tv_usec += (idle_timeout % 1000) * 1000;
-	while (servo_kill_time[servo].tv_usec >= 1000000) {
-		servo_kill_time[servo].tv_usec -= 1000000;
-		servo_kill_time[servo].tv_sec++;
-	}
+	deadline_set(&idle_heap, servo, loop_now + (uint64_t)idle_ms[servo] * 1000000);
 }
 
+// Idle any outputs whose time is up, then re-arm idle_fd if need be
 static void
-get_next_idle_timeout(struct timeval *tv)
+expire_idle_timers(void)
 {
-	int i;
-	struct timeval now;
-	struct timeval min = { 60, 0 };
-	long this_diff, min_diff;
+	struct itimerspec its;
+	uint64_t next;
+	int servo;
 
-	gettimeofday(&now, NULL);
-	for (i = 0; i < MAX_SERVOS; i++) {
-		if (servo2gpio[i] == DMY || servo_kill_time[i].tv_sec == 0)
-			continue;
-		else if (servo_kill_time[i].tv_sec < now.tv_sec ||
-			(servo_kill_time[i].tv_sec == now.tv_sec &&
-			 servo_kill_time[i].tv_usec <= now.tv_usec)) {
-			servo_kill_time[i].tv_sec = 0;
-			set_servo_idle(i);
-		} else {
-			this_diff = (servo_kill_time[i].tv_sec - now.tv_sec) * 1000000
-				+ servo_kill_time[i].tv_usec - now.tv_usec;
-			min_diff = min.tv_sec * 1000000 + min.tv_usec;
-			if (this_diff < min_diff) {
-				min.tv_sec = this_diff / 1000000;
-				min.tv_usec = this_diff % 1000000;
-			}
-		}
+	while ((servo = deadline_pop_expired(&idle_heap, loop_now)) >= 0) {
+		set_servo_idle(servo);
+		stats.idle_expiries++;
 	}
-	*tv = min;
+	if (deadline_next(&idle_heap, &next) < 0)
+		next = 0;
+	if (next == idle_armed)
+		return;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = next / 1000000000;
+	its.it_value.tv_nsec = next % 1000000000;
+	if (timerfd_settime(idle_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		fatal("servod: timerfd_settime() failed: %m\n");
+	idle_armed = next;
 }
 
 
 static uint32_t
-mem_virt_to_phys(void *virt)
+mem_virt_to_phys(const group_t *g, void *virt)
 {
-	uint32_t offset = (uint8_t *)virt - mbox.virt_addr;
+	uint32_t offset = (uint8_t *)virt - g->mbox.virt_addr;
 
-	return mbox.bus_addr + offset;
+	return g->mbox.bus_addr + offset;
 }
 
 static void *
 map_peripheral(uint32_t base, uint32_t len)
 {
+#ifdef LEDEK_EMULATOR
+	return emu_map_peripheral(base, len);
+#else
 	int fd = open("/dev/mem", O_RDWR|O_SYNC);
 	void * vaddr;
 
@@ -238,11 +411,14 @@ map_peripheral(uint32_t base, uint32_t len)
 	close(fd);
 
 	return vaddr;
+#endif
 }
 
 static void
 set_servo_idle(int servo)
 {
+	group_t *g = GROUP_OF(servo);
+
 	/* Just remove the 'turn-on' action and allow the 'turn-off' action at
 	 * the end of the current pulse to turn it off.  Special case if
 	 * current width is 100%; in that case there will be no 'turn-off'
@@ -250,73 +426,678 @@ set_servo_idle(int servo)
 	 * force the output in other cases, because that might lead to
 	 * truncated pulses which would make a servo change position.
 	 */
-	turnon_mask[servo] = 0;
-	if (servowidth[servo] == num_samples)
+	if (dithering[servo]) {
+		dithering[servo] = 0;
+		num_dithering--;
+	}
+	if (hw_pwm[servo]) {
+		// The PWM block finishes the period it is in first
+		set_hw_pwm(hw_pwm[servo] - 1, 0);
+		shadow_on[servo] = 0;
+		return;
+	}
+	if (g->chain_mode == CHAIN_BCM) {
+		// There is no turn-on to remove, so just go dark from the next cycle
+		bcm_set(&g->bcm, servo2gpio[servo], 0);
+		shadow_on[servo] = 0;
+		return;
+	}
+	g->turnon_mask[servo] = shadow_on[servo] = 0;
+	// Nor may a frame still to be copied in turn it back on
+	if (g->chain_mode == CHAIN_MASK)
+		g->frame_stage[g->num_samples * g->num_banks + servo] = 0;
+	if (flushedwidth[servo] == g->num_samples)
 		gpio_set(servo2gpio[servo], invert ? 1 : 0);
 }
 
-/* Carefully add or remove bits from the turnoff_mask such that regardless
- * of where the DMA controller is in its cycle, and whether we are increasing
- * or decreasing the pulse width, the generated pulse will only ever be the
- * old width or the new width.  If we don't take such care then there could be
- * a cycle with some pulse width between the two requested ones.  That doesn't
- * really matter for servos, but when driving LEDs some odd intensity for one
- * cycle can be noticeable.  It may be that the servo output has been turned
- * off via the inactivity timer, which is handled by always setting the turnon
- * mask appropriately at the end of this function.
+/* Count the first 'n' of a group's update batches as applied, each update
+ * taking the mean time its batch had waited.
  */
 static void
-set_servo(int servo, int width)
+count_applied(group_t *g, int n)
+{
+	uint64_t now = monotonic_ns();
+	apply_batch_t *b;
+
+	for (b = g->apply; b < g->apply + n; b++)
+		metrics_observe(&stats.apply_ns, now - b->sum_since / b->n, b->n);
+	g->num_apply -= n;
+	memmove(g->apply, g->apply + n, g->num_apply * sizeof(*b));
+}
+
+/* Start timing an update to 'g' from the loop_now it came in on.  If every
+ * batch is in use, later updates share the newest one, or failing that the
+ * oldest is counted as applied early to make room.
+ */
+static void
+note_update(group_t *g)
+{
+	apply_batch_t *b = g->apply + g->num_apply - 1;
+
+	if (!g->num_apply || b->flush ||
+			(b->last != loop_now && g->num_apply < APPLY_BATCHES)) {
+		if (g->num_apply == APPLY_BATCHES)
+			count_applied(g, 1);
+		b = g->apply + g->num_apply++;
+		memset(b, 0, sizeof(*b));
+	}
+	b->sum_since += loop_now;
+	b->last = loop_now;
+	b->n++;
+}
+
+// The group's updates not yet in its chain have just been put there
+static void
+note_flushed(group_t *g)
 {
-	volatile uint32_t *dp;
 	int i;
-	uint32_t mask = 1 << servo2gpio[servo];
 
+	g->flush_seq++;
+	for (i = g->num_apply - 1; i >= 0 && !g->apply[i].flush; i--)
+		g->apply[i].flush = g->flush_seq;
+}
+
+// The group's controller has picked up every flush up to 'flush'
+static void
+note_applied(group_t *g, uint64_t flush)
+{
+	int n = 0;
+
+	while (n < g->num_apply && g->apply[n].flush && g->apply[n].flush <= flush)
+		n++;
+	if (n)
+		count_applied(g, n);
+}
+
+/* A relink flush has been picked up once the old CBs it left retiring have
+ * gone, as until then a pulse may still end at its old width.
+ */
+static void
+relink_applied(group_t *g)
+{
+	uint64_t flush = g->flush_seq;
+	int servo;
+
+	for (servo = 0; g->relink.num_retiring && servo < MAX_SERVOS; servo++) {
+		if (g->relink.retiring[servo] && g->retire_flush[servo] <= flush)
+			flush = g->retire_flush[servo] - 1;
+	}
+	note_applied(g, flush);
+}
+
+/* In relink mode a width change moves the servo's turn-off CB instead.  A
+ * servo whose last move is still waiting for its old CB to be retired is
+ * left dirty and tried again on a later pass; go_go_go() keeps polling
+ * while that is the case.
+ */
+static void
+flush_relink(group_t *g)
+{
+	uint64_t deferred = g->relink.deferred;
+	int i, n, servo, width;
+
+	relink_reap(&g->relink);
+	for (i = n = 0; i < g->num_dirty; i++) {
+		servo = g->dirty_list[i];
+		width = servowidth[servo];
+		if (width == 0)
+			g->turnon_mask[servo] = shadow_on[servo] = 0;
+		if (relink_move(&g->relink, servo, width) < 0) {
+			g->dirty_list[n++] = servo;
+			continue;
+		}
+		if (g->relink.deferred != deferred) {
+			g->retire_flush[servo] = g->flush_seq + 1;
+			deferred = g->relink.deferred;
+		}
+		flushedwidth[servo] = width;
+		if (width)
+			g->turnon_mask[servo] = shadow_on[servo] = GPIO_BIT(servo2gpio[servo]);
+		dirty[servo] = 0;
+	}
+	g->num_dirty = n;
+	// Until all the servos have gone in, the updates wait as a whole
+	if (!n)
+		note_flushed(g);
+	relink_applied(g);
+}
+
+// Widths and starts of a group's outputs, packed, returning how many
+static int
+group_phases(const group_t *g, int *width, int *start, int *servo_of)
+{
+	int servo, n = 0;
+
+	for (servo = 0; servo < MAX_SERVOS; servo++) {
+		if (servo2gpio[servo] == DMY || GROUP_OF(servo) != g || hw_pwm[servo])
+			continue;
+		servo_of[n] = servo;
+		width[n] = servowidth[servo];
+		start[n] = servostart[servo];
+		n++;
+	}
+	return n;
+}
+
+/* Move the starts of a sparse group's outputs to wherever phase_alloc()
+ * says they are least likely to be on, and to switch, together.  Only the
+ * sparse layout can do this without a glitch, as the move goes in with the
+ * rebuilt chain and so takes effect for every output at a cycle boundary;
+ * the other layouts have their turn-on CBs laid out for good at startup.
+ * Outputs whose pulses cross the cycle boundary now stay put, as each
+ * chain would only see one end of them.  The new starts are only taken if
+ * they are better than the old, or no worse when 'forced' by the rephase
+ * command, so that outputs don't wander about for nothing.  An allocation
+ * costs O(outputs * samples), so with --rephase it is only tried when a
+ * change has made the peak, or the edges in one step, go up.  When the
+ * old starts are kept that is counted, and said when 'forced'.  Returns
+ * the number of outputs moved.
+ */
+static int
+rephase(group_t *g, int forced)
+{
+	int width[MAX_SERVOS], start[MAX_SERVOS], servo_of[MAX_SERVOS];
+	int i, n, servo, peak, edges, new_peak, new_edges, moved = 0;
+	char fixed[MAX_SERVOS];
+
+	n = group_phases(g, width, start, servo_of);
+	for (i = 0; i < n; i++) {
+		servo = servo_of[i];
+		fixed[i] = flushedwidth[servo] < g->num_samples &&
+				servostart[servo] + flushedwidth[servo] > g->num_samples;
+	}
+	peak = phase_peak(g->num_samples, n, width, start, &edges);
+	if (peak < 0 || (!forced && peak <= g->last_peak && edges <= g->last_edges)) {
+		g->last_peak = peak;
+		g->last_edges = edges;
+		return 0;
+	}
+	new_peak = phase_alloc(g->num_samples, n, width, fixed, start);
+	if (new_peak < 0)
+		return 0;
+	phase_peak(g->num_samples, n, width, start, &new_edges);
+	g->last_peak = peak;
+	g->last_edges = edges;
+	if (new_peak < peak || (new_peak == peak && new_edges < edges) ||
+			(forced && new_peak == peak && new_edges == edges)) {
+		for (i = 0; i < n; i++) {
+			servo = servo_of[i];
+			if (start[i] == servostart[servo])
+				continue;
+			sparse_set_start(&g->sparse, servo, start[i]);
+			servostart[servo] = start[i];
+			moved++;
+		}
+	}
+	if (!moved) {
+		g->rephases_kept++;
+		if (forced)
+			printf("Group %d not rephased, keeping the old starts: peak on at "
+				"once %d, most edges in one step %d, against %d and %d "
+				"with new ones\n", (int)(g - groups), peak, edges,
+				new_peak, new_edges);
+		return 0;
+	}
+	g->last_peak = new_peak;
+	g->last_edges = new_edges;
+	g->rephases++;
+	if (forced)
+		printf("Group %d rephased, %d outputs moved: peak on at once %d -> %d, "
+			"most edges in one step %d -> %d\n", (int)(g - groups), moved,
+			peak, new_peak, edges, new_edges);
+	return moved;
+}
+
+// Set the turn-on words held back until the chain the group queued runs
+static void
+sparse_turn_on(group_t *g)
+{
+	int servo;
+
+	for (servo = 0; servo < MAX_SERVOS; servo++) {
+		if (sparse_turnon[servo] && GROUP_OF(servo) == g) {
+			g->turnon_mask[servo] = shadow_on[servo] = GPIO_BIT(servo2gpio[servo]);
+			sparse_turnon[servo] = 0;
+		}
+	}
+}
+
+/* In sparse mode all the changes made in a pass go into one rebuild of the
+ * spare chain, which the DMA controller moves on to at the end of its
+ * current cycle.  Until it has, later changes wait, as with relink.  An
+ * output leaving width 0 has no turn-off CB in the old chain, so its
+ * turn-on word is only set once the new chain is running.
+ */
+static void
+flush_sparse(group_t *g)
+{
+	int i, servo, moved = 0;
+
+	if (g->sparse.pending) {
+		if (!sparse_switched(&g->sparse))
+			return;
+		sparse_turn_on(g);
+		note_applied(g, g->flush_seq);
+	}
+	if (g->rephase_wanted || (auto_rephase && g->num_dirty))
+		moved = rephase(g, g->rephase_wanted);
+	g->rephase_wanted = 0;
+	if ((!g->num_dirty && !moved) || sparse_update(&g->sparse, servowidth) < 0)
+		return;
+	note_flushed(g);
+	for (i = 0; i < g->num_dirty; i++) {
+		servo = g->dirty_list[i];
+		flushedwidth[servo] = servowidth[servo];
+		if (servowidth[servo])
+			sparse_turnon[servo] = 1;
+		else
+			g->turnon_mask[servo] = shadow_on[servo] = 0;
+		dirty[servo] = 0;
+	}
+	g->num_dirty = 0;
+}
 
-	if (width > servowidth[servo]) {
-		dp = turnoff_mask + servostart[servo] + width;
-		if (dp >= turnoff_mask + num_samples)
-			dp -= num_samples;
+/* In BCM mode a width is a brightness, which goes into the bit-planes.
+ * All the changes made in a pass are handed over together, and if the
+ * controller hasn't picked up the last lot yet, go_go_go() polls until it
+ * has.
+ */
+static void
+flush_bcm(group_t *g)
+{
+	int i, servo;
+
+	// Before bcm_flush() hands over more, and so loses track of the last lot
+	if (bcm_taken(&g->bcm))
+		note_applied(g, g->flush_seq);
+	for (i = 0; i < g->num_dirty; i++) {
+		servo = g->dirty_list[i];
+		bcm_set(&g->bcm, servo2gpio[servo], servowidth[servo]);
+		flushedwidth[servo] = servowidth[servo];
+		shadow_on[servo] = servowidth[servo] ? GPIO_BIT(servo2gpio[servo]) : 0;
+		dirty[servo] = 0;
+	}
+	g->num_dirty = 0;
+	if (bcm_flush(&g->bcm) == 0)
+		note_flushed(g);
+	if (bcm_taken(&g->bcm))
+		note_applied(g, g->flush_seq);
+}
 
-		for (i = width; i > servowidth[servo]; i--) {
-			dp--;
-			if (dp < turnoff_mask)
-				dp = turnoff_mask + num_samples - 1;
-			//printf("%5d, clearing at %p\n", dp - ctl->turnoff, dp);
-			*dp &= ~mask;
+/* In mask mode a frame can't be written into turnoff_mask in place, as
+ * the controller would run part of a cycle from the old table and part
+ * from the new.  Instead the dirty servos' changes go into the shadow
+ * copies as usual, the words that changed are staged in frame_stage, and
+ * the loop back at the end of the chain is pointed at the frame CBs:
+ *
+ *     ... delay(n-1) -> copy off words, a CB per run -> copy on words ->
+ *         unhook -> cb_base
+ *
+ * The controller copies the staged words across between one cycle and the
+ * next, then the unhook CB points the loop back at cb_base again, which
+ * is how we know it has been done.  With a CB per run of changed words, up
+ * to FRAME_SPANS of them, the copy is as long as the widths moved rather
+ * than the stretch of table between the first change and the last.  It
+ * still holds the chain up: edges just after the boundary go out late by
+ * as long as it takes, and once that is more than the PWM or PCM FIFO
+ * covers, the whole cycle runs long by the difference.  On the emulator at
+ * a 2us step, a frame moving all eight servos between 500us and 2500us
+ * copies 8000 words and the cycle after it runs 482us long, as does a
+ * pulse ending at the boundary; moving two servos a step costs about 1us.
+ *
+ * A pulse that crossed the end of the cycle under the old width, and no
+ * longer does, would be cut off at the start of the new cycle; its
+ * turn-offs there are held back and go in with the next frame, which
+ * flush_group() stages as soon as this one has been copied in.  Until
+ * then, as with relink and sparse, later changes wait.
+ */
+static void
+stage_frame(group_t *g)
+{
+	int i, j, n, end, servo, bank, held, first = 0;
+	int words = g->num_samples * g->num_banks;
+	int lo = g->hold_lo, hi = g->hold_hi, on_lo = MAX_SERVOS, on_hi = -1;
+	uint32_t mask, on, changed, *bits, *stage_on = g->frame_stage + words;
+	dma_cb_t *cbp = g->frame_cbs, *oncb = cbp + FRAME_SPANS;
+
+	// Turn-offs held back last time have had the cycle they were waiting for
+	for (i = lo; i <= hi; i++) {
+		g->frame_set[i] |= g->frame_hold[i];
+		g->frame_hold[i] = 0;
+	}
+	g->hold_lo = words;
+	g->hold_hi = -1;
+	g->frame_wanted = 0;
+
+	for (n = 0; n < g->num_dirty; n++) {
+		servo = g->dirty_list[n];
+		mask = GPIO_BIT(servo2gpio[servo]);
+		bank = GPIO_BANK(servo2gpio[servo]);
+		held = servostart[servo] + flushedwidth[servo] > g->num_samples &&
+				servostart[servo] + servowidth[servo] <= g->num_samples;
+		if (servowidth[servo] > flushedwidth[servo]) {
+			i = flushedwidth[servo];
+			end = servowidth[servo];
+			bits = g->frame_clr;
+		} else {
+			i = servowidth[servo];
+			end = flushedwidth[servo];
+			bits = g->frame_set;
+		}
+		for (i += servostart[servo], end += servostart[servo]; i < end; i++) {
+			if (i < g->num_samples) {
+				j = i * g->num_banks + bank;
+				bits[j] |= mask;
+			} else {
+				j = (i - g->num_samples) * g->num_banks + bank;
+				(held ? g->frame_hold : bits)[j] |= mask;
+				if (held && j < g->hold_lo)
+					g->hold_lo = j;
+				if (held && j > g->hold_hi)
+					g->hold_hi = j;
+			}
+			if (j < lo)
+				lo = j;
+			if (j > hi)
+				hi = j;
+		}
+		flushedwidth[servo] = servowidth[servo];
+		on = servowidth[servo] ? mask : 0;
+		if (on != shadow_on[servo]) {
+			shadow_on[servo] = on;
+			if (servo < on_lo)
+				on_lo = servo;
+			if (servo > on_hi)
+				on_hi = servo;
+		}
+		dirty[servo] = 0;
+	}
+	g->num_dirty = 0;
+
+	// A CB per run of words that changed, with short gaps copied over
+	for (i = lo, n = 0, end = -1; i <= hi; i++) {
+		changed = (g->frame_set[i] & ~g->frame_hold[i]) |
+				g->frame_clr[i];
+		g->shadow_off[i] = (g->shadow_off[i] | g->frame_set[i] |
+				g->frame_hold[i]) & ~g->frame_clr[i];
+		g->frame_stage[i] = g->shadow_off[i] & ~g->frame_hold[i];
+		g->frame_set[i] = g->frame_clr[i] = 0;
+		if (!changed)
+			continue;
+		if (n == 0 || (i - end > FRAME_GAP && n < FRAME_SPANS)) {
+			cbp[n].src = mem_virt_to_phys(g, g->frame_stage + i);
+			cbp[n].dst = mem_virt_to_phys(g, g->turnoff_mask + i);
+			cbp[n].next = mem_virt_to_phys(g, cbp + n + 1);
+			first = i;
+			n++;
 		}
-	} else if (width < servowidth[servo]) {
-		dp = turnoff_mask + servostart[servo] + width;
-		if (dp >= turnoff_mask + num_samples)
-			dp -= num_samples;
+		cbp[n - 1].length = (i - first + 1) * sizeof(uint32_t);
+		end = i;
+	}
+	for (servo = on_lo; servo <= on_hi; servo++)
+		stage_on[servo] = shadow_on[servo];
+	if (n == 0 && on_hi < 0)
+		return;
+
+	for (i = 0; i < n; i++)
+		g->mask_words_written += cbp[i].length / sizeof(uint32_t);
+	if (n)
+		cbp[n - 1].next = mem_virt_to_phys(g,
+				on_hi < 0 ? oncb + 1 : oncb);
+	oncb->src = mem_virt_to_phys(g, stage_on + on_lo);
+	oncb->dst = mem_virt_to_phys(g, g->turnon_mask + on_lo);
+	oncb->length = (on_hi - on_lo + 1) * sizeof(uint32_t);
+	BARRIER();
+	g->cb_last->next = mem_virt_to_phys(g, n ? cbp : oncb);
+	g->frame_pending = 1;
+}
+
+/* turnoff_mask and turnon_mask are uncached, so every read of them is a
+ * bus round trip.  Instead all changes are made to cached shadow copies
+ * first and only the words that changed are copied across, with writes
+ * alone, by flush_masks() at the end of each pass of the event loop.  As a
+ * servo is only flushed once per pass, however many times it was set, a
+ * client streaming updates costs at most one table update per wakeup.
+ *
+ * Each servo is flushed carefully, such that regardless of where the DMA
+ * controller is in its cycle, and whether we are increasing or decreasing
+ * the pulse width, the generated pulse will only ever be the old width or
+ * the new width.  If we don't take such care then there could be a cycle
+ * with some pulse width between the two.  That doesn't really matter for
+ * servos, but when driving LEDs some odd intensity for one cycle can be
+ * noticeable.  It may be that the servo output has been turned off via the
+ * inactivity timer, which is handled by always setting the turnon mask
+ * appropriately when flushing.
+ */
+static void
+flush_group(group_t *g)
+{
+	int i, servo;
+	uint32_t mask;
 
-		for (i = width; i < servowidth[servo]; i++) {
-			//printf("%5d, setting at %p\n", dp - ctl->turnoff, dp);
-			*dp++ |= mask;
-			if (dp >= turnoff_mask + num_samples)
-				dp = turnoff_mask;
+	if (g->chain_mode == CHAIN_RELINK) {
+		flush_relink(g);
+		return;
+	} else if (g->chain_mode == CHAIN_SPARSE) {
+		flush_sparse(g);
+		return;
+	} else if (g->chain_mode == CHAIN_BCM) {
+		flush_bcm(g);
+		return;
+	}
+	if (g->frame_pending) {
+		if (g->cb_last->next != mem_virt_to_phys(g, g->cb_base))
+			return;
+		g->frame_pending = 0;
+		note_applied(g, g->flush_seq);
+	}
+	if (g->frame_wanted || g->hold_hi >= 0) {
+		stage_frame(g);
+		note_flushed(g);
+		if (!g->frame_pending)
+			note_applied(g, g->flush_seq);
+		return;
+	}
+	for (i = 0; i < g->num_dirty; i++) {
+		servo = g->dirty_list[i];
+		mask = GPIO_BIT(servo2gpio[servo]);
+		if (g->num_banks == 1) {
+			mask_change_width(g->shadow_off, g->num_samples, servostart[servo],
+					flushedwidth[servo], servowidth[servo], mask);
+			g->mask_words_written += mask_flush_width(g->turnoff_mask,
+					g->shadow_off, g->num_samples, servostart[servo],
+					flushedwidth[servo], servowidth[servo]);
+		} else {
+			mask_change_width_banked(g->shadow_off, g->num_samples,
+					servostart[servo], flushedwidth[servo],
+					servowidth[servo], GPIO_BANK(servo2gpio[servo]), mask);
+			g->mask_words_written += mask_flush_width(g->turnoff_mask,
+					g->shadow_off, g->num_samples * 2, servostart[servo] * 2,
+					flushedwidth[servo] * 2, servowidth[servo] * 2);
 		}
+		flushedwidth[servo] = servowidth[servo];
+		shadow_on[servo] = servowidth[servo] ? mask : 0;
+		g->turnon_mask[servo] = shadow_on[servo];
+		dirty[servo] = 0;
+	}
+	g->num_dirty = 0;
+	note_flushed(g);
+	note_applied(g, g->flush_seq);
+}
+
+void
+flush_masks(void)
+{
+	int i;
+
+	// A controller being restarted picks changes up once it is going again
+	for (i = 0; i < num_groups; i++) {
+		if (!watched[i].restarting)
+			flush_group(groups + i);
+	}
+	if (strip_pixels && !strip_held && !watched[num_groups].restarting)
+		strip_flush(&strip);
+}
+
+// Whether any group, or the strip, has changes still waiting to go out
+static int
+flush_pending(void)
+{
+	group_t *g;
+
+	for (g = groups; g < groups + num_groups; g++) {
+		if (g->num_dirty || g->relink.num_retiring || g->sparse.pending ||
+				g->bcm.changed || g->rephase_wanted ||
+				g->frame_pending || g->hold_hi >= 0 || g->num_apply)
+			return 1;
+	}
+	return strip_pixels && strip.changed && !strip_held;
+}
+
+/* Outputs given to the PWM block by --hw-pwm aren't in any chain; a change
+ * is one register write, which the block takes up at the start of its
+ * next period.  The duty cycle has the resolution of the PWM clock rather
+ * than of a step, so a width with a fraction goes out as it is instead of
+ * being dithered.
+ */
+static void
+set_hw_width(int servo, int width)
+{
+	const group_t *g = GROUP_OF(servo);
+	uint64_t fine = (uint64_t)width << dither_bits;
+
+	if (dither_bits && finewidth[servo] >> dither_bits == width)
+		fine = finewidth[servo];
+	set_hw_pwm(hw_pwm[servo] - 1,
+			fine * g->step_time_us * HWPWM_CLOCK_MHZ >> dither_bits);
+	servowidth[servo] = flushedwidth[servo] = width;
+	// Kept as for a chain output, though no turnon_mask word goes with it
+	shadow_on[servo] = width ? GPIO_BIT(servo2gpio[servo]) : 0;
+}
+
+// As set_servo(), but leaving the idle timeout alone
+static void
+set_width(int servo, int width)
+{
+	group_t *g = GROUP_OF(servo);
+
+	if (hw_pwm[servo]) {
+		set_hw_width(servo, width);
+		return;
 	}
+	g->mask_updates++;
+	g->mask_words_changed += abs(width - servowidth[servo]);
 	servowidth[servo] = width;
-	if (width == 0) {
-		turnon_mask[servo] = 0;
-	} else {
-		turnon_mask[servo] = mask;
+	if (!dirty[servo]) {
+		dirty[servo] = 1;
+		g->dirty_list[g->num_dirty++] = servo;
 	}
+}
+
+void
+set_servo(int servo, int width)
+{
+	set_width(servo, width);
 	update_idle_time(servo);
+	stats.set_servo++;
+	// The PWM block takes a width straight away
+	if (hw_pwm[servo])
+		metrics_observe(&stats.apply_ns, monotonic_ns() - loop_now, 1);
+	else
+		note_update(GROUP_OF(servo));
+}
+
+// Which sample the group's DMA controller is working on, or 0 if stopped
+static int
+dma_sample_pos(const group_t *g)
+{
+	uint32_t off = g->dma_reg[DMA_CONBLK_AD] - mem_virt_to_phys(g, g->cb_base);
+
+	if (off >= g->num_cbs * sizeof(dma_cb_t))
+		return 0;
+	return g->cb_sample[off / sizeof(dma_cb_t)];
+}
+
+/* Apply new widths to several servos of one group at once; widths[] holds
+ * -1 for servos that are to be left alone, and servos in other groups are
+ * skipped.  In mask mode the changes are staged and copied in between two
+ * cycles, see stage_frame(), so every servo in the frame changes on the
+ * same cycle, and each pulse is either the old width or the new one.
+ * This doesn't touch the idle timeouts; set_servo_frame() does.
+ */
+static void
+write_group_frame(group_t *g, const int *widths)
+{
+	int servo;
+
+	/* Moving CBs one at a time can't be made to land in the same cycle,
+	 * so in relink mode a frame is just a run of single updates.  In
+	 * sparse and BCM modes those updates all go into the same chain
+	 * rebuild or plane update, so they land together anyway.  Outputs on
+	 * the PWM block go straight out, and the chain goes without.
+	 */
+	for (servo = 0; servo < MAX_SERVOS; servo++) {
+		if (widths[servo] >= 0 && GROUP_OF(servo) == g)
+			set_width(servo, widths[servo]);
+	}
+	if (g->chain_mode == CHAIN_MASK)
+		g->frame_wanted = 1;
+	flush_group(g);
+}
+
+/* Groups run on separate controllers with their own cycles, so a frame
+ * covering several groups lands in the same cycle within each group, but
+ * not across them.
+ */
+static void
+write_frame(const int *widths)
+{
+	int i;
+
+	for (i = 0; i < num_groups; i++)
+		write_group_frame(groups + i, widths);
+}
+
+static void
+set_servo_frame(const int *widths)
+{
+	char chained[MAX_GROUPS] = { 0 };
+	int servo, i, n = 0;
+
+	// Timed as an update to each group whose chain it goes into
+	for (servo = 0; servo < MAX_SERVOS; servo++) {
+		if (widths[servo] >= 0 && !hw_pwm[servo])
+			chained[servo_group[servo]] = 1;
+	}
+	for (i = 0; i < num_groups; i++) {
+		if (chained[i]) {
+			note_update(groups + i);
+			n++;
+		}
+	}
+	if (!n)
+		metrics_observe(&stats.apply_ns, monotonic_ns() - loop_now, 1);
+	write_frame(widths);
+	for (servo = 0; servo < MAX_SERVOS; servo++) {
+		if (widths[servo] >= 0)
+			update_idle_time(servo);
+	}
+	stats.frames++;
 }
 
 
 
 static void
-init_ctrl_data(void)
+init_ctrl_data(group_t *g)
 {
-	dma_cb_t *cbp = cb_base;
+	dma_cb_t *cbp = g->cb_base;
 	uint32_t phys_fifo_addr, cbinfo;
 	uint32_t phys_gpclr0;
 	uint32_t phys_gpset0;
 	int servo, i, numservos = 0, curstart = 0;
-	uint32_t maskall = 0;
+	uint64_t maskall = 0;
+	uint32_t bits[MAX_SERVOS];
+	uint8_t bank[MAX_SERVOS];
 
 	if (invert) {
 		phys_gpclr0 = GPIO_PHYS_BASE + 0x1c;
@@ -326,7 +1107,7 @@ init_ctrl_data(void)
 		phys_gpset0 = GPIO_PHYS_BASE + 0x1c;
 	}
 
-	if (delay_hw == DELAY_VIA_PWM) {
+	if (g->delay_hw == DELAY_VIA_PWM) {
 		phys_fifo_addr = PWM_PHYS_BASE + 0x18;
 		cbinfo = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP | DMA_D_DREQ | DMA_PER_MAP(5);
 	} else {
@@ -334,70 +1115,174 @@ init_ctrl_data(void)
 		cbinfo = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP | DMA_D_DREQ | DMA_PER_MAP(2);
 	}
 
-	memset(turnon_mask, 0, MAX_SERVOS * sizeof(*turnon_mask));
-
 	for (servo = 0 ; servo < MAX_SERVOS; servo++) {
-		servowidth[servo] = 0;
-		if (servo2gpio[servo] != DMY) {
+		bits[servo] = bank[servo] = 0;
+		if (servo2gpio[servo] != DMY && GROUP_OF(servo) == g && !hw_pwm[servo]) {
+			servowidth[servo] = flushedwidth[servo] = 0;
+			shadow_on[servo] = 0;
 			numservos++;
-			maskall |= 1 << servo2gpio[servo];
+			maskall |= 1ULL << servo2gpio[servo];
+			bits[servo] = GPIO_BIT(servo2gpio[servo]);
+			bank[servo] = GPIO_BANK(servo2gpio[servo]);
+			servostart[servo] = curstart;
+			curstart += g->num_samples / g->num_servos;
 		}
 	}
+	g->hold_lo = g->num_samples * g->num_banks;
+	g->hold_hi = -1;
+
+	if (g->chain_mode == CHAIN_RELINK) {
+		relink_init(&g->relink, g->mbox.virt_addr,
+				mem_virt_to_phys(g, g->mbox.virt_addr), g->num_samples,
+				servostart, bits, bank, phys_gpclr0, phys_gpset0,
+				phys_fifo_addr, cbinfo, g->dma_reg);
+		g->turnon_mask = g->relink.turnon;
+		g->cb_base = g->relink.entry;
+		return;
+	} else if (g->chain_mode == CHAIN_SPARSE) {
+		if (sparse_init(&g->sparse, g->mbox.virt_addr,
+				mem_virt_to_phys(g, g->mbox.virt_addr), g->num_samples,
+				servostart, bits, bank, phys_gpclr0, phys_gpset0,
+				phys_fifo_addr, cbinfo, g->dma_reg) < 0)
+			fatal("servod: calloc() failed\n");
+		g->turnon_mask = g->sparse.turnon;
+		g->cb_base = sparse_entry(&g->sparse);
+		return;
+	} else if (g->chain_mode == CHAIN_BCM) {
+		bcm_init(&g->bcm, g->mbox.virt_addr, mem_virt_to_phys(g, g->mbox.virt_addr),
+				g->bcm_bits, maskall, phys_gpclr0, phys_gpset0,
+				phys_fifo_addr, cbinfo, g->dma_reg);
+		g->cb_base = g->bcm.cbs;
+		return;
+	}
 
-	for (i = 0; i < num_samples; i++)
-		turnoff_mask[i] = maskall;
+	g->cb_sample = calloc(g->num_cbs, sizeof(*g->cb_sample));
+	g->frame_set = calloc(g->num_samples * g->num_banks, sizeof(*g->frame_set));
+	g->frame_clr = calloc(g->num_samples * g->num_banks, sizeof(*g->frame_clr));
+	g->frame_hold = calloc(g->num_samples * g->num_banks, sizeof(*g->frame_hold));
+	if (!g->cb_sample || !g->frame_set || !g->frame_clr || !g->frame_hold)
+		fatal("servod: calloc() failed\n");
+	// Same alignment as turnoff_mask, so both line up for the vector copies
+	if (posix_memalign((void **)&g->shadow_off, PAGE_SIZE,
+			g->num_samples * g->num_banks * sizeof(*g->shadow_off)))
+		fatal("servod: posix_memalign() failed\n");
 
-	for (servo = 0; servo < MAX_SERVOS; servo++) {
-		if (servo2gpio[servo] != DMY) {
-			servostart[servo] = curstart;
-			curstart += num_samples / num_servos;
-		}
-	}
+	memset(g->turnon_mask, 0, MAX_SERVOS * sizeof(*g->turnon_mask));
+	if (g->capture_slots)
+		memset(g->capture_slots, 0, g->num_samples * sizeof(*g->capture_slots));
+	for (i = 0; i < g->num_samples * g->num_banks; i++)
+		g->turnoff_mask[i] = g->shadow_off[i] = maskall >> (i % g->num_banks * 32);
 
 	servo = 0;
-	while (servo < MAX_SERVOS && servo2gpio[servo] == DMY)
+	while (servo < MAX_SERVOS && !bits[servo])
 		servo++;
 
-	for (i = 0; i < num_samples; i++) {
+	/* With bank 1 in use each turn-off CB clears both banks, GPCLR0 and
+	 * GPCLR1 being next to each other; otherwise it is just as it was.
+	 */
+	for (i = 0; i < g->num_samples; i++) {
 		cbp->info = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP;
-		cbp->src = mem_virt_to_phys(turnoff_mask + i);
+		if (g->num_banks > 1)
+			cbp->info |= DMA_SRC_INC | DMA_DEST_INC;
+		cbp->src = mem_virt_to_phys(g, g->turnoff_mask + i * g->num_banks);
 		cbp->dst = phys_gpclr0;
-		cbp->length = 4;
+		cbp->length = 4 * g->num_banks;
 		cbp->stride = 0;
-		cbp->next = mem_virt_to_phys(cbp + 1);
+		cbp->next = mem_virt_to_phys(g, cbp + 1);
+		g->cb_sample[cbp - g->cb_base] = i;
 		cbp++;
-		if (i == servostart[servo]) {
+		if (servo < MAX_SERVOS && i == servostart[servo]) {
 			cbp->info = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP;
-			cbp->src = mem_virt_to_phys(turnon_mask + servo);
-			cbp->dst = phys_gpset0;
+			cbp->src = mem_virt_to_phys(g, g->turnon_mask + servo);
+			cbp->dst = phys_gpset0 + bank[servo] * 4;
 			cbp->length = 4;
 			cbp->stride = 0;
-			cbp->next = mem_virt_to_phys(cbp + 1);
+			cbp->next = mem_virt_to_phys(g, cbp + 1);
+			g->cb_sample[cbp - g->cb_base] = i;
 			cbp++;
 			servo++;
-			while (servo < MAX_SERVOS && servo2gpio[servo] == DMY)
+			while (servo < MAX_SERVOS && !bits[servo])
 				servo++;
 		}
+		if (g->capture_slots) {
+			// The levels the step leaves the outputs at, then the time
+			cbp->info = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP;
+			cbp->src = GPIO_PHYS_BASE + GPIO_LEV0 * 4;
+			cbp->dst = mem_virt_to_phys(g, &g->capture_slots[i].levels);
+			cbp->length = 4;
+			cbp->stride = 0;
+			cbp->next = mem_virt_to_phys(g, cbp + 1);
+			g->cb_sample[cbp - g->cb_base] = i;
+			cbp++;
+			cbp->info = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP;
+			cbp->src = ST_PHYS_BASE + ST_CLO * 4;
+			cbp->dst = mem_virt_to_phys(g, &g->capture_slots[i].stamp);
+			cbp->length = 4;
+			cbp->stride = 0;
+			cbp->next = mem_virt_to_phys(g, cbp + 1);
+			g->cb_sample[cbp - g->cb_base] = i;
+			cbp++;
+		}
 		// Delay
 		cbp->info = cbinfo;
-		cbp->src = mem_virt_to_phys(turnoff_mask);	// Any data will do
+		cbp->src = mem_virt_to_phys(g, g->turnoff_mask);	// Any data will do
 		cbp->dst = phys_fifo_addr;
 		cbp->length = 4;
 		cbp->stride = 0;
-		cbp->next = mem_virt_to_phys(cbp + 1);
+		cbp->next = mem_virt_to_phys(g, cbp + 1);
+		g->cb_sample[cbp - g->cb_base] = i;
 		cbp++;
 	}
 	cbp--;
-	cbp->next = mem_virt_to_phys(cb_base);
+	cbp->next = mem_virt_to_phys(g, g->cb_base);
+	g->cb_last = cbp;
+
+	/* The frame CBs, see stage_frame(), which fills in what the copies
+	 * cover.  The unhook CB copies the loop back's usual next, kept after
+	 * the staged words, into the loop back.
+	 */
+	cbp = g->frame_cbs;
+	for (i = 0; i < FRAME_CBS; i++) {
+		cbp[i].info = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP | DMA_SRC_INC | DMA_DEST_INC;
+		cbp[i].stride = 0;
+		cbp[i].next = mem_virt_to_phys(g, cbp + i + 1);
+	}
+	i = g->num_samples * g->num_banks + MAX_SERVOS;
+	g->frame_stage[i] = mem_virt_to_phys(g, g->cb_base);
+	cbp += FRAME_CBS - 1;
+	cbp->info = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP;
+	cbp->src = mem_virt_to_phys(g, g->frame_stage + i);
+	cbp->dst = mem_virt_to_phys(g, &g->cb_last->next);
+	cbp->length = sizeof(uint32_t);
+	cbp->next = mem_virt_to_phys(g, g->cb_base);
 }
 
+/* Whether a controller is moving, given time to send a FIFO word or two.
+ * A sparse chain can stay on one delay CB for many steps, but the
+ * remaining length counts down as it goes.
+ */
+static int
+dma_running(volatile uint32_t *dma_reg, int word_us)
+{
+	uint32_t last, len;
+
+	last = dma_reg[DMA_CONBLK_AD];
+	len = dma_reg[DMA_TXFR_LEN];
+	udelay(word_us*2);
+	return dma_reg[DMA_CONBLK_AD] != last || dma_reg[DMA_TXFR_LEN] != len;
+}
+
+/* "status <file>" writes "OK" or an error to the named file, which is the
+ * only way of getting an answer back through the fifo.  It is "OK" if every
+ * group's controller, and the strip's, is running.  Socket clients get the
+ * same answer as their reply, and may leave the file name off.
+ */
 static void
-do_status(char *filename)
+do_status(client_t *c, char *filename)
 {
-	uint32_t last;
 	int status = -1;
 	char *p;
-	int fd;
+	int fd, i;
 	const char *dma_dead = "ERROR: DMA not running\n";
 
 	while (*filename == ' ')
@@ -406,174 +1291,1342 @@ do_status(char *filename)
 	while (p > filename && (*p == '\n' || *p == '\r' || *p == ' '))
 		*p-- = '\0';
 
-	last = dma_reg[DMA_CONBLK_AD];
-	udelay(step_time_us*2);
-	if (dma_reg[DMA_CONBLK_AD] != last)
+	for (i = 0; i < num_groups; i++) {
+		if (!dma_running(groups[i].dma_reg, groups[i].step_time_us))
+			break;
+	}
+	if (i == num_groups && (!strip_pixels ||
+			dma_running(strip_dma_reg, 32 * 1000000 / STRIP_BIT_HZ + 1)))
 		status = 0;
+	client_reply(c, "%s", status == 0 ? "OK\n" : dma_dead);
+	if (!*filename)
+		return;
 	if ((fd = open(filename, O_WRONLY|O_CREAT, 0666)) >= 0) {
 		if (status == 0)
 			write(fd, "OK\n", 3);
 		else
 			write(fd, dma_dead, strlen(dma_dead));
 		close(fd);
+	} else if (c->replies) {
+		client_error(c, "Failed to open %s for writing: %m\n", filename);
 	} else {
 		printf("Failed to open %s for writing: %m\n", filename);
 	}
 }
 
-static void
-do_debug(void)
+// Bus address of the CB the strip's controller should be started on
+static uint32_t
+strip_entry_bus(void)
 {
-	int i;
-	uint32_t mask = 0;
-	uint32_t last;
+	return strip_mbox.bus_addr + ((uint8_t *)strip_entry(&strip) - strip_mbox.virt_addr);
+}
 
-	last = dma_reg[DMA_CONBLK_AD];
-	udelay(step_time_us*2);
-	printf("%08x %08x\n", last, dma_reg[DMA_CONBLK_AD]);
+// First CB of the group's chain, which for --sparse moves with each switch
+static dma_cb_t *
+group_entry(const group_t *g)
+{
+	return g->chain_mode == CHAIN_SPARSE ? sparse_entry(&g->sparse) : g->cb_base;
+}
+
+// Group number of a watched controller, or "strip"
+static const char *
+watch_name(const watch_t *w)
+{
+	static const char *names[MAX_GROUPS] = { "0", "1" };
+
+	return w - watched < num_groups ? names[w - watched] : "strip";
+}
+
+static void
+init_watchdog(void)
+{
+	group_t *g;
+	watch_t *w = watched;
+
+	for (g = groups; g < groups + num_groups; g++, w++) {
+		w->dma_reg = g->dma_reg;
+		w->dma_chan = g->dma_chan;
+		w->word_us = g->step_time_us;
+	}
+	if (strip_pixels) {
+		w->dma_reg = strip_dma_reg;
+		w->dma_chan = strip_dma_chan;
+		w->word_us = 32 * 1000000 / STRIP_BIT_HZ + 1;
+		w++;
+	}
+	num_watched = w - watched;
+}
+
+static void
+arm_timer(int fd, uint64_t us)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = us / 1000000;
+	its.it_value.tv_nsec = us % 1000000 * 1000;
+	if (timerfd_settime(fd, 0, &its, NULL) < 0)
+		fatal("servod: timerfd_settime() failed: %m\n");
+}
+
+/* Bring a stopped mask chain's tables up to date by doing what the frame
+ * CBs would have at the end of the cycle, if it had got there.
+ */
+static void
+finish_frame(group_t *g)
+{
+	uint32_t addr = g->cb_last->next, base = mem_virt_to_phys(g, g->cb_base);
+	uint32_t end = mem_virt_to_phys(g, g->frame_cbs + FRAME_CBS - 1);
+	dma_cb_t *cbp;
+
+	while (addr != base && addr != end) {
+		cbp = (dma_cb_t *)(g->mbox.virt_addr + (addr - g->mbox.bus_addr));
+		memcpy(g->mbox.virt_addr + (cbp->dst - g->mbox.bus_addr),
+				g->mbox.virt_addr + (cbp->src - g->mbox.bus_addr), cbp->length);
+		addr = cbp->next;
+	}
+	BARRIER();
+	g->cb_last->next = base;
+	g->frame_pending = 0;
+}
+
+/* A controller that is to be started again at the top of its chain can't
+ * be relied on to finish anything it was part way through, so with it
+ * stopped, whatever its group was waiting on it for is done here: a queued
+ * sparse chain becomes the live one, relink's retiring CBs are unlinked,
+ * and a staged frame is copied in.  The chain then matches the shadow
+ * tables, and group_entry() is where it starts.  BCM and the strip take
+ * a queued copy as live as soon as it is queued, so need nothing done.
+ */
+static void
+settle_chain(group_t *g)
+{
+	if (g->chain_mode == CHAIN_SPARSE && g->sparse.pending) {
+		sparse_finish(&g->sparse);
+		sparse_turn_on(g);
+	} else if (g->chain_mode == CHAIN_RELINK) {
+		relink_retire_all(&g->relink);
+	} else if (g->chain_mode == CHAIN_MASK && g->frame_pending) {
+		finish_frame(g);
+	}
+	note_applied(g, g->flush_seq);
+}
+
+/* Make the next of a restart's setup writes, and once they are all done
+ * take the controller's position from there, so that one which goes
+ * nowhere is then seen as stalled again.
+ */
+static void
+restart_step(watch_t *w)
+{
+	uint64_t expirations;
+	int us;
+
+	read(w->restart_fd, &expirations, sizeof(expirations));
+	if ((us = hw_setup_step(&w->setup)) >= 0) {
+		arm_timer(w->restart_fd, us);
+		return;
+	}
+	w->restarting = 0;
+	w->last_cb = w->dma_reg[DMA_CONBLK_AD];
+	w->last_len = w->dma_reg[DMA_TXFR_LEN];
+	w->suspect = 0;
+}
+
+/* Stop the controller and start it again at the top of its chain, with its
+ * pacing set up afresh in case that is what went wrong.  The widths are all
+ * in the chain's memory already, so they carry on as they were, though the
+ * outputs may see one short or long pulse as the cycle starts over.  PWM
+ * and PCM want up to 100us between setup writes, about a millisecond in
+ * all, so rather than wait in udelay() the writes are made a step at a
+ * time each time restart_fd expires, by restart_step().  Until the
+ * controller is going again, changes to its outputs wait in the shadow
+ * tables.
+ */
+static void
+restart_dma(watch_t *w)
+{
+	group_t *g;
+
+	w->dma_reg[DMA_CS] = DMA_RESET;
+	if (w - watched < num_groups) {
+		g = groups + (w - watched);
+		settle_chain(g);
+		hw_setup_delay(&w->setup, g->delay_hw, g->step_time_us, g->dma_reg,
+				mem_virt_to_phys(g, group_entry(g)));
+	} else {
+		hw_setup_strip(&w->setup, strip_dma_reg, strip_entry_bus());
+	}
+	w->restarting = 1;
+	arm_timer(w->restart_fd, 1);
+}
+
+static void
+recover_dma(watch_t *w, int reason, uint32_t cs, uint32_t debug, uint32_t cb)
+{
+	wd_event_t *e = wd_events + wd_num_events++ % WATCHDOG_EVENTS;
+	char when[32];
+	struct tm tm;
+
+	clock_gettime(CLOCK_REALTIME, &e->when);
+	e->watch = w - watched;
+	e->reason = reason;
+	e->cs = cs;
+	e->debug = debug;
+	e->cb = cb;
+	e->in_a_row = ++w->in_a_row;
+	w->recoveries[reason]++;
+	w->last_recovery = e->when;
+
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&e->when.tv_sec, &tm));
+	fprintf(stderr, "%s servod: DMA channel %d (%s%s) %s at CB 0x%08x, CS 0x%08x, "
+			"DEBUG 0x%x; restarting, %d in a row\n", when, w->dma_chan,
+			e->watch < num_groups ? "group " : "", watch_name(w),
+			wd_reasons[reason], cb, cs, debug, e->in_a_row);
+	restart_dma(w);
+}
+
+/* Look at each controller without waiting on it.  One that has an error
+ * bit set or has stopped is restarted there and then.  One that is on the
+ * same word of the same CB as at the last check is only suspect, as the
+ * checks may have lined up with its cycle; it is looked at again a couple
+ * of words later, and restarted if it still hasn't moved.
+ */
+static void
+check_dma(void)
+{
+	uint32_t cs, debug, cb, len;
+	uint64_t expirations;
+	int recheck_us = 0;
+	watch_t *w;
+
+	read(watchdog_fd, &expirations, sizeof(expirations));
+	for (w = watched; w < watched + num_watched; w++) {
+		if (w->restarting)
+			continue;
+		cs = w->dma_reg[DMA_CS];
+		debug = w->dma_reg[DMA_DEBUG] & 7;
+		cb = w->dma_reg[DMA_CONBLK_AD];
+		len = w->dma_reg[DMA_TXFR_LEN];
+		if ((cs & DMA_ERROR) || debug) {
+			recover_dma(w, WD_ERROR, cs, debug, cb);
+		} else if (!(cs & DMA_ACTIVE)) {
+			recover_dma(w, WD_STOPPED, cs, debug, cb);
+		} else if (cb == w->last_cb && len == w->last_len) {
+			if (w->suspect) {
+				recover_dma(w, WD_STALLED, cs, debug, cb);
+			} else {
+				w->suspect = 1;
+				if (w->word_us * 2 > recheck_us)
+					recheck_us = w->word_us * 2;
+			}
+		} else {
+			w->last_cb = cb;
+			w->last_len = len;
+			w->suspect = 0;
+			w->in_a_row = 0;
+		}
+	}
+	arm_timer(watchdog_fd, recheck_us ? recheck_us : watchdog_ms * 1000ULL);
+}
+
+/* What the DMA controller does each cycle: CBs fetched, and the bus
+ * transactions and bytes that costs, counting a fetch per CB and a read
+ * and a write per word it moves.  The normal chain's figures are shown
+ * alongside for the other layouts.
+ */
+static void
+print_chain_cost(const group_t *g)
+{
+	int cbs = g->num_samples * 2 + g->num_servos;
+	uint64_t xfers = cbs * 3ULL, bytes = cbs * (sizeof(dma_cb_t) + 8ULL);
+
+	// Turn-off CBs clear both banks if they must
+	xfers += g->num_samples * (g->num_banks - 1) * 2ULL;
+	bytes += g->num_samples * (g->num_banks - 1) * 8ULL;
+	printf("\nDMA per cycle, normal chain: %7d CBs, %9llu transactions, %9llu bytes\n",
+		cbs, (unsigned long long)xfers, (unsigned long long)bytes);
+	if (g->capture) {
+		cbs += g->num_samples * 2;
+		xfers += g->num_samples * 2 * 3ULL;
+		bytes += g->num_samples * 2 * (sizeof(dma_cb_t) + 8ULL);
+		printf("DMA per cycle, with capture: %7d CBs, %9llu transactions, %9llu bytes\n",
+			cbs, (unsigned long long)xfers, (unsigned long long)bytes);
+	}
+	if (g->chain_mode == CHAIN_RELINK) {
+		cbs = g->num_samples + g->num_servos * 2;
+		xfers = cbs * 3ULL;
+		bytes = cbs * (sizeof(dma_cb_t) + 8ULL);
+	} else if (g->chain_mode == CHAIN_SPARSE) {
+		sparse_cost(&g->sparse, &cbs, &xfers, &bytes);
+	} else if (g->chain_mode == CHAIN_BCM) {
+		bcm_cost(&g->bcm, &cbs, &xfers, &bytes);
+	} else {
+		return;
+	}
+	printf("DMA per cycle, this chain:   %7d CBs, %9llu transactions, %9llu bytes\n",
+		cbs, (unsigned long long)xfers, (unsigned long long)bytes);
+}
+
+static void
+debug_group(group_t *g)
+{
+	int i, k;
+	uint32_t mask[2] = { 0, 0 };
+	uint32_t last;
+	uint64_t curr, prev;
+
+	last = g->dma_reg[DMA_CONBLK_AD];
+	udelay(g->step_time_us*2);
+	printf("%08x %08x\n", last, g->dma_reg[DMA_CONBLK_AD]);
+
+	printf("---------------------------\n");
+	printf("Servo  Start  Width  TurnOn\n");
+	for (i = 0; i < MAX_SERVOS; i++) {
+		if (servo2gpio[i] != DMY && GROUP_OF(i) == g && hw_pwm[i]) {
+			printf("%3d:   PWM%d %6d %6d\n", i, hw_pwm[i],
+					servowidth[i], !!shadow_on[i]);
+		} else if (servo2gpio[i] != DMY && GROUP_OF(i) == g) {
+			printf("%3d: %6d %6d %6d\n", i, servostart[i],
+					servowidth[i], !!shadow_on[i]);
+			mask[GPIO_BANK(servo2gpio[i])] |= GPIO_BIT(servo2gpio[i]);
+		}
+	}
+	for (i = k = 0; i < MAX_SERVOS; i++) {
+		if (!dithering[i] || GROUP_OF(i) != g)
+			continue;
+		if (!k++)
+			printf("\nDithered widths:\n");
+		printf("%3d: %10.3f\n", i, (double)finewidth[i] / (1 << dither_bits));
+	}
+	if (g->chain_mode != CHAIN_BCM) {
+		int width[MAX_SERVOS], start[MAX_SERVOS], servo_of[MAX_SERVOS];
+		int n = group_phases(g, width, start, servo_of), peak, edges;
+
+		peak = phase_peak(g->num_samples, n, width, start, &edges);
+		printf("\nPeak outputs on at once: %d, most edges in one step: %d\n",
+			peak, edges);
+	}
+	print_chain_cost(g);
+	if (g->chain_mode == CHAIN_SPARSE) {
+		printf("Chain rebuilds: %llu, writing %.1f words each\n",
+			(unsigned long long)g->sparse.rebuilds, g->sparse.rebuilds ?
+			(double)g->sparse.words_written / g->sparse.rebuilds : 0.0);
+		printf("Start moves: %llu, old starts kept: %llu\n",
+			(unsigned long long)g->rephases,
+			(unsigned long long)g->rephases_kept);
+	} else if (g->chain_mode == CHAIN_BCM) {
+		printf("\nPlane  Steps        On\n");
+		for (i = 0; i < g->bcm_bits; i++) {
+			printf("%3d: %7d ", i, 1 << i);
+			for (k = 0; k < g->bcm.banks; k++)
+				printf(" %08x", g->bcm.set[i][k] & mask[k]);
+			printf("\n");
+		}
+		printf("\nPlane updates: %llu, writing %.1f words each\n",
+			(unsigned long long)g->bcm.flushes, g->bcm.flushes ?
+			(double)g->bcm.words_written / g->bcm.flushes : 0.0);
+	}
+	if (g->chain_mode == CHAIN_RELINK) {
+		printf("\nTurn-off CBs:\n");
+		for (i = 0; i < MAX_SERVOS; i++) {
+			if (servo2gpio[i] == DMY || GROUP_OF(i) != g || hw_pwm[i])
+				continue;
+			if (g->relink.live[i])
+				printf("%3d: @%5d%s\n", i,
+					g->relink.slot[g->relink.live[i] - g->relink.turnoff],
+					g->relink.retiring[i] ? " (retiring old)" : "");
+			else
+				printf("%3d: none\n", i);
+		}
+		printf("\nCB moves: %llu, retired late: %llu, waits for DMA: %llu\n",
+			(unsigned long long)g->relink.moves,
+			(unsigned long long)g->relink.deferred,
+			(unsigned long long)g->relink.waits);
+		printf("---------------------------\n");
+		return;
+	}
+	if (g->chain_mode == CHAIN_SPARSE || g->chain_mode == CHAIN_BCM) {
+		printf("---------------------------\n");
+		return;
+	}
+	printf("\nData:\n");
+	prev = ~0ULL;
+	for (i = 0; i < g->num_samples; i++) {
+		curr = g->shadow_off[i * g->num_banks] & mask[0];
+		if (g->num_banks > 1)
+			curr |= (uint64_t)(g->shadow_off[i * g->num_banks + 1] & mask[1]) << 32;
+		if (curr != prev && g->num_banks > 1)
+			printf("@%5d: %08x %08x\n", i, (uint32_t)curr, (uint32_t)(curr >> 32));
+		else if (curr != prev)
+			printf("@%5d: %08x\n", i, (uint32_t)curr);
+		prev = curr;
+	}
+	if (g->mask_updates) {
+		/* Changing turnoff_mask in place would have cost a read and a
+		 * write for every word each update changed.
+		 */
+		printf("\nWidth updates: %llu, changing %.1f words each\n"
+			"Bus writes per update: %.1f, saved %.1f writes and %.1f reads\n",
+			(unsigned long long)g->mask_updates,
+			(double)g->mask_words_changed / g->mask_updates,
+			(double)g->mask_words_written / g->mask_updates,
+			((double)g->mask_words_changed - g->mask_words_written) / g->mask_updates,
+			(double)g->mask_words_changed / g->mask_updates);
+	}
+	printf("---------------------------\n");
+}
+
+#define STRIP_DEBUG_PIXELS	32	/* Pixels listed by debug */
+
+static void
+debug_strip(void)
+{
+	uint32_t last;
+	int i;
+
+	printf("\nStrip, DMA channel %d:\n", strip_dma_chan);
+	last = strip_dma_reg[DMA_CONBLK_AD];
+	udelay(1000);
+	printf("%08x %08x\n", last, strip_dma_reg[DMA_CONBLK_AD]);
+	printf("---------------------------\n");
+	for (i = 0; i < strip.num_pixels && i < STRIP_DEBUG_PIXELS; i++)
+		printf("%06x%s", strip_get(&strip, i), i % 8 == 7 ? "\n" : " ");
+	if (i % 8)
+		printf("\n");
+	if (strip.num_pixels > STRIP_DEBUG_PIXELS)
+		printf("... %d more\n", strip.num_pixels - STRIP_DEBUG_PIXELS);
+	printf("Pixels: %d on GPIO %d, refreshed at %.1fHz\n", strip.num_pixels,
+			STRIP_GPIO, strip_refresh_hz(&strip));
+	printf("Frames queued: %llu, flushes held for a switch: %llu\n",
+			(unsigned long long)strip.frames, (unsigned long long)strip.held);
+	printf("---------------------------\n");
+}
+
+static void
+debug_watchdog(void)
+{
+	const wd_event_t *e;
+	const watch_t *w;
+	char when[32];
+	struct tm tm;
+	uint64_t i;
+
+	if (!wd_num_events)
+		return;
+	printf("\nDMA restarts, most recent last:\n");
+	i = wd_num_events > WATCHDOG_EVENTS ? wd_num_events - WATCHDOG_EVENTS : 0;
+	for (; i < wd_num_events; i++) {
+		e = wd_events + i % WATCHDOG_EVENTS;
+		w = watched + e->watch;
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S",
+				localtime_r(&e->when.tv_sec, &tm));
+		printf("%s.%03ld  chan %2d  %-7s  CB %08x  CS %08x  DEBUG %x  %d in a row\n",
+			when, e->when.tv_nsec / 1000000, w->dma_chan, wd_reasons[e->reason],
+			e->cb, e->cs, e->debug, e->in_a_row);
+	}
+	for (w = watched; w < watched + num_watched; w++) {
+		printf("Channel %2d restarts: %llu stalled, %llu error, %llu stopped\n",
+			w->dma_chan, (unsigned long long)w->recoveries[WD_STALLED],
+			(unsigned long long)w->recoveries[WD_ERROR],
+			(unsigned long long)w->recoveries[WD_STOPPED]);
+	}
+	printf("---------------------------\n");
+}
+
+static void
+do_debug(void)
+{
+	int i;
+
+	flush_masks();
+	for (i = 0; i < num_groups; i++) {
+		if (num_groups > 1)
+			printf("\nGroup %d, DMA channel %d:\n", i, groups[i].dma_chan);
+		debug_group(groups + i);
+	}
+	if (strip_pixels)
+		debug_strip();
+	debug_watchdog();
+}
+
+// Words each group's chain updates have written to DMA memory, by layout
+static uint64_t
+chain_words_written(const group_t *g)
+{
+	if (g->chain_mode == CHAIN_SPARSE)
+		return g->sparse.words_written;
+	else if (g->chain_mode == CHAIN_BCM)
+		return g->bcm.words_written;
+	return g->mask_words_written;
+}
+
+/* The counts in the Prometheus text format.  ledek_dma_cb_address is the CB
+ * each controller is on, so a scraper can see that it is running by it
+ * changing from one scrape to the next, rather than waiting to watch it as
+ * do_status() does.
+ */
+static void
+write_stats(FILE *fp)
+{
+	static const char *sources[] = { "source=\"fifo\"", "source=\"socket\"" };
+	char labels[MAX_GROUPS][16], label[48];
+	const watch_t *w;
+	int i;
+
+	for (i = 0; i < num_groups; i++)
+		sprintf(labels[i], "group=\"%d\"", i);
+
+	metrics_family(fp, "ledek_commands_total", "counter", "Command lines handled.");
+	for (i = 0; i < 2; i++)
+		metrics_value(fp, "ledek_commands_total", sources[i], stats.lines[i]);
+	metrics_family(fp, "ledek_command_errors_total", "counter",
+			"Command lines rejected, and input lines too long to take.");
+	for (i = 0; i < 2; i++)
+		metrics_value(fp, "ledek_command_errors_total", sources[i], stats.errors[i]);
+	metrics_family(fp, "ledek_read_bytes_total", "counter", "Bytes of commands read.");
+	for (i = 0; i < 2; i++)
+		metrics_value(fp, "ledek_read_bytes_total", sources[i], stats.bytes[i]);
+	metrics_family(fp, "ledek_ring_records_total", "counter",
+			"Records taken off the shared memory ring.");
+	metrics_value(fp, "ledek_ring_records_total", NULL, stats.ring_records);
+	metrics_family(fp, "ledek_ring_invalid_total", "counter",
+			"Ring records ignored as invalid.");
+	metrics_value(fp, "ledek_ring_invalid_total", NULL, stats.ring_invalid);
+	metrics_family(fp, "ledek_set_servo_total", "counter",
+			"Single output updates from commands and the ring.");
+	metrics_value(fp, "ledek_set_servo_total", NULL, stats.set_servo);
+	metrics_family(fp, "ledek_frames_total", "counter",
+			"Frames of updates applied together.");
+	metrics_value(fp, "ledek_frames_total", NULL, stats.frames);
+	metrics_family(fp, "ledek_idle_expiries_total", "counter",
+			"Outputs turned off by their idle timeout.");
+	metrics_value(fp, "ledek_idle_expiries_total", NULL, stats.idle_expiries);
+	metrics_family(fp, "ledek_apply_latency_seconds", "histogram",
+			"From the event loop waking with an update to its chain holding it.");
+	metrics_hist(fp, "ledek_apply_latency_seconds", NULL, &stats.apply_ns);
+
+	metrics_family(fp, "ledek_width_updates_total", "counter",
+			"Width changes made to each group's chain.");
+	for (i = 0; i < num_groups; i++)
+		metrics_value(fp, "ledek_width_updates_total", labels[i], groups[i].mask_updates);
+	metrics_family(fp, "ledek_chain_words_written_total", "counter",
+			"Turn-off mask, or CB, words written to DMA memory by updates.");
+	for (i = 0; i < num_groups; i++) {
+		if (groups[i].chain_mode != CHAIN_RELINK)
+			metrics_value(fp, "ledek_chain_words_written_total", labels[i],
+					chain_words_written(groups + i));
+	}
+	metrics_family(fp, "ledek_relink_moves_total", "counter",
+			"Turn-off CBs moved, with --relink.");
+	for (i = 0; i < num_groups; i++) {
+		if (groups[i].chain_mode == CHAIN_RELINK)
+			metrics_value(fp, "ledek_relink_moves_total", labels[i],
+					groups[i].relink.moves);
+	}
+	metrics_family(fp, "ledek_dma_cb_address", "gauge",
+			"Bus address of the CB each DMA controller is on.");
+	for (i = 0; i < num_groups; i++)
+		metrics_value(fp, "ledek_dma_cb_address", labels[i],
+				groups[i].dma_reg[DMA_CONBLK_AD]);
+	if (strip_pixels)
+		metrics_value(fp, "ledek_dma_cb_address", "group=\"strip\"",
+				strip_dma_reg[DMA_CONBLK_AD]);
+	metrics_family(fp, "ledek_dma_restarts_total", "counter",
+			"DMA controllers restarted by the watchdog.");
+	for (w = watched; w < watched + num_watched; w++) {
+		for (i = 0; i < 3; i++) {
+			sprintf(label, "group=\"%s\",reason=\"%s\"", watch_name(w), wd_reasons[i]);
+			metrics_value(fp, "ledek_dma_restarts_total", label, w->recoveries[i]);
+		}
+	}
+	metrics_family(fp, "ledek_dma_last_restart_timestamp_seconds", "gauge",
+			"When the watchdog last restarted each DMA controller, or 0.");
+	for (w = watched; w < watched + num_watched; w++) {
+		sprintf(label, "group=\"%s\"", watch_name(w));
+		metrics_value(fp, "ledek_dma_last_restart_timestamp_seconds", label,
+				w->last_recovery.tv_sec);
+	}
+	if (strip_pixels) {
+		metrics_family(fp, "ledek_strip_frames_total", "counter",
+				"Strip frames queued.");
+		metrics_value(fp, "ledek_strip_frames_total", NULL, strip.frames);
+		metrics_family(fp, "ledek_strip_held_total", "counter",
+				"Strip flushes put off until the last frame had gone out.");
+		metrics_value(fp, "ledek_strip_held_total", NULL, strip.held);
+	}
+}
+
+/* Write the stats to a file next to 'path', then rename it into place, so
+ * that a scraper never reads one half written.
+ */
+static int
+save_stats(const char *path)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (!(fp = fopen(tmp, "w")))
+		return -1;
+	write_stats(fp);
+	if (fclose(fp) || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+rewrite_stats_file(void)
+{
+	uint64_t expirations;
+
+	read(stats_fd, &expirations, sizeof(expirations));
+	if (save_stats(stats_path) < 0) {
+		if (!stats_failing)
+			fprintf(stderr, "servod: Failed to write %s: %m\n", stats_path);
+		stats_failing = 1;
+	} else {
+		stats_failing = 0;
+	}
+}
+
+// Map the target of a parsed command to a servo, or -1 if it is invalid
+static int
+resolve_servo(client_t *c, const servo_cmd_t *cmd)
+{
+	int servo;
+
+	if (cmd->hdr) {
+		if (cmd->hdr != 1 && cmd->hdr != 5) {
+			client_error(c, "Invalid header P%d\n", cmd->hdr);
+			return -1;
+		} else if (cmd->num < 1 ||
+				(cmd->hdr == 1 && cmd->num > NUM_P1PINS) ||
+				(cmd->hdr == 5 && cmd->num > NUM_P5PINS)) {
+			client_error(c, "Invalid pin number P%d-%d\n", cmd->hdr, cmd->num);
+			return -1;
+		}
+		servo = cmd->hdr == 1 ? p1pin2servo[cmd->num] : p5pin2servo[cmd->num];
+		if (servo == DMY) {
+			client_error(c, "P%d-%d is not mapped to a servo\n", cmd->hdr, cmd->num);
+			return -1;
+		}
+	} else {
+		servo = cmd->num;
+		if (servo >= MAX_SERVOS) {
+			client_error(c, "Invalid servo number %d\n", servo);
+			return -1;
+		} else if (servo2gpio[servo] == DMY) {
+			client_error(c, "Servo %d is not mapped to a GPIO pin\n", servo);
+			return -1;
+		}
+	}
+	return servo;
+}
+
+/* A parsed width for 'servo' in 1/2^dither_bits ticks, relative to 'cur'
+ * in the same units, or -1 if it is out of range.  Percentages and levels
+ * go through the servo's curve if it has one.
+ */
+static int
+width_for(int servo, const width_spec_t *spec, int cur)
+{
+	const group_t *g = GROUP_OF(servo);
+
+	if (servo_curve[servo] && (spec->unit == WIDTH_PERCENT || spec->unit == WIDTH_LEVEL))
+		return curve_width(servo_curve[servo], spec, cur);
+	return width_to_fine(spec, cur, g->step_time_us, g->servo_min_ticks,
+			g->servo_max_ticks, dither_bits);
+}
+
+/* Parse one "<target>=<width>[@<time>[:<easing>]]" item, ending at 'term'
+ * or the end of the line, into a servo number, a width in 1/2^dither_bits
+ * ticks and how long to take getting there.  Relative widths are relative
+ * to cur[servo], in the same units.
+ * Returns a pointer just past the item, or NULL after reporting the
+ * problem.
+ */
+static const char *
+parse_item(client_t *c, const char *line, const char *p, char term,
+		const int *cur, int *servo, int *width, ramp_spec_t *ramp)
+{
+	servo_cmd_t cmd;
+
+	p = parse_servo_target(p, &cmd);
+	if (!p || !*(p = skip_spaces(p))) {
+		client_error(c, "Bad input: %s\n", line);
+		return NULL;
+	}
+	if ((*servo = resolve_servo(c, &cmd)) < 0)
+		return NULL;
+	p = parse_width_spec(p, &cmd.width);
+	ramp->ms = 0;
+	if (p && *p == '@' && !(p = parse_ramp_spec(p, ramp))) {
+		client_error(c, "Invalid ramp specified\n");
+		return NULL;
+	}
+	if (p && (!*(p = skip_spaces(p)) || *p == term))
+		*width = width_for(*servo, &cmd.width, cur[*servo]);
+	else
+		*width = -1;
+	if (*width < 0) {
+		client_error(c, "Invalid width specified\n");
+		return NULL;
+	}
+	return p;
+}
+
+static void
+set_cycle_timer(group_t *g, int on)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (on) {
+		its.it_interval.tv_sec = g->cycle_time_us / 1000000;
+		its.it_interval.tv_nsec = (g->cycle_time_us % 1000000) * 1000;
+		its.it_value = its.it_interval;
+	}
+	if (timerfd_settime(g->cycle_fd, 0, &its, NULL) < 0)
+		fatal("servod: timerfd_settime() failed: %m\n");
+	g->cycle_timer_on = on;
+}
+
+/* Whole ticks for the coming cycle of a servo whose width has a fraction.
+ * This is a first order sigma-delta: the fraction is added to what was
+ * left over last cycle, and a whole tick carried whenever that reaches
+ * one, so the width alternates between the two nearest tick counts and
+ * averages out at the fine width over a few cycles.
+ */
+static int
+dither_next(int servo)
+{
+	uint32_t one = 1 << dither_bits;
+
+	dither_acc[servo] += finewidth[servo] & (one - 1);
+	if (dither_acc[servo] < one)
+		return finewidth[servo] >> dither_bits;
+	dither_acc[servo] -= one;
+	return (finewidth[servo] >> dither_bits) + 1;
+}
+
+/* Make 'fine' the servo's width, and return the whole ticks to set it to
+ * for the coming cycle.  The cycle tick takes over from there if there is
+ * a fraction to dither.
+ */
+static int
+dither_width(int servo, int fine)
+{
+	int frac = (fine & ((1 << dither_bits) - 1)) != 0;
+
+	finewidth[servo] = fine;
+	if (hw_pwm[servo])
+		return fine >> dither_bits;
+	if (frac != dithering[servo]) {
+		dithering[servo] = frac;
+		num_dithering += frac ? 1 : -1;
+	}
+	if (!frac)
+		return fine >> dither_bits;
+	if (!GROUP_OF(servo)->cycle_timer_on)
+		set_cycle_timer(GROUP_OF(servo), 1);
+	return dither_next(servo);
+}
+
+// The first step is taken on the next cycle tick of the servo's group
+static void
+start_ramp(int servo, int width, const ramp_spec_t *spec)
+{
+	group_t *g = GROUP_OF(servo);
+
+	ramp_start(ramps + servo, finewidth[servo], width,
+			(g->servo_min_ticks > 0 ? g->servo_min_ticks : 1) << dither_bits,
+			spec->ease, loop_now, spec->ms);
+	if (!g->cycle_timer_on)
+		set_cycle_timer(g, 1);
+}
+
+/* Called once per cycle of a group while any of its ramps is running or
+ * any of its widths is being dithered.  Every active ramp is stepped,
+ * every dithered width takes its next tick count, and they all go out
+ * together in one write_group_frame().  Dithering alone doesn't count as
+ * an update for the idle timeout.
+ */
+static void
+advance_cycle(group_t *g)
+{
+	int widths[MAX_SERVOS];
+	int servo, active = 0, dithered = 0;
+	uint64_t expirations;
+
+	if (read(g->cycle_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+	for (servo = 0; servo < MAX_SERVOS; servo++) {
+		widths[servo] = -1;
+		if (GROUP_OF(servo) != g)
+			continue;
+		if (ramps[servo].active) {
+			widths[servo] = dither_width(servo, ramp_width(ramps + servo, loop_now));
+			active += ramps[servo].active;
+			update_idle_time(servo);
+		} else if (dithering[servo]) {
+			widths[servo] = dither_next(servo);
+		}
+		dithered += dithering[servo];
+	}
+	write_group_frame(g, widths);
+	if (!active && !dithered)
+		set_cycle_timer(g, 0);
+}
+
+/* "frame <item>,<item>,..." sets several servos at once.  The whole frame
+ * is checked before anything is changed, and is then applied in a single
+ * write_group_frame() so every output switches to its new width in the
+ * same cycle, other than in relink mode.  Any
+ * ramps in the frame all start from the same cycle too.
+ */
+static int
+process_frame(client_t *c, char *line, char *args)
+{
+	int widths[MAX_SERVOS];
+	int pending[MAX_SERVOS];
+	ramp_spec_t specs[MAX_SERVOS], spec;
+	const char *p = args;
+	int servo, width;
+
+	for (servo = 0; servo < MAX_SERVOS; servo++) {
+		widths[servo] = -1;
+		pending[servo] = finewidth[servo];
+	}
+	for (;;) {
+		if (!(p = parse_item(c, line, p, ',', pending, &servo, &width, &spec)))
+			return -1;
+		widths[servo] = pending[servo] = width;
+		specs[servo] = spec;
+		if (!*p)
+			break;
+		p++;
+	}
+	for (servo = 0; servo < MAX_SERVOS; servo++) {
+		if (widths[servo] < 0)
+			continue;
+		ramps[servo].active = 0;
+		if (specs[servo].ms) {
+			start_ramp(servo, widths[servo], specs + servo);
+			widths[servo] = -1;
+		} else {
+			widths[servo] = dither_width(servo, widths[servo]);
+		}
+	}
+	set_servo_frame(widths);
+	return 0;
+}
+
+/* "idle <target>=<time>" sets the idle timeout for one output, in ms or s,
+ * overriding --idle-timeout; a time of 0 disables it.  The new timeout
+ * runs from now.
+ */
+static int
+process_idle(client_t *c, char *line, char *args)
+{
+	servo_cmd_t cmd;
+	const char *p;
+	uint32_t ms;
+	int servo;
+
+	if (!(p = parse_servo_target(args, &cmd))) {
+		client_error(c, "Bad input: %s\n", line);
+		return -1;
+	}
+	if ((servo = resolve_servo(c, &cmd)) < 0)
+		return -1;
+	p = skip_spaces(p);
+	if (*p == '0' && !*skip_spaces(p + 1)) {
+		ms = 0;
+	} else if (!(p = parse_duration(p, &ms)) || *skip_spaces(p) ||
+			ms < 10 || ms > 3600000) {
+		client_error(c, "Invalid idle timeout specified\n");
+		return -1;
+	}
+	idle_ms[servo] = ms;
+	deadline_clear(&idle_heap, servo);
+	flush_masks();
+	if (shadow_on[servo])
+		update_idle_time(servo);
+	return 0;
+}
+
+/* "rephase" moves the starts of the outputs in sparse groups to suit their
+ * current widths, as --rephase does every time they change.
+ */
+static int
+process_rephase(client_t *c)
+{
+	int i, n = 0;
+
+	for (i = 0; i < num_groups; i++) {
+		if (groups[i].chain_mode == CHAIN_SPARSE) {
+			groups[i].rephase_wanted = 1;
+			n++;
+		}
+	}
+	if (!n) {
+		client_error(c, "rephase needs the sparse chain layout\n");
+		return -1;
+	}
+	flush_masks();
+	return 0;
+}
+
+/* "strip <first>[..<last>]=<rrggbb>[,<rrggbb>...]" sets pixels on the
+ * --strip.  The colours go to the pixels from <first> on, and with a range
+ * are repeated to fill it, so "strip 0..59=ff0000" makes sixty pixels red
+ * and "strip 0..59=ff0000,000000" every other one.  The pixels all change
+ * in the same frame.
+ */
+static int
+process_strip(client_t *c, char *line, char *args)
+{
+	static uint32_t colours[STRIP_MAX_PIXELS];
+	const char *p = skip_spaces(args);
+	int first, last, i, n = 0;
+
+	if (!strip_pixels) {
+		client_error(c, "strip needs --strip\n");
+		return -1;
+	}
+	if (!(p = parse_range(p, &first, &last)) || *p++ != '=') {
+		client_error(c, "Bad input: %s\n", line);
+		return -1;
+	}
+	do {
+		if (n == STRIP_MAX_PIXELS || !(p = parse_rgb(p, colours + n++))) {
+			client_error(c, "Bad input: %s\n", line);
+			return -1;
+		}
+	} while (*p++ == ',');
+	if (*skip_spaces(p - 1)) {
+		client_error(c, "Bad input: %s\n", line);
+		return -1;
+	}
+	if (last < 0)
+		last = first + n - 1;
+	if (first > last || last >= strip.num_pixels) {
+		client_error(c, "Invalid pixel range, the strip has %d\n", strip.num_pixels);
+		return -1;
+	}
+	for (i = first; i <= last; i++)
+		strip_set(&strip, i, colours[(i - first) % n]);
+	return 0;
+}
+
+/* "stats <file>" writes the counts --stats-file has to the named file
+ * there and then, whether or not --stats-file was given.
+ */
+static int
+process_stats(client_t *c, char *line, char *filename)
+{
+	char *p;
+
+	filename = (char *)skip_spaces(filename);
+	p = filename + strlen(filename) - 1;
+	while (p > filename && (*p == '\n' || *p == '\r' || *p == ' '))
+		*p-- = '\0';
+	if (!*filename) {
+		client_error(c, "Bad input: %s\n", line);
+		return -1;
+	}
+	if (save_stats(filename) < 0) {
+		client_error(c, "Failed to write %s: %m\n", filename);
+		return -1;
+	}
+	return 0;
+}
+
+/* "capture <file>" writes the changes --capture has seen on the outputs in
+ * bank 0 to the named file, one line per change with the system timer in
+ * us and the GPLEV0 bits in hex.  It covers the time since the last
+ * capture command, if that was less than a cycle ago, and otherwise the
+ * last cycle, with a "# missed" line for the gap.
+ */
+static int
+process_capture(client_t *c, char *line, char *filename)
+{
+	group_t *g = groups;
+	capture_slot_t *copy, *edges;
+	uint32_t mask = 0;
+	int i, n, pos, first, count;
+	FILE *fp;
+	char *p;
+
+	if (!g->capture) {
+		client_error(c, "capture needs --capture\n");
+		return -1;
+	}
+	filename = (char *)skip_spaces(filename);
+	p = filename + strlen(filename) - 1;
+	while (p > filename && (*p == '\n' || *p == '\r' || *p == ' '))
+		*p-- = '\0';
+	if (!*filename) {
+		client_error(c, "Bad input: %s\n", line);
+		return -1;
+	}
+	for (i = 0; i < MAX_SERVOS; i++) {
+		if (servo2gpio[i] != DMY && !GPIO_BANK(servo2gpio[i]))
+			mask |= GPIO_BIT(servo2gpio[i]);
+	}
+	if (!(copy = malloc(g->num_samples * 2 * sizeof(*copy))))
+		fatal("servod: malloc() failed\n");
+	edges = copy + g->num_samples;
+
+	/* Only slots the controller didn't reach while they were being copied
+	 * are used, starting after the one it was on when it finished.
+	 */
+	pos = dma_sample_pos(g);
+	memcpy(copy, g->capture_slots, g->num_samples * sizeof(*copy));
+	first = dma_sample_pos(g);
+	count = g->num_samples - 1 - (first - pos + g->num_samples) % g->num_samples;
+	first = (first + 1) % g->num_samples;
+
+	if (!(fp = fopen(filename, "w"))) {
+		client_error(c, "Failed to open %s for writing: %m\n", filename);
+		free(copy);
+		return -1;
+	}
+	if (g->capture_seen && count > 0 &&
+			(int32_t)(copy[first].stamp - g->capture_seen) > g->step_time_us * 2)
+		fprintf(fp, "# missed %uus\n", copy[first].stamp - g->capture_seen);
+	n = capture_edges(copy, g->num_samples, first, count, mask,
+			g->capture_seen ? g->capture_seen : copy[first].stamp - 1,
+			&g->capture_levels, edges, g->num_samples);
+	for (i = 0; i < n; i++)
+		fprintf(fp, "%u %08x\n", edges[i].stamp, edges[i].levels);
+	fclose(fp);
+	if (count > 0)
+		g->capture_seen = copy[(first + count - 1) % g->num_samples].stamp;
+	free(copy);
+	return 0;
+}
+
+/* Servo commands take the form "N=<width>" or "P1-N=<width>", where the
+ * width is in steps, "us" or "%", optionally with a '+' or '-' prefix to
+ * make it relative to the current width.  Socket clients get "OK" or
+ * "ERROR: <reason>" back for every line.
+ */
+static void
+process_line(client_t *c, char *line)
+{
+	int servo, width;
+	ramp_spec_t ramp;
+
+	if (!strcmp(line, "debug")) {
+		do_debug();
+		client_reply(c, "OK\n");
+	} else if (!strcmp(line, "status") || !strncmp(line, "status ", 7)) {
+		do_status(c, line + 6);
+	} else if (!strncmp(line, "frame ", 6)) {
+		if (process_frame(c, line, line + 6) == 0)
+			client_reply(c, "OK\n");
+	} else if (!strncmp(line, "idle ", 5)) {
+		if (process_idle(c, line, line + 5) == 0)
+			client_reply(c, "OK\n");
+	} else if (!strcmp(line, "rephase")) {
+		if (process_rephase(c) == 0)
+			client_reply(c, "OK\n");
+	} else if (!strncmp(line, "stats ", 6)) {
+		if (process_stats(c, line, line + 6) == 0)
+			client_reply(c, "OK\n");
+	} else if (!strncmp(line, "capture ", 8)) {
+		if (process_capture(c, line, line + 8) == 0)
+			client_reply(c, "OK\n");
+	} else if (!strncmp(line, "strip ", 6)) {
+		if (process_strip(c, line, line + 6) == 0)
+			client_reply(c, "OK\n");
+	} else if (parse_item(c, line, line, '\0', finewidth, &servo, &width, &ramp)) {
+		ramps[servo].active = 0;
+		if (ramp.ms)
+			start_ramp(servo, width, &ramp);
+		else
+			set_servo(servo, dither_width(servo, width));
+		client_reply(c, "OK\n");
+	}
+}
+
+/* Apply records from the shared memory ring.  Records flagged
+ * SERVORING_MORE are collected in ring_widths[] and applied, along with the
+ * record that ends the frame, in one set_servo_frame() pass; a frame may be
+ * split across wakeups if the client is still pushing it when we drain.
+ * SERVORING_PIXEL records go straight into the strip's pixels, and
+ * strip_held keeps them from being sent until the one ending the frame.
+ */
+static void
+process_ring(void)
+{
+	static int ring_widths[MAX_SERVOS];
+	static int ring_pending = -1;	/* -1: nothing collected yet */
+	ring_rec_t recs[RING_BATCH];
+	int i, n, servo, width, cur, bad = 0;
+	width_spec_t spec;
+
+	if (ring_pending < 0) {
+		for (servo = 0; servo < MAX_SERVOS; servo++)
+			ring_widths[servo] = -1;
+		ring_pending = 0;
+	}
+	while ((n = ring_drain(recs, RING_BATCH)) > 0) {
+		stats.ring_records += n;
+		for (i = 0; i < n; i++) {
+			if (recs[i].flags & SERVORING_PIXEL) {
+				if (recs[i].channel >= strip.num_pixels)
+					bad++;
+				else
+					strip_set(&strip, recs[i].channel, recs[i].ticks);
+				strip_held = !!(recs[i].flags & SERVORING_MORE);
+				continue;
+			}
+			servo = recs[i].channel;
+			if (servo >= MAX_SERVOS || servo2gpio[servo] == DMY ||
+					(recs[i].ticks < 0 && !(recs[i].flags & SERVORING_RELATIVE))) {
+				bad++;
+				continue;
+			}
+			cur = ring_widths[servo] >= 0 ? ring_widths[servo] : finewidth[servo];
+			spec.unit = recs[i].flags & SERVORING_LEVEL ? WIDTH_LEVEL : WIDTH_STEPS;
+			spec.rel = 0;
+			if (recs[i].flags & SERVORING_RELATIVE)
+				spec.rel = recs[i].ticks < 0 ? -1 : 1;
+			spec.value = (uint64_t)(recs[i].ticks < 0 ? -(int64_t)recs[i].ticks :
+					recs[i].ticks) * PARSE_FRAC_ONE;
+			width = width_for(servo, &spec, cur);
+			if (width < 0) {
+				bad++;
+				continue;
+			}
+			ramps[servo].active = 0;
+			if (!(recs[i].flags & SERVORING_MORE) && !ring_pending) {
+				set_servo(servo, dither_width(servo, width));
+				continue;
+			}
+			ring_widths[servo] = width;
+			ring_pending = 1;
+			if (!(recs[i].flags & SERVORING_MORE)) {
+				for (servo = 0; servo < MAX_SERVOS; servo++) {
+					if (ring_widths[servo] >= 0)
+						ring_widths[servo] = dither_width(servo, ring_widths[servo]);
+				}
+				set_servo_frame(ring_widths);
+				for (servo = 0; servo < MAX_SERVOS; servo++)
+					ring_widths[servo] = -1;
+				ring_pending = 0;
+			}
+		}
+	}
+	ring_ack();
+	stats.ring_invalid += bad;
+	if (bad)
+		fprintf(stderr, "Ignored %d invalid updates from the ring\n", bad);
+}
+
+/* The control socket, CTLFILE, takes the same commands as the fifo but
+ * from any number of clients at once, each with its own line buffer and
+ * replies.  The listening socket is made here, before we daemonize, so
+ * that failures are reported on the terminal.
+ */
+static int
+create_ctl_socket(void)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, CTLFILE, sizeof(addr.sun_path) - 1);
+
+	unlink(CTLFILE);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) < 0)
+		fatal("servod: Failed to create socket: %m\n");
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		fatal("servod: Failed to bind %s: %m\n", CTLFILE);
+	if (chmod(CTLFILE, 0666) < 0)
+		fatal("servod: Failed to set permissions on %s: %m\n", CTLFILE);
+	if (listen(fd, 16) < 0)
+		fatal("servod: Failed to listen on %s: %m\n", CTLFILE);
+
+	return fd;
+}
+
+static int epoll_fd;
+static client_t *fifo_client;
+static char listen_tag, ring_tag, idle_tag, stats_tag, watchdog_tag;	/* epoll data for other fds */
+static char cycle_tag[MAX_GROUPS];
+static char restart_tag[MAX_GROUPS + 1];
+
+static void
+watch_fd(int fd, void *ptr)
+{
+	struct epoll_event ev;
 
-	printf("---------------------------\n");
-	printf("Servo  Start  Width  TurnOn\n");
-	for (i = 0; i < MAX_SERVOS; i++) {
-		if (servo2gpio[i] != DMY) {
-			printf("%3d: %6d %6d %6d\n", i, servostart[i],
-					servowidth[i], !!turnon_mask[i]);
-			mask |= 1 << servo2gpio[i];
-		}
-	}
-	printf("\nData:\n");
-	last = 0xffffffff;
-	for (i = 0; i < num_samples; i++) {
-		uint32_t curr = turnoff_mask[i] & mask;
-		if (curr != last)
-			printf("@%5d: %08x\n", i, curr);
-		last = curr;
-	}
-	printf("---------------------------\n");
+	ev.events = EPOLLIN;
+	ev.data.ptr = ptr;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		fatal("servod: epoll_ctl() failed: %m\n");
 }
 
-static int
-parse_width(int servo, char *width_arg)
+static void
+close_client(client_t *c)
 {
-	char *p;
-	char *digits = width_arg;
-	double width;
+	client_flush(c);
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	client_free(c);
+}
 
-	if (*width_arg == '-' || *width_arg == '+') {
-		digits++;
-	}
+static void
+accept_clients(int listen_fd)
+{
+	struct epoll_event ev;
+	client_t *c;
+	int fd;
 
-	if (*digits < '0' || *digits > '9') {
-		return -1;
+	while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+		if (!(c = client_new(fd, 1))) {
+			close(fd);
+			continue;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close(fd);
+			client_free(c);
+		}
 	}
-	width = strtod(digits, &p);
+}
 
-	if (*p == '\0') {
-		/* Specified in steps */
-	} else if (!strcmp(p, "us")) {
-		width /= step_time_us;
-	} else if (!strcmp(p, "%")) {
-		width = width * (servo_max_ticks - servo_min_ticks) / 100.0 + servo_min_ticks;
-	} else {
-		return -1;
+/* Commands arrive as newline terminated lines.  Each time a client is
+ * readable we pull in whatever one read() gives us and process every
+ * complete line; a partial line stays in that client's buffer until the
+ * rest of it turns up.  Doing a single read per event keeps one busy
+ * client from starving the others.
+ */
+static void
+handle_client(client_t *c, uint32_t events)
+{
+	struct epoll_event ev;
+	uint64_t errors = c->errors;
+	ssize_t n;
+	char *line;
+
+	if (events & EPOLLOUT)
+		client_flush(c);
+	if (events & (EPOLLIN|EPOLLHUP|EPOLLERR)) {
+		n = linebuf_read(&c->in, c->fd);
+		if (n > 0)
+			stats.bytes[c->replies] += n;
+		while ((line = linebuf_getline(&c->in))) {
+			process_line(c, line);
+			stats.lines[c->replies]++;
+		}
+		if (c->in.overflow) {
+			client_error(c, "Input too long\n");
+			c->in.overflow = 0;
+		}
+		stats.errors[c->replies] += c->errors - errors;
+		if (c != fifo_client && (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)))
+			c->dead = 1;
 	}
-	width = floor(width);
-	if (*width_arg == '+') {
-		width = servowidth[servo] + width;
-		if (width > servo_max_ticks)
-			width = servo_max_ticks;
-	} else if (*width_arg == '-') {
-		width = servowidth[servo] - width;
-		if (width < servo_min_ticks)
-			width = servo_min_ticks;
+	if (c->dead) {
+		close_client(c);
+		return;
 	}
-
-	if (width == 0) {
-		return (int)width;
-	} else if (width < servo_min_ticks || width > servo_max_ticks) {
-		return -1;
-	} else {
-		return (int)width;
+	// Only ask for EPOLLOUT while there are replies waiting to go
+	if (!!c->out_len != c->polling_out) {
+		c->polling_out = !!c->out_len;
+		ev.events = EPOLLIN | (c->polling_out ? EPOLLOUT : 0);
+		ev.data.ptr = c;
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
 	}
 }
 
 static void
-go_go_go(void)
+go_go_go(int listen_fd)
 {
-	int fd;
-	struct timeval tv;
-	static char line[128];
-	int nchars = 0;
+	struct epoll_event events[MAX_EVENTS];
+	uint64_t expirations;
+	int fd, ring_fd, i, n;
+	char *tag;
 
 	if ((fd = open(DEVFILE, O_RDWR|O_NONBLOCK)) == -1)
 		fatal("servod: Failed to open %s: %m\n", DEVFILE);
+	if (!(fifo_client = client_new(fd, 0)))
+		fatal("servod: Failed to allocate input buffer\n");
+	if ((ring_fd = ring_start()) < 0)
+		fatal("servod: Failed to start ring thread: %m\n");
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		fatal("servod: epoll_create1() failed: %m\n");
+	watch_fd(fd, fifo_client);
+	watch_fd(listen_fd, &listen_tag);
+	watch_fd(ring_fd, &ring_tag);
+	for (i = 0; i < num_groups; i++) {
+		groups[i].cycle_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+		if (groups[i].cycle_fd < 0)
+			fatal("servod: timerfd_create() failed: %m\n");
+		watch_fd(groups[i].cycle_fd, cycle_tag + i);
+	}
+	if ((idle_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) < 0)
+		fatal("servod: timerfd_create() failed: %m\n");
+	watch_fd(idle_fd, &idle_tag);
+	if (stats_path) {
+		struct itimerspec its = { { STATS_INTERVAL_S, 0 }, { STATS_INTERVAL_S, 0 } };
+
+		stats_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+		if (stats_fd < 0 || timerfd_settime(stats_fd, 0, &its, NULL) < 0)
+			fatal("servod: Failed to start stats timer: %m\n");
+		watch_fd(stats_fd, &stats_tag);
+	}
+	if (watchdog_ms) {
+		init_watchdog();
+		if ((watchdog_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) < 0)
+			fatal("servod: timerfd_create() failed: %m\n");
+		arm_timer(watchdog_fd, watchdog_ms * 1000ULL);
+		watch_fd(watchdog_fd, &watchdog_tag);
+		for (i = 0; i < num_watched; i++) {
+			watched[i].restart_fd = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK|TFD_CLOEXEC);
+			if (watched[i].restart_fd < 0)
+				fatal("servod: timerfd_create() failed: %m\n");
+			watch_fd(watched[i].restart_fd, restart_tag + i);
+		}
+	}
 
 	for (;;) {
-		int n, width, servo;
-		fd_set ifds;
-		char width_arg[64];
-
-		FD_ZERO(&ifds);
-		FD_SET(fd, &ifds);
-		get_next_idle_timeout(&tv);
-		if ((n = select(fd+1, &ifds, NULL, NULL, &tv)) != 1)
-			continue;
-		while (read(fd, line+nchars, 1) == 1) {
-			if (line[nchars] == '\n') {
-				line[++nchars] = '\0';
-				nchars = 0;
-				if (line[0] == 'p' || line[0] == 'P') {
-					int hdr, pin, width;
-
-					n = sscanf(line+1, "%d-%d=%s", &hdr, &pin, width_arg);
-					if (n != 3) {
-						fprintf(stderr, "Bad input: %s", line);
-					} else if (hdr != 1 && hdr != 5) {
-						fprintf(stderr, "Invalid header P%d\n", hdr);
-					} else if (pin < 1 ||
-							(hdr == 1 && pin > NUM_P1PINS) ||
-							(hdr == 5 && pin > NUM_P5PINS)) {
-						fprintf(stderr, "Invalid pin number P%d-%d\n", hdr, pin);
-					} else if ((hdr == 1 && p1pin2servo[pin] == DMY) ||
-						   (hdr == 5 && p5pin2servo[pin] == DMY)) {
-							fprintf(stderr, "P%d-%d is not mapped to a servo\n", hdr, pin);
-					} else {
-						if (hdr == 1) {
-							servo = p1pin2servo[pin];
-						} else {
-							servo = p5pin2servo[pin];
-						}
-						if ((width = parse_width(servo, width_arg)) < 0) {
-							fprintf(stderr, "Invalid width specified\n");
-						} else {
-							set_servo(servo, width);
-						}
-					}
-				} else {
-					n = sscanf(line, "%d=%s", &servo, width_arg);
-					if (!strcmp(line, "debug\n")) {
-						do_debug();
-					} else if (!strncmp(line, "status ", 7)) {
-						do_status(line + 7);
-					} else if (n != 2) {
-						fprintf(stderr, "Bad input: %s", line);
-					} else if (servo < 0 || servo >= MAX_SERVOS) {
-						fprintf(stderr, "Invalid servo number %d\n", servo);
-					} else if (servo2gpio[servo] == DMY) {
-						fprintf(stderr, "Servo %d is not mapped to a GPIO pin\n", servo);
-					} else if ((width = parse_width(servo, width_arg)) < 0) {
-						fprintf(stderr, "Invalid width specified\n");
-					} else {
-						set_servo(servo, width);
-					}
-				}
-			} else {
-				if (++nchars >= 126) {
-					fprintf(stderr, "Input too long\n");
-					nchars = 0;
-				}
-			}
+		n = epoll_wait(epoll_fd, events, MAX_EVENTS, flush_pending() ? 1 : -1);
+		loop_now = monotonic_ns();
+		for (i = 0; i < n; i++) {
+			tag = events[i].data.ptr;
+			if (tag == &listen_tag)
+				accept_clients(listen_fd);
+			else if (tag == &ring_tag)
+				process_ring();
+			else if (tag >= cycle_tag && tag < cycle_tag + MAX_GROUPS)
+				advance_cycle(groups + (tag - cycle_tag));
+			else if (tag == &idle_tag)
+				read(idle_fd, &expirations, sizeof(expirations));
+			else if (tag == &stats_tag)
+				rewrite_stats_file();
+			else if (tag == &watchdog_tag)
+				check_dma();
+			else if (tag >= restart_tag && tag < restart_tag + MAX_GROUPS + 1)
+				restart_step(watched + (tag - restart_tag));
+			else
+				handle_client(events[i].data.ptr, events[i].events);
 		}
+		flush_masks();
+		expire_idle_timers();
 	}
 }
 
@@ -588,7 +2641,7 @@ go_go_go(void)
 
 
 static int
-parse_min_max_arg(char *arg, char *name)
+parse_min_max_arg(const group_t *g, char *arg, char *name)
 {
 	char *p;
 	double val = strtod(arg, &p);
@@ -604,15 +2657,15 @@ parse_min_max_arg(char *arg, char *name)
 		if (val != floor(val)) {
 			fatal("Invalid %s value specified\n", name);
 		}
-		if ((int)val % step_time_us) {
+		if ((int)val % g->step_time_us) {
 			fatal("%s value is not a multiple of step-time\n", name);
 		}
-		return val / step_time_us;
+		return val / g->step_time_us;
 	} else if (!strcmp(p, "%")) {
 		if (val < 0 || val > 100.0) {
 			fatal("%s value must be between 0% and 100% inclusive\n", name);
 		}
-		return (int)(val * (double)cycle_time_us / 100.0 / step_time_us);
+		return (int)(val * (double)g->cycle_time_us / 100.0 / g->step_time_us);
 	} else {
 		fatal("Invalid %s value specified\n", name);
 	}
@@ -620,6 +2673,505 @@ parse_min_max_arg(char *arg, char *name)
 	return -1;	/* Never reached */
 }
 
+/* Each --curve is "<curve>" for every output, or "<servo>,...:<curve>" for
+ * some; later ones take precedence.  Curves are built in fine ticks, so
+ * with --dither they can use the steps in between, and separately for each
+ * group, whose min and max may differ.
+ */
+static void
+init_curves(char **args, int num_args)
+{
+	int servos[MAX_SERVOS];
+	int i, j, n, servo;
+	char *spec, *p;
+	group_t *g;
+	int *lut;
+
+	for (i = 0; i < num_args; i++) {
+		spec = args[i];
+		n = 0;
+		if (*spec >= '0' && *spec <= '9') {
+			for (p = spec; ; p++) {
+				servo = strtol(p, &p, 10);
+				if (servo >= MAX_SERVOS || servo2gpio[servo] == DMY)
+					fatal("Invalid servo %d in --curve=%s\n", servo, args[i]);
+				servos[n++] = servo;
+				if (*p != ',' || n == MAX_SERVOS)
+					break;
+			}
+			if (*p != ':')
+				fatal("Invalid --curve=%s\n", args[i]);
+			spec = p + 1;
+		} else {
+			for (servo = 0; servo < MAX_SERVOS; servo++) {
+				if (servo2gpio[servo] != DMY)
+					servos[n++] = servo;
+			}
+		}
+		for (g = groups; g < groups + num_groups; g++) {
+			lut = NULL;
+			for (j = 0; j < n; j++) {
+				if (GROUP_OF(servos[j]) != g)
+					continue;
+				if (!lut && !(lut = malloc(CURVE_LEVELS * sizeof(*lut))))
+					fatal("servod: malloc() failed\n");
+				servo_curve[servos[j]] = lut;
+				curve_name[servos[j]] = spec;
+			}
+			if (lut && curve_build(lut, spec, g->servo_min_ticks << dither_bits,
+					g->servo_max_ticks << dither_bits) < 0)
+				fatal("Invalid curve '%s': %m\n", spec);
+		}
+	}
+}
+
+static void
+print_group(const group_t *g)
+{
+	printf("Using hardware:                %s\n", g->delay_hw == DELAY_VIA_PWM ? "PWM" : "PCM");
+	printf("Using DMA channel:         %7d\n", g->dma_chan);
+	printf("Number of servos:          %7d\n", g->num_servos);
+	printf("Servo cycle time:          %7dus\n", g->cycle_time_us);
+	printf("Pulse increment step size: %7dus\n", g->step_time_us);
+	printf("Minimum width value:       %7d (%dus)\n", g->servo_min_ticks,
+						g->servo_min_ticks * g->step_time_us);
+	printf("Maximum width value:       %7d (%dus)\n", g->servo_max_ticks,
+						g->servo_max_ticks * g->step_time_us);
+	printf("Chain layout:             %s\n", chain_names[g->chain_mode]);
+}
+
+/* Settings from the command line for one group, which init_group() checks
+ * and works the group's timing and chain layout out from.
+ */
+typedef struct {
+	char *dma_chan;
+	char *cycle_time;
+	char *step_time;
+	char *min;
+	char *max;
+	char *bcm;
+	int chain_mode;
+	int capture;
+} group_args_t;
+
+/* "--group=<servos>:<setting>:..." moves the listed servos into group 1,
+ * which runs on its own DMA channel, given by "dma-chan=N", with the other
+ * settings being "cycle-time=N", "step-size=N", "min=N", "max=N" and one
+ * of "relink", "sparse" or "bcm=N", as for the options of the same names.
+ * Settings left out take the defaults, not the values given for group 0.
+ */
+static void
+parse_group_arg(char *arg, group_args_t *a)
+{
+	char *p = arg, *end, *setting;
+	long servo;
+
+	do {
+		servo = strtol(p, &end, 10);
+		if (end == p || servo < 0 || servo >= MAX_SERVOS || servo2gpio[servo] == DMY)
+			fatal("Invalid servo in --group=%s\n", arg);
+		servo_group[servo] = 1;
+		p = end;
+	} while (*p++ == ',');
+	if (p[-1] != ':')
+		fatal("Invalid --group=%s\n", arg);
+
+	memset(a, 0, sizeof(*a));
+	a->chain_mode = CHAIN_MASK;
+	for (setting = p; setting; setting = p) {
+		if ((p = strchr(setting, ':')))
+			*p++ = '\0';
+		if (!strncmp(setting, "dma-chan=", 9))
+			a->dma_chan = setting + 9;
+		else if (!strncmp(setting, "cycle-time=", 11))
+			a->cycle_time = setting + 11;
+		else if (!strncmp(setting, "step-size=", 10))
+			a->step_time = setting + 10;
+		else if (!strncmp(setting, "min=", 4))
+			a->min = setting + 4;
+		else if (!strncmp(setting, "max=", 4))
+			a->max = setting + 4;
+		else if (a->chain_mode == CHAIN_MASK && !strcmp(setting, "relink"))
+			a->chain_mode = CHAIN_RELINK;
+		else if (a->chain_mode == CHAIN_MASK && !strcmp(setting, "sparse"))
+			a->chain_mode = CHAIN_SPARSE;
+		else if (a->chain_mode == CHAIN_MASK && !strncmp(setting, "bcm=", 4)) {
+			a->chain_mode = CHAIN_BCM;
+			a->bcm = setting + 4;
+		} else {
+			fatal("Invalid setting '%s' in --group\n", setting);
+		}
+	}
+	if (!a->dma_chan)
+		fatal("--group needs a dma-chan setting\n");
+}
+
+static void
+init_group(group_t *g, const group_args_t *a)
+{
+	char *p;
+	int i;
+
+	g->chain_mode = a->chain_mode;
+	g->capture = a->capture;
+	g->capture_levels = ~0;
+	if (g->capture && g->chain_mode != CHAIN_MASK)
+		fatal("--capture needs the normal chain layout\n");
+	if (a->dma_chan) {
+		g->dma_chan = strtol(a->dma_chan, &p, 10);
+		if (*a->dma_chan < '0' || *a->dma_chan > '9' ||
+				*p || g->dma_chan < DMA_CHAN_MIN || g->dma_chan > DMA_CHAN_MAX)
+			fatal("Invalid dma-chan specified\n");
+	} else {
+		g->dma_chan = dma_chan;
+	}
+
+	if (a->cycle_time) {
+		g->cycle_time_us = strtol(a->cycle_time, &p, 10);
+		if (*a->cycle_time < '0' || *a->cycle_time > '9' ||
+				(*p && strcmp(p, "us")) ||
+				g->cycle_time_us < 1000 || g->cycle_time_us > 1000000)
+			fatal("Invalid cycle-time specified\n");
+	} else {
+		g->cycle_time_us = DEFAULT_CYCLE_TIME_US;
+	}
+
+	if (a->step_time) {
+		g->step_time_us = strtol(a->step_time, &p, 10);
+		if (*a->step_time < '0' || *a->step_time > '9' ||
+				(*p && strcmp(p, "us")) ||
+				g->step_time_us < 2 || g->step_time_us > 1000) {
+			fatal("Invalid step-size specified\n");
+		}
+	} else {
+		g->step_time_us = DEFAULT_STEP_TIME_US;
+	}
+
+	if (g->chain_mode == CHAIN_BCM) {
+		g->bcm_bits = strtol(a->bcm, &p, 10);
+		if (*a->bcm < '0' || *a->bcm > '9' || *p ||
+				g->bcm_bits < BCM_MIN_BITS || g->bcm_bits > BCM_MAX_BITS)
+			fatal("Invalid bcm bits specified, must be %d to %d\n",
+					BCM_MIN_BITS, BCM_MAX_BITS);
+		if (a->cycle_time)
+			fatal("cycle-time can't be given with --bcm\n");
+		g->cycle_time_us = ((1 << g->bcm_bits) - 1) * g->step_time_us;
+		if (g->cycle_time_us > BCM_MAX_CYCLE_US)
+			fatal("--bcm=%d with %dus steps gives a %dus cycle, over the "
+				"%dus limit; use fewer bits or a smaller step-size\n",
+				g->bcm_bits, g->step_time_us, g->cycle_time_us,
+				BCM_MAX_CYCLE_US);
+	}
+
+	if (g->cycle_time_us % g->step_time_us) {
+		fatal("cycle-time is not a multiple of step-size\n");
+	}
+
+	if (g->chain_mode != CHAIN_BCM && g->cycle_time_us / g->step_time_us < 100) {
+		fatal("cycle-time must be at least 100 * step-size\n");
+	}
+
+	if (a->min) {
+		g->servo_min_ticks = parse_min_max_arg(g, a->min, "min");
+	} else if (g->chain_mode == CHAIN_BCM) {
+		g->servo_min_ticks = 0;
+	} else {
+		g->servo_min_ticks = DEFAULT_SERVO_MIN_US / g->step_time_us;
+	}
+
+	if (a->max) {
+		g->servo_max_ticks = parse_min_max_arg(g, a->max, "max");
+	} else if (g->chain_mode == CHAIN_BCM) {
+		g->servo_max_ticks = g->cycle_time_us / g->step_time_us;
+	} else {
+		g->servo_max_ticks = DEFAULT_SERVO_MAX_US / g->step_time_us;
+	}
+
+	// Bank 1 costs the DMA controller more, so only use it if we must
+	g->num_banks = 1;
+	for (i = 0; i < MAX_SERVOS; i++) {
+		if (servo2gpio[i] == DMY || GROUP_OF(i) != g || hw_pwm[i])
+			continue;
+		g->num_servos++;
+		if (GPIO_BANK(servo2gpio[i]))
+			g->num_banks = 2;
+	}
+	// Group 0 still paces the cycle when all its outputs are on the PWM block
+	if (!g->num_servos && !(g == groups && num_hw_pwm))
+		fatal("Group %d has no servos\n", (int)(g - groups));
+
+	g->num_samples = g->cycle_time_us / g->step_time_us;
+	g->num_cbs =     g->num_samples * (g->capture ? 4 : 2) + MAX_SERVOS;
+	if (g->chain_mode == CHAIN_RELINK)
+		g->num_pages = (relink_mem_size(g->num_samples) + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	else if (g->chain_mode == CHAIN_SPARSE)
+		g->num_pages = (sparse_mem_size(g->num_samples) + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	else if (g->chain_mode == CHAIN_BCM)
+		g->num_pages = (bcm_mem_size(g->bcm_bits) + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	else
+		g->num_pages = ((g->num_cbs + FRAME_CBS) * sizeof(dma_cb_t) +
+				(g->num_samples * g->num_banks + MAX_SERVOS) * 4 * 2 + 4 +
+				g->capture * g->num_samples * sizeof(capture_slot_t) +
+				PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+	if (g->num_pages > MAX_MEMORY_USAGE / PAGE_SIZE) {
+		fatal("Using too much memory; reduce cycle-time or increase step-size\n");
+	}
+
+	if (g->servo_max_ticks > g->num_samples) {
+		fatal("max value is larger than cycle time\n");
+	}
+	if (g->servo_min_ticks >= g->servo_max_ticks) {
+		fatal("min value is >= max value\n");
+	}
+}
+
+static void
+alloc_dma_mem(mbox_t *m, int num_pages)
+{
+	/* Use the mailbox interface to the VC to ask for physical memory */
+	// Use the mailbox interface to request memory from the VideoCore
+	// We specifiy (-1) for the handle rather than calling mbox_open()
+	// so multiple users can share the resource.
+	m->handle = -1; // mbox_open();
+	m->size = num_pages * 4096;
+	m->mem_ref = mem_alloc(m->handle, m->size, 4096, mem_flag);
+	if (m->mem_ref < 0) {
+		fatal("Failed to alloc memory from VideoCore\n");
+	}
+	m->bus_addr = mem_lock(m->handle, m->mem_ref);
+	if (m->bus_addr == ~0) {
+		mem_free(m->handle, m->size);
+		fatal("Failed to lock memory\n");
+	}
+	m->virt_addr = mapmem(BUS_TO_PHYS(m->bus_addr), m->size);
+}
+
+static void
+free_dma_mem(mbox_t *m)
+{
+	if (m->virt_addr != NULL) {
+		unmapmem(m->virt_addr, m->size);
+		mem_unlock(m->handle, m->mem_ref);
+		mem_free(m->handle, m->mem_ref);
+		if (m->handle >= 0)
+			mbox_close(m->handle);
+		m->virt_addr = NULL;
+	}
+}
+
+// Get memory from the VideoCore for the group's chain, then build it
+static void
+start_group(group_t *g)
+{
+	mbox_t *m = &g->mbox;
+
+	g->dma_reg = dma_base + g->dma_chan * DMA_CHAN_SIZE / sizeof(uint32_t);
+	alloc_dma_mem(m, g->num_pages);
+
+	if (g->chain_mode == CHAIN_MASK) {
+		g->turnoff_mask = (uint32_t *)m->virt_addr;
+		g->turnon_mask = (uint32_t *)(m->virt_addr +
+			g->num_samples * g->num_banks * sizeof(uint32_t));
+		if (g->capture)
+			g->capture_slots = (capture_slot_t *)(g->turnon_mask + MAX_SERVOS);
+		g->cb_base = (dma_cb_t *)(m->virt_addr +
+			ROUNDUP(g->num_samples * g->num_banks + MAX_SERVOS +
+				g->capture * g->num_samples * 2, 8) * sizeof(uint32_t));
+		// Then the frame CBs and the words they copy
+		g->frame_cbs = g->cb_base + g->num_cbs;
+		g->frame_stage = (uint32_t *)(g->frame_cbs + FRAME_CBS);
+	}
+	init_ctrl_data(g);
+}
+
+/* "--strip=<pixels>:dma-chan=N" drives that many pixels, up to
+ * STRIP_MAX_PIXELS, from the given DMA channel.
+ */
+static void
+parse_strip_arg(char *arg)
+{
+	char *p, *end, *setting;
+	long n;
+
+	n = strtol(arg, &p, 10);
+	if (p == arg || n < 1 || n > STRIP_MAX_PIXELS || *p != ':')
+		fatal("Invalid --strip=%s, it needs 1 to %d pixels and a dma-chan\n",
+				arg, STRIP_MAX_PIXELS);
+	strip_pixels = n;
+	strip_dma_chan = -1;
+	for (setting = p + 1; setting; setting = p) {
+		if ((p = strchr(setting, ':')))
+			*p++ = '\0';
+		if (!strncmp(setting, "dma-chan=", 9)) {
+			n = strtol(setting + 9, &end, 10);
+			if (setting[9] < '0' || setting[9] > '9' || *end ||
+					n < DMA_CHAN_MIN || n > DMA_CHAN_MAX)
+				fatal("Invalid dma-chan specified\n");
+			strip_dma_chan = n;
+		} else {
+			fatal("Invalid setting '%s' in --strip\n", setting);
+		}
+	}
+	if (strip_dma_chan < 0)
+		fatal("--strip needs a dma-chan setting\n");
+}
+
+// Tell tools such as servodebug where to find the capture ring
+static void
+write_capture_cfg(const group_t *g)
+{
+	FILE *fp = fopen(CFGFILE, "a");
+
+	if (!fp)
+		return;
+	fprintf(fp, "\nCapture ring: %d slots of %dus at 0x%08x\n", g->num_samples,
+			g->step_time_us, BUS_TO_PHYS(mem_virt_to_phys(g, g->capture_slots)));
+	fclose(fp);
+}
+
+// Get memory for the strip's buffers, then start it sending, all pixels off
+static void
+start_strip(void)
+{
+	strip_dma_reg = dma_base + strip_dma_chan * DMA_CHAN_SIZE / sizeof(uint32_t);
+	alloc_dma_mem(&strip_mbox, (strip_mem_size(strip_pixels) + PAGE_SIZE - 1) >> PAGE_SHIFT);
+	strip_init(&strip, strip_mbox.virt_addr, strip_mbox.bus_addr, strip_pixels,
+			PCM_PHYS_BASE + 0x04,
+			DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP | DMA_D_DREQ | DMA_PER_MAP(2));
+	init_strip_pcm(strip_dma_reg, strip_entry_bus());
+	strip_gpio_mode = gpio_get_mode(STRIP_GPIO);
+	gpio_set_mode(STRIP_GPIO, GPIO_MODE_ALT0);
+	printf("\nStrip refresh rate:        %7.1fHz\n", strip_refresh_hz(&strip));
+}
+
+/* Blank the strip, which needs the blank frame to have gone out in full,
+ * then stop it.  Called from stop_groups().
+ */
+static void
+stop_strip(void)
+{
+	int i, frame_us, tries = 0;
+
+	if (!strip_dma_reg || !strip_mbox.virt_addr)
+		return;
+	frame_us = 1000000 / strip_refresh_hz(&strip) + 1;
+	for (i = 0; i < strip.num_pixels; i++)
+		strip_set(&strip, i, 0);
+	while (strip_flush(&strip) < 0 && tries++ < 3)
+		udelay(frame_us);
+	udelay(frame_us * 2);
+	gpio_set_mode(STRIP_GPIO, strip_gpio_mode);
+	stop_strip_pcm(strip_dma_reg);
+	free_dma_mem(&strip_mbox);
+}
+
+/* --hw-pwm gives each of the PWM block's two channels to the first servo
+ * in group 0 on a pin that channel can drive.  Anything else stays on DMA:
+ * servos on other pins, a second servo for a channel already taken, a
+ * channel the kernel's PWM driver has, and everything when group 1 needs
+ * the PWM block to pace it, or when --strip has PCM so group 0 needs it.
+ * If any servo does get a channel, group 0 is paced by PCM instead.
+ */
+static void
+init_hw_pwm_servos(void)
+{
+	uint32_t mode;
+	int servo, chan, taken = 0;
+
+	if (num_groups > 1 || strip_pixels)
+		return;
+	for (servo = 0; servo < MAX_SERVOS; servo++) {
+		if (servo2gpio[servo] == DMY ||
+				(chan = hw_pwm_channel(servo2gpio[servo], &mode)) < 0 ||
+				(taken & (1 << chan)) || hw_pwm_claimed(chan))
+			continue;
+		hw_pwm[servo] = chan + 1;
+		taken |= 1 << chan;
+		num_hw_pwm++;
+	}
+	if (num_hw_pwm)
+		groups[0].delay_hw = DELAY_VIA_PCM;
+}
+
+// Which servos init_hw_pwm_servos() gave a PWM channel, and why not the rest
+static void
+print_hw_pwm(void)
+{
+	uint32_t mode;
+	int servo, chan, n = 0;
+
+	printf("\nHardware PWM:\n");
+	for (servo = 0; servo < MAX_SERVOS; servo++) {
+		if (servo2gpio[servo] == DMY ||
+				(chan = hw_pwm_channel(servo2gpio[servo], &mode)) < 0)
+			continue;
+		if (hw_pwm[servo])
+			printf("    %2d on PWM%d\n", servo, chan + 1);
+		else if (num_groups > 1)
+			printf("    %2d on DMA, as group 1 is paced by PWM\n", servo);
+		else if (strip_pixels)
+			printf("    %2d on DMA, as PCM drives the strip\n", servo);
+		else if (hw_pwm_claimed(chan))
+			printf("    %2d on DMA, as the kernel has PWM%d\n", servo, chan + 1);
+		else
+			printf("    %2d on DMA, as PWM%d is taken\n", servo, chan + 1);
+		n++;
+	}
+	if (!n)
+		printf("    None, as no servos are on GPIO 12, 13, 18 or 19\n");
+}
+
+/* Called from terminate(), perhaps before everything is set up: turn every
+ * output off, give the controllers a cycle or two to take that up, then
+ * stop them and give their memory back.  The strip is blanked and stopped
+ * along with them.
+ */
+void
+stop_groups(void)
+{
+	int i, wait_us = 0;
+	group_t *g;
+
+	for (g = groups; g < groups + num_groups; g++) {
+		if (!g->dma_reg || !g->mbox.virt_addr)
+			continue;
+		for (i = 0; i < MAX_SERVOS; i++) {
+			if (servo2gpio[i] != DMY && GROUP_OF(i) == g)
+				set_servo(i, 0);
+		}
+		flush_group(g);
+		if (g->cycle_time_us > wait_us)
+			wait_us = g->cycle_time_us;
+	}
+	if (wait_us) {
+		udelay(wait_us);
+		// Some chain layouts only take changes up at the next cycle
+		for (g = groups; g < groups + num_groups; g++) {
+			if (g->dma_reg && g->mbox.virt_addr)
+				flush_group(g);
+		}
+		udelay(wait_us);
+	}
+	if (hw_pwm_started) {
+		// Hand the pins back to their output latches, which are off, first
+		for (i = 0; i < MAX_SERVOS; i++) {
+			if (hw_pwm[i])
+				gpio_set_mode(servo2gpio[i], GPIO_MODE_OUT);
+		}
+		stop_hw_pwm();
+		hw_pwm_started = 0;
+	}
+	stop_strip();
+	for (g = groups; g < groups + num_groups; g++) {
+		if (g->dma_reg && g->mbox.virt_addr) {
+			g->dma_reg[DMA_CS] = DMA_RESET;
+			udelay(10);
+		}
+		free_dma_mem(&g->mbox);
+	}
+}
+
 int
 main(int argc, char **argv)
 {
@@ -627,14 +3179,21 @@ main(int argc, char **argv)
 	char *p1pins = default_p1_pins;
 	char *p5pins = default_p5_pins;
 	int p1first = 1, hadp1 = 0, hadp5 = 0;
-	char *servo_min_arg = NULL;
-	char *servo_max_arg = NULL;
+	group_args_t args[MAX_GROUPS] = { { .chain_mode = CHAIN_MASK } };
 	char *idle_timeout_arg = NULL;
-	char *cycle_time_arg = NULL;
-	char *step_time_arg = NULL;
-	char *dma_chan_arg = NULL;
+	char *gpios_arg = NULL;
+	char *group_arg = NULL;
+	char *strip_arg = NULL;
+	group_t *g;
+	char *curve_args[MAX_SERVOS + 1];
+	int num_curve_args = 0;
+#ifdef LEDEK_EMULATOR
+	char *vcd_arg = NULL;
+#endif
 	char *p;
 	int daemonize = 1;
+	int hw_pwm_arg = 0;
+	int listen_fd;
 
 	setvbuf(stdout, NULL, _IOLBF, 0);
 
@@ -648,6 +3207,7 @@ main(int argc, char **argv)
 			{ "help",         no_argument,       0, 'h' },
 			{ "p1pins",       required_argument, 0, '1' },
 			{ "p5pins",       required_argument, 0, '5' },
+			{ "gpios",        required_argument, 0, 'g' },
 			{ "min",          required_argument, 0, 'm' },
 			{ "max",          required_argument, 0, 'x' },
 			{ "invert",       no_argument,       0, 'i' },
@@ -655,6 +3215,21 @@ main(int argc, char **argv)
 			{ "step-size",    required_argument, 0, 's' },
 			{ "debug",        no_argument,       0, 'f' },
 			{ "dma-chan",     required_argument, 0, 'd' },
+			{ "relink",       no_argument,       0, 'r' },
+			{ "sparse",       no_argument,       0, 'S' },
+			{ "bcm",          required_argument, 0, 'B' },
+			{ "dither",       no_argument,       0, 'D' },
+			{ "curve",        required_argument, 0, 'C' },
+			{ "group",        required_argument, 0, 'G' },
+			{ "rephase",      no_argument,       0, 'R' },
+			{ "hw-pwm",       no_argument,       0, 'H' },
+			{ "strip",        required_argument, 0, 'W' },
+			{ "capture",      no_argument,       0, 'K' },
+			{ "stats-file",   required_argument, 0, 'M' },
+			{ "watchdog",     required_argument, 0, 'w' },
+#ifdef LEDEK_EMULATOR
+			{ "vcd",          required_argument, 0, 'V' },
+#endif
 			{ 0,              0,                 0, 0   }
 		};
 
@@ -662,21 +3237,57 @@ main(int argc, char **argv)
 		if (c == -1) {
 			break;
 		} else if (c =='d') {
-			dma_chan_arg = optarg;
+			args[0].dma_chan = optarg;
+#ifdef LEDEK_EMULATOR
+		} else if (c == 'V') {
+			vcd_arg = optarg;
+#endif
 		} else if (c == 'f') {
 			daemonize = 0;
+		} else if (c == 'M') {
+			stats_path = optarg;
+		} else if (c == 'w') {
+			watchdog_ms = strtol(optarg, &p, 10);
+			if (*optarg < '0' || *optarg > '9' || (*p && strcmp(p, "ms")) ||
+					(watchdog_ms && watchdog_ms < 10) || watchdog_ms > 3600000)
+				fatal("Invalid watchdog specified\n");
+		} else if (c == 'r' || c == 'S' || c == 'B') {
+			if (args[0].chain_mode != CHAIN_MASK)
+				fatal("Only one of --relink, --sparse and --bcm can be used\n");
+			args[0].chain_mode = c == 'r' ? CHAIN_RELINK :
+					c == 'S' ? CHAIN_SPARSE : CHAIN_BCM;
+			if (c == 'B')
+				args[0].bcm = optarg;
+		} else if (c == 'D') {
+			dither_bits = DITHER_BITS;
+		} else if (c == 'C') {
+			if (num_curve_args == MAX_SERVOS + 1)
+				fatal("Too many --curve options\n");
+			curve_args[num_curve_args++] = optarg;
+		} else if (c == 'G') {
+			if (group_arg)
+				fatal("Only one --group can be used\n");
+			group_arg = optarg;
+		} else if (c == 'R') {
+			auto_rephase = 1;
+		} else if (c == 'H') {
+			hw_pwm_arg = 1;
+		} else if (c == 'W') {
+			strip_arg = optarg;
+		} else if (c == 'K') {
+			args[0].capture = 1;
 		} else if (c == 'p') {
-			delay_hw = DELAY_VIA_PCM;
+			groups[0].delay_hw = DELAY_VIA_PCM;
 		} else if (c == 't') {
 			idle_timeout_arg = optarg;
 		} else if (c == 'c') {
-			cycle_time_arg = optarg;
+			args[0].cycle_time = optarg;
 		} else if (c == 's') {
-			step_time_arg = optarg;
+			args[0].step_time = optarg;
 		} else if (c == 'm') {
-			servo_min_arg = optarg;
+			args[0].min = optarg;
 		} else if (c == 'x') {
-			servo_max_arg = optarg;
+			args[0].max = optarg;
 		} else if (c == 'i') {
 			invert = 1;
 		} else if (c == 'h') {
@@ -696,8 +3307,59 @@ main(int argc, char **argv)
 				"                      %d steps or %dus\n"
 				"  --invert            Inverts outputs\n"
 				"  --dma-chan=N        tells servod which dma channel to use, default %d\n"
+				"  --relink            give each output its own turn-off control block and\n"
+				"                      move that on updates, so an update costs the same\n"
+				"                      whatever the step size; frames are then applied\n"
+				"                      one output at a time\n"
+				"  --sparse            only put control blocks where an edge is due and\n"
+				"                      cover the gaps with long delays, which uses far\n"
+				"                      less memory bandwidth at small step sizes\n"
+				"  --bcm=N             binary code modulation with N bits (%d to %d) of\n"
+				"                      brightness for LEDs; the cycle time is then\n"
+				"                      (2^N - 1) steps, at most %dus, and widths are\n"
+				"                      brightness levels\n"
+				"  --dither            allow widths between whole steps, such as 4=12.37%%,\n"
+				"                      by switching between the nearest whole widths from\n"
+				"                      cycle to cycle so that they average out right\n"
+				"  --curve=[<servos>:]<curve>\n"
+				"                      map percentages and brightness levels onto widths\n"
+				"                      with a curve: linear, gamma[G] (default 2.2), cie,\n"
+				"                      or file:<path> for a table of 0.0 to 1.0 values;\n"
+				"                      <servos> is a comma separated list, default all\n"
+				"  --group=<servos>:<settings>\n"
+				"                      drive the listed servos from a second DMA channel,\n"
+				"                      paced by whichever of PWM and PCM the rest don't\n"
+				"                      use, with its own cycle and step; <settings> are\n"
+				"                      ':' separated, dma-chan=N (required), cycle-time=N,\n"
+				"                      step-size=N, min=N, max=N, relink, sparse, bcm=N\n"
+				"  --rephase           with --sparse, move the starts of pulses as widths\n"
+				"                      change so that fewer are on, or switch, at once\n"
+				"  --hw-pwm            drive up to two servos on GPIO 12, 13, 18 or 19\n"
+				"                      from the PWM block itself, with no DMA and to\n"
+				"                      %dns; the chain is then paced by PCM, and servos\n"
+				"                      it can't take stay on DMA\n"
+				"  --capture           have the DMA controller record the GPIO levels and\n"
+				"                      the time at every step, for the capture command\n"
+				"                      and servodebug; normal chain layout only\n"
+				"  --strip=<pixels>:dma-chan=N\n"
+				"                      drive a WS2812 LED strip of up to %d pixels from\n"
+				"                      the PCM block on GPIO %d, on its own DMA channel;\n"
+				"                      servos are then paced by PWM, and --pcm, --group\n"
+				"                      and --hw-pwm can't have it\n"
+				"  --stats-file=<file> rewrite <file> every second with counters and a\n"
+				"                      latency histogram in the Prometheus text format,\n"
+				"                      for node_exporter's textfile collector and such\n"
+				"  --watchdog=Nms      check the DMA controllers every N milliseconds,\n"
+				"                      default %d, and restart any that has faulted or\n"
+				"                      stalled, keeping the widths; 0 turns it off\n"
 				"  --p1pins=<list>     tells servod which pins on the P1 header to use\n"
 				"  --p5pins=<list>     tells servod which pins on the P5 header to use\n"
+				"  --gpios=<list>      map servos straight onto GPIO numbers, 0 to %d,\n"
+				"                      in place of p1pins and p5pins; GPIO 32 and up\n"
+				"                      cost the DMA controller a little more\n"
+#ifdef LEDEK_EMULATOR
+				"  --vcd=<file>        write emulated GPIO transitions to a VCD file\n"
+#endif
 				"\nwhere <list> defaults to \"%s\" for p1pins and\n"
 				"\"%s\" for p5pins.  p5pins is only valid on rev 2 boards.\n\n"
 				"min and max values can be specified in units of steps, in microseconds,\n"
@@ -715,13 +3377,50 @@ main(int argc, char **argv)
 				"Servo adjustments may also be specified relative to the current\n"
 				"position by adding a '+' or '-' prefix to the width as follows:\n\n"
 				"  echo 0=+10 > /dev/servoblaster\n"
-				"  echo 0=-20 > /dev/servoblaster\n\n",
+				"  echo 0=-20 > /dev/servoblaster\n\n"
+				"Several servos can be changed together, so that they all switch to\n"
+				"their new widths in the same cycle (except with --relink), with a\n"
+				"frame command:\n\n"
+				"  echo frame 0=50%%,1=1200us,5=+3 > /dev/servoblaster\n\n"
+				"Adding @<time> moves to the new width gradually over that time, in\n"
+				"ms or s, with an optional easing of linear (default), in, out, inout\n"
+				"or exp.  exp gives an even looking fade on LEDs:\n\n"
+				"  echo 0=80%%@500ms > /dev/servoblaster\n"
+				"  echo 3=100%%@2s:exp > /dev/servoblaster\n\n"
+				"Brightness can also be given as a 16 bit level from 0 to 65535, which\n"
+				"goes through the output's --curve just as a percentage does:\n\n"
+				"  echo 0=40000lv > /dev/servoblaster\n\n"
+				"The idle timeout can be set for each output separately, in ms or s,\n"
+				"or 0 to disable it:\n\n"
+				"  echo idle 2=1500ms > /dev/servoblaster\n\n"
+				"With --sparse, the starts of pulses can be moved once to suit the\n"
+				"widths the outputs have now, and the result is logged:\n\n"
+				"  echo rephase > /dev/servoblaster\n\n"
+				"With --capture, the changes on the outputs since the last capture,\n"
+				"or over the last cycle, are written to a file:\n\n"
+				"  echo capture /tmp/edges > /dev/servoblaster\n\n"
+				"The counts --stats-file keeps can be written out at any time:\n\n"
+				"  echo stats /tmp/ledek.prom > /dev/servoblaster\n\n"
+				"With --strip, pixels are set to rrggbb colours, which are repeated\n"
+				"to fill a range; all the pixels in one command change together:\n\n"
+				"  echo strip 0..59=ff0000 > /dev/servoblaster\n"
+				"  echo strip 4=00ff00,0000ff > /dev/servoblaster\n\n"
+				"The same commands can be sent over the Unix domain socket %s,\n"
+				"which replies to each line with \"OK\" or \"ERROR: <reason>\":\n\n"
+				"  echo 0=50%% | socat - UNIX-CONNECT:%s\n\n"
+				"Programs sending a lot of updates can instead push binary records\n"
+				"into the shared memory ring %s; see servoring.h.\n\n",
 				argv[0],
 				DEFAULT_CYCLE_TIME_US,
 				DEFAULT_STEP_TIME_US,
 				DEFAULT_SERVO_MIN_US/DEFAULT_STEP_TIME_US, DEFAULT_SERVO_MIN_US,
 				DEFAULT_SERVO_MAX_US/DEFAULT_STEP_TIME_US, DEFAULT_SERVO_MAX_US,
-				DMA_CHAN_DEFAULT, default_p1_pins, default_p5_pins);
+				DMA_CHAN_DEFAULT, BCM_MIN_BITS, BCM_MAX_BITS, BCM_MAX_CYCLE_US,
+				1000 / HWPWM_CLOCK_MHZ, STRIP_MAX_PIXELS, STRIP_GPIO,
+				WATCHDOG_DEFAULT_MS,
+				NUM_GPIOS - 1,
+				default_p1_pins, default_p5_pins,
+				CTLFILE, CTLFILE, SERVORING_NAME);
 			exit(0);
 		} else if (c == '1') {
 			p1pins = optarg;
@@ -733,6 +3432,8 @@ main(int argc, char **argv)
 			hadp5 = 1;
 			if (!hadp1)
 				p1first = 0;
+		} else if (c == 'g') {
+			gpios_arg = optarg;
 		} else {
 			fatal("Invalid parameter\n");
 		}
@@ -743,14 +3444,32 @@ main(int argc, char **argv)
 	if (board_model == 2 && p5pins[0])
 		fatal("Board models 2 and later do not have a P5 header\n");
 
-	parse_pin_lists(p1first, p1pins, p5pins);
+	if (gpios_arg && (hadp1 || hadp5))
+		fatal("--gpios can't be used with --p1pins or --p5pins\n");
+	if (gpios_arg)
+		parse_gpio_list(gpios_arg);
+	else
+		parse_pin_lists(p1first, p1pins, p5pins);
 
-	if (dma_chan_arg) {
-		dma_chan = strtol(dma_chan_arg, &p, 10);
-		if (*dma_chan_arg < '0' || *dma_chan_arg > '9' ||
-				*p || dma_chan < DMA_CHAN_MIN || dma_chan > DMA_CHAN_MAX)
-			fatal("Invalid dma-chan specified\n");
+	if (group_arg) {
+		parse_group_arg(group_arg, args + 1);
+		num_groups = 2;
 	}
+	if (strip_arg) {
+		parse_strip_arg(strip_arg);
+		if (groups[0].delay_hw == DELAY_VIA_PCM)
+			fatal("--strip needs PCM, so can't be used with --pcm\n");
+		if (group_arg)
+			fatal("--strip needs PCM, so can't be used with --group\n");
+		for (i = 0; i < MAX_SERVOS; i++) {
+			if (servo2gpio[i] == STRIP_GPIO)
+				fatal("Servo %d is on GPIO %d, which --strip needs\n", i, STRIP_GPIO);
+		}
+	}
+	if (hw_pwm_arg)
+		init_hw_pwm_servos();
+	// PWM and PCM can each pace one group
+	groups[1].delay_hw = groups[0].delay_hw == DELAY_VIA_PWM ? DELAY_VIA_PCM : DELAY_VIA_PWM;
 
 	if (idle_timeout_arg) {
 		idle_timeout = strtol(idle_timeout_arg, &p, 10);
@@ -762,130 +3481,92 @@ main(int argc, char **argv)
 		idle_timeout = 0;
 	}
 
-	if (cycle_time_arg) {
-		cycle_time_us = strtol(cycle_time_arg, &p, 10);
-		if (*cycle_time_arg < '0' || *cycle_time_arg > '9' ||
-				(*p && strcmp(p, "us")) ||
-				cycle_time_us < 1000 || cycle_time_us > 1000000)
-			fatal("Invalid cycle-time specified\n");
-	} else {
-		cycle_time_us = DEFAULT_CYCLE_TIME_US;
-	}
-
-	if (step_time_arg) {
-		step_time_us = strtol(step_time_arg, &p, 10);
-		if (*step_time_arg < '0' || *step_time_arg > '9' ||
-				(*p && strcmp(p, "us")) ||
-				step_time_us < 2 || step_time_us > 1000) {
-			fatal("Invalid step-size specified\n");
-		}
-	} else {
-		step_time_us = DEFAULT_STEP_TIME_US;
-	}
-
-	if (cycle_time_us % step_time_us) {
-		fatal("cycle-time is not a multiple of step-size\n");
-	}
-
-	if (cycle_time_us / step_time_us < 100) {
-		fatal("cycle-time must be at least 100 * step-size\n");
-	}
-
-	if (servo_min_arg) {
-		servo_min_ticks = parse_min_max_arg(servo_min_arg, "min");
-	} else {
-		servo_min_ticks = DEFAULT_SERVO_MIN_US / step_time_us;
-	}
-
-	if (servo_max_arg) {
-		servo_max_ticks = parse_min_max_arg(servo_max_arg, "max");
-	} else {
-		servo_max_ticks = DEFAULT_SERVO_MAX_US / step_time_us;
-	}
-
-	num_samples = cycle_time_us / step_time_us;
-	num_cbs =     num_samples * 2 + MAX_SERVOS;
-	num_pages =   (num_cbs * sizeof(dma_cb_t) + num_samples * 4 +
-				MAX_SERVOS * 4 + PAGE_SIZE - 1) >> PAGE_SHIFT;
-
-	if (num_pages > MAX_MEMORY_USAGE / PAGE_SIZE) {
-		fatal("Using too much memory; reduce cycle-time or increase step-size\n");
-	}
+	for (i = 0; i < num_groups; i++)
+		init_group(groups + i, args + i);
+	if (num_groups > 1 && groups[0].dma_chan == groups[1].dma_chan)
+		fatal("Each group needs a DMA channel of its own\n");
+	if (strip_pixels && strip_dma_chan == groups[0].dma_chan)
+		fatal("--strip needs a DMA channel of its own\n");
+	if (auto_rephase && groups[0].chain_mode != CHAIN_SPARSE &&
+			(num_groups == 1 || groups[1].chain_mode != CHAIN_SPARSE))
+		fatal("--rephase needs a group with the sparse chain layout\n");
 
-	if (servo_max_ticks > num_samples) {
-		fatal("max value is larger than cycle time\n");
-	}
-	if (servo_min_ticks >= servo_max_ticks) {
-		fatal("min value is >= max value\n");
-	}
+	init_curves(curve_args, num_curve_args);
 
 	{
 		int bcm_model = bcm_host_get_model_type();
 
-		if (bcm_model < NUM_MODELS)
+		if (bcm_model < num_models)
 			printf("\nBoard model:               %7s\n", model_names[bcm_model]);
 		else
 			printf("\nBoard model:               Unknown\n");
 	}
 
 	printf("GPIO configuration:            %s\n", gpio_desc[gpio_cfg]);
-	printf("Using hardware:                %s\n", delay_hw == DELAY_VIA_PWM ? "PWM" : "PCM");
-	printf("Using DMA channel:         %7d\n", dma_chan);
+	print_group(groups);
 	if (idle_timeout)
 		printf("Idle timeout:              %7dms\n", idle_timeout);
 	else
 		printf("Idle timeout:             Disabled\n");
-	printf("Number of servos:          %7d\n", num_servos);
-	printf("Servo cycle time:          %7dus\n", cycle_time_us);
-	printf("Pulse increment step size: %7dus\n", step_time_us);
-	printf("Minimum width value:       %7d (%dus)\n", servo_min_ticks,
-						servo_min_ticks * step_time_us);
-	printf("Maximum width value:       %7d (%dus)\n", servo_max_ticks,
-						servo_max_ticks * step_time_us);
 	printf("Output levels:            %s\n", invert ? "Inverted" : "  Normal");
-	printf("\nUsing P1 pins:               %s\n", p1pins);
-	if (board_model == 1 && gpio_cfg == 2)
-		printf("Using P5 pins:               %s\n", p5pins);
+	printf("Width dithering:          %s\n", dither_bits ? " Enabled" : "Disabled");
+	if (auto_rephase)
+		printf("Pulse starts:                Moved\n");
+	if (watchdog_ms)
+		printf("DMA watchdog:              %7dms\n", watchdog_ms);
+	else
+		printf("DMA watchdog:             Disabled\n");
+	if (stats_path)
+		printf("Stats file:                  %s\n", stats_path);
+	if (gpios_arg) {
+		printf("\nUsing GPIOs:                 %s\n", gpios_arg);
+	} else {
+		printf("\nUsing P1 pins:               %s\n", p1pins);
+		if (board_model == 1 && gpio_cfg == 2)
+			printf("Using P5 pins:               %s\n", p5pins);
+	}
+	if (num_groups > 1) {
+		printf("\nGroup 1 servos:           ");
+		for (i = 0; i < MAX_SERVOS; i++) {
+			if (servo_group[i])
+				printf(" %d", i);
+		}
+		printf("\n");
+		print_group(groups + 1);
+	}
+	if (hw_pwm_arg)
+		print_hw_pwm();
+	if (strip_pixels) {
+		printf("\nStrip pixels:              %7d\n", strip_pixels);
+		printf("Using DMA channel:         %7d\n", strip_dma_chan);
+		printf("Data out:                  GPIO-%d\n", STRIP_GPIO);
+	}
 	printf("\nServo mapping:\n");
 	for (i = 0; i < MAX_SERVOS; i++) {
 		if (servo2gpio[i] == DMY)
 			continue;
-		printf("    %2d on %-5s          GPIO-%d\n", i, gpio2pinname(servo2gpio[i]), servo2gpio[i]);
+		if (curve_name[i])
+			printf("    %2d on %-5s          GPIO-%-2d  %s\n", i, gpio2pinname(servo2gpio[i]),
+					servo2gpio[i], curve_name[i]);
+		else
+			printf("    %2d on %-5s          GPIO-%d\n", i, gpio2pinname(servo2gpio[i]), servo2gpio[i]);
 	}
 	printf("\n");
 
 	init_idle_timers();
 	setup_sighandlers();
 
-	dma_reg = map_peripheral(DMA_VIRT_BASE, DMA_LEN);
-	dma_reg += dma_chan * DMA_CHAN_SIZE / sizeof(uint32_t);
+#ifdef LEDEK_EMULATOR
+	if (vcd_arg && emu_set_vcd(vcd_arg) < 0)
+		fatal("servod: Failed to open %s: %m\n", vcd_arg);
+#endif
+
+	dma_base = map_peripheral(DMA_VIRT_BASE, DMA_LEN);
 	pwm_reg = map_peripheral(PWM_VIRT_BASE, PWM_LEN);
 	pcm_reg = map_peripheral(PCM_VIRT_BASE, PCM_LEN);
 	clk_reg = map_peripheral(CLK_VIRT_BASE, CLK_LEN);
 	gpio_reg = map_peripheral(GPIO_VIRT_BASE, GPIO_LEN);
 
-	/* Use the mailbox interface to the VC to ask for physical memory */
-	// Use the mailbox interface to request memory from the VideoCore
-	// We specifiy (-1) for the handle rather than calling mbox_open()
-	// so multiple users can share the resource.
-	mbox.handle = -1; // mbox_open();
-	mbox.size = num_pages * 4096;
-	mbox.mem_ref = mem_alloc(mbox.handle, mbox.size, 4096, mem_flag);
-	if (mbox.mem_ref < 0) {
-		fatal("Failed to alloc memory from VideoCore\n");
-	}
-	mbox.bus_addr = mem_lock(mbox.handle, mbox.mem_ref);
-	if (mbox.bus_addr == ~0) {
-		mem_free(mbox.handle, mbox.size);
-		fatal("Failed to lock memory\n");
-	}
-	mbox.virt_addr = mapmem(BUS_TO_PHYS(mbox.bus_addr), mbox.size);
-
-	turnoff_mask = (uint32_t *)mbox.virt_addr;
-	turnon_mask = (uint32_t *)(mbox.virt_addr + num_samples * sizeof(uint32_t));
-	cb_base = (dma_cb_t *)(mbox.virt_addr +
-		ROUNDUP(num_samples + MAX_SERVOS, 8) * sizeof(uint32_t));
-
 	for (i = 0; i < MAX_SERVOS; i++) {
 		if (servo2gpio[i] == DMY)
 			continue;
@@ -895,19 +3576,48 @@ main(int argc, char **argv)
 	}
 	restore_gpio_modes = 1;
 
-	init_ctrl_data();
-	init_hardware();
+	if (num_hw_pwm) {
+		uint32_t mode;
+		int chans = 0;
+
+		for (i = 0; i < MAX_SERVOS; i++) {
+			if (hw_pwm[i])
+				chans |= 1 << (hw_pwm[i] - 1);
+		}
+		init_hw_pwm(chans, groups[0].cycle_time_us * HWPWM_CLOCK_MHZ, invert);
+		hw_pwm_started = 1;
+		for (i = 0; i < MAX_SERVOS; i++) {
+			if (hw_pwm[i] && hw_pwm_channel(servo2gpio[i], &mode) >= 0)
+				gpio_set_mode(servo2gpio[i], mode);
+		}
+	}
+
+	for (g = groups; g < groups + num_groups; g++) {
+		start_group(g);
+		if (num_groups > 1)
+			printf("\nGroup %d:", (int)(g - groups));
+		print_chain_cost(g);
+		init_hardware(g->delay_hw, g->step_time_us, g->dma_reg,
+				mem_virt_to_phys(g, g->cb_base));
+		if (g->capture)
+			write_capture_cfg(g);
+	}
+	if (strip_pixels)
+		start_strip();
 
 	unlink(DEVFILE);
 	if (mkfifo(DEVFILE, 0666) < 0)
 		fatal("servod: Failed to create %s: %m\n", DEVFILE);
 	if (chmod(DEVFILE, 0666) < 0)
 		fatal("servod: Failed to set permissions on %s: %m\n", DEVFILE);
+	listen_fd = create_ctl_socket();
+	if (ring_create() < 0)
+		fatal("servod: Failed to create shared memory %s: %m\n", SERVORING_NAME);
 
 	if (daemonize && daemon(0,1) < 0)
 		fatal("servod: Failed to daemonize process: %m\n");
 
-	go_go_go();
+	go_go_go(listen_fd);
 
 	return 0;
 }
@@ -0,0 +1,42 @@
+#ifndef LEDEK_SERVOD
+#define LEDEK_SERVOD
+
+#include <stdint.h>
+
+#include "dma.h"
+#include "gpio.h"
+
+#define MAX_SERVOS	64	/* Enough for every GPIO, with room to map servo
+				 * IDs to P1 pins, if you want to
+				 */
+
+#ifdef LEDEK_EMULATOR
+#define DEVFILE			"/tmp/servoblaster"
+#define CFGFILE			"/tmp/servoblaster-cfg"
+#define CTLFILE			"/tmp/servoblaster-ctl"
+#else
+#define DEVFILE			"/dev/servoblaster"
+#define CFGFILE			"/dev/servoblaster-cfg"
+#define CTLFILE			"/dev/servoblaster-ctl"
+#endif
+
+typedef struct {
+    int handle;		/* From mbox_open() */
+    uint32_t size;		/* Required size */
+    unsigned mem_ref;	/* From mem_alloc() */
+    unsigned bus_addr;	/* From mem_lock() */
+    uint8_t *virt_addr;	/* From mapmem() */
+} mbox_t;
+
+extern uint8_t servo2gpio[MAX_SERVOS];
+extern uint8_t p1pin2servo[NUM_P1PINS+1];
+extern uint8_t p5pin2servo[NUM_P5PINS+1];
+extern int num_servos;
+extern uint32_t gpiomode[MAX_SERVOS];
+extern int restore_gpio_modes;
+
+void set_servo(int servo, int width);
+void flush_masks(void);
+void stop_groups(void);
+
+#endif //LEDEK_SERVOD
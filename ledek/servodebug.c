@@ -1,13 +1,32 @@
 /*
  * servodebug.c - a utility to help debug issues with ledek
  *
- * This code should be compiled with the command:
+ * This is built alongside servod, or by hand with:
  *
- *   gcc -Wall -O2 -o servodebug servodebug.c
+ *   gcc -Wall -O2 -I/opt/vc/include -L/opt/vc/lib -o servodebug \
+ *       servodebug.c board.c capture.c vcd.c -lbcm_host
  *
- * It should be run with the command:
+ * servodebug reads the servo mapping from CFGFILE, then watches the
+ * outputs in GPIO bank 0 until it is stopped with ^C, for --time, or until
+ * --edges edges have been collected.  It then reports, for each output, a
+ * histogram of its pulse widths and periods, the period jitter, and how
+ * many glitches it saw, and with --vcd writes every edge to a VCD file.
+ * Leaving it running while servod is under its usual update load shows how
+ * much that load disturbs the outputs.
  *
- *   sudo chrt 1 ./servodebug
+ * Edges come from one of three places, given with --source:
+ *
+ *   ring   The ring servod --capture has the DMA controller fill, mapped
+ *          through /dev/mem.  Every step is stamped by the controller as
+ *          it runs it, so nothing is missed while servodebug sleeps.  This
+ *          is the default when servod has --capture.
+ *   ctl    The same ring read out by "capture" commands over the control
+ *          socket, for the emulator or where /dev/mem can't be mapped.
+ *   poll   GPLEV0 polled by the CPU, for a servod without --capture.  This
+ *          takes a whole core, and misses edges whenever servodebug is
+ *          preempted, so run it as:
+ *
+ *            sudo chrt 1 ./servodebug --source=poll
  *
  * Richard Hirst - Nov 25th 2012
  */
@@ -23,95 +42,49 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <signal.h>
 #include <time.h>
-#include <sys/time.h>
-
-#define BCM2708_DMA_NO_WIDE_BURSTS	(1<<26)
-#define BCM2708_DMA_WAIT_RESP		(1<<3)
-#define BCM2708_DMA_D_DREQ		(1<<6)
-#define BCM2708_DMA_PER_MAP(x)		((x)<<16)
-#define BCM2708_DMA_END			(1<<1)
-#define BCM2708_DMA_RESET		(1<<31)
-#define BCM2708_DMA_INT			(1<<2)
-
-#define DMA_CHAN_SIZE		0x100
-#define DMA_CHAN_MIN		0
-#define DMA_CHAN_MAX		14
-#define DMA_CHAN_DEFAULT	14
-
-#define DMA_CS			(0x00/4)
-#define DMA_CONBLK_AD		(0x04/4)
-#define DMA_DEBUG		(0x20/4)
-
-#define GPIO_BASE		0x3f200000
-#define GPIO_LEN		0xB4
-#define DMA_BASE		0x3f007000
-#define DMA_LEN			DMA_CHAN_SIZE * (DMA_CHAN_MAX+1)
-#define PWM_BASE		0x3f20C000
-#define PWM_LEN			0x28
-#define CLK_BASE	        0x3f101000
-#define CLK_LEN			0xA8
-#define TICK_BASE		0x3f003000
-#define TICK_LEN		0x08
-
-#define PWM_CTL			(0x00/4)
-#define PWM_DMAC		(0x08/4)
-#define PWM_RNG1		(0x10/4)
-#define PWM_FIFO		(0x18/4)
-
-#define PWMCLK_CNTL		40
-#define PWMCLK_DIV		41
-
-#define PWMCTL_MODE1		(1<<1)
-#define PWMCTL_PWEN1		(1<<0)
-#define PWMCTL_CLRF		(1<<6)
-#define PWMCTL_USEF1		(1<<5)
-
-#define PWMDMAC_ENAB		(1<<31)
-// I think this means it requests as soon as there is one free slot in the FIFO
-// which is what we want as burst DMA would mess up our timing..
-#define PWMDMAC_THRSHLD		((15<<8)|(15<<0))
-
-#define GPFSEL0			(0x00/4)
-#define GPCLR0			(0x28/4)
-#define GPLEV0			(0x34/4)
-
-typedef struct {
-	uint32_t info, src, dst, length,
-		 stride, next, pad[2];
-} dma_cb_t;
-
-static volatile uint32_t *gpio_reg;
-static volatile uint32_t *pwm_reg;
-static volatile uint32_t *clk_reg;
-static volatile uint32_t *dma_reg;
-static volatile uint32_t *tick_reg;
-
-static uint32_t dma_chan = DMA_CHAN_DEFAULT;
-
-static uint8_t servo2gpio[] = {
-                4,      // P1-7
-                17,     // P1-11
-#ifdef PWM0_ON_GPIO18
-                1,      // P1-5 (GPIO-18, P1-12 is currently PWM0, for debug)
-#else
-                18,     // P1-12
-#endif
-                21,     // P1-13
-                22,     // P1-15
-                23,     // P1-16
-                24,     // P1-18
-                25,     // P1-22
-};
-#define NUM_SERVOS      (sizeof(servo2gpio)/sizeof(servo2gpio[0]))
-
-struct {
-	uint32_t stamp;
-	uint32_t levels;
-} trans[20];
+#include <getopt.h>
 
-static void
+#include "board.h"
+#include "capture.h"
+#include "gpio.h"
+#include "servod.h"
+#include "st.h"
+#include "vcd.h"
+
+#define SOURCE_RING		0
+#define SOURCE_CTL		1
+#define SOURCE_POLL		2
+
+static const char *source_names[] = { "ring", "ctl", "poll" };
+
+#define DEFAULT_MAX_EDGES	4000000
+#define MAX_GAPS		4096	/* Gaps in the capture that are tracked */
+#define HIST_BINS		10
+#define HIST_BAR		40	/* Characters for the largest bin */
+
+#define CAPTURE_TMPFILE		"/tmp/servodebug-capture"
+
+static volatile int stopping;
+
+static int num_watched;
+static uint8_t servo_gpio[MAX_SERVOS];	/* From CFGFILE, DMY if unused */
+static uint32_t servo_mask;		/* GPLEV0 bits of the outputs */
+
+static int ring_slots;			/* From CFGFILE, 0 without --capture */
+static int ring_step_us;
+static uint32_t ring_phys;
+
+static capture_slot_t *edges;		/* First is the levels at the start */
+static int num_edges, max_edges;
+static int gaps[MAX_GAPS];		/* Edges which follow a gap in the capture */
+static int num_gaps;
+static uint64_t missed_us;
+
+void
 fatal(char *fmt, ...)
 {
 	va_list ap;
@@ -123,98 +96,466 @@ fatal(char *fmt, ...)
 }
 
 static void
-msleep(int ms)
+stop(int dummy)
+{
+	stopping = 1;
+}
+
+static uint64_t
+monotonic_us(void)
 {
-	struct timespec ts = { 0, ms * 1000 * 1000 };
+	struct timespec ts;
 
-	if (nanosleep(&ts, NULL)) {
-		fprintf(stderr, "nanosleep() failed: %s\n", strerror(errno));
-		exit(1);
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+sleep_us(int us)
+{
+	struct timespec ts = { us / 1000000, us % 1000000 * 1000 };
+
+	nanosleep(&ts, NULL);
 }
 
 static void *
-map_peripheral(uint32_t base, uint32_t len)
+map_phys(uint32_t base, uint32_t len)
 {
-	int fd = open("/dev/mem", O_RDWR);
-	void * vaddr;
+	int fd = open("/dev/mem", O_RDWR|O_SYNC);
+	uint32_t off = base & 4095;
+	uint8_t *vaddr;
 
 	if (fd < 0)
 		fatal("Failed to open /dev/mem: %m\n");
-	vaddr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, base);
+	vaddr = mmap(NULL, len + off, PROT_READ|PROT_WRITE, MAP_SHARED, fd, base - off);
 	if (vaddr == MAP_FAILED)
-		fatal("Failed to map peripheral at 0x%08x: %m\n", base);
+		fatal("Failed to map 0x%08x: %m\n", base);
 	close(fd);
 
-	return vaddr;
+	return vaddr + off;
+}
+
+// The servo mapping servod wrote, and where its capture ring is, if it has one
+static void
+read_cfg_file(void)
+{
+	FILE *fp = fopen(CFGFILE, "r");
+	char line[256];
+	int servo, gpio;
+
+	if (!fp)
+		fatal("Failed to open %s: %m; is servod running?\n", CFGFILE);
+	memset(servo_gpio, DMY, sizeof(servo_gpio));
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, " %d on %*s GPIO-%d", &servo, &gpio) == 2 &&
+				servo >= 0 && servo < MAX_SERVOS && gpio >= 0 && gpio < NUM_GPIOS) {
+			servo_gpio[servo] = gpio;
+		} else {
+			sscanf(line, "Capture ring: %d slots of %dus at 0x%x",
+					&ring_slots, &ring_step_us, &ring_phys);
+		}
+	}
+	fclose(fp);
+
+	for (servo = 0; servo < MAX_SERVOS; servo++) {
+		if (servo_gpio[servo] == DMY)
+			continue;
+		if (GPIO_BANK(servo_gpio[servo])) {
+			printf("Servo %d is on GPIO %d, which servodebug can't watch\n",
+					servo, servo_gpio[servo]);
+			servo_gpio[servo] = DMY;
+			continue;
+		}
+		servo_mask |= GPIO_BIT(servo_gpio[servo]);
+		num_watched++;
+	}
+	if (!num_watched)
+		fatal("No servos in GPIO bank 0 in %s\n", CFGFILE);
+}
+
+static void
+add_edge(uint32_t stamp, uint32_t levels)
+{
+	edges[num_edges].stamp = stamp;
+	edges[num_edges].levels = levels;
+	num_edges++;
+}
+
+static void
+add_gap(uint32_t us)
+{
+	missed_us += us;
+	if (num_gaps < MAX_GAPS)
+		gaps[num_gaps++] = num_edges;
+}
+
+/* Read the ring a quarter of a cycle at a time.  The controller stamps a
+ * slot after filling in its levels, so the slot with the oldest stamp may
+ * be half written, and is left for the next read.
+ */
+static void
+capture_ring(uint64_t end_us)
+{
+	volatile capture_slot_t *ring;
+	capture_slot_t *copy;
+	uint32_t seen = 0, levels = ~0;
+	int first, count = ring_slots - 1;
+
+	ring = map_phys(ring_phys, ring_slots * sizeof(*copy));
+	if (!(copy = malloc(ring_slots * sizeof(*copy))))
+		fatal("malloc() failed\n");
+	while (!stopping && num_edges < max_edges && (!end_us || monotonic_us() < end_us)) {
+		memcpy(copy, (const void *)ring, ring_slots * sizeof(*copy));
+		first = (capture_oldest(copy, ring_slots) + 1) % ring_slots;
+		if (seen && (int32_t)(copy[first].stamp - seen) > ring_step_us * 2)
+			add_gap(copy[first].stamp - seen);
+		num_edges += capture_edges(copy, ring_slots, first, count, servo_mask,
+				seen ? seen : copy[first].stamp - 1, &levels,
+				edges + num_edges, max_edges - num_edges);
+		seen = copy[(first + count - 1) % ring_slots].stamp;
+		sleep_us(ring_slots * ring_step_us / 4);
+	}
+	free(copy);
+}
+
+/* Have servod write out what its ring has seen since the last time, a
+ * quarter of a cycle at a time.
+ */
+static void
+capture_ctl(uint64_t end_us)
+{
+	struct sockaddr_un addr;
+	char line[256];
+	uint32_t stamp, levels;
+	FILE *sock, *fp;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, CTLFILE, sizeof(addr.sun_path) - 1);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+			connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		fatal("Failed to connect to %s: %m\n", CTLFILE);
+	if (!(sock = fdopen(fd, "r+")))
+		fatal("fdopen() failed: %m\n");
+	while (!stopping && num_edges < max_edges && (!end_us || monotonic_us() < end_us)) {
+		fprintf(sock, "capture %s\n", CAPTURE_TMPFILE);
+		fflush(sock);
+		if (!fgets(line, sizeof(line), sock))
+			fatal("servod closed the control socket\n");
+		if (strncmp(line, "OK", 2))
+			fatal("servod replied %s", line);
+		if (!(fp = fopen(CAPTURE_TMPFILE, "r")))
+			fatal("Failed to open %s: %m\n", CAPTURE_TMPFILE);
+		while (num_edges < max_edges && fgets(line, sizeof(line), fp)) {
+			// servod remembers where the last reader got to, which may not be us
+			if (!strncmp(line, "# missed ", 9) && num_edges)
+				add_gap(strtoul(line + 9, NULL, 10));
+			else if (sscanf(line, "%u %x", &stamp, &levels) == 2)
+				add_edge(stamp, levels & servo_mask);
+		}
+		fclose(fp);
+		sleep_us(ring_slots * ring_step_us / 4);
+	}
+	unlink(CAPTURE_TMPFILE);
+	fclose(sock);
+}
+
+// Spin on GPLEV0, stamping each change with the system timer
+static void
+capture_poll(uint64_t end_us)
+{
+	volatile uint32_t *gpio_reg = map_phys(GPIO_VIRT_BASE, GPIO_LEN);
+	volatile uint32_t *st_reg = map_phys(ST_VIRT_BASE, ST_LEN);
+	uint32_t v1, v2, start = st_reg[ST_CLO];
+
+	v1 = gpio_reg[GPIO_LEV0] & servo_mask;
+	add_edge(start, v1);
+	while (!stopping && num_edges < max_edges &&
+			(!end_us || st_reg[ST_CLO] - start < end_us)) {
+		v2 = gpio_reg[GPIO_LEV0] & servo_mask;
+		if (v2 != v1) {
+			add_edge(st_reg[ST_CLO], v2);
+			v1 = v2;
+		}
+	}
+}
+
+static int
+cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Value at percentile 'pc' of the sorted array
+static uint32_t
+percentile(const uint32_t *v, int n, int pc)
+{
+	return v[(int)((int64_t)(n - 1) * pc / 100)];
+}
+
+/* Print min, p50, p99 and max of the 'n' values, sorting them, then a
+ * histogram: a bin per value if there are few enough, otherwise HIST_BINS
+ * equal bins from min to max.
+ */
+static void
+print_hist(const char *what, uint32_t *v, int n)
+{
+	int count[HIST_BINS], lo[HIST_BINS], distinct = 1, i, b, most = 0;
+	uint32_t span;
+
+	qsort(v, n, sizeof(*v), cmp_u32);
+	printf("  %s us: min %u  p50 %u  p99 %u  max %u\n", what, v[0],
+			percentile(v, n, 50), percentile(v, n, 99), v[n - 1]);
+	for (i = 1; i < n && distinct <= HIST_BINS; i++)
+		distinct += v[i] != v[i - 1];
+	memset(count, 0, sizeof(count));
+	if (distinct <= HIST_BINS) {
+		for (i = b = 0; i < n; i++) {
+			if (i && v[i] != v[i - 1])
+				b++;
+			lo[b] = v[i];
+			count[b]++;
+		}
+	} else {
+		span = (v[n - 1] - v[0]) / HIST_BINS + 1;
+		for (b = 0; b < HIST_BINS; b++)
+			lo[b] = v[0] + b * span;
+		for (i = 0; i < n; i++)
+			count[(v[i] - v[0]) / span]++;
+		distinct = HIST_BINS;
+	}
+	for (b = 0; b < distinct; b++) {
+		if (count[b] > most)
+			most = count[b];
+	}
+	for (b = 0; b < distinct; b++) {
+		printf("    %8u%s %-*.*s %d\n", lo[b], distinct == HIST_BINS && n > 1 &&
+				v[n - 1] - v[0] >= HIST_BINS ? "+" : " ", HIST_BAR,
+				(int)((int64_t)count[b] * HIST_BAR / most),
+				"########################################", count[b]);
+	}
+}
+
+/* Widths, periods and glitches for one output.  Nothing is measured across
+ * a gap in the capture, and the first record is only the starting levels.
+ */
+static void
+report_servo(int servo, int glitch_us, uint32_t *widths, uint32_t *periods)
+{
+	uint32_t bit = GPIO_BIT(servo_gpio[servo]), rise = 0, fall = 0, median;
+	int i, g = 0, high, known = 0, have_rise = 0, have_fall = 0;
+	int num_widths = 0, num_periods = 0, glitches = 0;
+
+	high = !!(edges[0].levels & bit);
+	for (i = 1; i < num_edges; i++) {
+		if (g < num_gaps && gaps[g] == i) {
+			have_rise = have_fall = 0;
+			g++;
+		}
+		if (!!(edges[i].levels & bit) == high)
+			continue;
+		high = !high;
+		if (high) {
+			if (have_fall && edges[i].stamp - fall < glitch_us)
+				glitches++;
+			if (have_rise)
+				periods[num_periods++] = edges[i].stamp - rise;
+			rise = edges[i].stamp;
+			have_rise = 1;
+		} else {
+			if (have_rise) {
+				widths[num_widths++] = edges[i].stamp - rise;
+				if (edges[i].stamp - rise < glitch_us)
+					glitches++;
+			}
+			fall = edges[i].stamp;
+			have_fall = 1;
+		}
+		known = 1;
+	}
+
+	printf("\nServo %d, GPIO-%d: %d pulses, %d glitches\n", servo,
+			servo_gpio[servo], num_widths, glitches);
+	if (!known) {
+		printf("  Stayed %s; have you tried \"echo %d=50%% > %s\"?\n",
+				high ? "high" : "low", servo, DEVFILE);
+		return;
+	}
+	if (num_widths)
+		print_hist("width", widths, num_widths);
+	if (num_periods) {
+		print_hist("period", periods, num_periods);
+		// Jitter is how far each period is from the median
+		median = percentile(periods, num_periods, 50);
+		for (i = 0; i < num_periods; i++)
+			periods[i] = periods[i] > median ? periods[i] - median : median - periods[i];
+		qsort(periods, num_periods, sizeof(*periods), cmp_u32);
+		printf("  period jitter us: p50 %u  p99 %u  max %u\n",
+				percentile(periods, num_periods, 50),
+				percentile(periods, num_periods, 99), periods[num_periods - 1]);
+	}
+}
+
+static void
+write_vcd(const char *path)
+{
+	char *names[MAX_SERVOS], name[MAX_SERVOS][16];
+	int signal[MAX_SERVOS], n = 0, servo, i, s;
+	uint64_t t = 0, levels;
+	vcd_t *vcd;
+
+	for (servo = 0; servo < MAX_SERVOS; servo++) {
+		if (servo_gpio[servo] == DMY)
+			continue;
+		snprintf(name[n], sizeof(name[n]), "servo%d", servo);
+		names[n] = name[n];
+		signal[n++] = servo;
+	}
+	if (!(vcd = vcd_open(path, "servodebug", n, names)))
+		fatal("Failed to open %s: %m\n", path);
+	for (i = 0; i < num_edges; i++) {
+		if (i)
+			t += edges[i].stamp - edges[i - 1].stamp;
+		for (s = 0, levels = 0; s < n; s++) {
+			if (edges[i].levels & GPIO_BIT(servo_gpio[signal[s]]))
+				levels |= 1ULL << s;
+		}
+		vcd_sample(vcd, t * 1000, levels);
+	}
+	vcd_close(vcd);
+	printf("\nWrote %d edges to %s\n", num_edges, path);
 }
 
 int
 main(int argc, char **argv)
 {
-	int tr, i;
-	uint32_t v1, v2, mask, t1;
-	struct timeval tv1, tv2;
-
-	printf("This code should be compiled with the command:\n\n");
-	printf("  gcc -Wall -O2 -o servodebug servodebug.c\n");
-	printf("\nIt should be run with the command:\n\n");
-	printf("  sudo chrt 1 ./servodebug\n\n");
-	gpio_reg = map_peripheral(GPIO_BASE, GPIO_LEN);
-	dma_reg = map_peripheral(DMA_BASE, DMA_LEN);
-	dma_reg += dma_chan * DMA_CHAN_SIZE / sizeof(uint32_t);
-	pwm_reg = map_peripheral(PWM_BASE, PWM_LEN);
-	clk_reg = map_peripheral(CLK_BASE, CLK_LEN);
-	tick_reg = map_peripheral(TICK_BASE, TICK_LEN);
-
-	v1 = dma_reg[DMA_CONBLK_AD];
-	msleep(5);
-	v2 = dma_reg[DMA_CONBLK_AD];
-
-	if (v1 == v2)
-		fatal("DMA controller is not running - is the module loaded?\n");
-	printf("\nGood, DMA controller is running\n");
-
-	printf("\nTiming 1M cycles of system tick, should take 1000000us\n");
-	printf("but small variations are to be expected\n");
-	gettimeofday(&tv1, NULL);
-	v1 = tick_reg[1];
-	while (tick_reg[1] - v1 < 1000000)
-		;
-	gettimeofday(&tv2, NULL);
-	i = (tv2.tv_sec - tv1.tv_sec) * 1000000 + tv2.tv_usec - tv1.tv_usec;
-	printf("\n1M increments of system tick measured at %dus\n", i);
-
-	printf("\nMonitoring for the first 20 transitions on servo control lines\n");
-
-	for (i = 0, mask = 0; i < NUM_SERVOS; i++)
-		mask |= 1 << servo2gpio[i];
-
-	t1 = tick_reg[1];
-	v1 = gpio_reg[GPLEV0] & mask;
-	for (tr = 0; tr < 20; tr++) {
-		do {
-			if (tick_reg[1] - t1 > 1000000)
-				fatal("No servo pulses generated - have you tried \"echo 0=100 > /dev/servoblaster\"?\n");
-			v2 = gpio_reg[GPLEV0] & mask;
-		} while (v1 == v2);
-		trans[tr].stamp = tick_reg[1];
-		trans[tr].levels = v2;
-		v1 = v2;
+	int source = -1, glitch_us = 0, seconds = 0, servo;
+	char *vcd_path = NULL, *p;
+	uint32_t *widths, *periods;
+	struct sigaction sa;
+	uint64_t start_us;
+
+	max_edges = DEFAULT_MAX_EDGES;
+	while (1) {
+		static struct option long_options[] = {
+			{ "source",       required_argument, 0, 's' },
+			{ "time",         required_argument, 0, 't' },
+			{ "edges",        required_argument, 0, 'e' },
+			{ "glitch",       required_argument, 0, 'g' },
+			{ "vcd",          required_argument, 0, 'v' },
+			{ "help",         no_argument,       0, 'h' },
+			{ 0,              0,                 0, 0   }
+		};
+		int c = getopt_long(argc, argv, "h", long_options, NULL);
+
+		if (c == -1) {
+			break;
+		} else if (c == 's') {
+			for (source = 0; source < 3 && strcmp(optarg, source_names[source]); source++)
+				;
+			if (source == 3)
+				fatal("Invalid source '%s'\n", optarg);
+		} else if (c == 't') {
+			seconds = strtol(optarg, &p, 10);
+			if (*optarg < '0' || *optarg > '9' || (*p && strcmp(p, "s")) || seconds < 1)
+				fatal("Invalid time specified\n");
+		} else if (c == 'e') {
+			max_edges = strtol(optarg, &p, 10);
+			if (*optarg < '0' || *optarg > '9' || *p || max_edges < 2 ||
+					max_edges > 256000000)
+				fatal("Invalid edges specified\n");
+		} else if (c == 'g') {
+			glitch_us = strtol(optarg, &p, 10);
+			if (*optarg < '0' || *optarg > '9' || (*p && strcmp(p, "us")))
+				fatal("Invalid glitch specified\n");
+		} else if (c == 'v') {
+			vcd_path = optarg;
+		} else if (c == 'h') {
+			printf("\nUsage: %s <options>\n\n"
+				"Options:\n"
+				"  --source=ring|ctl|poll\n"
+				"                      where to get edges from: servod's --capture\n"
+				"                      ring mapped directly (the default with\n"
+				"                      --capture), the same through the control\n"
+				"                      socket, or by polling GPLEV0 (the default\n"
+				"                      without it; run under chrt 1)\n"
+				"  --time=Ns           stop after N seconds, rather than at ^C\n"
+				"  --edges=N           stop after N edges, default %d; the buffer\n"
+				"                      for them is allocated up front\n"
+				"  --glitch=Nus        count pulses and gaps shorter than this as\n"
+				"                      glitches, default two steps, or 20us\n"
+				"  --vcd=<file>        write the edges to a VCD file\n\n",
+				argv[0], DEFAULT_MAX_EDGES);
+			exit(0);
+		} else {
+			fatal("Invalid parameter\n");
+		}
 	}
 
-	for (tr = 1; tr < 20; tr++)
-		trans[tr].stamp -= trans[0].stamp;
-	trans[0].stamp = 0;
-	printf("\n    time   outputs\n    (us)   76543210\n");
-	for (tr = 0; tr < 20; tr++) {
-		printf("   %6d  ", trans[tr].stamp);
-		for (i = NUM_SERVOS - 1; i >= 0; i--)
-			printf("%s", trans[tr].levels & (1 << servo2gpio[i]) ? "1" : "0");
-		printf("\n");
+	get_model_and_revision();
+	read_cfg_file();
+#ifdef LEDEK_EMULATOR
+	// The emulated peripherals are inside servod, so only it can read them
+	if (source < 0)
+		source = SOURCE_CTL;
+	if (source != SOURCE_CTL)
+		fatal("With the emulator, only --source=ctl works\n");
+#endif
+	if (source < 0)
+		source = ring_slots ? SOURCE_RING : SOURCE_POLL;
+	if (source != SOURCE_POLL && !ring_slots)
+		fatal("--source=%s needs servod to have --capture\n", source_names[source]);
+	if (!glitch_us)
+		glitch_us = ring_step_us ? ring_step_us * 2 : 20;
+
+	// Touch every page now, so none are faulted in while capturing
+	if (!(edges = malloc(max_edges * sizeof(*edges))))
+		fatal("Failed to allocate room for %d edges\n", max_edges);
+	memset(edges, 0, max_edges * sizeof(*edges));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	printf("Watching %d servos from %s", num_watched, source_names[source]);
+	if (ring_slots)
+		printf(", %dus steps", ring_step_us);
+	printf(", for %s; glitches are under %dus\n",
+			seconds ? "the time given" : "as long as you leave it (^C to stop)", glitch_us);
+	start_us = monotonic_us();
+	if (source == SOURCE_RING)
+		capture_ring(seconds ? start_us + seconds * 1000000ULL : 0);
+	else if (source == SOURCE_CTL)
+		capture_ctl(seconds ? start_us + seconds * 1000000ULL : 0);
+	else
+		capture_poll(seconds * 1000000ULL);
+
+	printf("\nCollected %d edges over %.1fs", num_edges > 0 ? num_edges - 1 : 0,
+			(monotonic_us() - start_us) / 1e6);
+	if (num_edges == max_edges)
+		printf(", stopping as the buffer is full");
+	printf("\n");
+	if (num_gaps)
+		printf("Missed %lluus of capture in %d gaps; reads fell more than a cycle behind\n",
+				(unsigned long long)missed_us, num_gaps);
+	if (num_edges < 1)
+		fatal("Nothing captured\n");
+
+	widths = malloc((num_edges / 2 + 1) * sizeof(*widths));
+	periods = malloc((num_edges / 2 + 1) * sizeof(*periods));
+	if (!widths || !periods)
+		fatal("malloc() failed\n");
+	for (servo = 0; servo < MAX_SERVOS; servo++) {
+		if (servo_gpio[servo] != DMY)
+			report_servo(servo, glitch_us, widths, periods);
 	}
+	if (vcd_path)
+		write_vcd(vcd_path);
 	printf("\n");
 
 	return 0;
 }
-
@@ -0,0 +1,124 @@
+#ifndef LEDEK_SERVORING
+#define LEDEK_SERVORING
+
+/*
+ * Shared memory update ring for local clients that want to send a lot of
+ * updates without going through the fifo.  servod creates the ring as the
+ * POSIX shared memory object SERVORING_NAME; a client maps it and pushes
+ * fixed size binary records:
+ *
+ *     servoring_t *ring = servoring_open();
+ *
+ *     servoring_push(ring, 3, 150, 0);
+ *
+ * Any number of processes and threads may push at once.  The ring is a
+ * bounded multi-producer queue with a sequence number per slot, so pushing
+ * is lock free and needs no system call while servod is busy draining it.
+ * Only when servod has gone idle does a push cost one futex wake.
+ *
+ * Widths are in ticks (steps), as for a plain "N=ticks" command, or with
+ * SERVORING_LEVEL, 16 bit brightness levels as for "N=<level>lv", which go
+ * through the output's --curve.  Records pushed with SERVORING_MORE are
+ * held back and applied together with the next record pushed without it,
+ * in the same cycle, like a frame command.
+ *
+ * With --strip, a record flagged SERVORING_PIXEL sets a pixel instead:
+ * channel is the pixel number and ticks the colour as 0xRRGGBB.  A whole
+ * frame of pixels is pushed with SERVORING_MORE on all but the last, and
+ * goes out to the strip when that arrives:
+ *
+ *     for (i = 0; i < n; i++)
+ *         servoring_push(ring, i, rgb[i], SERVORING_PIXEL |
+ *                        (i < n - 1 ? SERVORING_MORE : 0));
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define SERVORING_NAME		"/servoblaster-ring"
+#define SERVORING_MAGIC		0x53425231	/* "SBR1" */
+#define SERVORING_SLOTS		1024		/* Must be a power of two */
+
+#define SERVORING_RELATIVE	(1<<0)	/* ticks is a signed adjustment */
+#define SERVORING_MORE		(1<<1)	/* More of the same frame follows */
+#define SERVORING_LEVEL		(1<<2)	/* ticks is a brightness level */
+#define SERVORING_PIXEL		(1<<3)	/* channel is a strip pixel, ticks its colour */
+
+typedef struct {
+    uint32_t seq;
+    uint16_t channel;
+    uint16_t flags;
+    int32_t ticks;
+    uint32_t pad;
+} servoring_slot_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t num_slots;
+    uint32_t head __attribute__((aligned(64)));	/* Next slot to claim */
+    uint32_t doorbell __attribute__((aligned(64)));	/* Bumped per push */
+    uint32_t waiting;				/* servod is asleep */
+    uint32_t tail __attribute__((aligned(64)));	/* Next slot to drain */
+    servoring_slot_t slots[SERVORING_SLOTS] __attribute__((aligned(64)));
+} servoring_t;
+
+static inline servoring_t *servoring_open(void) {
+    servoring_t *ring;
+    int fd = shm_open(SERVORING_NAME, O_RDWR, 0);
+
+    if (fd < 0)
+        return NULL;
+    ring = mmap(NULL, sizeof(*ring), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED)
+        return NULL;
+    if (ring->magic != SERVORING_MAGIC || ring->num_slots != SERVORING_SLOTS) {
+        munmap(ring, sizeof(*ring));
+        errno = EPROTO;
+        return NULL;
+    }
+    return ring;
+}
+
+static inline void servoring_close(servoring_t *ring) {
+    munmap(ring, sizeof(*ring));
+}
+
+// Returns 0, or -1 with errno set to EAGAIN if the ring is full
+static inline int servoring_push(servoring_t *ring, int channel, int ticks, int flags) {
+    uint32_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    servoring_slot_t *slot;
+    int32_t diff;
+
+    for (;;) {
+        slot = ring->slots + (pos & (SERVORING_SLOTS - 1));
+        diff = (int32_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            errno = EAGAIN;
+            return -1;
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+    slot->channel = channel;
+    slot->flags = flags;
+    slot->ticks = ticks;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&ring->doorbell, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &ring->doorbell, FUTEX_WAKE, 1, NULL, NULL, 0);
+
+    return 0;
+}
+
+#endif //LEDEK_SERVORING
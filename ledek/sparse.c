@@ -0,0 +1,218 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sparse.h"
+
+#define BARRIER()		__sync_synchronize()
+
+/* The DMA lite channels, which include the default channel 14, only take
+ * 16 bit transfer lengths, so long quiet stretches are split up.
+ */
+#define SPARSE_MAX_WORDS	16383
+
+#define MAX_EDGES		(1 + MAX_SERVOS * 2)
+
+#define ROUNDUP(val, blksz)	(((val)+((blksz)-1)) & ~(blksz-1))
+
+static int max_cbs(int num_samples) {
+    // Turn-off per bank and delay CB per edge, turn-on per servo, and the
+    // long delays
+    return MAX_EDGES * 3 + MAX_SERVOS + num_samples / SPARSE_MAX_WORDS + 1;
+}
+
+static uint32_t chain_size(int num_samples) {
+    return ROUNDUP(max_cbs(num_samples) * sizeof(uint32_t), sizeof(dma_cb_t)) +
+           max_cbs(num_samples) * sizeof(dma_cb_t);
+}
+
+uint32_t sparse_mem_size(int num_samples) {
+    return ROUNDUP(MAX_SERVOS * sizeof(uint32_t), sizeof(dma_cb_t)) +
+           chain_size(num_samples) * 2;
+}
+
+static uint32_t bus(const sparse_t *s, const void *p) {
+    return s->bus_base + ((const uint8_t *)p - s->virt_base);
+}
+
+static int cmp_int(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// Write CB 'i' of chain 'c', touching only the words that have changed
+static void put_cb(sparse_t *s, sparse_chain_t *c, int i, uint32_t info,
+                   uint32_t src, uint32_t dst, uint32_t len, uint32_t next) {
+    dma_cb_t cb = { info, src, dst, len, 0, next, { 0, 0 } };
+    uint32_t *new = (uint32_t *)&cb, *old = (uint32_t *)(c->shadow_cbs + i);
+    volatile uint32_t *dst_words = (volatile uint32_t *)(c->cbs + i);
+    int w;
+
+    for (w = 0; w < sizeof(cb) / sizeof(uint32_t); w++) {
+        if (new[w] != old[w]) {
+            dst_words[w] = old[w] = new[w];
+            s->words_written++;
+        }
+    }
+}
+
+static void set_next(sparse_t *s, sparse_chain_t *c, int i, uint32_t next) {
+    if (c->shadow_cbs[i].next != next) {
+        c->cbs[i].next = c->shadow_cbs[i].next = next;
+        s->words_written++;
+    }
+}
+
+static void build(sparse_t *s, sparse_chain_t *c, const int *width) {
+    uint32_t info = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP;
+    int n = s->num_samples, edge[MAX_EDGES], num_edges = 1;
+    int i, e, p, q, len, servo, bank;
+    uint32_t clr[2];
+
+    edge[0] = 0;
+    for (servo = 0; servo < MAX_SERVOS; servo++) {
+        if (!s->bits[servo])
+            continue;
+        edge[num_edges++] = s->start[servo];
+        if (width[servo] < n)
+            edge[num_edges++] = (s->start[servo] + width[servo]) % n;
+    }
+    qsort(edge, num_edges, sizeof(*edge), cmp_int);
+
+    for (e = i = 0; e < num_edges; e++) {
+        p = edge[e];
+        if (e + 1 < num_edges && edge[e + 1] == p)
+            continue;
+        q = e + 1 < num_edges ? edge[e + 1] : n;
+
+        clr[0] = clr[1] = 0;
+        for (servo = 0; servo < MAX_SERVOS; servo++) {
+            if (s->bits[servo] && width[servo] < n &&
+                    (s->start[servo] + width[servo]) % n == p)
+                clr[s->bank[servo]] |= s->bits[servo];
+        }
+        for (bank = 0; bank < 2; bank++) {
+            if (!clr[bank])
+                continue;
+            if (c->shadow_clr[i] != clr[bank]) {
+                c->clr[i] = c->shadow_clr[i] = clr[bank];
+                s->words_written++;
+            }
+            put_cb(s, c, i, info, bus(s, c->clr + i), s->clr_addr + bank * 4, 4,
+                   bus(s, c->cbs + i + 1));
+            i++;
+        }
+        for (servo = 0; servo < MAX_SERVOS; servo++) {
+            if (!s->bits[servo] || s->start[servo] != p)
+                continue;
+            put_cb(s, c, i, info, bus(s, s->turnon + servo),
+                   s->set_addr + s->bank[servo] * 4, 4, bus(s, c->cbs + i + 1));
+            i++;
+        }
+        for (; p < q; p += len) {
+            len = q - p < SPARSE_MAX_WORDS ? q - p : SPARSE_MAX_WORDS;
+            // Any data will do; the last CB of all loops back to the start
+            put_cb(s, c, i, s->fifo_info, bus(s, c->clr), s->fifo_addr, len * 4,
+                   bus(s, c->cbs + (p + len < n ? i + 1 : 0)));
+            i++;
+        }
+    }
+    c->num_cbs = i;
+}
+
+int sparse_init(sparse_t *s, void *virt, uint32_t bus_addr, int num_samples,
+                const int *start, const uint32_t *bits, const uint8_t *bank,
+                uint32_t clr_addr, uint32_t set_addr, uint32_t fifo_addr,
+                uint32_t fifo_info, volatile uint32_t *dma_reg) {
+    int width[MAX_SERVOS] = { 0 };
+    uint8_t *p;
+    int i;
+
+    memset(s, 0, sizeof(*s));
+    s->num_samples = num_samples;
+    s->max_cbs = max_cbs(num_samples);
+    s->virt_base = virt;
+    s->bus_base = bus_addr;
+    s->dma_reg = dma_reg;
+    s->clr_addr = clr_addr;
+    s->set_addr = set_addr;
+    s->fifo_addr = fifo_addr;
+    s->fifo_info = fifo_info;
+    s->turnon = (uint32_t *)virt;
+    memset(s->turnon, 0, MAX_SERVOS * sizeof(uint32_t));
+    memcpy(s->bits, bits, sizeof(s->bits));
+    memcpy(s->bank, bank, sizeof(s->bank));
+    memcpy(s->start, start, sizeof(s->start));
+
+    p = s->virt_base + ROUNDUP(MAX_SERVOS * sizeof(uint32_t), sizeof(dma_cb_t));
+    for (i = 0; i < 2; i++, p += chain_size(num_samples)) {
+        s->chain[i].clr = (uint32_t *)p;
+        s->chain[i].cbs = (dma_cb_t *)(p +
+                ROUNDUP(s->max_cbs * sizeof(uint32_t), sizeof(dma_cb_t)));
+        s->chain[i].shadow_clr = calloc(s->max_cbs, sizeof(uint32_t));
+        s->chain[i].shadow_cbs = calloc(s->max_cbs, sizeof(dma_cb_t));
+        if (!s->chain[i].shadow_clr || !s->chain[i].shadow_cbs)
+            return -1;
+        memset(s->chain[i].clr, 0, s->max_cbs * sizeof(uint32_t));
+        memset(s->chain[i].cbs, 0, s->max_cbs * sizeof(dma_cb_t));
+        build(s, s->chain + i, width);
+    }
+    s->words_written = 0;
+    return 0;
+}
+
+dma_cb_t *sparse_entry(const sparse_t *s) {
+    return s->chain[s->live].cbs;
+}
+
+int sparse_switched(sparse_t *s) {
+    const sparse_chain_t *c = s->chain + !s->live;
+    uint32_t addr;
+
+    if (!s->pending)
+        return 1;
+    addr = s->dma_reg[DMA_CONBLK_AD];
+    if (addr < bus(s, c->cbs) || addr >= bus(s, c->cbs + c->num_cbs))
+        return 0;
+    s->live = !s->live;
+    s->pending = 0;
+    return 1;
+}
+
+void sparse_finish(sparse_t *s) {
+    if (!s->pending)
+        return;
+    s->live = !s->live;
+    s->pending = 0;
+}
+
+int sparse_update(sparse_t *s, const int *width) {
+    sparse_chain_t *live = s->chain + s->live, *spare = s->chain + !s->live;
+
+    if (!sparse_switched(s))
+        return -1;
+    build(s, spare, width);
+    BARRIER();
+    set_next(s, live, live->num_cbs - 1, bus(s, spare->cbs));
+    BARRIER();
+    s->pending = 1;
+    s->rebuilds++;
+    return 0;
+}
+
+void sparse_set_start(sparse_t *s, int servo, int start) {
+    s->start[servo] = start;
+}
+
+void sparse_cost(const sparse_t *s, int *cbs, uint64_t *transactions, uint64_t *bytes) {
+    const sparse_chain_t *c = s->chain + s->live;
+    uint64_t words;
+    int i;
+
+    *cbs = c->num_cbs;
+    *transactions = *bytes = 0;
+    // One CB fetch, then a read and a write for each word
+    for (i = 0; i < c->num_cbs; i++) {
+        words = c->shadow_cbs[i].length / 4;
+        *transactions += 1 + words * 2;
+        *bytes += sizeof(dma_cb_t) + words * 8;
+    }
+}
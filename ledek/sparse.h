@@ -0,0 +1,99 @@
+#ifndef LEDEK_SPARSE
+#define LEDEK_SPARSE
+
+#include <stdint.h>
+
+#include "dma.h"
+#include "servod.h"
+
+/* Alternative chain layout for --sparse.  The normal chain has a turn-off
+ * CB and a delay CB for every sample, although outputs only ever change at
+ * a few of them.  A sparse chain only has CBs at the samples where an edge
+ * is due, and covers each quiet stretch in between with a single delay CB
+ * that writes one word to the PWM or PCM FIFO per sample it spans:
+ *
+ *     [turnoff(k)] [turnon(k)...] delay(k..k') [turnoff(k')] ...
+ *
+ * turnoff(k) clears the bits of the outputs whose pulses end at sample k,
+ * so it only appears where some pulse ends; there is one per GPIO bank
+ * with a pulse ending there.  The controller then fetches
+ * a handful of CBs per cycle rather than two or three per sample.
+ *
+ * Since edges move when widths change, there are two copies of the chain.
+ * Each loops back to its own start at the end of the cycle.  A change is
+ * made by rebuilding the copy the controller isn't using, then pointing
+ * the end of the one it is using at the new one, so the controller picks
+ * it up at the next cycle boundary and every output in the change switches
+ * together.  The rebuild only writes the CB words that differ from what
+ * that copy held before.
+ */
+
+typedef struct {
+    uint32_t *clr;		/* Turn-off word per CB slot */
+    dma_cb_t *cbs;
+    uint32_t *shadow_clr;	/* Cached copies of what clr and cbs hold */
+    dma_cb_t *shadow_cbs;
+    int num_cbs;		/* In use, ending with the loop back */
+} sparse_chain_t;
+
+typedef struct {
+    int num_samples;
+    int max_cbs;
+    uint8_t *virt_base;		/* Start of the memory the chains are in */
+    uint32_t bus_base;		/* ... and its bus address */
+    volatile uint32_t *dma_reg;
+    uint32_t clr_addr, set_addr, fifo_addr, fifo_info;
+    uint32_t *turnon;		/* Turn-on word for each servo, as turnon_mask */
+    uint32_t bits[MAX_SERVOS];	/* GPIO bit for each servo, 0 if unused */
+    uint8_t bank[MAX_SERVOS];	/* ... and the GPIO bank it is in */
+    int start[MAX_SERVOS];
+    sparse_chain_t chain[2];
+    int live;			/* Chain the controller is running */
+    int pending;		/* Set while waiting for it to move to the other */
+    uint64_t rebuilds;
+    uint64_t words_written;	/* CB and turn-off words written by rebuilds */
+} sparse_t;
+
+// Bytes of DMA visible memory needed, to be 32 byte aligned
+uint32_t sparse_mem_size(int num_samples);
+
+/* Build both chains in 'virt', which the DMA controller sees at 'bus', with
+ * every output at width 0.  Servos with bits[servo] == 0 are not used.
+ * CBs for bank 1 outputs write the register after clr_addr or set_addr.
+ * Returns -1 if the host side copies can't be allocated.
+ */
+int sparse_init(sparse_t *s, void *virt, uint32_t bus, int num_samples,
+                const int *start, const uint32_t *bits, const uint8_t *bank,
+                uint32_t clr_addr, uint32_t set_addr, uint32_t fifo_addr,
+                uint32_t fifo_info, volatile uint32_t *dma_reg);
+
+// First CB of the chain the controller should be started on
+dma_cb_t *sparse_entry(const sparse_t *s);
+
+/* Rebuild the spare chain for these widths and queue the switch to it.
+ * Returns -1 if the previous switch hasn't happened yet.
+ */
+int sparse_update(sparse_t *s, const int *width);
+
+/* Move a servo's pulse to start at sample 'start' from the next
+ * sparse_update() on.  The pulse must not then cross the end of the cycle,
+ * nor have crossed it in the live chain, or the switch between chains
+ * would cut it short or stretch it for a cycle.
+ */
+void sparse_set_start(sparse_t *s, int servo, int start);
+
+/* Returns 1 once the controller has moved to the last chain queued, after
+ * which turn-on words for outputs that have just left width 0 may be set.
+ */
+int sparse_switched(sparse_t *s);
+
+/* Take the last chain queued as live without waiting for the controller
+ * to move to it, for when the controller is stopped and is to be started
+ * on sparse_entry().
+ */
+void sparse_finish(sparse_t *s);
+
+// What the controller does each cycle running the live chain
+void sparse_cost(const sparse_t *s, int *cbs, uint64_t *transactions, uint64_t *bytes);
+
+#endif //LEDEK_SPARSE
@@ -0,0 +1,15 @@
+#ifndef LEDEK_ST
+#define LEDEK_ST
+
+// The free running 1MHz system timer
+#define ST_BASE_OFFSET		0x00003000
+#define ST_LEN			0x1c
+
+#define ST_VIRT_BASE		(periph_virt_base + ST_BASE_OFFSET)
+#define ST_PHYS_BASE		(periph_phys_base + ST_BASE_OFFSET)
+
+#define ST_CS			(0x00/4)
+#define ST_CLO			(0x04/4)
+#define ST_CHI			(0x08/4)
+
+#endif //LEDEK_ST
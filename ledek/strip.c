@@ -0,0 +1,155 @@
+#include <string.h>
+
+#include "strip.h"
+
+#define BARRIER()		__sync_synchronize()
+
+#define ROUNDUP(val, blksz)	(((val)+((blksz)-1)) & ~(blksz-1))
+
+#define NUM_CBS			5
+#define RESET_CB		4
+#define RESET_WORDS		((STRIP_RESET_US * (STRIP_BIT_HZ / 1000) / 1000 + 31) / 32)
+
+// Symbol bits for each byte, 24 of them, the first in bit 23
+static uint32_t symbols[256];
+
+static void init_symbols(void) {
+    int b, bit;
+
+    if (symbols[0])
+        return;
+    for (b = 0; b < 256; b++) {
+        for (bit = 7; bit >= 0; bit--)
+            symbols[b] = symbols[b] << 3 | (b & (1 << bit) ? 6 : 4);
+    }
+}
+
+static int data_words(int num_pixels) {
+    return (num_pixels * 3 * 24 + 31) / 32;
+}
+
+static uint32_t buf_size(int num_pixels) {
+    return ROUNDUP((1 + data_words(num_pixels)) * sizeof(uint32_t), sizeof(dma_cb_t));
+}
+
+uint32_t strip_mem_size(int num_pixels) {
+    return NUM_CBS * sizeof(dma_cb_t) + sizeof(dma_cb_t) + buf_size(num_pixels) * 2 +
+           RESET_WORDS * sizeof(uint32_t);
+}
+
+static uint32_t bus(const strip_t *s, const volatile void *p) {
+    return s->bus_base + ((const volatile uint8_t *)p - s->virt_base);
+}
+
+int strip_encode(const uint8_t *grb, int num_bytes, uint32_t *out) {
+    uint32_t *start = out;
+    uint64_t acc = 0;
+    int i, bits = 0;
+
+    init_symbols();
+    for (i = 0; i < num_bytes; i++) {
+        acc = acc << 24 | symbols[grb[i]];
+        bits += 24;
+        if (bits >= 32) {
+            bits -= 32;
+            *out++ = acc >> bits;
+        }
+    }
+    // The low end of the last word is the start of the reset
+    if (bits)
+        *out++ = acc << (32 - bits);
+    return out - start;
+}
+
+void strip_init(strip_t *s, void *virt, uint32_t bus_addr, int num_pixels,
+                uint32_t fifo_addr, uint32_t fifo_info) {
+    uint32_t info = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP;
+    uint32_t *zeros;
+    dma_cb_t *cb;
+    int b;
+
+    memset(s, 0, sizeof(*s));
+    s->num_pixels = num_pixels;
+    s->num_words = data_words(num_pixels);
+    s->virt_base = virt;
+    s->bus_base = bus_addr;
+    s->cbs = virt;
+    s->seen = (uint32_t *)(s->cbs + NUM_CBS);
+    s->buf[0] = (uint32_t *)(s->cbs + NUM_CBS + 1);
+    s->buf[1] = (uint32_t *)((uint8_t *)s->buf[0] + buf_size(num_pixels));
+    zeros = (uint32_t *)((uint8_t *)s->buf[1] + buf_size(num_pixels));
+    memset(virt, 0, strip_mem_size(num_pixels));
+
+    for (b = 0; b < 2; b++) {
+        strip_encode(s->grb, num_pixels * 3, s->buf[b] + 1);
+        cb = s->cbs + b * 2;
+        cb[0].info = info;
+        cb[0].src = bus(s, s->buf[b]);
+        cb[0].dst = bus(s, s->seen);
+        cb[0].length = sizeof(uint32_t);
+        cb[0].next = bus(s, cb + 1);
+        cb[1].info = fifo_info | DMA_SRC_INC;
+        cb[1].src = bus(s, s->buf[b] + 1);
+        cb[1].dst = fifo_addr;
+        cb[1].length = s->num_words * sizeof(uint32_t);
+        cb[1].next = bus(s, s->cbs + RESET_CB);
+    }
+    cb = s->cbs + RESET_CB;
+    cb->info = fifo_info | DMA_SRC_INC;
+    cb->src = bus(s, zeros);
+    cb->dst = fifo_addr;
+    cb->length = RESET_WORDS * sizeof(uint32_t);
+    cb->next = bus(s, s->cbs);
+    BARRIER();
+}
+
+dma_cb_t *strip_entry(const strip_t *s) {
+    return s->cbs + s->live * 2;
+}
+
+void strip_set(strip_t *s, int pixel, uint32_t rgb) {
+    uint8_t *p = s->grb + pixel * 3;
+    uint8_t g = rgb >> 8, r = rgb >> 16, b = rgb;
+
+    if (p[0] != g || p[1] != r || p[2] != b) {
+        p[0] = g;
+        p[1] = r;
+        p[2] = b;
+        s->changed = 1;
+    }
+}
+
+uint32_t strip_get(const strip_t *s, int pixel) {
+    const uint8_t *p = s->grb + pixel * 3;
+
+    return (uint32_t)p[1] << 16 | (uint32_t)p[0] << 8 | p[2];
+}
+
+int strip_flush(strip_t *s) {
+    int spare = !s->live;
+
+    if (!s->changed)
+        return 0;
+    if (s->pending) {
+        if (*s->seen != s->frame) {
+            s->held++;
+            return -1;
+        }
+        s->pending = 0;
+    }
+    s->frame++;
+    strip_encode(s->grb, s->num_pixels * 3, s->buf[spare] + 1);
+    s->buf[spare][0] = s->frame;
+    BARRIER();
+    s->cbs[RESET_CB].next = bus(s, s->cbs + spare * 2);
+    BARRIER();
+    s->live = spare;
+    s->pending = 1;
+    s->changed = 0;
+    s->frames++;
+    return 0;
+}
+
+double strip_refresh_hz(const strip_t *s) {
+    return (double)STRIP_BIT_HZ / ((s->num_words + RESET_WORDS) * 32);
+}
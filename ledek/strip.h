@@ -0,0 +1,83 @@
+#ifndef LEDEK_STRIP
+#define LEDEK_STRIP
+
+#include <stdint.h>
+
+#include "dma.h"
+
+/* WS2812 ("NeoPixel") strip output for --strip, sent out of the PCM block's
+ * data pin.  Each bit of a pixel goes out as three bits of the PCM stream
+ * at STRIP_BIT_HZ, 110 for a 1 and 100 for a 0, so a 1 is high for 833ns
+ * and a 0 for 417ns in a 1.25us bit.  Pixels are sent green, red, blue,
+ * most significant bit first, and a frame ends with STRIP_RESET_US of low.
+ *
+ * A frame is encoded, a byte at a time through a table, into one of two
+ * buffers.  Each buffer has a pair of CBs: one copies the buffer's frame
+ * number into a 'seen' word, the other feeds the buffer to the PCM FIFO.
+ * Both pairs go on to a CB that sends the reset, and that loops back to the
+ * pair for the live buffer, so the strip is refreshed from it with no help
+ * from the CPU:
+ *
+ *     seen(A) data(A) --+
+ *                       +-- reset --> seen(A) ...
+ *     seen(B) data(B) --+
+ *
+ * A new frame is encoded into the other buffer and the reset CB pointed at
+ * its pair, much as sparse.h switches chains.  Once 'seen' holds the new
+ * frame's number, the controller has moved over and the old buffer is free
+ * for the frame after.
+ */
+
+#define STRIP_MAX_PIXELS	2048
+#define STRIP_BIT_HZ		2400000		/* Three per WS2812 bit */
+#define STRIP_RESET_US		300		/* Newer WS2812Bs need over 280us */
+
+typedef struct {
+    int num_pixels;
+    int num_words;		/* Of PCM data per frame */
+    uint8_t *virt_base;		/* Start of the memory the buffers are in */
+    uint32_t bus_base;		/* ... and its bus address */
+    dma_cb_t *cbs;		/* Pair per buffer, then the reset */
+    volatile uint32_t *seen;	/* Frame number of the buffer being sent */
+    uint32_t *buf[2];		/* Frame number, then the PCM data */
+    uint8_t grb[STRIP_MAX_PIXELS * 3];
+    int live;			/* Buffer the controller is sending */
+    int pending;		/* Set while waiting for it to move to the other */
+    int changed;		/* grb[] differs from the live buffer */
+    uint32_t frame;		/* Number of the last frame queued */
+    uint64_t frames;		/* Frames queued */
+    uint64_t held;		/* Flushes put off while a switch was pending */
+} strip_t;
+
+// Bytes of DMA visible memory needed, to be 32 byte aligned
+uint32_t strip_mem_size(int num_pixels);
+
+/* Set up the buffers and CBs in 'virt', which the DMA controller sees at
+ * 'bus', with every pixel off.  The data and reset CBs write to
+ * 'fifo_addr' with 'fifo_info', which should pace them by the FIFO's DREQ.
+ */
+void strip_init(strip_t *s, void *virt, uint32_t bus, int num_pixels,
+                uint32_t fifo_addr, uint32_t fifo_info);
+
+// First CB of the loop the controller should be started on
+dma_cb_t *strip_entry(const strip_t *s);
+
+// Set a pixel to 0xRRGGBB from the next strip_flush() on
+void strip_set(strip_t *s, int pixel, uint32_t rgb);
+
+// The pixel as last set, as 0xRRGGBB
+uint32_t strip_get(const strip_t *s, int pixel);
+
+/* Encode the pixels into the spare buffer, if they have changed, and queue
+ * the switch to it.  Returns -1 if the previous switch hasn't happened yet,
+ * in which case the changes stay pending for a later call.
+ */
+int strip_flush(strip_t *s);
+
+// Encode 'num_bytes' of pixel data, returning the words written to 'out'
+int strip_encode(const uint8_t *grb, int num_bytes, uint32_t *out);
+
+// Frames sent per second, taking the reset into account
+double strip_refresh_hz(const strip_t *s);
+
+#endif //LEDEK_STRIP
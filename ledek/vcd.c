@@ -0,0 +1,64 @@
+#include <stdlib.h>
+
+#include "vcd.h"
+
+// Signal identifiers are single printable characters starting at '!'
+#define VCD_ID(n)	((char)('!' + (n)))
+
+vcd_t *vcd_open(const char *path, const char *scope, int num_signals, char **names) {
+    vcd_t *vcd;
+    int i;
+
+    if (num_signals > VCD_MAX_SIGNALS)
+        return NULL;
+    vcd = calloc(1, sizeof(*vcd));
+    if (!vcd)
+        return NULL;
+    vcd->fp = fopen(path, "w");
+    if (!vcd->fp) {
+        free(vcd);
+        return NULL;
+    }
+    vcd->num_signals = num_signals;
+
+    fprintf(vcd->fp, "$timescale 1ns $end\n");
+    fprintf(vcd->fp, "$scope module %s $end\n", scope);
+    for (i = 0; i < num_signals; i++)
+        fprintf(vcd->fp, "$var wire 1 %c %s $end\n", VCD_ID(i), names[i]);
+    fprintf(vcd->fp, "$upscope $end\n");
+    fprintf(vcd->fp, "$enddefinitions $end\n");
+
+    return vcd;
+}
+
+void vcd_sample(vcd_t *vcd, uint64_t time_ns, uint64_t levels) {
+    uint64_t changed;
+    int i;
+
+    if (vcd->started) {
+        changed = levels ^ vcd->last_levels;
+        if (!changed)
+            return;
+    } else {
+        changed = vcd->num_signals == 64 ? ~0ULL : (1ULL << vcd->num_signals) - 1;
+        vcd->started = 1;
+    }
+    // VCD requires monotonic timestamps
+    if (time_ns < vcd->last_time)
+        time_ns = vcd->last_time;
+    fprintf(vcd->fp, "#%llu\n", (unsigned long long)time_ns);
+    for (i = 0; i < vcd->num_signals; i++) {
+        if (changed & (1ULL << i))
+            fprintf(vcd->fp, "%d%c\n", (int)((levels >> i) & 1), VCD_ID(i));
+    }
+    vcd->last_levels = levels;
+    vcd->last_time = time_ns;
+}
+
+void vcd_close(vcd_t *vcd) {
+    if (!vcd)
+        return;
+    fprintf(vcd->fp, "#%llu\n", (unsigned long long)vcd->last_time);
+    fclose(vcd->fp);
+    free(vcd);
+}
@@ -0,0 +1,26 @@
+#ifndef LEDEK_VCD
+#define LEDEK_VCD
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define VCD_MAX_SIGNALS		64
+
+/* Minimal Value Change Dump writer.  Signals are single bit wires, and the
+ * caller hands over the complete set of levels as a bitmask each time
+ * something may have changed; only the bits that actually differ from the
+ * previous sample are written out.  Timestamps are in nanoseconds.
+ */
+typedef struct {
+    FILE *fp;
+    int num_signals;
+    uint64_t last_levels;
+    uint64_t last_time;
+    int started;
+} vcd_t;
+
+vcd_t *vcd_open(const char *path, const char *scope, int num_signals, char **names);
+void vcd_sample(vcd_t *vcd, uint64_t time_ns, uint64_t levels);
+void vcd_close(vcd_t *vcd);
+
+#endif //LEDEK_VCD